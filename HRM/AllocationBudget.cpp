@@ -0,0 +1,133 @@
+#include "pch.h"
+#include "AllocationBudget.h"
+#include <atomic>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+
+namespace
+{
+	struct StageCounters
+	{
+		std::atomic<uint64_t> Allocations{ 0 };
+		std::atomic<uint64_t> Bytes{ 0 };
+	};
+
+	std::array<StageCounters, AllocationBudget::StageCount> Counted;
+
+	// Trivial, so reading it from operator new is safe on any thread at any
+	// point of its life
+	thread_local AllocationBudget::Stage CurrentStage =
+		AllocationBudget::Stage::Other;
+
+	const char* const StageNames[AllocationBudget::StageCount] = {
+		"other", "notification", "delivery", "output", "socket" };
+}
+
+#if HRM_COUNT_ALLOCATIONS
+
+// Every other form of new and delete ends up in these, except the over
+// aligned ones, which the pipeline doesn't use
+void* operator new(size_t Size)
+{
+	StageCounters& Stage = Counted[static_cast<size_t>(CurrentStage)];
+	Stage.Allocations.fetch_add(1, std::memory_order_relaxed);
+	Stage.Bytes.fetch_add(Size, std::memory_order_relaxed);
+	if (void* Block = std::malloc(Size == 0 ? 1 : Size))
+	{
+		return Block;
+	}
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t Size)
+{
+	return operator new(Size);
+}
+
+void operator delete(void* Block) noexcept
+{
+	std::free(Block);
+}
+
+void operator delete(void* Block, size_t) noexcept
+{
+	std::free(Block);
+}
+
+void operator delete[](void* Block) noexcept
+{
+	std::free(Block);
+}
+
+void operator delete[](void* Block, size_t) noexcept
+{
+	std::free(Block);
+}
+
+#endif
+
+const char* AllocationBudget::GetName(Stage Named)
+{
+	return StageNames[static_cast<size_t>(Named)];
+}
+
+AllocationBudget::Snapshot AllocationBudget::Take()
+{
+	Snapshot Result;
+	for (size_t i = 0; i < StageCount; ++i)
+	{
+		Result[i].Allocations =
+			Counted[i].Allocations.load(std::memory_order_relaxed);
+		Result[i].Bytes = Counted[i].Bytes.load(std::memory_order_relaxed);
+	}
+	return Result;
+}
+
+bool AllocationBudget::Report(const Snapshot& Since, uint64_t Samples,
+	const char* Unit)
+{
+	if (!IsEnabled())
+	{
+		std::cout << "Allocation counters not built in, define "
+			"HRM_COUNT_ALLOCATIONS to 1" << std::endl;
+		return true;
+	}
+	const Snapshot Now = Take();
+	bool bWithinBudget = true;
+	for (size_t i = 0; i < StageCount; ++i)
+	{
+		const Stage Reported = static_cast<Stage>(i);
+		const uint64_t Allocations = Now[i].Allocations -
+			Since[i].Allocations;
+		const uint64_t Bytes = Now[i].Bytes - Since[i].Bytes;
+		std::cout << "allocations, " << GetName(Reported) << ": "
+			<< Allocations << " (" << Bytes << " bytes)";
+		if (Samples > 0)
+		{
+			std::cout << ", " << std::fixed << std::setprecision(3)
+				<< static_cast<double>(Allocations) / Samples
+				<< " per " << Unit << std::defaultfloat;
+		}
+		if (IsSteadyState(Reported) && Allocations > 0)
+		{
+			std::cout << " over budget";
+			bWithinBudget = false;
+		}
+		std::cout << std::endl;
+	}
+	return bWithinBudget;
+}
+
+AllocationBudget::Stage AllocationBudget::Enter(Stage Entered)
+{
+	const Stage Previous = CurrentStage;
+	CurrentStage = Entered;
+	return Previous;
+}
+
+void AllocationBudget::Leave(Stage Previous)
+{
+	CurrentStage = Previous;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Heap allocations per pipeline stage. Built only with HRM_COUNT_ALLOCATIONS
+// defined to 1, which replaces the global operator new and delete; otherwise
+// the macro compiles to nothing and every counter stays at 0.
+//
+// HRM_ALLOCATION_STAGE(Name) charges the allocations of the current thread,
+// from that line to the end of the scope, to AllocationBudget::Stage::Name.
+// Stages nest, the innermost one is charged, and allocations outside any
+// stage go to Other. The scope must not span a co_await.
+#ifndef HRM_COUNT_ALLOCATIONS
+#define HRM_COUNT_ALLOCATIONS 0
+#endif
+
+#if HRM_COUNT_ALLOCATIONS
+#define HRM_ALLOCATION_CONCAT_INNER(A, B) A##B
+#define HRM_ALLOCATION_CONCAT(A, B) HRM_ALLOCATION_CONCAT_INNER(A, B)
+#define HRM_ALLOCATION_STAGE(Name) \
+	AllocationBudget::ScopedStage HRM_ALLOCATION_CONCAT(AllocationStage, \
+		__LINE__)(AllocationBudget::Stage::Name)
+#else
+#define HRM_ALLOCATION_STAGE(Name) ((void)0)
+#endif
+
+namespace AllocationBudget
+{
+	enum class Stage : uint8_t
+	{
+		// Anything outside the stages below
+		Other,
+		// GATT notification handler, from the bytes to the sample ring
+		Notification,
+		// Delivery stage, from the ring to the frames handed to the outputs
+		Delivery,
+		// Output queues and their pumps, up to the socket
+		Output,
+		// Socket writes and the WinRT operations awaited, which allocate on
+		// their own
+		Socket,
+		Count
+	};
+
+	constexpr size_t StageCount = static_cast<size_t>(Stage::Count);
+
+	// Stages of the heart rate path that must not allocate once warmed up
+	constexpr bool IsSteadyState(Stage Checked)
+	{
+		return Checked == Stage::Notification || Checked == Stage::Delivery ||
+			Checked == Stage::Output;
+	}
+
+	const char* GetName(Stage Named);
+
+	struct Counters
+	{
+		uint64_t Allocations = 0;
+		uint64_t Bytes = 0;
+	};
+
+	using Snapshot = std::array<Counters, StageCount>;
+
+	// Counters so far, from every thread. Meaningful only if built in.
+	constexpr bool IsEnabled() { return HRM_COUNT_ALLOCATIONS != 0; }
+	Snapshot Take();
+
+	// Prints the allocations of every stage since the given snapshot, per
+	// sample, or whatever Unit names, if Samples isn't 0. Returns false if a
+	// steady state stage allocated.
+	bool Report(const Snapshot& Since, uint64_t Samples,
+		const char* Unit = "sample");
+
+	// Stage of the current thread, returning the previous one
+	Stage Enter(Stage Entered);
+	void Leave(Stage Previous);
+
+	class ScopedStage
+	{
+	public:
+		explicit ScopedStage(Stage Entered) : Previous(Enter(Entered)) {}
+		~ScopedStage() { Leave(Previous); }
+
+		ScopedStage(const ScopedStage&) = delete;
+		ScopedStage& operator=(const ScopedStage&) = delete;
+
+	private:
+		Stage Previous;
+	};
+}
@@ -0,0 +1,253 @@
+#pragma once
+
+#include "Reactor.h"
+#include "Task.h"
+#include "TimerWheel.h"
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+#include <utility>
+
+// What the tasks of Task.h await. Cancellation uses the standard stop
+// tokens: whoever owns an operation keeps a std::stop_source and hands its
+// token to the awaits it may want to cut short.
+namespace Async
+{
+	// Resumes a coroutine on a reactor without allocating. Embedded in the
+	// awaiter, which lives in the frame of the suspended coroutine.
+	class Resumption : public Reactor::Item
+	{
+	public:
+		Resumption() : Item(&Resume) {}
+
+		void Post(Reactor& Loop, std::coroutine_handle<> Awaiting)
+		{
+			Handle = Awaiting;
+			Loop.Post(*this);
+		}
+
+	private:
+		static void Resume(Reactor::Item& Work)
+		{
+			static_cast<Resumption&>(Work).Handle.resume();
+		}
+
+		std::coroutine_handle<> Handle;
+	};
+
+	// Moves the awaiting coroutine over to the given reactor. Doesn't
+	// suspend if it's already there.
+	class ResumeOn
+	{
+	public:
+		explicit ResumeOn(Reactor& Loop) : Loop(Loop) {}
+
+		bool await_ready() const { return Loop.IsCurrent(); }
+		void await_suspend(std::coroutine_handle<> Awaiting)
+		{
+			Resumed.Post(Loop, Awaiting);
+		}
+		void await_resume() const noexcept {}
+
+	private:
+		Reactor& Loop;
+		Resumption Resumed;
+	};
+
+	// Manual reset event. Set resumes every coroutine waiting for it, inline
+	// on the thread that sets it.
+	class Event
+	{
+	public:
+		class Awaiter
+		{
+		public:
+			explicit Awaiter(Event& Owner) : Owner(Owner), Next(nullptr) {}
+
+			bool await_ready() const { return Owner.IsSet(); }
+			bool await_suspend(std::coroutine_handle<> Awaiting)
+			{
+				Handle = Awaiting;
+				std::lock_guard<std::mutex> Guard(Owner.Lock);
+				if (Owner.bSet)
+				{
+					return false;
+				}
+				Next = Owner.Waiters;
+				Owner.Waiters = this;
+				return true;
+			}
+			void await_resume() const noexcept {}
+
+		private:
+			friend class Event;
+
+			Event& Owner;
+			std::coroutine_handle<> Handle;
+			Awaiter* Next;
+		};
+
+		Event() : bSet(false), Waiters(nullptr) {}
+
+		Event(const Event&) = delete;
+		Event& operator=(const Event&) = delete;
+
+		void Set()
+		{
+			Awaiter* Resumed;
+			{
+				std::lock_guard<std::mutex> Guard(Lock);
+				bSet = true;
+				Resumed = std::exchange(Waiters, nullptr);
+			}
+			while (Resumed)
+			{
+				// The awaiter goes away with the resumed coroutine
+				Awaiter* Next = Resumed->Next;
+				Resumed->Handle.resume();
+				Resumed = Next;
+			}
+		}
+
+		void Reset()
+		{
+			std::lock_guard<std::mutex> Guard(Lock);
+			bSet = false;
+		}
+
+		bool IsSet()
+		{
+			std::lock_guard<std::mutex> Guard(Lock);
+			return bSet;
+		}
+
+		Awaiter operator co_await() { return Awaiter(*this); }
+
+	private:
+		std::mutex Lock;
+		bool bSet;
+		// Waiting coroutines, latest first
+		Awaiter* Waiters;
+	};
+
+	// Awaits an operation reporting its result through a callback, such as
+	// the GattTransport and GattCommandQueue operations, and resumes on the
+	// given reactor. Start is called with the callback to hand over to the
+	// operation, which must call it exactly once.
+	template <typename T, typename Starter>
+	class CallbackAwaiter
+	{
+	public:
+		CallbackAwaiter(Reactor& Loop, Starter Start) : Loop(Loop),
+			Start(std::move(Start)), Result()
+		{
+		}
+
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(std::coroutine_handle<> Awaiting)
+		{
+			Handle = Awaiting;
+			// Nothing of the awaiter is touched once the callback posted the
+			// resumption, it may already be gone
+			Start([this](T Value) {
+				Result = std::move(Value);
+				Resumed.Post(Loop, Handle);
+				});
+		}
+		T await_resume() { return std::move(Result); }
+
+	private:
+		Reactor& Loop;
+		Starter Start;
+		std::coroutine_handle<> Handle;
+		Resumption Resumed;
+		T Result;
+	};
+
+	template <typename T, typename Starter>
+	CallbackAwaiter<T, Starter> FromCallback(Reactor& Loop, Starter Start)
+	{
+		return CallbackAwaiter<T, Starter>(Loop, std::move(Start));
+	}
+
+	// Sleeps on the timer wheel without blocking any thread, and resumes on
+	// the given reactor once the time is up or the token is cancelled,
+	// whatever comes first. Awaiting it returns false if cancelled. Cancelled
+	// while suspending, it resumes right away on the awaiting thread.
+	class Delay
+	{
+	public:
+		Delay(TimerWheel& Timers, Reactor& Loop, uint32_t Milliseconds,
+			std::stop_token Token = {}) : Timers(Timers), Loop(Loop),
+			Milliseconds(Milliseconds), Token(std::move(Token)), State(0)
+		{
+		}
+
+		Delay(const Delay&) = delete;
+		Delay& operator=(const Delay&) = delete;
+
+		bool await_ready() const noexcept { return Token.stop_requested(); }
+		bool await_suspend(std::coroutine_handle<> Awaiting)
+		{
+			Handle = Awaiting;
+			Timer.Callback = [this]() { Finish(false); };
+			if (Token.stop_possible())
+			{
+				OnCancel.emplace(Token, Cancel{ this });
+			}
+			Timers.Arm(Timer, Milliseconds);
+			// Whoever finishes first resumes, unless it happened before this
+			const uint8_t Previous = State.fetch_or(Suspended);
+			return (Previous & Finished) == 0;
+		}
+		bool await_resume()
+		{
+			// Neither the stop callback nor the wheel may still be running
+			OnCancel.reset();
+			Timers.CancelAndWait(Timer);
+			return !Token.stop_requested() &&
+				(State.load() & Cancelled) == 0;
+		}
+
+	private:
+		static constexpr uint8_t Suspended = 1;
+		static constexpr uint8_t Finished = 2;
+		static constexpr uint8_t Cancelled = 4;
+
+		struct Cancel
+		{
+			Delay* Self;
+			void operator()() const noexcept { Self->Finish(true); }
+		};
+
+		void Finish(bool bCancelled)
+		{
+			uint8_t Previous = State.load();
+			do
+			{
+				if (Previous & Finished)
+				{
+					return;
+				}
+			} while (!State.compare_exchange_weak(Previous, Previous |
+				Finished | (bCancelled ? Cancelled : 0)));
+			if (Previous & Suspended)
+			{
+				Resumed.Post(Loop, Handle);
+			}
+		}
+
+		TimerWheel& Timers;
+		Reactor& Loop;
+		const uint32_t Milliseconds;
+		std::stop_token Token;
+		std::coroutine_handle<> Handle;
+		Resumption Resumed;
+		TimerEntry Timer;
+		std::optional<std::stop_callback<Cancel>> OnCancel;
+		std::atomic<uint8_t> State;
+	};
+}
@@ -0,0 +1,859 @@
+#include "pch.h"
+#include "Benchmarks.h"
+#include "AllocationBudget.h"
+#include "Codec.h"
+#include "ControlParser.h"
+#include "LatencyHistogram.h"
+#include "RemoteCommunication.h"
+#include "SampleDelivery.h"
+#include "SampleFrame.h"
+#include "SessionManager.h"
+#include "SharedHeartRateReader.h"
+#include "SimulatedMiBand3.h"
+#include "SpscRing.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cwchar>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <ppltasks.h>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+	// Nanoseconds per operation between two time points
+	double NanosecondsPerOp(Clock::time_point Start, Clock::time_point End,
+		uint64 Operations)
+	{
+		return std::chrono::duration<double, std::nano>(End - Start).count() /
+			static_cast<double>(Operations);
+	}
+
+	// Value of "--Name value" in the options, or Default if the option isn't
+	// given. False, after printing why, if its value is missing or isn't a
+	// decimal number that fits in 32 bits.
+	bool OptionValue(const std::vector<std::wstring>& Options,
+		const std::wstring& Name, uint32 Default, uint32& Value)
+	{
+		Value = Default;
+		for (size_t i = 0; i < Options.size(); ++i)
+		{
+			if (Options[i] != Name)
+			{
+				continue;
+			}
+			const std::wstring Text = i + 1 < Options.size() ?
+				Options[i + 1] : std::wstring();
+			wchar_t* End = nullptr;
+			errno = 0;
+			const unsigned long Parsed = std::wcstoul(Text.c_str(), &End, 10);
+			if (Text.empty() || Text[0] < L'0' || Text[0] > L'9' ||
+				End != Text.c_str() + Text.size() || errno == ERANGE ||
+				Parsed > UINT32_MAX)
+			{
+				std::wcout << "Invalid value \"" << Text << "\" for " << Name
+					<< ", usage: " << Name << " <number>" << std::endl;
+				return false;
+			}
+			Value = static_cast<uint32>(Parsed);
+			return true;
+		}
+		return true;
+	}
+
+	// Latencies of one path with the thread safety the benchmark needs, the
+	// sample path records from the socket reads and the command path from
+	// the GATT writes
+	struct LatencyRecorder
+	{
+		std::mutex Lock;
+		LatencyHistogram Histogram;
+
+		void Record(uint64 Microseconds)
+		{
+			std::lock_guard<std::mutex> Guard(Lock);
+			Histogram.Record(Microseconds);
+		}
+
+		void Reset()
+		{
+			std::lock_guard<std::mutex> Guard(Lock);
+			Histogram.Reset();
+		}
+
+		uint64 GetCount()
+		{
+			std::lock_guard<std::mutex> Guard(Lock);
+			return Histogram.GetCount();
+		}
+
+		// JSON object with the percentiles and the throughput over the
+		// given seconds
+		std::string ToJson(double Seconds)
+		{
+			std::lock_guard<std::mutex> Guard(Lock);
+			std::ostringstream Json;
+			Json << "{\"count\":" << Histogram.GetCount()
+				<< ",\"throughput\":" << Histogram.GetCount() / Seconds
+				<< ",\"p50\":" << Histogram.Percentile(50.0)
+				<< ",\"p99\":" << Histogram.Percentile(99.0)
+				<< ",\"p999\":" << Histogram.Percentile(99.9)
+				<< ",\"max\":" << Histogram.GetMax()
+				<< ",\"mean\":" << Histogram.GetMean() << "}";
+			return Json.str();
+		}
+	};
+
+	// Stand-in for the external server listening on the client port. Reads
+	// the binary frames sent by the service and records the latency of every
+	// heart rate frame. Shared with its receive loop, which may outlive the
+	// benchmark until its socket is closed.
+	struct LoopbackClient
+	{
+		StreamSocketListener^ Listener;
+		StreamSocket^ Socket;
+		DataReader^ Reader;
+		std::vector<uint8> Buffer;
+		// Bytes of a frame split between reads
+		std::vector<uint8> Partial;
+		std::atomic<bool> bConnected{ false };
+		std::atomic<uint32> ConnectedBands{ 0 };
+		LatencyRecorder Samples;
+	};
+
+	void ConsumeFrames(LoopbackClient& Client, const uint8* Data,
+		uint32 Size)
+	{
+		const uint64 Now = SampleFrames::MonotonicMicroseconds();
+		Client.Partial.insert(Client.Partial.end(), Data, Data + Size);
+		size_t Pos = 0;
+		while (Client.Partial.size() - Pos >= SampleFrames::HeaderSize)
+		{
+			const uint8* Frame = Client.Partial.data() + Pos;
+			const size_t FrameSize = SampleFrames::HeaderSize +
+				ControlParser::ReadLE16(Frame + 2);
+			if (Client.Partial.size() - Pos < FrameSize)
+			{
+				break;
+			}
+			const uint64 Timestamp = ControlParser::ReadLE32(Frame + 8) |
+				(static_cast<uint64>(ControlParser::ReadLE32(Frame + 12))
+					<< 32);
+			const uint8* Payload = Frame + SampleFrames::HeaderSize;
+			switch (static_cast<SampleFrames::FrameType>(Frame[0]))
+			{
+			case SampleFrames::FrameType::HeartRate:
+				Client.Samples.Record(Now - Timestamp);
+				break;
+			case SampleFrames::FrameType::Status:
+				if (ControlParser::ReadLE16(Payload) == 200)
+				{
+					++Client.ConnectedBands;
+				}
+				break;
+			default:
+				break;
+			}
+			Pos += FrameSize;
+		}
+		Client.Partial.erase(Client.Partial.begin(),
+			Client.Partial.begin() + Pos);
+	}
+
+	void ClientReceiveLoop(std::shared_ptr<LoopbackClient> Client)
+	{
+		concurrency::create_task(Client->Reader->LoadAsync(
+			static_cast<unsigned int>(Client->Buffer.size())))
+			.then([Client](concurrency::task<unsigned int> PreviousTask) {
+			try
+			{
+				unsigned int Size = PreviousTask.get();
+				if (Size == 0)
+				{
+					return;
+				}
+				Client->Reader->ReadBytes(Platform::ArrayReference<uint8>(
+					Client->Buffer.data(), Size));
+				ConsumeFrames(*Client, Client->Buffer.data(), Size);
+				ClientReceiveLoop(Client);
+			}
+			catch (Platform::Exception^)
+			{
+			}
+				});
+	}
+
+	// The stream based codecs Codec.h replaced, as they were, the baseline of
+	// the codec benchmark
+	namespace Legacy
+	{
+		int CharToInt(char Char)
+		{
+			if (Char >= '0' && Char <= '9')
+			{
+				return Char - '0';
+			}
+			if (Char >= 'a' && Char <= 'f')
+			{
+				return Char - 'a' + 10;
+			}
+			return -1;
+		}
+
+		std::wstring FormatAddress(unsigned long long BluetoothAddress)
+		{
+			std::wostringstream Address;
+			Address << std::hex << std::setfill(L'0')
+				<< std::setw(2) << ((BluetoothAddress >> (5 * 8)) & 0xff)
+				<< ":"
+				<< std::setw(2) << ((BluetoothAddress >> (4 * 8)) & 0xff)
+				<< ":"
+				<< std::setw(2) << ((BluetoothAddress >> (3 * 8)) & 0xff)
+				<< ":"
+				<< std::setw(2) << ((BluetoothAddress >> (2 * 8)) & 0xff)
+				<< ":"
+				<< std::setw(2) << ((BluetoothAddress >> (1 * 8)) & 0xff)
+				<< ":"
+				<< std::setw(2) << ((BluetoothAddress >> (0 * 8)) & 0xff);
+			return Address.str();
+		}
+
+		unsigned long long ParseAddress(const std::string& Text)
+		{
+			uint64 Multiplier = 1;
+			unsigned long long Address = 0;
+			for (int i = static_cast<int>(Text.size()) - 1; i >= 0; --i)
+			{
+				if (Text[i] != ':')
+				{
+					Address += CharToInt(Text[i]) * Multiplier;
+					Multiplier *= 16;
+				}
+			}
+			return Address;
+		}
+
+		Codec::GuidValue ParseGuid(const std::string& Guid)
+		{
+			unsigned int Fields[11];
+			const size_t Offsets[11] = { 0, 9, 14, 19, 21, 24, 26, 28, 30,
+				32, 34 };
+			const size_t Sizes[11] = { 8, 4, 4, 2, 2, 2, 2, 2, 2, 2, 2 };
+			std::stringstream ss;
+			ss << std::hex;
+			for (size_t i = 0; i < 11; ++i)
+			{
+				ss.clear();
+				ss.str(std::string());
+				ss << Guid.substr(Offsets[i], Sizes[i]);
+				ss >> Fields[i];
+			}
+			Codec::GuidValue Value;
+			Value.Data1 = Fields[0];
+			Value.Data2 = static_cast<uint16_t>(Fields[1]);
+			Value.Data3 = static_cast<uint16_t>(Fields[2]);
+			for (size_t i = 0; i < 8; ++i)
+			{
+				Value.Data4[i] = static_cast<uint8_t>(Fields[3 + i]);
+			}
+			return Value;
+		}
+
+		std::string FormatUnsigned(uint16 Value)
+		{
+			std::stringstream Buffer;
+			Buffer << Value;
+			return Buffer.str();
+		}
+	}
+
+	// Runs the operation the given times, returns nanoseconds per run
+	template <typename Operation>
+	double TimeOperation(uint64 Runs, Operation&& Run)
+	{
+		auto Start = Clock::now();
+		for (uint64 i = 0; i < Runs; ++i)
+		{
+			Run(i);
+		}
+		return NanosecondsPerOp(Start, Clock::now(), Runs);
+	}
+
+	void PrintComparison(const char* Name, double Before, double After)
+	{
+		std::cout << "codec " << Name << ": " << Before << " ns before, "
+			<< After << " ns after (" << Before / After << "x)" << std::endl;
+	}
+
+	// Waits until the condition holds, up to the given milliseconds
+	template <typename Condition>
+	bool WaitFor(Condition&& Done, uint32 Milliseconds)
+	{
+		auto Deadline = Clock::now() + std::chrono::milliseconds(Milliseconds);
+		while (!Done())
+		{
+			if (Clock::now() > Deadline)
+			{
+				return false;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		return true;
+	}
+}
+
+bool Benchmarks::Run(const std::wstring& Name,
+	const std::vector<std::wstring>& Options)
+{
+	if (Name == L"ring")
+	{
+		RingPublish();
+		return true;
+	}
+	if (Name == L"parser")
+	{
+		ControlParserThroughput();
+		return true;
+	}
+	if (Name == L"codec")
+	{
+		return CodecThroughput();
+	}
+	if (Name == L"e2e")
+	{
+		return EndToEndLatency(Options);
+	}
+	if (Name == L"alloc")
+	{
+		return AllocationBudgetCheck(Options);
+	}
+	std::wcout << "Unknown benchmark: " << Name << std::endl;
+	return false;
+}
+
+void Benchmarks::RingPublish()
+{
+	constexpr uint64 Samples = 10000000;
+	auto Ring = std::make_unique<SpscRing<HeartRateSample, 256>>();
+
+	// Publish with a consumer draining the ring on another thread, the way
+	// the GATT callback and the delivery stage run
+	std::atomic<bool> bReady(false);
+	std::atomic<bool> bDone(false);
+	uint64 Consumed = 0;
+	std::thread Consumer([&] {
+		HeartRateSample Sample;
+		bReady.store(true, std::memory_order_release);
+		while (!bDone.load(std::memory_order_acquire) || Ring->Size() > 0)
+		{
+			while (Ring->TryPop(Sample))
+			{
+				++Consumed;
+			}
+		}
+		});
+
+	while (!bReady.load(std::memory_order_acquire))
+	{
+	}
+
+	auto Start = Clock::now();
+	for (uint64 i = 0; i < Samples; ++i)
+	{
+		HeartRateSample Sample{ i, static_cast<uint32>(i), 70 };
+		Ring->TryPush(Sample);
+	}
+	auto End = Clock::now();
+	bDone.store(true, std::memory_order_release);
+	Consumer.join();
+
+	std::cout << "ring publish (with consumer): "
+		<< NanosecondsPerOp(Start, End, Samples) << " ns/sample, "
+		<< Consumed << " consumed, " << Ring->Overflows() << " overflows"
+		<< std::endl;
+
+	// Publish into a full ring, the cost of the overflow path when the
+	// consumer is stalled
+	auto Full = std::make_unique<SpscRing<HeartRateSample, 256>>();
+	HeartRateSample Sample{ 0, 0, 70 };
+	while (Full->TryPush(Sample))
+	{
+	}
+	auto Initial = Full->Overflows();
+	Start = Clock::now();
+	for (uint64 i = 0; i < Samples; ++i)
+	{
+		Full->TryPush(Sample);
+	}
+	End = Clock::now();
+
+	std::cout << "ring publish (stalled consumer): "
+		<< NanosecondsPerOp(Start, End, Samples) << " ns/sample, "
+		<< Full->Overflows() - Initial << " overflows" << std::endl;
+}
+
+void Benchmarks::ControlParserThroughput()
+{
+	// Typical session traffic: vibrations, heart rate toggles, band
+	// addressing and the odd message
+	std::vector<uint8> Stream;
+	const uint8 Message[] = { 'G', 'o', 'a', 'l', '!' };
+	uint64 Instructions = 0;
+	while (Stream.size() < 16 * 1024 * 1024)
+	{
+		const uint8 Vibrate[] = { 9, 1, 5, 0xf4, 0x01 };
+		const uint8 HeartRate[] = { 4, 1 };
+		const uint8 Header[] = { 3, sizeof(Message), 0, 0, 0 };
+		Stream.insert(Stream.end(), std::begin(Vibrate), std::end(Vibrate));
+		Stream.insert(Stream.end(), std::begin(HeartRate),
+			std::end(HeartRate));
+		Stream.insert(Stream.end(), std::begin(Header), std::end(Header));
+		Stream.insert(Stream.end(), std::begin(Message), std::end(Message));
+		Instructions += 4;
+	}
+
+	// Chunks the size of a socket read, and odd sized ones that split most
+	// instructions
+	for (size_t Chunk : { static_cast<size_t>(4096), static_cast<size_t>(7) })
+	{
+		ControlParser Parser;
+		uint64 Dispatched = 0;
+		auto Start = Clock::now();
+		for (size_t Pos = 0; Pos < Stream.size(); Pos += Chunk)
+		{
+			Parser.Feed(Stream.data() + Pos,
+				std::min(Chunk, Stream.size() - Pos),
+				[&Dispatched](const ControlInstruction&) { ++Dispatched; });
+		}
+		auto End = Clock::now();
+		double Seconds = std::chrono::duration<double>(End - Start).count();
+
+		std::cout << "parser, " << Chunk << " byte chunks: "
+			<< static_cast<uint64>(Dispatched / Seconds)
+			<< " instructions/s, " << NanosecondsPerOp(Start, End, Dispatched)
+			<< " ns/instruction (" << Dispatched << " of " << Instructions
+			<< ")" << std::endl;
+	}
+}
+
+bool Benchmarks::CodecThroughput()
+{
+	constexpr uint64 Runs = 1000000;
+	const std::string GuidText = "00000009-0000-3512-2118-0009af100700";
+	std::vector<uint64> Addresses;
+	for (uint64 i = 0; i < 1024; ++i)
+	{
+		// Spread over the 48 bits of an address
+		Addresses.push_back((i * 0x9e3779b97f4a7c15ull) >> 16);
+	}
+
+	// Same output as the old functions before timing anything
+	wchar_t Wide[Codec::AddressTextSize];
+	char Narrow[Codec::AddressTextSize];
+	for (uint64 Address : Addresses)
+	{
+		Codec::FormatAddress(Address, Wide);
+		Codec::FormatAddress(Address, Narrow);
+		uint64_t Parsed = 0;
+		Codec::ParseAddress(Narrow, Codec::AddressTextSize, Parsed);
+		if (std::wstring(Wide, Codec::AddressTextSize) !=
+			Legacy::FormatAddress(Address) || Parsed !=
+			Legacy::ParseAddress(std::string(Narrow, Codec::AddressTextSize)))
+		{
+			std::cout << "codec: address mismatch" << std::endl;
+			return false;
+		}
+	}
+	for (uint32 Value = 0; Value <= 0xffff; ++Value)
+	{
+		char Text[Codec::MaxDecimalDigits];
+		auto Size = Codec::FormatUnsigned(Value, Text);
+		if (std::string(Text, Size) !=
+			Legacy::FormatUnsigned(static_cast<uint16>(Value)))
+		{
+			std::cout << "codec: decimal mismatch" << std::endl;
+			return false;
+		}
+	}
+	Codec::GuidValue Guid;
+	if (!Codec::ParseGuid(GuidText.data(), GuidText.size(), Guid) ||
+		!(Guid == Legacy::ParseGuid(GuidText)))
+	{
+		std::cout << "codec: GUID mismatch" << std::endl;
+		return false;
+	}
+
+	// Sinks so the compiler keeps every call
+	uint64 Sink = 0;
+	PrintComparison("GUID parse",
+		TimeOperation(Runs / 10, [&](uint64) {
+			Sink += Legacy::ParseGuid(GuidText).Data1;
+			}),
+		TimeOperation(Runs, [&](uint64) {
+			Codec::ParseGuid(GuidText.data(), GuidText.size(), Guid);
+			Sink += Guid.Data1;
+			}));
+	PrintComparison("address format",
+		TimeOperation(Runs / 10, [&](uint64 i) {
+			Sink += Legacy::FormatAddress(Addresses[i & 1023]).size();
+			}),
+		TimeOperation(Runs, [&](uint64 i) {
+			Sink += Codec::FormatAddress(Addresses[i & 1023], Wide) + Wide[0];
+			}));
+	const std::string AddressText(Narrow, Codec::AddressTextSize);
+	PrintComparison("address parse",
+		TimeOperation(Runs, [&](uint64) {
+			Sink += Legacy::ParseAddress(AddressText);
+			}),
+		TimeOperation(Runs, [&](uint64) {
+			uint64_t Address = 0;
+			Codec::ParseAddress(AddressText.data(), AddressText.size(),
+				Address);
+			Sink += Address;
+			}));
+	PrintComparison("decimal format",
+		TimeOperation(Runs / 10, [&](uint64 i) {
+			Sink += Legacy::FormatUnsigned(static_cast<uint16>(i)).size();
+			}),
+		TimeOperation(Runs, [&](uint64 i) {
+			char Text[Codec::MaxDecimalDigits];
+			Sink += Codec::FormatUnsigned(static_cast<uint16>(i), Text) +
+				Text[0];
+			}));
+	std::cout << "codec checksum " << Sink << std::endl;
+	return true;
+}
+
+bool Benchmarks::EndToEndLatency(const std::vector<std::wstring>& Options)
+{
+	uint32 Bands;
+	uint32 Interval;
+	uint32 VibrateRate;
+	uint32 Duration;
+	uint32 Port;
+	if (!OptionValue(Options, L"--bands", 1, Bands) ||
+		!OptionValue(Options, L"--interval", 100, Interval) ||
+		!OptionValue(Options, L"--vibrate", 10, VibrateRate) ||
+		!OptionValue(Options, L"--duration", 10, Duration) ||
+		!OptionValue(Options, L"--udp", 0, Port))
+	{
+		return false;
+	}
+	// A simulated band notifying every 0 ms would never stop
+	if (Interval == 0 || Port > UINT16_MAX)
+	{
+		std::cout << "e2e: --interval must be above 0 and --udp a port"
+			<< std::endl;
+		return false;
+	}
+	Bands = std::max<uint32>(1, std::min(Bands, SessionManager::MaxBands));
+	const bool bSharedMemory = std::find(Options.begin(), Options.end(),
+		L"--shm") != Options.end();
+	const uint16 DatagramPort = static_cast<uint16>(Port);
+	const bool bAllocations = std::find(Options.begin(), Options.end(),
+		L"--allocations") != Options.end();
+
+	// Loopback client, listening before the service is told to connect
+	auto Client = std::make_shared<LoopbackClient>();
+	Client->Buffer.resize(ControlChunkSize);
+	Client->Listener = ref new StreamSocketListener();
+	// Weak, the listener belongs to the client
+	std::weak_ptr<LoopbackClient> Listening = Client;
+	Client->Listener->ConnectionReceived += ref new Windows::Foundation::
+		TypedEventHandler<StreamSocketListener^,
+		StreamSocketListenerConnectionReceivedEventArgs^>(
+			[Listening](StreamSocketListener^,
+				StreamSocketListenerConnectionReceivedEventArgs^ Args) {
+				auto Client = Listening.lock();
+				if (!Client)
+				{
+					return;
+				}
+				Client->Socket = Args->Socket;
+				Client->Reader = ref new DataReader(Args->Socket->InputStream);
+				Client->Reader->InputStreamOptions =
+					InputStreamOptions::Partial;
+				Client->bConnected = true;
+				ClientReceiveLoop(Client);
+			});
+	concurrency::create_task(
+		Client->Listener->BindServiceNameAsync(L"1242")).get();
+
+	// Vibrations carry their sequence number as duration, so the write on
+	// 0x2a06 can be matched with the time the instruction was sent
+	std::vector<std::atomic<uint64>> SentAt(65536);
+	LatencyRecorder Commands;
+	SimulatedBandSettings Settings;
+	Settings.NotificationInterval = Interval;
+	SessionManager^ Session = ref new SessionManager();
+	if (bSharedMemory && !Session->PublishTo("hrm-bench"))
+	{
+		std::cout << "e2e: couldn't create the shared memory" << std::endl;
+		return false;
+	}
+	Session->UseSimulatedBands(Settings, [&SentAt, &Commands](
+		GattChannel Channel, const uint8_t* Data, uint32_t Size) {
+			if (Channel == GattChannel::Alert && Size >= 3 && Data[0] == 0xff)
+			{
+				uint64 Sent = SentAt[ControlParser::ReadLE16(Data + 1)].load();
+				if (Sent != 0)
+				{
+					Commands.Record(
+						SampleFrames::MonotonicMicroseconds() - Sent);
+				}
+			}
+		});
+
+	// Control connection, retried while the server binds its port
+	StreamSocket^ Control = ref new StreamSocket();
+	bool bControlConnected = WaitFor([Control] {
+		try
+		{
+			concurrency::create_task(Control->ConnectAsync(
+				ref new Windows::Networking::HostName(L"localhost"),
+				L"1243")).get();
+			return true;
+		}
+		catch (Platform::Exception^)
+		{
+			return false;
+		}
+		}, 5000);
+	if (!bControlConnected)
+	{
+		std::cout << "e2e: couldn't connect to the control port" << std::endl;
+		return false;
+	}
+	DataWriter^ Writer = ref new DataWriter(Control->OutputStream);
+	auto SendInstructions = [Writer](std::vector<uint8> Bytes) {
+		Writer->WriteBytes(Platform::ArrayReference<uint8>(Bytes.data(),
+			static_cast<unsigned int>(Bytes.size())));
+		concurrency::create_task(Writer->StoreAsync()).get();
+	};
+
+	// Datagram receiver, only heart rate frames arrive on it
+	// Shared with the handler, which may still run once the socket is closed
+	auto DatagramSamples = std::make_shared<LatencyRecorder>();
+	DatagramSocket^ Datagrams = nullptr;
+	if (DatagramPort != 0)
+	{
+		Datagrams = ref new DatagramSocket();
+		Datagrams->MessageReceived += ref new Windows::Foundation::
+			TypedEventHandler<DatagramSocket^,
+			DatagramSocketMessageReceivedEventArgs^>(
+				[DatagramSamples](DatagramSocket^,
+					DatagramSocketMessageReceivedEventArgs^ Args) {
+					const uint64 Now = SampleFrames::MonotonicMicroseconds();
+					DataReader^ Reader = Args->GetDataReader();
+					std::vector<uint8> Data(Reader->UnconsumedBufferLength);
+					Reader->ReadBytes(Platform::ArrayReference<uint8>(
+						Data.data(), static_cast<unsigned int>(Data.size())));
+					for (size_t Pos = 0;
+						Pos + SampleFrames::HeaderSize <= Data.size();)
+					{
+						const uint8* Frame = Data.data() + Pos;
+						const uint64 Timestamp =
+							ControlParser::ReadLE32(Frame + 8) |
+							(static_cast<uint64>(
+								ControlParser::ReadLE32(Frame + 12)) << 32);
+						DatagramSamples->Record(Now - Timestamp);
+						Pos += SampleFrames::HeaderSize +
+							ControlParser::ReadLE16(Frame + 2);
+					}
+				});
+		concurrency::create_task(Datagrams->BindServiceNameAsync(
+			DatagramPort.ToString())).get();
+	}
+
+	// Binary frames, datagrams if asked, then the client connection and
+	// every band
+	SendInstructions({ 7, 1 });
+	if (DatagramPort != 0)
+	{
+		SendInstructions({ 14, static_cast<uint8>(DatagramPort),
+			static_cast<uint8>(DatagramPort >> 8) });
+	}
+	SendInstructions({ 0, 1 });
+	if (!WaitFor([Client] { return Client->bConnected.load(); }, 5000))
+	{
+		std::cout << "e2e: the service didn't connect to the client port"
+			<< std::endl;
+		return false;
+	}
+	for (uint32 Band = 0; Band < Bands; ++Band)
+	{
+		char Text[Codec::AddressTextSize];
+		const std::string Address(Text, Codec::FormatAddress(Band, Text));
+		std::vector<uint8> Connect{ 9, static_cast<uint8>(Band), 2,
+			static_cast<uint8>(Address.size()), 0, 0, 0 };
+		Connect.insert(Connect.end(), Address.begin(), Address.end());
+		SendInstructions(Connect);
+	}
+	if (!WaitFor([Client, Bands] {
+		return Client->ConnectedBands.load() >= Bands; }, 10000))
+	{
+		std::cout << "e2e: only " << Client->ConnectedBands.load() << " of "
+			<< Bands << " bands authenticated" << std::endl;
+		return false;
+	}
+	for (uint32 Band = 0; Band < Bands; ++Band)
+	{
+		SendInstructions({ 9, static_cast<uint8>(Band), 4, 1 });
+	}
+
+	// Reader polling every band as fast as it can, the way a game polls
+	// once per frame, only with no frame time in between
+	LatencyRecorder SharedSamples;
+	std::atomic<bool> bPolling(bSharedMemory);
+	// Written by the poller before it exits, read after the join
+	double PollNanoseconds = 0;
+	std::thread Poller;
+	if (bSharedMemory)
+	{
+		Poller = std::thread([&] {
+			SharedHeartRateReader Reader;
+			if (!Reader.Open("hrm-bench"))
+			{
+				return;
+			}
+			std::vector<uint32> LastSequence(Bands, 0);
+			std::vector<bool> bSeen(Bands, false);
+			uint64 Count = 0;
+			const auto PollStart = Clock::now();
+			while (bPolling.load(std::memory_order_relaxed))
+			{
+				for (uint32 Band = 0; Band < Bands; ++Band)
+				{
+					SharedHeartRate::Sample Latest;
+					++Count;
+					if (!Reader.ReadLatest(static_cast<uint8>(Band), Latest) ||
+						(bSeen[Band] && Latest.Sequence == LastSequence[Band]))
+					{
+						continue;
+					}
+					SharedSamples.Record(
+						SampleFrames::MonotonicMicroseconds() -
+						Latest.Timestamp);
+					LastSequence[Band] = Latest.Sequence;
+					bSeen[Band] = true;
+				}
+			}
+			PollNanoseconds = NanosecondsPerOp(PollStart, Clock::now(),
+				std::max<uint64>(1, Count));
+			});
+	}
+
+	// Warm up, then measure for the given duration
+	std::this_thread::sleep_for(std::chrono::seconds(1));
+	Client->Samples.Reset();
+	Commands.Reset();
+	SharedSamples.Reset();
+	DatagramSamples->Reset();
+	const AllocationBudget::Snapshot Allocated = AllocationBudget::Take();
+	const uint64 Vibrations = static_cast<uint64>(VibrateRate) * Bands *
+		Duration;
+	auto Start = Clock::now();
+	auto End = Start + std::chrono::seconds(Duration);
+	uint16 Sequence = 0;
+	for (uint64 i = 0; i < Vibrations; ++i)
+	{
+		std::this_thread::sleep_until(Start + (End - Start) * i / Vibrations);
+		// Sequence 0 is never sent, it marks unused slots
+		Sequence = Sequence == 0xffff ? 1 : Sequence + 1;
+		const uint8 Band = static_cast<uint8>(i % Bands);
+		SentAt[Sequence] = SampleFrames::MonotonicMicroseconds();
+		SendInstructions({ 9, Band, 5, static_cast<uint8>(Sequence),
+			static_cast<uint8>(Sequence >> 8) });
+	}
+	std::this_thread::sleep_until(End);
+	const double Seconds = std::chrono::duration<double>(
+		Clock::now() - Start).count();
+	const bool bWithinBudget = !bAllocations ||
+		AllocationBudget::Report(Allocated, Client->Samples.GetCount());
+	bPolling = false;
+	if (Poller.joinable())
+	{
+		Poller.join();
+	}
+
+	for (uint32 Band = 0; Band < Bands; ++Band)
+	{
+		SendInstructions({ 9, static_cast<uint8>(Band), 4, 0 });
+	}
+	if (DatagramPort != 0)
+	{
+		SendInstructions({ 14, 0, 0 });
+	}
+	SendInstructions({ 0, 0 });
+
+	std::ostringstream Json;
+	Json << "{\"benchmark\":\"e2e\",\"bands\":" << Bands
+		<< ",\"interval_ms\":" << Interval
+		<< ",\"vibrate_per_s\":" << VibrateRate
+		<< ",\"duration_s\":" << Seconds << ",\"unit\":\"us\""
+		<< ",\"sample\":" << Client->Samples.ToJson(Seconds)
+		<< ",\"command\":" << Commands.ToJson(Seconds);
+	if (DatagramPort != 0)
+	{
+		Json << ",\"udp_sample\":" << DatagramSamples->ToJson(Seconds);
+	}
+	if (bSharedMemory)
+	{
+		Json << ",\"shm_sample\":" << SharedSamples.ToJson(Seconds)
+			<< ",\"shm_poll_ns\":" << PollNanoseconds;
+	}
+	Json << "}";
+	std::cout << Json.str() << std::endl;
+
+	for (size_t i = 0; i + 1 < Options.size(); ++i)
+	{
+		if (Options[i] == L"--output")
+		{
+			std::ofstream(Options[i + 1]) << Json.str() << std::endl;
+		}
+	}
+
+	delete Control;
+	delete Client->Listener;
+	// Ends the receive loop, which then lets the client go
+	if (Client->Socket)
+	{
+		delete Client->Socket;
+	}
+	if (Datagrams)
+	{
+		delete Datagrams;
+	}
+	return bWithinBudget;
+}
+
+bool Benchmarks::AllocationBudgetCheck(
+	const std::vector<std::wstring>& Options)
+{
+	if (!AllocationBudget::IsEnabled())
+	{
+		std::cout << "alloc: build with HRM_COUNT_ALLOCATIONS defined to 1"
+			<< std::endl;
+		return false;
+	}
+	std::vector<std::wstring> Run = Options;
+	Run.insert(Run.end(), { L"--allocations", L"--vibrate", L"0" });
+	// The rate the sample windows are sized for
+	if (std::find(Options.begin(), Options.end(), L"--interval") ==
+		Options.end())
+	{
+		Run.insert(Run.end(), { L"--interval", L"250" });
+	}
+	return EndToEndLatency(Run);
+}
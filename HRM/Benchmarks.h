@@ -0,0 +1,55 @@
+#pragma once
+
+#include "pch.h"
+#include <string>
+#include <vector>
+
+// Benchmarks of the hot paths, run with "HRM.exe --bench <name> [options]"
+// instead of the service. Results are printed to stdout.
+namespace Benchmarks
+{
+	// Runs the benchmark with the given name and options, returns false if it
+	// doesn't exist or fails.
+	bool Run(const std::wstring& Name,
+		const std::vector<std::wstring>& Options);
+
+	// Cost of publishing a heart rate sample into the SPSC ring, with and
+	// without a consumer draining it.
+	void RingPublish();
+
+	// Instructions per second of the control protocol parser, fed with a
+	// recorded mix of instructions in socket sized chunks.
+	void ControlParserThroughput();
+
+	// Cost of the text codecs of Codec.h against the stream based versions
+	// they replaced, GUID parsing, address formatting and parsing and
+	// decimal formatting. Checks both produce the same output first.
+	bool CodecThroughput();
+
+	// End-to-end latency of the whole service against simulated bands and a
+	// loopback client on the client port, at the given rates:
+	// - sample: from the 0x2a37 notification to the heart rate frame read by
+	//   the client
+	// - command: from a vibrate instruction (ID 5) sent on the control port
+	//   to the write on 0x2a06
+	// - shm_sample, with --shm: from the notification to the sample seen by
+	//   a reader polling the shared memory channel, against the TCP path of
+	//   the sample latency, and the cost of one poll in nanoseconds
+	// - udp_sample, with --udp port: from the notification to the heart
+	//   rate datagram received on that port
+	// Options: --bands n (1), --interval ms between notifications (100),
+	// --vibrate n per second and band (10), --duration seconds (10),
+	// --shm, --udp port, --output file, --allocations to also print the
+	// heap allocations per stage over the measured run and fail if the
+	// heart rate path allocated (see AllocationBudget.h). Prints p50 / p99 /
+	// p99.9 / max in microseconds and the sustained throughput as a JSON
+	// object on the last line of stdout, and to the output file if given.
+	bool EndToEndLatency(const std::vector<std::wstring>& Options);
+
+	// Steady state allocation check: the end-to-end benchmark with
+	// --allocations, no vibrations and a notification every 250 ms unless
+	// --interval is given. Fails if a notification, delivery or output stage
+	// allocated once warmed up, or if the counters aren't built in
+	// (HRM_COUNT_ALLOCATIONS).
+	bool AllocationBudgetCheck(const std::vector<std::wstring>& Options);
+}
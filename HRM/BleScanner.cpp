@@ -0,0 +1,124 @@
+#include "pch.h"
+#include "BleScanner.h"
+#include "BlthUtil.h"
+#include "SampleFrame.h"
+
+using namespace Windows::Devices::Bluetooth::Advertisement;
+
+BleScanner::BleScanner(Platform::Guid Service, TimerWheel& Timers,
+	DeviceHandler OnDevice, BatchHandler OnBatch) :
+	Timers(Timers), OnDevice(std::move(OnDevice)),
+	OnBatch(std::move(OnBatch)), bScanning(false),
+	BatchTimer([this] { SendUpdates(); }), StopTimer([this] { Stop(); })
+{
+	Watcher = ref new BluetoothLEAdvertisementWatcher();
+	Watcher->ScanningMode = BluetoothLEScanningMode::Active;
+	// The stack drops the advertisements of other devices
+	Watcher->AdvertisementFilter->Advertisement->ServiceUuids->Append(Service);
+	ReceivedToken = Watcher->Received += ref new
+		Windows::Foundation::TypedEventHandler<
+		BluetoothLEAdvertisementWatcher^,
+		BluetoothLEAdvertisementReceivedEventArgs^>(
+			[this](BluetoothLEAdvertisementWatcher^,
+				BluetoothLEAdvertisementReceivedEventArgs^ Args) {
+				OnAdvertisement(Args->BluetoothAddress,
+					Args->RawSignalStrengthInDBm);
+			});
+}
+
+BleScanner::~BleScanner()
+{
+	Timers.Cancel(StopTimer);
+	Timers.Cancel(BatchTimer);
+	Watcher->Received -= ReceivedToken;
+	Watcher->Stop();
+}
+
+void BleScanner::Start(uint32_t Seconds)
+{
+	if (Seconds == 0)
+	{
+		Stop();
+		return;
+	}
+	bool bStarted = false;
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		if (!bScanning)
+		{
+			Table.Clear();
+			bScanning = true;
+			bStarted = true;
+			Timers.Arm(BatchTimer, BatchInterval, BatchInterval);
+		}
+		Timers.Arm(StopTimer, Seconds * 1000);
+	}
+	if (bStarted)
+	{
+		std::wcout << "BLE Scanner started for " << Seconds << " seconds."
+			<< std::endl;
+		Watcher->Start();
+	}
+}
+
+void BleScanner::Stop()
+{
+	std::lock_guard<std::mutex> Reporting(BatchLock);
+	std::vector<ScanEntry> Summary;
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		if (!bScanning)
+		{
+			return;
+		}
+		bScanning = false;
+		Timers.Cancel(StopTimer);
+		Timers.Cancel(BatchTimer);
+		Summary = Table.GetEntries();
+	}
+	// Outside the lock, a late advertisement may be waiting on it
+	Watcher->Stop();
+	std::wcout << "BLE Scanner stopped, " << Summary.size()
+		<< " devices found." << std::endl;
+	OnBatch(Summary, true);
+}
+
+// Runs on the Bluetooth stack's threads for every advertisement.
+void BleScanner::OnAdvertisement(uint64_t Address, int16_t Rssi)
+{
+	bool bNew;
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		if (!bScanning)
+		{
+			return;
+		}
+		bNew = Table.Record(Address, Rssi,
+			SampleFrames::MonotonicMicroseconds());
+	}
+	if (bNew)
+	{
+		std::wcout << "Device: " << BluetoothUtilities::FormatBluetoothAddress(
+			Address) << " found." << std::endl;
+		OnDevice(Address);
+	}
+}
+
+// Reports the devices updated since the previous batch, if any.
+void BleScanner::SendUpdates()
+{
+	std::lock_guard<std::mutex> Reporting(BatchLock);
+	std::vector<ScanEntry> Updates;
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		if (!bScanning)
+		{
+			return;
+		}
+		Table.TakeUpdates(Updates);
+	}
+	if (!Updates.empty())
+	{
+		OnBatch(Updates, false);
+	}
+}
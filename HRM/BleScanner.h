@@ -0,0 +1,63 @@
+#pragma once
+
+#include "pch.h"
+#include "ScanTable.h"
+#include "TimerWheel.h"
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <Windows.Devices.Bluetooth.h>
+
+// Non-blocking scanner for the peripherals advertising a service. Scans run
+// on the Bluetooth stack's threads and the shared timer wheel; every device is
+// recorded once in a table however often it advertises. The devices updated
+// meanwhile are reported in batches, and all of them once more when the scan
+// ends.
+class BleScanner
+{
+public:
+	// Called the first time a device is seen in a scan
+	using DeviceHandler = std::function<void(uint64_t Address)>;
+	// Called with the devices updated since the previous batch, and with
+	// every device and bFinal when the scan ends
+	using BatchHandler = std::function<void(
+		const std::vector<ScanEntry>& Entries, bool bFinal)>;
+
+	BleScanner(Platform::Guid Service, TimerWheel& Timers,
+		DeviceHandler OnDevice, BatchHandler OnBatch);
+	~BleScanner();
+
+	BleScanner(const BleScanner&) = delete;
+	BleScanner& operator=(const BleScanner&) = delete;
+
+	// Scans for the given seconds and returns right away. Starting a running
+	// scan restarts its countdown and keeps what it found; 0 seconds stops
+	// it.
+	void Start(uint32_t Seconds);
+	// Ends the scan, if any, and reports the summary
+	void Stop();
+
+	// Milliseconds between batches of updates
+	static constexpr uint32_t BatchInterval = 500;
+
+private:
+	void OnAdvertisement(uint64_t Address, int16_t Rssi);
+	void SendUpdates();
+
+	TimerWheel& Timers;
+	DeviceHandler OnDevice;
+	BatchHandler OnBatch;
+
+	Windows::Devices::Bluetooth::Advertisement::
+		BluetoothLEAdvertisementWatcher^ Watcher;
+	Windows::Foundation::EventRegistrationToken ReceivedToken;
+
+	// Held while reporting, so no batch follows the summary
+	std::mutex BatchLock;
+	// Guards the table and the scan state
+	std::mutex Lock;
+	ScanTable Table;
+	bool bScanning;
+	TimerEntry BatchTimer;
+	TimerEntry StopTimer;
+};
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "pch.h"
+#include "Codec.h"
 #include "MiBand3.h"
 #include "RemoteCommunication.h"
 
@@ -16,7 +17,13 @@ namespace BluetoothUtilities
 	std::wstring FormatBluetoothAddress(unsigned long long BluetoothAddress);
 	unsigned long long FormatBluetoothAddressInverse(
 		Platform::Array<uint8>^ BluetoothAddress);
-	void scan(MiBand3^ band, int secs);
 	Platform::Guid GetGuidFromStringBase(std::string SubGuid);
 	Platform::Guid GetGuidFromString(std::string Guid);
+
+	inline Platform::Guid ToGuid(const Codec::GuidValue& Value)
+	{
+		return Platform::Guid(Value.Data1, Value.Data2, Value.Data3,
+			Value.Data4[0], Value.Data4[1], Value.Data4[2], Value.Data4[3],
+			Value.Data4[4], Value.Data4[5], Value.Data4[6], Value.Data4[7]);
+	}
 }
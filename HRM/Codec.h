@@ -0,0 +1,241 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Text encodings used by the service: GUIDs, bluetooth addresses and decimal
+// integers. Everything is constexpr, table driven and writes into caller
+// buffers, so nothing allocates and constants are encoded at compile time.
+// Output matches what the stream based versions produced byte for byte.
+namespace Codec
+{
+	// Fields of a GUID, as Platform::Guid takes them
+	struct GuidValue
+	{
+		uint32_t Data1 = 0;
+		uint16_t Data2 = 0;
+		uint16_t Data3 = 0;
+		std::array<uint8_t, 8> Data4{};
+
+		constexpr bool operator==(const GuidValue& Other) const = default;
+	};
+
+	// "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx"
+	constexpr size_t GuidTextSize = 36;
+	// "xx:xx:xx:xx:xx:xx"
+	constexpr size_t AddressTextSize = 17;
+	// Longest uint64_t in decimal
+	constexpr size_t MaxDecimalDigits = 20;
+
+	// Value of every character as a hex digit, -1 if it isn't one. Both
+	// cases are accepted.
+	constexpr std::array<int8_t, 256> HexValues = [] {
+		std::array<int8_t, 256> Values{};
+		for (auto& Value : Values)
+		{
+			Value = -1;
+		}
+		for (int i = 0; i < 10; ++i)
+		{
+			Values['0' + i] = static_cast<int8_t>(i);
+		}
+		for (int i = 0; i < 6; ++i)
+		{
+			Values['a' + i] = static_cast<int8_t>(10 + i);
+			Values['A' + i] = static_cast<int8_t>(10 + i);
+		}
+		return Values;
+	}();
+
+	constexpr char HexDigits[] = "0123456789abcdef";
+
+	// Two decimal digits of every number below 100
+	constexpr std::array<char, 200> DecimalPairs = [] {
+		std::array<char, 200> Pairs{};
+		for (int i = 0; i < 100; ++i)
+		{
+			Pairs[i * 2] = static_cast<char>('0' + i / 10);
+			Pairs[i * 2 + 1] = static_cast<char>('0' + i % 10);
+		}
+		return Pairs;
+	}();
+
+	template <typename CharT>
+	constexpr int HexValue(CharT Char)
+	{
+		const auto Code = static_cast<uint32_t>(Char);
+		return Code < 256 ? HexValues[Code] : -1;
+	}
+
+	// Reads Digits hex digits from Text into Value. False on any non hex
+	// digit.
+	template <typename CharT, typename T>
+	constexpr bool ReadHex(const CharT* Text, size_t Digits, T& Value)
+	{
+		Value = 0;
+		for (size_t i = 0; i < Digits; ++i)
+		{
+			const int Digit = HexValue(Text[i]);
+			if (Digit < 0)
+			{
+				return false;
+			}
+			Value = static_cast<T>((Value << 4) | static_cast<T>(Digit));
+		}
+		return true;
+	}
+
+	// Parses a GUID in its 8-4-4-4-12 form, either case. False if the text
+	// is malformed, Guid is left unspecified then.
+	template <typename CharT>
+	constexpr bool ParseGuid(const CharT* Text, size_t Size, GuidValue& Guid)
+	{
+		if (Size != GuidTextSize || Text[8] != '-' || Text[13] != '-' ||
+			Text[18] != '-' || Text[23] != '-')
+		{
+			return false;
+		}
+		bool bValid = ReadHex(Text, 8, Guid.Data1) &&
+			ReadHex(Text + 9, 4, Guid.Data2) &&
+			ReadHex(Text + 14, 4, Guid.Data3) &&
+			ReadHex(Text + 19, 2, Guid.Data4[0]) &&
+			ReadHex(Text + 21, 2, Guid.Data4[1]);
+		for (size_t i = 0; bValid && i < 6; ++i)
+		{
+			bValid = ReadHex(Text + 24 + i * 2, 2, Guid.Data4[2 + i]);
+		}
+		return bValid;
+	}
+
+	// GUID known at compile time. A malformed one doesn't compile.
+	consteval GuidValue GuidLiteral(const char(&Text)[GuidTextSize + 1])
+	{
+		GuidValue Guid;
+		if (!ParseGuid(Text, GuidTextSize, Guid))
+		{
+			throw "Malformed GUID literal";
+		}
+		return Guid;
+	}
+
+	// Characteristics of the MiBand's own services,
+	// 0000xxxx-0000-3512-2118-0009af100700
+	constexpr GuidValue MiBandGuid(uint16_t ShortId)
+	{
+		GuidValue Guid = GuidLiteral("00000000-0000-3512-2118-0009af100700");
+		Guid.Data1 = ShortId;
+		return Guid;
+	}
+
+	// Writes the GUID in its 8-4-4-4-12 lowercase form into Out, which must
+	// hold GuidTextSize characters. Returns GuidTextSize.
+	template <typename CharT>
+	constexpr size_t FormatGuid(const GuidValue& Guid, CharT* Out)
+	{
+		auto WriteHex = [&Out](uint64_t Value, size_t Digits) {
+			for (size_t i = 0; i < Digits; ++i)
+			{
+				Out[Digits - 1 - i] =
+					static_cast<CharT>(HexDigits[Value & 0xf]);
+				Value >>= 4;
+			}
+			Out += Digits;
+		};
+		WriteHex(Guid.Data1, 8);
+		*Out++ = '-';
+		WriteHex(Guid.Data2, 4);
+		*Out++ = '-';
+		WriteHex(Guid.Data3, 4);
+		*Out++ = '-';
+		WriteHex(Guid.Data4[0], 2);
+		WriteHex(Guid.Data4[1], 2);
+		*Out++ = '-';
+		for (size_t i = 2; i < 8; ++i)
+		{
+			WriteHex(Guid.Data4[i], 2);
+		}
+		return GuidTextSize;
+	}
+
+	// Writes the lower 48 bits of the address as "xx:xx:xx:xx:xx:xx" into
+	// Out, which must hold AddressTextSize characters. Returns
+	// AddressTextSize.
+	template <typename CharT>
+	constexpr size_t FormatAddress(uint64_t Address, CharT* Out)
+	{
+		for (size_t i = 0; i < 6; ++i)
+		{
+			const auto Byte = static_cast<uint8_t>(Address >> (8 * (5 - i)));
+			Out[i * 3] = static_cast<CharT>(HexDigits[Byte >> 4]);
+			Out[i * 3 + 1] = static_cast<CharT>(HexDigits[Byte & 0xf]);
+			if (i < 5)
+			{
+				Out[i * 3 + 2] = ':';
+			}
+		}
+		return AddressTextSize;
+	}
+
+	// Parses an address as hex digits, with any ':' separators ignored, so
+	// groups may be shorter than two digits. False on any other character,
+	// no digits or more than 16 of them.
+	template <typename CharT>
+	constexpr bool ParseAddress(const CharT* Text, size_t Size,
+		uint64_t& Address)
+	{
+		Address = 0;
+		size_t Digits = 0;
+		for (size_t i = 0; i < Size; ++i)
+		{
+			if (Text[i] == ':')
+			{
+				continue;
+			}
+			const int Digit = HexValue(Text[i]);
+			if (Digit < 0 || ++Digits > 16)
+			{
+				return false;
+			}
+			Address = (Address << 4) | static_cast<uint64_t>(Digit);
+		}
+		return Digits > 0;
+	}
+
+	// Writes Value in decimal into Out, which must hold MaxDecimalDigits
+	// characters, like std::to_chars. Returns the characters written.
+	template <typename CharT>
+	constexpr size_t FormatUnsigned(uint64_t Value, CharT* Out)
+	{
+		// Written backwards two digits at a time, then moved to the front
+		CharT Buffer[MaxDecimalDigits] = {};
+		size_t Pos = MaxDecimalDigits;
+		while (Value >= 100)
+		{
+			const auto Pair = static_cast<size_t>(Value % 100) * 2;
+			Value /= 100;
+			Buffer[--Pos] = static_cast<CharT>(DecimalPairs[Pair + 1]);
+			Buffer[--Pos] = static_cast<CharT>(DecimalPairs[Pair]);
+		}
+		if (Value >= 10)
+		{
+			const auto Pair = static_cast<size_t>(Value) * 2;
+			Buffer[--Pos] = static_cast<CharT>(DecimalPairs[Pair + 1]);
+			Buffer[--Pos] = static_cast<CharT>(DecimalPairs[Pair]);
+		}
+		else
+		{
+			Buffer[--Pos] = static_cast<CharT>('0' + Value);
+		}
+		const size_t Size = MaxDecimalDigits - Pos;
+		for (size_t i = 0; i < Size; ++i)
+		{
+			Out[i] = Buffer[Pos + i];
+		}
+		return Size;
+	}
+
+	static_assert(MiBandGuid(0x0009) ==
+		GuidLiteral("00000009-0000-3512-2118-0009af100700"));
+	static_assert(HexValue('F') == 15 && HexValue('g') == -1);
+}
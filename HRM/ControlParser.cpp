@@ -0,0 +1,44 @@
+#include "pch.h"
+#include "ControlParser.h"
+
+ControlParser::ControlParser(uint32_t MaxMessageSize) :
+	CurrentState(State::Id), CurrentId(0), Needed(0), Have(0),
+	MaxMessageSize(MaxMessageSize)
+{
+}
+
+void ControlParser::Reset()
+{
+	CurrentState = State::Id;
+	Needed = 0;
+	Have = 0;
+}
+
+// Argument layout of every instruction, unknown ones have no arguments.
+uint8_t ControlParser::ArgumentsSize(uint8_t Id)
+{
+	switch (Id)
+	{
+	// Start / stop client, heart rate on / off, output mode, band address
+	case 0:
+	case 4:
+	case 7:
+	case 9:
+		return sizeof(uint8_t);
+	// Scan seconds, vibrate milliseconds, coalescing window, subscription,
+	// datagram port
+	case 1:
+	case 5:
+	case 8:
+	case 10:
+	case 14:
+		return sizeof(uint16_t);
+	// Connect address, custom message, aggregates configuration
+	case 2:
+	case 3:
+	case 13:
+		return SizePrefixed;
+	default:
+		return 0;
+	}
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Complete instruction of the control protocol. Args points to the payload
+// that follows the instruction id, without the size prefix of variable length
+// instructions, and is only valid during the dispatch.
+struct ControlInstruction
+{
+	uint8_t Id;
+	const uint8_t* Args;
+	uint32_t ArgsSize;
+};
+
+// Resumable parser of the control protocol (see RemoteCommunication.h for the
+// instructions). Bytes are fed in chunks of any size, every instruction
+// completed by a chunk is dispatched right away, and partial instructions are
+// kept until the next chunk. Arguments that arrive whole within a chunk are
+// dispatched in place, without copies.
+class ControlParser
+{
+public:
+	explicit ControlParser(uint32_t MaxMessageSize = 64 * 1024);
+
+	// Parses a chunk, calling OnInstruction(const ControlInstruction&) for
+	// every complete instruction. Returns false, and stops parsing for good,
+	// on a protocol error (a message bigger than MaxMessageSize).
+	template <typename Handler>
+	bool Feed(const uint8_t* Data, size_t Size, Handler&& OnInstruction);
+
+	// Forgets any partial instruction and clears the error state.
+	void Reset();
+
+	bool HasError() const { return CurrentState == State::Error; }
+	// True if a partial instruction is waiting for more bytes.
+	bool HasPartial() const { return CurrentState != State::Id; }
+
+	static uint16_t ReadLE16(const uint8_t* Data)
+	{
+		return static_cast<uint16_t>(Data[0] | (Data[1] << 8));
+	}
+
+	static uint32_t ReadLE32(const uint8_t* Data)
+	{
+		return static_cast<uint32_t>(ReadLE16(Data)) |
+			(static_cast<uint32_t>(ReadLE16(Data + 2)) << 16);
+	}
+
+	// Size of the fixed arguments of an instruction, or SizePrefixed for the
+	// ones made of a uint32 size followed by that many bytes.
+	static constexpr uint8_t SizePrefixed = 0xff;
+	static uint8_t ArgumentsSize(uint8_t Id);
+
+private:
+	enum class State : uint8_t
+	{
+		Id,
+		Fixed,
+		Length,
+		Body,
+		Error
+	};
+
+	State CurrentState;
+	uint8_t CurrentId;
+	// Bytes needed by the current state and bytes gathered so far
+	uint32_t Needed;
+	uint32_t Have;
+	uint32_t MaxMessageSize;
+	// Partial fixed arguments or size prefix
+	uint8_t Scratch[8];
+	// Partial variable length payload, reused across instructions
+	std::vector<uint8_t> Body;
+};
+
+template <typename Handler>
+bool ControlParser::Feed(const uint8_t* Data, size_t Size,
+	Handler&& OnInstruction)
+{
+	size_t Pos = 0;
+	while (Pos < Size)
+	{
+		const size_t Available = Size - Pos;
+		switch (CurrentState)
+		{
+		case State::Id:
+		{
+			CurrentId = Data[Pos++];
+			const uint8_t Arguments = ArgumentsSize(CurrentId);
+			Have = 0;
+			if (Arguments == 0)
+			{
+				OnInstruction(ControlInstruction{ CurrentId, nullptr, 0 });
+			}
+			else if (Arguments == SizePrefixed)
+			{
+				Needed = sizeof(uint32_t);
+				CurrentState = State::Length;
+			}
+			else
+			{
+				Needed = Arguments;
+				CurrentState = State::Fixed;
+			}
+			break;
+		}
+		case State::Fixed:
+		case State::Body:
+		{
+			// Whole arguments available, dispatch them in place
+			if (Have == 0 && Available >= Needed)
+			{
+				OnInstruction(ControlInstruction{ CurrentId, Data + Pos,
+					Needed });
+				Pos += Needed;
+				CurrentState = State::Id;
+				break;
+			}
+			uint8_t* Target = CurrentState == State::Fixed ?
+				Scratch : Body.data();
+			const uint32_t Count = static_cast<uint32_t>(
+				Available < Needed - Have ? Available : Needed - Have);
+			std::memcpy(Target + Have, Data + Pos, Count);
+			Have += Count;
+			Pos += Count;
+			if (Have == Needed)
+			{
+				OnInstruction(ControlInstruction{ CurrentId, Target,
+					Needed });
+				CurrentState = State::Id;
+			}
+			break;
+		}
+		case State::Length:
+		{
+			const uint32_t Count = static_cast<uint32_t>(
+				Available < Needed - Have ? Available : Needed - Have);
+			std::memcpy(Scratch + Have, Data + Pos, Count);
+			Have += Count;
+			Pos += Count;
+			if (Have < Needed)
+			{
+				break;
+			}
+			const uint32_t MessageSize = ReadLE32(Scratch);
+			if (MessageSize > MaxMessageSize)
+			{
+				CurrentState = State::Error;
+				return false;
+			}
+			Have = 0;
+			if (MessageSize == 0)
+			{
+				OnInstruction(ControlInstruction{ CurrentId, nullptr, 0 });
+				CurrentState = State::Id;
+				break;
+			}
+			// Grows once up to the biggest message seen
+			if (Body.size() < MessageSize)
+			{
+				Body.resize(MessageSize);
+			}
+			Needed = MessageSize;
+			CurrentState = State::Body;
+			break;
+		}
+		case State::Error:
+			return false;
+		}
+	}
+	return CurrentState != State::Error;
+}
@@ -0,0 +1,55 @@
+// libFuzzer target for the control protocol parser. Not part of HRM.vcxproj,
+// build it on its own, for example:
+//   clang++ -std=c++17 -g -fsanitize=fuzzer,address -I.. ControlParserFuzz.cpp
+//     ../ControlParser.cpp -o ControlParserFuzz
+//   ./ControlParserFuzz ControlParserCorpus
+// The input is parsed twice, whole and split into chunks at positions taken
+// from the input itself, and both runs must dispatch the same instructions.
+
+#include "ControlParser.h"
+#include <cstdlib>
+#include <vector>
+
+namespace
+{
+	// Serializes every dispatched instruction, to compare both runs
+	void Record(std::vector<uint8_t>& Log, const ControlInstruction& I)
+	{
+		Log.push_back(I.Id);
+		Log.push_back(static_cast<uint8_t>(I.ArgsSize));
+		Log.push_back(static_cast<uint8_t>(I.ArgsSize >> 8));
+		Log.insert(Log.end(), I.Args, I.Args + I.ArgsSize);
+	}
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* Data, size_t Size)
+{
+	// Small limit so the size checks are exercised too
+	ControlParser Whole(4096);
+	std::vector<uint8_t> WholeLog;
+	bool bWholeOk = Whole.Feed(Data, Size, [&](const ControlInstruction& I) {
+		Record(WholeLog, I);
+		});
+
+	ControlParser Split(4096);
+	std::vector<uint8_t> SplitLog;
+	bool bSplitOk = true;
+	size_t Pos = 0;
+	size_t Step = 1;
+	while (Pos < Size && bSplitOk)
+	{
+		size_t Count = Step < Size - Pos ? Step : Size - Pos;
+		bSplitOk = Split.Feed(Data + Pos, Count,
+			[&](const ControlInstruction& I) { Record(SplitLog, I); });
+		Pos += Count;
+		// Next chunk size comes from the data, 1 to 64 bytes
+		Step = (Data[Pos - 1] & 0x3f) + 1;
+	}
+
+	if (bWholeOk != bSplitOk || WholeLog != SplitLog ||
+		Whole.HasPartial() != Split.HasPartial())
+	{
+		std::abort();
+	}
+	return 0;
+}
@@ -0,0 +1,108 @@
+#include "pch.h"
+#include "GattCache.h"
+#include <fstream>
+#include <sstream>
+
+// One line per band: address, pairing state and the characteristic and
+// descriptor handles of every channel, all in hex. The pairing state used to
+// be a paired flag, which reads as Unknown or Paired.
+GattCache::GattCache(const std::string& Path) : Path(Path)
+{
+	Load();
+}
+
+void GattCache::Load()
+{
+	std::ifstream In(Path);
+	std::string Line;
+	while (std::getline(In, Line))
+	{
+		std::istringstream Fields(Line);
+		GattCacheEntry Entry;
+		uint32_t Pairing = 0;
+		Fields >> std::hex >> Entry.Address >> Pairing;
+		Entry.Pairing = static_cast<PairingState>(Pairing);
+		for (size_t i = 0; i < GattCacheEntry::ChannelCount; ++i)
+		{
+			Fields >> Entry.Characteristics[i] >> Entry.Descriptors[i];
+		}
+		// Lines from another layout version are skipped
+		if (Fields && Entry.Address != 0 &&
+			Pairing <= static_cast<uint32_t>(PairingState::Rejected))
+		{
+			Entries[Entry.Address] = Entry;
+		}
+	}
+}
+
+void GattCache::Save()
+{
+	std::ofstream Out(Path, std::ios::trunc);
+	Out << std::hex;
+	for (auto& Item : Entries)
+	{
+		const GattCacheEntry& Entry = Item.second;
+		Out << Entry.Address << ' ' << static_cast<uint32_t>(Entry.Pairing);
+		for (size_t i = 0; i < GattCacheEntry::ChannelCount; ++i)
+		{
+			Out << ' ' << Entry.Characteristics[i] << ' '
+				<< Entry.Descriptors[i];
+		}
+		Out << '\n';
+	}
+}
+
+bool GattCache::Find(uint64_t Address, GattCacheEntry& Entry)
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	auto It = Entries.find(Address);
+	if (It == Entries.end())
+	{
+		return false;
+	}
+	Entry = It->second;
+	return true;
+}
+
+void GattCache::StoreLayout(const GattCacheEntry& Entry)
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	GattCacheEntry& Stored = Entries[Entry.Address];
+	const PairingState Pairing = Stored.Address == Entry.Address ?
+		Stored.Pairing : PairingState::Unknown;
+	Stored = Entry;
+	Stored.Pairing = Pairing;
+	Save();
+}
+
+void GattCache::SetPairing(uint64_t Address, PairingState Pairing)
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	GattCacheEntry& Stored = Entries[Address];
+	if (Stored.Address != Address || Stored.Pairing != Pairing)
+	{
+		Stored.Address = Address;
+		Stored.Pairing = Pairing;
+		Save();
+	}
+}
+
+void GattCache::Forget(uint64_t Address)
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	auto It = Entries.find(Address);
+	if (It == Entries.end())
+	{
+		return;
+	}
+	if (It->second.Pairing == PairingState::Unknown)
+	{
+		Entries.erase(It);
+	}
+	else
+	{
+		It->second.Characteristics.fill(0);
+		It->second.Descriptors.fill(0);
+	}
+	Save();
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "GattTransport.h"
+#include <array>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+// What a band made of our key on its last handshake
+enum class PairingState : uint8_t
+{
+	// Never completed nor failed a handshake with it
+	Unknown,
+	// Accepted our key
+	Paired,
+	// Failed the challenge, it holds another key
+	Rejected
+};
+
+// What a band looked like the last time it connected
+struct GattCacheEntry
+{
+	static constexpr size_t ChannelCount =
+		static_cast<size_t>(GattChannel::Count);
+
+	uint64_t Address = 0;
+	// Attribute handle of the characteristic of every channel and of its
+	// client configuration descriptor, 0 if it has none
+	std::array<uint16_t, ChannelCount> Characteristics{};
+	std::array<uint16_t, ChannelCount> Descriptors{};
+	PairingState Pairing = PairingState::Unknown;
+
+	// False if only the pairing state is known
+	bool HasLayout() const
+	{
+		for (uint16_t Handle : Characteristics)
+		{
+			if (Handle != 0)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+// Per address cache of the GATT layout and auth state of the bands, kept in a
+// text file so it survives restarts. Entries are only hints: transports check
+// them against the device and fall back to full discovery on mismatch.
+class GattCache
+{
+public:
+	explicit GattCache(const std::string& Path);
+
+	bool Find(uint64_t Address, GattCacheEntry& Entry);
+	// Adds or replaces the layout of a band, keeping its auth state
+	void StoreLayout(const GattCacheEntry& Entry);
+	void SetPairing(uint64_t Address, PairingState Pairing);
+	// Drops the layout of a band that didn't match the device, keeping its
+	// auth state
+	void Forget(uint64_t Address);
+
+private:
+	void Load();
+	// Lock must be held
+	void Save();
+
+	std::string Path;
+	std::mutex Lock;
+	std::map<uint64_t, GattCacheEntry> Entries;
+};
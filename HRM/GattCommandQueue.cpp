@@ -0,0 +1,216 @@
+#include "pch.h"
+#include "GattCommandQueue.h"
+#include <algorithm>
+
+namespace
+{
+	uint64_t Microseconds(std::chrono::steady_clock::duration Elapsed)
+	{
+		return static_cast<uint64_t>(
+			std::chrono::duration_cast<std::chrono::microseconds>(
+				Elapsed).count());
+	}
+}
+
+GattCommandQueue::GattCommandQueue(GattTransport& Transport,
+	uint32_t MaxRetries) :
+	Transport(Transport), MaxRetries(MaxRetries), InFlight(None),
+	bPumping(false), NextSequence(0)
+{
+}
+
+void GattCommandQueue::Write(GattChannel Channel, std::vector<uint8_t> Data,
+	GattPriority Priority, uint32_t CollapseKey,
+	GattTransport::Completion Done)
+{
+	Command NewCommand;
+	NewCommand.Data = std::move(Data);
+	NewCommand.Priority = Priority;
+	NewCommand.CollapseKey = CollapseKey;
+	NewCommand.Done.push_back(std::move(Done));
+	Push(Channel, std::move(NewCommand));
+}
+
+void GattCommandQueue::EnableNotifications(GattChannel Channel,
+	GattPriority Priority, GattTransport::Completion Done)
+{
+	Command NewCommand;
+	NewCommand.bEnableNotifications = true;
+	NewCommand.Priority = Priority;
+	NewCommand.Done.push_back(std::move(Done));
+	Push(Channel, std::move(NewCommand));
+}
+
+void GattCommandQueue::Push(GattChannel Channel, Command NewCommand)
+{
+	const size_t Index = static_cast<size_t>(Channel);
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		auto& Queue = Channels[Index];
+		if (NewCommand.CollapseKey != 0)
+		{
+			// The write in flight is already on the link, only later ones
+			// can be replaced
+			auto First = Queue.begin() + (InFlight == Index ? 1 : 0);
+			for (auto Queued = First; Queued != Queue.end(); ++Queued)
+			{
+				if (Queued->CollapseKey != NewCommand.CollapseKey)
+				{
+					continue;
+				}
+				// Keeps its place, so the channel order still holds
+				Queued->Data = std::move(NewCommand.Data);
+				Queued->Priority = std::max(Queued->Priority,
+					NewCommand.Priority);
+				Queued->Done.push_back(std::move(NewCommand.Done.front()));
+				++Stats.Collapsed;
+				return;
+			}
+		}
+		NewCommand.Sequence = NextSequence++;
+		NewCommand.Queued = Clock::now();
+		Queue.push_back(std::move(NewCommand));
+		++Stats.Depth;
+		Stats.MaxDepth = std::max(Stats.MaxDepth, Stats.Depth);
+	}
+	Pump();
+}
+
+void GattCommandQueue::Clear()
+{
+	std::vector<GattTransport::Completion> Failed;
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		for (size_t i = 0; i < ChannelCount; ++i)
+		{
+			auto& Queue = Channels[i];
+			auto First = Queue.begin() + (InFlight == i ? 1 : 0);
+			for (auto Queued = First; Queued != Queue.end(); ++Queued)
+			{
+				for (auto& Done : Queued->Done)
+				{
+					Failed.push_back(std::move(Done));
+				}
+				++Stats.Failed;
+				--Stats.Depth;
+			}
+			Queue.erase(First, Queue.end());
+		}
+	}
+	for (auto& Done : Failed)
+	{
+		if (Done)
+		{
+			Done(false);
+		}
+	}
+}
+
+GattQueueStats GattCommandQueue::GetStats()
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	return Stats;
+}
+
+GattQueueSummary GattCommandQueue::GetSummary()
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	GattQueueSummary Summary;
+	Summary.Depth = Stats.Depth;
+	Summary.QueueLatencyP99 = Stats.QueueLatency.Percentile(99.0);
+	Summary.LinkLatencyP99 = Stats.LinkLatency.Percentile(99.0);
+	return Summary;
+}
+
+// Sends the next operation if none is in flight. Loops instead of recursing
+// when the transport completes inline.
+void GattCommandQueue::Pump()
+{
+	std::unique_lock<std::mutex> Guard(Lock);
+	if (bPumping)
+	{
+		return;
+	}
+	bPumping = true;
+	while (InFlight == None)
+	{
+		// Highest priority head, the oldest one on ties
+		size_t Next = None;
+		for (size_t i = 0; i < ChannelCount; ++i)
+		{
+			if (Channels[i].empty())
+			{
+				continue;
+			}
+			const Command& Head = Channels[i].front();
+			if (Next == None ||
+				Head.Priority > Channels[Next].front().Priority ||
+				(Head.Priority == Channels[Next].front().Priority &&
+					Head.Sequence < Channels[Next].front().Sequence))
+			{
+				Next = i;
+			}
+		}
+		if (Next == None)
+		{
+			break;
+		}
+
+		// Stays at the front until it completes, so the reference holds
+		Command& Current = Channels[Next].front();
+		if (Current.Attempts++ == 0)
+		{
+			Current.Started = Clock::now();
+			Stats.QueueLatency.Record(
+				Microseconds(Current.Started - Current.Queued));
+		}
+		InFlight = Next;
+		const auto Channel = static_cast<GattChannel>(Next);
+		Guard.unlock();
+		auto OnDone = [this](bool bSuccess) { OnComplete(bSuccess); };
+		if (Current.bEnableNotifications)
+		{
+			Transport.EnableNotifications(Channel, OnDone);
+		}
+		else
+		{
+			Transport.Write(Channel, Current.Data.data(),
+				static_cast<uint32_t>(Current.Data.size()), OnDone);
+		}
+		Guard.lock();
+	}
+	bPumping = false;
+}
+
+void GattCommandQueue::OnComplete(bool bSuccess)
+{
+	std::vector<GattTransport::Completion> Finished;
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		auto& Queue = Channels[InFlight];
+		Command& Current = Queue.front();
+		if (!bSuccess && Current.Attempts <= MaxRetries)
+		{
+			// Stays at the front of its channel and goes again
+			++Stats.Retried;
+		}
+		else
+		{
+			Stats.LinkLatency.Record(
+				Microseconds(Clock::now() - Current.Started));
+			++(bSuccess ? Stats.Completed : Stats.Failed);
+			Finished = std::move(Current.Done);
+			Queue.pop_front();
+			--Stats.Depth;
+		}
+		InFlight = None;
+	}
+	for (auto& Done : Finished)
+	{
+		if (Done)
+		{
+			Done(bSuccess);
+		}
+	}
+	Pump();
+}
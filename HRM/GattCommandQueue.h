@@ -0,0 +1,114 @@
+#pragma once
+
+#include "GattTransport.h"
+#include "LatencyHistogram.h"
+#include <array>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// Priority of a queued GATT operation, higher ones go first
+enum class GattPriority : uint8_t
+{
+	// Keepalive pings
+	Background,
+	// Auth handshake and heart rate control
+	Control,
+	// Vibrations and messages, felt by the user
+	Haptic
+};
+
+// Counters of a command queue. Latencies are in microseconds, from queueing
+// to the first attempt and from there to the final result.
+struct GattQueueStats
+{
+	// Operations queued or in flight
+	uint32_t Depth = 0;
+	uint32_t MaxDepth = 0;
+	uint64_t Completed = 0;
+	uint64_t Failed = 0;
+	uint64_t Retried = 0;
+	// Writes replaced by a newer one before they were sent
+	uint64_t Collapsed = 0;
+	LatencyHistogram QueueLatency;
+	LatencyHistogram LinkLatency;
+};
+
+// Depth of a command queue and the 99th percentile of its latencies, in
+// microseconds
+struct GattQueueSummary
+{
+	uint32_t Depth = 0;
+	uint64_t QueueLatencyP99 = 0;
+	uint64_t LinkLatencyP99 = 0;
+};
+
+// Serializes the GATT operations of one device over its transport, one at a
+// time, as the link runs them anyway. Operations on the same channel run in
+// the order they were queued; between channels, the highest priority head
+// goes first. A write with a collapse key replaces a queued, not yet sent
+// write with the same key to the same channel. Failed operations are retried
+// before their failure is reported.
+class GattCommandQueue
+{
+public:
+	explicit GattCommandQueue(GattTransport& Transport,
+		uint32_t MaxRetries = 2);
+
+	GattCommandQueue(const GattCommandQueue&) = delete;
+	GattCommandQueue& operator=(const GattCommandQueue&) = delete;
+
+	// A collapse key of 0 never collapses
+	void Write(GattChannel Channel, std::vector<uint8_t> Data,
+		GattPriority Priority, uint32_t CollapseKey,
+		GattTransport::Completion Done);
+	void EnableNotifications(GattChannel Channel, GattPriority Priority,
+		GattTransport::Completion Done);
+	// Fails every queued operation. The one in flight finishes on its own.
+	void Clear();
+
+	// Copies every counter, the histograms included
+	GattQueueStats GetStats();
+	// Reads the depth and the percentiles under one lock, without copying
+	// the histograms
+	GattQueueSummary GetSummary();
+
+private:
+	using Clock = std::chrono::steady_clock;
+	static constexpr size_t ChannelCount =
+		static_cast<size_t>(GattChannel::Count);
+	static constexpr size_t None = ChannelCount;
+
+	struct Command
+	{
+		std::vector<uint8_t> Data;
+		bool bEnableNotifications = false;
+		GattPriority Priority = GattPriority::Control;
+		uint32_t CollapseKey = 0;
+		// Queueing order, breaks ties between channels
+		uint64_t Sequence = 0;
+		uint32_t Attempts = 0;
+		Clock::time_point Queued;
+		Clock::time_point Started;
+		// Completions of this write and of those it replaced
+		std::vector<GattTransport::Completion> Done;
+	};
+
+	void Push(GattChannel Channel, Command NewCommand);
+	void Pump();
+	void OnComplete(bool bSuccess);
+
+	GattTransport& Transport;
+	const uint32_t MaxRetries;
+
+	std::mutex Lock;
+	// Pending operations of every channel, the one in flight at the front
+	std::array<std::deque<Command>, ChannelCount> Channels;
+	// Channel of the operation in flight, None if idle
+	size_t InFlight;
+	// A thread is dispatching, completions that run inline don't recurse
+	bool bPumping;
+	uint64_t NextSequence;
+	GattQueueStats Stats;
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+// GATT characteristics of the MiBand 3 used by this module. Backends map them
+// to their own handles.
+enum class GattChannel : uint8_t
+{
+	// fee1 / 00000009-0000-3512-2118-0009af100700, auth handshake
+	Authentication,
+	// 180d / 2a39, heart rate control point
+	HeartRateControlPoint,
+	// 180d / 2a37, heart rate measurement notifications
+	HeartRateMeasurement,
+	// 1802 / 2a06, immediate alert (vibration)
+	Alert,
+	// 1811 / 2a46, new alert (messages)
+	NewAlert,
+	// 1811 / 2a44, alert notification control point
+	AlertNotificationControlPoint,
+
+	Count
+};
+
+// Narrow interface between MiBand3 and a GATT peripheral. Every call returns
+// right away and reports its result through the given completion, which may
+// run on any thread, or inline before the call returns. Buffers passed in are
+// only valid during the call, and notification data only during the handler.
+class GattTransport
+{
+public:
+	using Completion = std::function<void(bool bSuccess)>;
+	using NotificationHandler = std::function<void(GattChannel Channel,
+		const uint8_t* Data, uint32_t Size)>;
+	using DisconnectionHandler = std::function<void()>;
+
+	virtual ~GattTransport() {}
+
+	// Connects to the device with the given address and resolves the
+	// characteristics.
+	virtual void Open(uint64_t Address, Completion Done) = 0;
+	virtual void Close() = 0;
+
+	virtual void Write(GattChannel Channel, const uint8_t* Data,
+		uint32_t Size, Completion Done) = 0;
+	// Subscribes to the notifications of the channel, they are delivered to
+	// the notification handler. Enabling a channel twice is harmless.
+	virtual void EnableNotifications(GattChannel Channel,
+		Completion Done) = 0;
+
+	// True if the last Open reused a cached layout instead of a full
+	// discovery
+	virtual bool OpenedFromCache() const { return false; }
+
+	// Handlers must be set before Open
+	virtual void SetNotificationHandler(NotificationHandler Handler) = 0;
+	virtual void SetDisconnectionHandler(DisconnectionHandler Handler) = 0;
+};
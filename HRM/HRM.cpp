@@ -3,19 +3,196 @@
 
 #include "pch.h"
 
+#include "AllocationBudget.h"
 #include "MiBand3.h"
 #include "RemoteCommunication.h"
+#include "SessionManager.h"
+#include "SessionReplay.h"
+#include "Benchmarks.h"
+#include "Trace.h"
+#include <cerrno>
+#include <cmath>
+#include <cwchar>
+
+namespace
+{
+	// Replay speed of "--replay <file> [speed|max]": "max" gives 0, as fast as
+	// possible, otherwise a factor above 0. False if the option is neither.
+	bool ParseReplaySpeed(const std::wstring& Option, double& Speed)
+	{
+		if (Option == L"max")
+		{
+			Speed = 0.0;
+			return true;
+		}
+		wchar_t* End = nullptr;
+		const double Value = std::wcstod(Option.c_str(), &End);
+		if (Option.empty() || End != Option.c_str() + Option.size() ||
+			!std::isfinite(Value) || Value <= 0.0)
+		{
+			return false;
+		}
+		Speed = Value;
+		return true;
+	}
+
+	// Interval of "--simulate [interval ms]", milliseconds between two
+	// notifications, above 0. False if the option is anything else.
+	bool ParseNotificationInterval(const std::wstring& Option,
+		uint32_t& Interval)
+	{
+		if (Option.empty() || Option[0] < L'0' || Option[0] > L'9')
+		{
+			return false;
+		}
+		wchar_t* End = nullptr;
+		errno = 0;
+		const unsigned long Value = std::wcstoul(Option.c_str(), &End, 10);
+		if (End != Option.c_str() + Option.size() || errno == ERANGE ||
+			Value == 0 || Value > UINT32_MAX)
+		{
+			return false;
+		}
+		Interval = static_cast<uint32_t>(Value);
+		return true;
+	}
+}
 
 // Main function of the program
 int main(Platform::Array<Platform::String^>^ args)
 {
+	// "--bench <name> [options]" runs a benchmark instead of the service
+	if (args->Length > 2 && std::wstring(args[1]->Data()) == L"--bench")
+	{
+		std::vector<std::wstring> Options;
+		for (unsigned int i = 3; i < args->Length; ++i)
+		{
+			Options.push_back(args[i]->Data());
+		}
+		return Benchmarks::Run(args[2]->Data(), Options) ? 0 : 1;
+	}
+
+	// "--simulate [interval ms]" serves simulated bands, so the whole
+	// pipeline runs without Bluetooth hardware. An option in place of the
+	// interval keeps the default one.
+	const bool bSimulate = args->Length > 1 &&
+		std::wstring(args[1]->Data()) == L"--simulate";
+	SimulatedBandSettings Settings;
+	if (bSimulate && args->Length > 2 &&
+		std::wstring(args[2]->Data()).compare(0, 2, L"--") != 0 &&
+		!ParseNotificationInterval(args[2]->Data(),
+			Settings.NotificationInterval))
+	{
+		std::wcout << "Invalid notification interval " << args[2]->Data()
+			<< ", usage: --simulate [interval ms], interval above 0"
+			<< std::endl;
+		return 1;
+	}
+
 	std::wcout << "Service started" << std::endl;
 
-	MiBand3^ MB3 = ref new MiBand3();
+	// Every band of the session is served by this manager
+	SessionManager^ Session = ref new SessionManager();
+
+	if (bSimulate)
+	{
+		Session->UseSimulatedBands(Settings);
+		std::wcout << "Simulating bands, one notification every "
+			<< Settings.NotificationInterval << " ms" << std::endl;
+	}
+
+	// "--record <file>" logs every sample and event of the session, so it
+	// can be replayed later
+	for (unsigned int i = 1; i + 1 < args->Length; ++i)
+	{
+		if (std::wstring(args[i]->Data()) != L"--record")
+		{
+			continue;
+		}
+		if (Session->RecordTo(args[i + 1]->Data()))
+		{
+			std::wcout << "Recording to " << args[i + 1]->Data() << std::endl;
+		}
+		else
+		{
+			std::wcout << "Could not record to " << args[i + 1]->Data()
+				<< std::endl;
+		}
+	}
+
+	// "--shm [name]" also publishes the samples into shared memory, for local
+	// readers that can't afford a socket per read (SharedHeartRateReader.h)
+	for (unsigned int i = 1; i < args->Length; ++i)
+	{
+		if (std::wstring(args[i]->Data()) != L"--shm")
+		{
+			continue;
+		}
+		std::string Name = SharedHeartRate::DefaultName;
+		if (i + 1 < args->Length && args[i + 1]->Data()[0] != L'-')
+		{
+			Name.clear();
+			for (const wchar_t* Char = args[i + 1]->Data(); *Char; ++Char)
+			{
+				Name.push_back(static_cast<char>(*Char));
+			}
+		}
+		if (Session->PublishTo(Name))
+		{
+			std::cout << "Publishing to shared memory " << Name << std::endl;
+		}
+		else
+		{
+			std::cout << "Could not create shared memory " << Name
+				<< std::endl;
+		}
+	}
+
+	// "--replay <file> [speed|max]" plays a recorded session to the client
+	// instead of serving bands, at the recorded pace by default
+	std::unique_ptr<SessionReplay> Replay;
+	if (args->Length > 2 && std::wstring(args[1]->Data()) == L"--replay")
+	{
+		double Speed = 1.0;
+		if (args->Length > 3 && !ParseReplaySpeed(args[3]->Data(), Speed))
+		{
+			std::wcout << "Invalid replay speed " << args[3]->Data()
+				<< ", usage: --replay <file> [speed|max], speed above 0"
+				<< std::endl;
+		}
+		else
+		{
+			Replay = std::make_unique<SessionReplay>(Session);
+			if (Replay->Open(args[2]->Data()))
+			{
+				Replay->Start(Speed);
+			}
+			else
+			{
+				std::wcout << "Could not replay " << args[2]->Data()
+					<< std::endl;
+				Replay.reset();
+			}
+		}
+	}
 
 	// Wait for user input to end
 	int a;
 	std::cin >> a;
+	Replay.reset();
+	// Flush what the recorder still holds once nothing feeds it anymore
+	if (auto Recorder = Session->GetRecorder())
+	{
+		Recorder->Close();
+	}
+
+#if HRM_ENABLE_TRACING
+	Tracing::WriteChromeTrace("hrm-trace-exit.json");
+#endif
+#if HRM_COUNT_ALLOCATIONS
+	// Allocations of the whole run, per stage
+	AllocationBudget::Report(AllocationBudget::Snapshot{}, 0);
+#endif
 
 	return 0;
 }
@@ -0,0 +1,163 @@
+#include "pch.h"
+#include "HeartRateAggregator.h"
+#include <algorithm>
+
+HeartRateAggregator::HeartRateAggregator() :
+	First(0)
+{
+	Configure({ 10, 60, 300 }, { 100, 120, 140, 160, 180 });
+}
+
+bool HeartRateAggregator::Configure(const std::vector<uint32_t>& WindowSeconds,
+	const std::vector<uint8_t>& ZoneBounds)
+{
+	if (WindowSeconds.empty() || WindowSeconds.size() > MaxWindows ||
+		ZoneBounds.size() >= MaxZones ||
+		!std::is_sorted(ZoneBounds.begin(), ZoneBounds.end()) ||
+		std::find(WindowSeconds.begin(), WindowSeconds.end(), 0u) !=
+			WindowSeconds.end())
+	{
+		return false;
+	}
+
+	std::lock_guard<std::mutex> Guard(Lock);
+	Windows.assign(WindowSeconds.size(), Window());
+	for (size_t i = 0; i < WindowSeconds.size(); ++i)
+	{
+		Windows[i].Seconds = WindowSeconds[i];
+		Windows[i].LengthUs = static_cast<uint64_t>(WindowSeconds[i]) *
+			1000000;
+		Windows[i].Tail = First + History.Size();
+		Windows[i].MinQueue.Reserve(WindowSeconds[i] * ReservedRate);
+		Windows[i].MaxQueue.Reserve(WindowSeconds[i] * ReservedRate);
+	}
+	History.Reserve(*std::max_element(WindowSeconds.begin(),
+		WindowSeconds.end()) * ReservedRate);
+	Bounds = ZoneBounds;
+	First += History.Size();
+	History.Clear();
+	return true;
+}
+
+void HeartRateAggregator::Add(uint64_t Timestamp, uint16_t Bpm)
+{
+	if (Bpm == 0)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> Guard(Lock);
+	Entry New;
+	New.Timestamp = Timestamp;
+	New.Bpm = Bpm;
+	New.Zone = ZoneOf(Bpm);
+	New.DurationUs = 0;
+	if (!History.IsEmpty() && Timestamp > History.Back().Timestamp)
+	{
+		New.DurationUs = static_cast<uint32_t>(std::min(
+			Timestamp - History.Back().Timestamp, MaxGapMs * 1000));
+	}
+	const uint64_t Index = First + History.Size();
+	History.PushBack(New);
+
+	for (auto& Target : Windows)
+	{
+		Target.Sum += Bpm;
+		++Target.Count;
+		Target.ZoneUs[New.Zone] += New.DurationUs;
+		// Older samples that can no longer be the extreme are dropped
+		while (!Target.MinQueue.IsEmpty() &&
+			At(Target.MinQueue.Back()).Bpm >= Bpm)
+		{
+			Target.MinQueue.PopBack();
+		}
+		Target.MinQueue.PushBack(Index);
+		while (!Target.MaxQueue.IsEmpty() &&
+			At(Target.MaxQueue.Back()).Bpm <= Bpm)
+		{
+			Target.MaxQueue.PopBack();
+		}
+		Target.MaxQueue.PushBack(Index);
+		Expire(Target, Timestamp);
+	}
+	Trim();
+}
+
+AggregateSnapshot HeartRateAggregator::Snapshot(uint64_t Now)
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	AggregateSnapshot Result;
+	Result.WindowCount = static_cast<uint8_t>(Windows.size());
+	Result.ZoneCount = static_cast<uint8_t>(Bounds.size() + 1);
+	std::copy(Bounds.begin(), Bounds.end(), Result.ZoneBounds.begin());
+	for (size_t i = 0; i < Windows.size(); ++i)
+	{
+		Window& Target = Windows[i];
+		Expire(Target, Now);
+		AggregateWindow& Out = Result.Windows[i];
+		Out.Seconds = Target.Seconds;
+		Out.Samples = Target.Count;
+		if (Target.Count > 0)
+		{
+			Out.Min = At(Target.MinQueue.Front()).Bpm;
+			Out.Max = At(Target.MaxQueue.Front()).Bpm;
+			Out.MeanCenti = static_cast<uint32_t>(
+				Target.Sum * 100 / Target.Count);
+		}
+		for (size_t Zone = 0; Zone < MaxZones; ++Zone)
+		{
+			Out.ZoneMs[Zone] = static_cast<uint32_t>(
+				Target.ZoneUs[Zone] / 1000);
+		}
+	}
+	Trim();
+	return Result;
+}
+
+uint8_t HeartRateAggregator::ZoneOf(uint16_t Bpm) const
+{
+	uint8_t Zone = 0;
+	while (Zone < Bounds.size() && Bpm >= Bounds[Zone])
+	{
+		++Zone;
+	}
+	return Zone;
+}
+
+// Removes the samples older than the window length from its aggregates
+void HeartRateAggregator::Expire(Window& Target, uint64_t Now)
+{
+	const uint64_t End = First + History.Size();
+	while (Target.Tail < End &&
+		At(Target.Tail).Timestamp + Target.LengthUs <= Now)
+	{
+		const Entry& Old = At(Target.Tail);
+		Target.Sum -= Old.Bpm;
+		--Target.Count;
+		Target.ZoneUs[Old.Zone] -= Old.DurationUs;
+		if (Target.MinQueue.Front() == Target.Tail)
+		{
+			Target.MinQueue.PopFront();
+		}
+		if (Target.MaxQueue.Front() == Target.Tail)
+		{
+			Target.MaxQueue.PopFront();
+		}
+		++Target.Tail;
+	}
+}
+
+// Drops the samples that left every window
+void HeartRateAggregator::Trim()
+{
+	uint64_t Oldest = First + History.Size();
+	for (const auto& Target : Windows)
+	{
+		Oldest = std::min(Oldest, Target.Tail);
+	}
+	while (First < Oldest)
+	{
+		History.PopFront();
+		++First;
+	}
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "RingQueue.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Snapshot of one rolling window. Times in milliseconds, the mean in
+// hundredths of a beat per minute. Min, Max and MeanCenti are 0 while the
+// window holds no samples.
+struct AggregateWindow
+{
+	uint32_t Seconds = 0;
+	uint32_t Samples = 0;
+	uint16_t Min = 0;
+	uint16_t Max = 0;
+	uint32_t MeanCenti = 0;
+	// Time spent in every zone, see AggregateSnapshot::ZoneBounds
+	std::array<uint32_t, 8> ZoneMs{};
+};
+
+// Every aggregate of a band at one point in time
+struct AggregateSnapshot
+{
+	uint8_t WindowCount = 0;
+	uint8_t ZoneCount = 0;
+	// Lowest heart rate of zones 1 to ZoneCount - 1, zone 0 being everything
+	// below the first bound
+	std::array<uint8_t, 7> ZoneBounds{};
+	std::array<AggregateWindow, 8> Windows{};
+};
+
+// Rolling aggregates of the heart rate of one band over several window
+// lengths: min, max and mean, and time in each heart rate zone. Every sample
+// updates every window in amortized constant time: min and max come from
+// monotonic deques, the mean from a running sum, and zone times from running
+// totals that expiring samples are subtracted from. All windows share one
+// history, as long as the longest of them.
+//
+// A sample accounts for the time since the previous one, capped at MaxGapMs
+// so a pause in the stream doesn't count as time in a zone. Samples of 0 bpm
+// (no skin contact) are ignored.
+class HeartRateAggregator
+{
+public:
+	static constexpr size_t MaxWindows = 8;
+	static constexpr size_t MaxZones = 8;
+	static constexpr uint64_t MaxGapMs = 5000;
+	// Samples per second the windows are sized for up front, so they don't
+	// grow on the sample path. Bands notify about once per second; faster
+	// streams just grow them once more.
+	static constexpr uint32_t ReservedRate = 4;
+
+	// 10 s, 1 min and 5 min windows, zones starting at 100, 120, 140, 160
+	// and 180 bpm
+	HeartRateAggregator();
+
+	// Replaces the window lengths and zone bounds, clearing every aggregate.
+	// Bounds must be ascending. False, and nothing changes, if there are no
+	// windows, a window of 0 s, too many of either or unsorted bounds.
+	bool Configure(const std::vector<uint32_t>& WindowSeconds,
+		const std::vector<uint8_t>& ZoneBounds);
+
+	// Adds a sample taken at the given monotonic microseconds
+	void Add(uint64_t Timestamp, uint16_t Bpm);
+	// Aggregates of every window ending at the given monotonic microseconds
+	AggregateSnapshot Snapshot(uint64_t Now);
+
+private:
+	struct Entry
+	{
+		uint64_t Timestamp;
+		uint32_t DurationUs;
+		uint16_t Bpm;
+		uint8_t Zone;
+	};
+
+	struct Window
+	{
+		uint32_t Seconds = 0;
+		uint64_t LengthUs = 0;
+		// Absolute index of the oldest sample in the window
+		uint64_t Tail = 0;
+		uint64_t Sum = 0;
+		uint32_t Count = 0;
+		std::array<uint64_t, MaxZones> ZoneUs{};
+		// Absolute indices of increasing (min) and decreasing (max) heart
+		// rates, the extreme at the front
+		RingQueue<uint64_t> MinQueue;
+		RingQueue<uint64_t> MaxQueue;
+	};
+
+	const Entry& At(uint64_t Index) const
+	{
+		return History[static_cast<size_t>(Index - First)];
+	}
+	uint8_t ZoneOf(uint16_t Bpm) const;
+	void Expire(Window& Target, uint64_t Now);
+	void Trim();
+
+	std::mutex Lock;
+	std::vector<Window> Windows;
+	std::vector<uint8_t> Bounds;
+	// Samples still in some window, History[0] having absolute index First
+	RingQueue<Entry> History;
+	uint64_t First;
+};
@@ -0,0 +1,57 @@
+#include "pch.h"
+#include "HeartRateMeasurement.h"
+
+bool DecodeHeartRateMeasurement(const uint8_t* Data, size_t Size,
+	HeartRateMeasurement& Out)
+{
+	Out = HeartRateMeasurement();
+	if (Size < 2)
+	{
+		return false;
+	}
+	const uint8_t Flags = Data[0];
+	size_t Pos = 1;
+	if (Flags & HeartRateFlags::Uint16)
+	{
+		if (Size < Pos + 2)
+		{
+			return false;
+		}
+		Out.Bpm = static_cast<uint16_t>(Data[Pos] | (Data[Pos + 1] << 8));
+		Pos += 2;
+	}
+	else
+	{
+		Out.Bpm = Data[Pos++];
+	}
+	Out.bContactSupported = (Flags & HeartRateFlags::ContactSupported) != 0;
+	Out.bContact = Out.bContactSupported &&
+		(Flags & HeartRateFlags::ContactDetected) != 0;
+
+	if (Flags & HeartRateFlags::EnergyExpended)
+	{
+		if (Size < Pos + 2)
+		{
+			return false;
+		}
+		Out.bEnergyExpended = true;
+		Out.EnergyExpended = static_cast<uint16_t>(Data[Pos] |
+			(Data[Pos + 1] << 8));
+		Pos += 2;
+	}
+
+	if (Flags & HeartRateFlags::RrIntervals)
+	{
+		for (; Pos + 2 <= Size; Pos += 2)
+		{
+			if (Out.RrCount == HeartRateMeasurement::MaxRrIntervals)
+			{
+				++Out.RrDropped;
+				continue;
+			}
+			Out.RrIntervals[Out.RrCount++] = static_cast<uint16_t>(
+				Data[Pos] | (Data[Pos + 1] << 8));
+		}
+	}
+	return true;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Decoded Heart Rate Measurement characteristic (0x2a37)
+//
+// Notification layout (little-endian)
+// uint8  Flags
+//   bit 0: heart rate is a uint16 instead of a uint8
+//   bit 1: sensor contact detected, bit 2: sensor contact supported
+//   bit 3: energy expended present
+//   bit 4: RR intervals present
+// uint8 or uint16 heart rate, bpm
+// uint16 energy expended, kJ, if flagged
+// uint16 RR intervals in 1/1024 s, as many as fit, if flagged
+struct HeartRateMeasurement
+{
+	// Enough for any notification of the default 23 byte ATT MTU. Bigger
+	// ones have their extra intervals counted in RrDropped.
+	static constexpr size_t MaxRrIntervals = 16;
+
+	uint16_t Bpm = 0;
+	bool bContactSupported = false;
+	bool bContact = false;
+	bool bEnergyExpended = false;
+	uint16_t EnergyExpended = 0;
+	uint8_t RrCount = 0;
+	uint8_t RrDropped = 0;
+	std::array<uint16_t, MaxRrIntervals> RrIntervals{};
+};
+
+namespace HeartRateFlags
+{
+	constexpr uint8_t Uint16 = 1 << 0;
+	constexpr uint8_t ContactDetected = 1 << 1;
+	constexpr uint8_t ContactSupported = 1 << 2;
+	constexpr uint8_t EnergyExpended = 1 << 3;
+	constexpr uint8_t RrIntervals = 1 << 4;
+}
+
+// Decodes a 0x2a37 notification as its flags describe it. False if it is too
+// short for the fields it flags; a trailing odd byte after the RR intervals
+// is ignored.
+bool DecodeHeartRateMeasurement(const uint8_t* Data, size_t Size,
+	HeartRateMeasurement& Out);
@@ -0,0 +1,134 @@
+#include "pch.h"
+#include "HeartRateStream.h"
+#include "Codec.h"
+#include "SharedHeartRatePublisher.h"
+#include "Trace.h"
+#include <algorithm>
+#include <iostream>
+#include <string_view>
+
+HeartRateStream::HeartRateStream(uint8_t BandId,
+	SharedHeartRatePublisher* Publisher) : BandId(BandId),
+	Publisher(Publisher), Sequence(0), ReportedOverflows(0)
+{
+}
+
+HeartRateSample HeartRateStream::Publish(const uint8_t* Data, uint32_t Size,
+	uint64_t Timestamp)
+{
+	HeartRateMeasurement Measurement;
+	DecodeHeartRateMeasurement(Data, Size, Measurement);
+	HeartRateSample Sample;
+	Sample.Timestamp = Timestamp;
+	Sample.Sequence = Sequence++;
+	Sample.Bpm = Measurement.Bpm;
+	Sample.RrCount = Measurement.RrCount;
+	std::copy_n(Measurement.RrIntervals.begin(), Measurement.RrCount,
+		Sample.RrIntervals.begin());
+	// A full ring means the delivery stage fell behind, the sample is counted
+	// as an overflow and dropped
+	Samples.TryPush(Sample);
+	return Sample;
+}
+
+uint32_t HeartRateStream::Drain(HeartRateSink& Sink,
+	SampleFrames::FrameMode Mode, bool bDatagrams)
+{
+	// Heart rate frames of the samples drained together, sent as one
+	// datagram once full or at the end
+	std::array<uint8_t, MaxDatagramSize> Datagram;
+	size_t DatagramSize = 0;
+
+	uint32_t Count = 0;
+	HeartRateSample Sample;
+	while (Samples.TryPop(Sample))
+	{
+		++Count;
+		if (bDatagrams)
+		{
+			DatagramSize += SampleFrames::WriteHeartRate(
+				Datagram.data() + DatagramSize, BandId, Sample.Sequence,
+				Sample.Timestamp, Sample.Bpm);
+			if (DatagramSize == Datagram.size())
+			{
+				Sink.SendDatagram(Datagram.data(),
+					static_cast<uint32_t>(DatagramSize));
+				DatagramSize = 0;
+			}
+		}
+
+		Aggregates.Add(Sample.Timestamp, Sample.Bpm);
+		for (uint8_t i = 0; i < Sample.RrCount; ++i)
+		{
+			Hrv.Add(Sample.RrIntervals[i]);
+		}
+		if (Publisher)
+		{
+			SharedHeartRate::Sample Shared;
+			Shared.Timestamp = Sample.Timestamp;
+			Shared.Sequence = Sample.Sequence;
+			Shared.Bpm = Sample.Bpm;
+			Publisher->Publish(BandId, Shared);
+		}
+
+		// Binary clients get the decoded value as is, without any formatting
+		if (Mode == SampleFrames::FrameMode::Binary)
+		{
+			std::array<uint8_t, SampleFrames::MaxFrameSize> Frame;
+			auto Size = SampleFrames::WriteHeartRate(Frame.data(), BandId,
+				Sample.Sequence, Sample.Timestamp, Sample.Bpm);
+			Sink.Send(SampleFrames::FrameType::HeartRate, Frame.data(),
+				static_cast<uint32_t>(Size));
+			// Followed by its RR intervals and the updated HRV, if any
+			if (Sample.RrCount > 0)
+			{
+				std::array<uint8_t, SampleFrames::MaxHrvFrameSize> HrvFrame;
+				Size = SampleFrames::WriteHrv(HrvFrame.data(), BandId,
+					Sample.Sequence, Sample.Timestamp,
+					Sample.RrIntervals.data(), Sample.RrCount, Hrv.Snapshot());
+				Sink.Send(SampleFrames::FrameType::Hrv, HrvFrame.data(),
+					static_cast<uint32_t>(Size));
+			}
+			continue;
+		}
+
+		// The string MiBand3::WriteToServer would send, written in place as
+		// UTF-8
+		char Text[2 * Codec::MaxDecimalDigits + 2];
+		size_t Size = 0;
+		if (BandId != 0)
+		{
+			Size = Codec::FormatUnsigned(BandId, Text);
+			Text[Size++] = ':';
+		}
+		size_t Digits;
+		{
+			HRM_TRACE_SCOPE("FormatHeartRate");
+			Digits = Codec::FormatUnsigned(Sample.Bpm, Text + Size);
+		}
+
+		std::cout << "Heart Rate: " << std::string_view(Text + Size, Digits)
+			<< std::endl;
+
+		Size += Digits;
+		Text[Size++] = '\0';
+		Sink.Send(SampleFrames::FrameType::HeartRate,
+			reinterpret_cast<const uint8_t*>(Text),
+			static_cast<uint32_t>(Size));
+	}
+	if (DatagramSize > 0)
+	{
+		Sink.SendDatagram(Datagram.data(),
+			static_cast<uint32_t>(DatagramSize));
+	}
+
+	// Report the samples lost since the last drain
+	const uint64_t Overflows = Samples.Overflows();
+	if (Overflows != ReportedOverflows)
+	{
+		std::cout << "Heart rate ring full, " << Overflows - ReportedOverflows
+			<< " samples dropped (" << Overflows << " total)" << std::endl;
+		ReportedOverflows = Overflows;
+	}
+	return Count;
+}
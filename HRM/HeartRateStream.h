@@ -0,0 +1,85 @@
+#pragma once
+
+#include "HeartRateAggregator.h"
+#include "HeartRateMeasurement.h"
+#include "HrvTracker.h"
+#include "SampleFrame.h"
+#include "SpscRing.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+class SharedHeartRatePublisher;
+
+// Heart rate frames sent in one datagram at most, and their bytes
+constexpr uint32_t MaxDatagramFrames = 16;
+constexpr uint32_t MaxDatagramSize = MaxDatagramFrames *
+	(SampleFrames::HeaderSize + sizeof(uint16_t));
+
+// Decoded heart rate notification, as published by the GATT callback
+struct HeartRateSample
+{
+	uint64_t Timestamp;
+	uint32_t Sequence;
+	uint16_t Bpm;
+	// RR intervals carried by the notification, in 1/1024 s
+	uint8_t RrCount = 0;
+	std::array<uint16_t, HeartRateMeasurement::MaxRrIntervals> RrIntervals;
+};
+
+// Outputs of a heart rate stream. The band hands its frames to the client
+// connection, the portable tests to plain buffers.
+class HeartRateSink
+{
+public:
+	virtual ~HeartRateSink() = default;
+
+	// One frame, or one text message, for the subscribers of its stream
+	virtual void Send(SampleFrames::FrameType Stream, const uint8_t* Data,
+		uint32_t Size) = 0;
+	// Heart rate frames of several samples, as one datagram
+	virtual void SendDatagram(const uint8_t* Data, uint32_t Size) = 0;
+};
+
+// Heart rate path of one band, from the 0x2a37 notification to the frames
+// handed to the outputs. Publish runs on the notification thread (producer)
+// and Drain on the delivery stage (consumer), with a preallocated ring
+// between them; neither allocates once the sliding windows were reserved.
+class HeartRateStream
+{
+public:
+	// Publisher is the shared memory channel of local readers, null if not
+	// publishing
+	HeartRateStream(uint8_t BandId, SharedHeartRatePublisher* Publisher);
+
+	HeartRateStream(const HeartRateStream&) = delete;
+	HeartRateStream& operator=(const HeartRateStream&) = delete;
+
+	// Decodes a notification and publishes it for Drain. A malformed one
+	// reads as 0 bpm. Returns the sample, also if the ring was full and it
+	// was dropped.
+	HeartRateSample Publish(const uint8_t* Data, uint32_t Size,
+		uint64_t Timestamp);
+
+	// Feeds every published sample to the aggregates, the HRV and the shared
+	// memory channel, and sends it: as binary frames or as text, depending
+	// on Mode, and also in datagrams if enabled. Returns the samples drained.
+	uint32_t Drain(HeartRateSink& Sink, SampleFrames::FrameMode Mode,
+		bool bDatagrams);
+
+	// Rolling aggregates of the drained samples
+	HeartRateAggregator& GetAggregates() { return Aggregates; }
+
+private:
+	uint8_t BandId;
+	SharedHeartRatePublisher* Publisher;
+
+	// Sequence of the heart rate frames, from the notification thread
+	uint32_t Sequence;
+	SpscRing<HeartRateSample, 256> Samples;
+	uint64_t ReportedOverflows;
+
+	// Owned by the delivery stage
+	HeartRateAggregator Aggregates;
+	HrvTracker Hrv;
+};
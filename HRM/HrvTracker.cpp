@@ -0,0 +1,141 @@
+#include "pch.h"
+#include "HrvTracker.h"
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+	// Intervals are in 1/1024 s
+	constexpr uint32_t Units = 1024;
+	constexpr uint16_t MinRr = 300 * Units / 1000;
+	constexpr uint16_t MaxRr = 2000 * Units / 1000;
+
+	double ToMilliseconds(double Value)
+	{
+		return Value * 1000.0 / Units;
+	}
+}
+
+HrvTracker::HrvTracker() :
+	HrvTracker({ 60, 300 })
+{
+}
+
+HrvTracker::HrvTracker(const std::vector<uint32_t>& WindowSeconds) :
+	First(0), bBroken(false), Rejected(0)
+{
+	uint64_t Longest = 0;
+	for (size_t i = 0; i < WindowSeconds.size() && i < MaxWindows; ++i)
+	{
+		Window New;
+		New.Seconds = WindowSeconds[i];
+		New.Length = static_cast<uint64_t>(WindowSeconds[i]) * Units;
+		Windows.push_back(New);
+		Longest = std::max(Longest, New.Length);
+	}
+	// Intervals are never shorter than MinRr, so the history never needs
+	// more than this and never grows while adding
+	History.Reserve(static_cast<size_t>(Longest / MinRr + 2));
+}
+
+void HrvTracker::Add(uint16_t Rr)
+{
+	if (Rr < MinRr || Rr > MaxRr)
+	{
+		++Rejected;
+		bBroken = true;
+		return;
+	}
+
+	Entry New;
+	New.Rr = Rr;
+	New.bDiff = !History.IsEmpty() && !bBroken;
+	New.AbsDiff = New.bDiff ? static_cast<uint16_t>(
+		std::abs(static_cast<int>(Rr) - History.Back().Rr)) : 0;
+	bBroken = false;
+	const uint64_t Index = First + History.Size();
+	History.PushBack(New);
+
+	uint64_t Oldest = Index;
+	for (auto& Target : Windows)
+	{
+		// Only a pair with both intervals in the window counts
+		if (New.bDiff && Target.Tail < Index)
+		{
+			AddDiff(Target, New, 1);
+		}
+		Target.Sum += Rr;
+		Target.SumSquares += static_cast<uint64_t>(Rr) * Rr;
+		Target.Duration += Rr;
+		while (Target.Duration > Target.Length && Target.Tail < Index)
+		{
+			const Entry& Old = At(Target.Tail);
+			Target.Sum -= Old.Rr;
+			Target.SumSquares -= static_cast<uint64_t>(Old.Rr) * Old.Rr;
+			Target.Duration -= Old.Rr;
+			++Target.Tail;
+			// The next interval lost its predecessor
+			if (At(Target.Tail).bDiff)
+			{
+				AddDiff(Target, At(Target.Tail), -1);
+			}
+		}
+		Oldest = std::min(Oldest, Target.Tail);
+	}
+
+	while (First < Oldest)
+	{
+		History.PopFront();
+		++First;
+	}
+}
+
+HrvSnapshot HrvTracker::Snapshot() const
+{
+	HrvSnapshot Result;
+	Result.WindowCount = static_cast<uint8_t>(Windows.size());
+	const uint64_t End = First + History.Size();
+	for (size_t i = 0; i < Windows.size(); ++i)
+	{
+		const Window& Source = Windows[i];
+		HrvWindow& Out = Result.Windows[i];
+		Out.Seconds = Source.Seconds;
+		const uint64_t Beats = End - Source.Tail;
+		Out.Beats = static_cast<uint32_t>(Beats);
+		if (Beats > 1)
+		{
+			// Exact in integers, n * sum(x^2) - sum(x)^2
+			const uint64_t Spread = Beats * Source.SumSquares -
+				Source.Sum * Source.Sum;
+			Out.Sdnn = ToMilliseconds(std::sqrt(static_cast<double>(Spread) /
+				static_cast<double>(Beats * (Beats - 1))));
+		}
+		if (Source.Diffs > 0)
+		{
+			Out.Rmssd = ToMilliseconds(std::sqrt(
+				static_cast<double>(Source.DiffSquares) / Source.Diffs));
+			Out.Pnn50 = 100.0 * Source.Nn50 / Source.Diffs;
+		}
+	}
+	return Result;
+}
+
+// Adds (Sign 1) or removes (Sign -1) the successive difference of an interval
+void HrvTracker::AddDiff(Window& Target, const Entry& New, int Sign)
+{
+	const uint64_t Square = static_cast<uint64_t>(New.AbsDiff) * New.AbsDiff;
+	// Above 50 ms, compared exactly in 1/1024 s units
+	const bool bNn50 = New.AbsDiff * 1000u > 50u * Units;
+	if (Sign > 0)
+	{
+		++Target.Diffs;
+		Target.DiffSquares += Square;
+		Target.Nn50 += bNn50 ? 1 : 0;
+	}
+	else
+	{
+		--Target.Diffs;
+		Target.DiffSquares -= Square;
+		Target.Nn50 -= bNn50 ? 1 : 0;
+	}
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "RingQueue.h"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Heart rate variability of one window, times in milliseconds
+struct HrvWindow
+{
+	uint32_t Seconds = 0;
+	// RR intervals in the window
+	uint32_t Beats = 0;
+	// Root mean square of successive differences
+	double Rmssd = 0;
+	// Standard deviation of the intervals
+	double Sdnn = 0;
+	// Percentage of successive differences above 50 ms
+	double Pnn50 = 0;
+};
+
+struct HrvSnapshot
+{
+	uint8_t WindowCount = 0;
+	std::array<HrvWindow, 4> Windows{};
+};
+
+// Streaming HRV over sliding windows of beat time: each window holds the
+// latest RR intervals adding up to at most its length. Every interval
+// updates every window in constant time with integer running sums (of the
+// intervals, of their squares and of the squared successive differences),
+// so the statistics are exact and never drift however long the stream.
+//
+// Intervals outside 300 to 2000 ms are artifacts (missed or extra beats) and
+// are dropped; no successive difference is taken across one. Not thread
+// safe, it is fed and read by the delivery stage only.
+class HrvTracker
+{
+public:
+	static constexpr size_t MaxWindows = 4;
+
+	// 1 min and 5 min windows
+	HrvTracker();
+	// At most MaxWindows lengths in seconds, none 0
+	explicit HrvTracker(const std::vector<uint32_t>& WindowSeconds);
+
+	// Adds an RR interval in 1/1024 s, as the 0x2a37 characteristic carries
+	void Add(uint16_t Rr);
+	HrvSnapshot Snapshot() const;
+
+	uint64_t GetRejected() const { return Rejected; }
+
+private:
+	struct Entry
+	{
+		uint16_t Rr;
+		// Difference to the previous interval, if that one was accepted
+		bool bDiff;
+		uint16_t AbsDiff;
+	};
+
+	struct Window
+	{
+		uint32_t Seconds = 0;
+		uint64_t Length = 0;
+		// Absolute index of the oldest interval in the window
+		uint64_t Tail = 0;
+		uint64_t Duration = 0;
+		uint64_t Sum = 0;
+		uint64_t SumSquares = 0;
+		uint64_t Diffs = 0;
+		uint64_t DiffSquares = 0;
+		uint64_t Nn50 = 0;
+	};
+
+	const Entry& At(uint64_t Index) const
+	{
+		return History[static_cast<size_t>(Index - First)];
+	}
+	void AddDiff(Window& Target, const Entry& New, int Sign);
+
+	std::vector<Window> Windows;
+	// Intervals still in some window, History[0] having absolute index First
+	RingQueue<Entry> History;
+	uint64_t First;
+	// The last interval was rejected, the next one starts a new run
+	bool bBroken;
+	uint64_t Rejected;
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+// Log-linear histogram in the style of HdrHistogram. Values below SubBuckets
+// are counted exactly, bigger ones by their highest bit and then linearly in
+// SubBuckets / 2 steps, so any value is reported within 1% of its real value
+// with a fixed footprint and no allocation while recording. Not thread safe,
+// every recording thread keeps its own and they're merged at the end.
+class LatencyHistogram
+{
+public:
+	LatencyHistogram() : Counts(BucketCount, 0) { Reset(); }
+
+	void Record(uint64_t Value)
+	{
+		++Counts[Index(Value)];
+		++Total;
+		Sum += Value;
+		Min = std::min(Min, Value);
+		Max = std::max(Max, Value);
+	}
+
+	void Merge(const LatencyHistogram& Other)
+	{
+		for (size_t i = 0; i < BucketCount; ++i)
+		{
+			Counts[i] += Other.Counts[i];
+		}
+		Total += Other.Total;
+		Sum += Other.Sum;
+		Min = std::min(Min, Other.Min);
+		Max = std::max(Max, Other.Max);
+	}
+
+	void Reset()
+	{
+		std::fill(Counts.begin(), Counts.end(), 0);
+		Total = 0;
+		Sum = 0;
+		Min = UINT64_MAX;
+		Max = 0;
+	}
+
+	// Smallest recorded value such that the given percent of the values are
+	// equal or lower, as the highest value of its bucket. 0 if empty.
+	uint64_t Percentile(double Percent) const
+	{
+		if (Total == 0)
+		{
+			return 0;
+		}
+		uint64_t Rank = static_cast<uint64_t>(Percent / 100.0 * Total + 0.5);
+		Rank = std::max<uint64_t>(1, std::min(Rank, Total));
+		uint64_t Seen = 0;
+		for (size_t i = 0; i < BucketCount; ++i)
+		{
+			Seen += Counts[i];
+			if (Seen >= Rank)
+			{
+				return std::min(HighestInBucket(i), Max);
+			}
+		}
+		return Max;
+	}
+
+	uint64_t GetCount() const { return Total; }
+	uint64_t GetMin() const { return Total > 0 ? Min : 0; }
+	uint64_t GetMax() const { return Max; }
+	double GetMean() const
+	{
+		return Total > 0 ? static_cast<double>(Sum) / Total : 0.0;
+	}
+
+private:
+	static constexpr unsigned SubBucketBits = 8;
+	static constexpr uint64_t SubBuckets = 1ull << SubBucketBits;
+	static constexpr uint64_t HalfBuckets = SubBuckets / 2;
+	// Exact range, then half a range for every further power of two
+	static constexpr size_t BucketCount =
+		SubBuckets + (64 - SubBucketBits) * HalfBuckets;
+
+	static size_t Index(uint64_t Value)
+	{
+		if (Value < SubBuckets)
+		{
+			return static_cast<size_t>(Value);
+		}
+		// Shift that leaves the value in [HalfBuckets, SubBuckets)
+		const unsigned Shift = std::bit_width(Value) - SubBucketBits;
+		return static_cast<size_t>(SubBuckets + (Shift - 1) * HalfBuckets +
+			((Value >> Shift) - HalfBuckets));
+	}
+
+	static uint64_t HighestInBucket(size_t Bucket)
+	{
+		if (Bucket < SubBuckets)
+		{
+			return Bucket;
+		}
+		const unsigned Shift =
+			static_cast<unsigned>((Bucket - SubBuckets) / HalfBuckets) + 1;
+		const uint64_t Sub = (Bucket - SubBuckets) % HalfBuckets + HalfBuckets;
+		return ((Sub + 1) << Shift) - 1;
+	}
+
+	std::vector<uint64_t> Counts;
+	uint64_t Total;
+	uint64_t Sum;
+	uint64_t Min;
+	uint64_t Max;
+};
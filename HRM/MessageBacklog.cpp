@@ -0,0 +1,67 @@
+#include "pch.h"
+#include "MessageBacklog.h"
+#include <algorithm>
+
+MessageBacklog::MessageBacklog(size_t CapacityBytes, size_t MaxMessages) :
+	Ring(CapacityBytes), Slots(std::max<size_t>(1, MaxMessages)), First(0),
+	Count(0), Dropped(0)
+{
+}
+
+void MessageBacklog::Push(const uint8_t* Data, uint32_t Size)
+{
+	if (Size == 0 || Size > Ring.size())
+	{
+		++Dropped;
+		return;
+	}
+	if (Count == Slots.size())
+	{
+		DropOldest();
+	}
+	// Right after the newest message if it fits there, otherwise from the
+	// start of the ring, up to the oldest message
+	size_t Start = 0;
+	while (Count > 0)
+	{
+		const size_t Head = Slots[First].Start;
+		const Slot& Newest = Slots[(First + Count - 1) % Slots.size()];
+		const size_t Tail = Newest.Start + Newest.Size;
+		if (Newest.Start >= Head)
+		{
+			if (Ring.size() - Tail >= Size)
+			{
+				Start = Tail;
+				break;
+			}
+			if (Head >= Size)
+			{
+				Start = 0;
+				break;
+			}
+		}
+		else if (Head - Tail >= Size)
+		{
+			Start = Tail;
+			break;
+		}
+		DropOldest();
+	}
+	std::copy(Data, Data + Size, Ring.begin() + Start);
+	Slots[(First + Count) % Slots.size()] = { Start, Size };
+	++Count;
+}
+
+void MessageBacklog::Clear()
+{
+	Dropped += Count;
+	First = 0;
+	Count = 0;
+}
+
+void MessageBacklog::DropOldest()
+{
+	First = (First + 1) % Slots.size();
+	--Count;
+	++Dropped;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Bounded FIFO of messages kept while their consumer is away, in a byte ring
+// and a ring of message slots, both allocated once. Every message is stored
+// contiguously: one that doesn't fit before the end of the byte ring starts
+// over at its beginning. When full, the oldest messages make room for new
+// ones and are counted as dropped. Not thread safe.
+class MessageBacklog
+{
+public:
+	explicit MessageBacklog(size_t CapacityBytes = 256 * 1024,
+		size_t MaxMessages = 8192);
+
+	// Messages bigger than the whole ring are dropped
+	void Push(const uint8_t* Data, uint32_t Size);
+
+	// Calls Take(const uint8_t* Data, uint32_t Size) for every message,
+	// oldest first, and empties the backlog
+	template <typename Consumer>
+	void Drain(Consumer&& Take);
+
+	void Clear();
+
+	size_t GetCount() const { return Count; }
+	uint64_t GetDropped() const { return Dropped; }
+
+private:
+	// Where a message starts in the byte ring, and its size
+	struct Slot
+	{
+		size_t Start;
+		uint32_t Size;
+	};
+
+	void DropOldest();
+
+	std::vector<uint8_t> Ring;
+	std::vector<Slot> Slots;
+	// Slot of the oldest message and slots in use
+	size_t First;
+	size_t Count;
+	uint64_t Dropped;
+};
+
+template <typename Consumer>
+void MessageBacklog::Drain(Consumer&& Take)
+{
+	while (Count > 0)
+	{
+		const Slot& Oldest = Slots[First];
+		Take(Ring.data() + Oldest.Start, Oldest.Size);
+		First = (First + 1) % Slots.size();
+		--Count;
+	}
+	First = 0;
+}
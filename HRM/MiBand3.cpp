@@ -1,277 +1,294 @@
 #include "pch.h"
 #include "MiBand3.h"
 #include "BlthUtil.h"
+#include "Codec.h"
 
+#include "AllocationBudget.h"
 #include "RemoteCommunication.h"
+#include "SessionManager.h"
+#include "Trace.h"
 #include <algorithm>
 
 using namespace BluetoothUtilities;
 
+namespace
+{
+	// Milliseconds without notifications before a streaming band is stalled,
+	// and before a starting one is
+	constexpr uint32 StallTimeout = 7000;
+	constexpr uint32 StartupGrace = 20000;
+	// Cool down before restarting, doubled by every failed restart
+	constexpr uint32 BaseBackoff = 2000;
+	constexpr uint32 MaxBackoff = 60000;
+	// A stall this long after the last recovery keeps the backoff growing
+	constexpr auto FlappingWindow = std::chrono::seconds(60);
+	// A newer vibration or ping replaces one still queued
+	constexpr uint32 VibrateCollapseKey = 1;
+	constexpr uint32 PingCollapseKey = 2;
+
+	// Outputs of the heart rate stream of a band: the subscribers of the
+	// client connection and its datagram target
+	class ClientSink : public HeartRateSink
+	{
+	public:
+		explicit ClientSink(RemoteCommunication^ RC) : RC(RC) {}
+
+		void Send(SampleFrames::FrameType Stream, const uint8_t* Data,
+			uint32_t Size) override
+		{
+			RC->Send(Stream, Data, Size);
+		}
+
+		void SendDatagram(const uint8_t* Data, uint32_t Size) override
+		{
+			RC->SendDatagram(Data, Size);
+		}
+
+	private:
+		RemoteCommunication^ RC;
+	};
+}
+
 // Class that represents a MiBand 3 object and handles all communication with 
 // the MiBand 3 peripheral. It doesn't need to have the Bluetooth address when 
-// creating the object and automatically creates a RemoteCommunication object 
-// for remote control.
+// creating the object. It's created by the SessionManager, which shares its
+// RemoteCommunication object among every band.
 
-MiBand3::MiBand3()
+MiBand3::MiBand3(uint8 InBandId, RemoteCommunication^ InRC)
 {
-	// Create a new RemoteCommunicaton object
-	RC = ref new RemoteCommunication(this);
+	RC = InRC;
+	// Stage that drains the samples of every band of the session
+	Delivery = RC->Manager->Delivery;
+	BandReactor = &RC->Manager->GetReactors().ForBand(InBandId);
+	Timers = &RC->Manager->GetTimers();
+	Recorder = RC->Manager->GetRecorder();
+	Publisher = RC->Manager->GetPublisher();
+	// The wheel thread only hands the timers over to the band
+	HeartRatePingTimer.Callback = [this]() {
+		BandReactor->Post([this]() { HeartRatePing(); });
+	};
+	StallTimer.Callback = [this]() {
+		BandReactor->Post([this]() { OnStall(); });
+	};
+	RecoveryTimer.Callback = [this]() {
+		BandReactor->Post([this]() { OnCooledDown(); });
+	};
+	bMonitoring = false;
+	Monitor = MonitorState::Idle;
+	Backoff = BaseBackoff;
+	StallCount = 0;
+	RecoveryCount = 0;
+	LastRecoveryMs = 0;
+	MaxRecoveryMs = 0;
 	// Set variables
 	UUIDServiceInfo = BluetoothUuidHelper::FromShortId(0xfee0);
-	UUIDServiceAuthentication = BluetoothUuidHelper::FromShortId(0xfee1);
-	UUIDServiceAlertNotification = BluetoothUuidHelper::FromShortId(0x1811);
-	UUIDServiceInmediateAlert = BluetoothUuidHelper::FromShortId(0x1802);
-	UUIDServiceHeartRate = BluetoothUuidHelper::FromShortId(0x180d);
-	// Start counters to check if the notifications stop arriving
-	HeartRateCounter = 0;
-	HeartRateLastCounter = 0;
-
+	// Frame sequences start at zero on every process start
+	StatusSequence = 0;
+	ScanResultSequence = 0;
+	AggregatesSequence = 0;
+
+	BandId = InBandId;
+	// Preallocated ring between the GATT callback and the delivery stage
+	HeartRate = std::make_unique<HeartRateStream>(InBandId, Publisher);
 	bAuthenticated = false;
+	ConnectedAddress = 0;
+	ConnectMs = 0;
+	FirstSampleMs = 0;
+	bAwaitingFirstSample = false;
+
+	// The session decides whether this band is real or simulated
+	Transport = RC->Manager->CreateTransport(BandId);
+	Transport->SetNotificationHandler([this](GattChannel Channel,
+		const uint8_t* Data, uint32_t Size) {
+		if (Channel == GattChannel::Authentication)
+		{
+			// The handler outlives the notification, so it gets a copy
+			std::vector<unsigned char> Bytes(Data, Data + Size);
+			BandReactor->Post([this, Bytes]() {
+				Async::Spawn(HandleAuthenticationNotifications(Bytes));
+				});
+		}
+		else if (Channel == GattChannel::HeartRateMeasurement)
+		{
+			HandleHeartRateNotifications(Data, Size);
+		}
+		});
+	Transport->SetDisconnectionHandler([this]() {
+		BandReactor->Post([this]() {
+			std::wcout << "MiBand 3 disconnected, band "
+				<< static_cast<int>(BandId) << std::endl;
+			if (Recorder)
+			{
+				Recorder->Append(SessionLog::RecordType::Disconnect, BandId,
+					0, 0);
+			}
+			// Nothing queued can reach the band anymore, and it has to
+			// authenticate again
+			Commands->Clear();
+			bAuthenticated = false;
+			});
+		});
+	Commands = std::make_unique<GattCommandQueue>(*Transport);
 }
 
-// Connects to a MiBand 3 peripheral in the given bluetooth address. If await is 
-// true, it waits for the asyncronous call to return.
+// Connects to a MiBand 3 peripheral in the given bluetooth address, in the
+// background. Called on the reactor of the band.
 void MiBand3::Connect(unsigned long long BluetoothAddress)
 {
-	InConnect(BluetoothAddress);
+	Async::Spawn(InConnect(BluetoothAddress));
+}
+
+void MiBand3::Scan(uint16 Seconds)
+{
+	std::lock_guard<std::mutex> Guard(ScannerLock);
+	if (!Scanner)
+	{
+		Scanner = std::make_unique<BleScanner>(UUIDServiceInfo, *Timers,
+			[this](uint64_t Address) {
+				WriteScanResult(Address);
+			},
+			[this](const std::vector<ScanEntry>& Entries, bool bFinal) {
+				WriteScanBatch(Entries, bFinal);
+			});
+	}
+	Scanner->Start(Seconds);
 }
 
 // Asyncronously connect to the MiBand 3 peripheral
-concurrency::task<void> MiBand3::InConnect(unsigned long long BluetoothAddress)
+Async::Task<void> MiBand3::InConnect(unsigned long long BluetoothAddress)
 {
+	ConnectedAddress = BluetoothAddress;
+	ConnectStart = std::chrono::steady_clock::now();
+	ConnectMs = 0;
+	FirstSampleMs = 0;
+	bAwaitingFirstSample = true;
 	// Initializes the connection with the peripheral
-	co_await Initialize(co_await BluetoothLEDevice::
-		FromBluetoothAddressAsync(BluetoothAddress));
-	// Authenticates the connection
+	if (!co_await OpenTransport(BluetoothAddress))
+	{
+		std::wcout << "Connection failed, band "
+			<< static_cast<int>(BandId) << std::endl;
+		co_return;
+	}
+	ConnectMs = static_cast<uint64>(
+		std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - ConnectStart).count());
+	std::wcout << "GATT ready in " << ConnectMs.load() << " ms ("
+		<< (Transport->OpenedFromCache() ? "warm" : "cold") << "), band "
+		<< static_cast<int>(BandId) << std::endl;
+	if (Recorder)
+	{
+		uint64 Address = BluetoothAddress;
+		Recorder->Append(SessionLog::RecordType::Connect, BandId,
+			Transport->OpenedFromCache() ? 1 : 0, 0, &Address,
+			sizeof(Address));
+	}
+	// Authenticates the connection. The handshake goes on in the
+	// notification handler, which sets the event on this reactor.
 	co_await Authentication();
-	Authenticated.wait();
-	std::wcout << "Authenticated with MiBand 3" << std::endl;
+	co_await Authenticated;
+	Authenticated.Reset();
+	std::wcout << "Authenticated with MiBand 3, band "
+		<< static_cast<int>(BandId) << std::endl;
 	bAuthenticated = true;
-	Authenticated.reset();
-	Connected.set();
+	RC->Manager->GetGattCache().SetPairing(ConnectedAddress,
+		PairingState::Paired);
 	// Indicates to the server that the connection to the MiBand 3 was
 	// successful
-	WriteToServer("200", true);
+	WriteStatus(200);
 }
 
-// Standard HRM behaviour
+// Standard HRM behaviour. Instructions only start it on authenticated bands.
 void MiBand3::RunHRM()
 {
-	// Waits for authentication ending
-	if (!this->bAuthenticated) {
-		std::wcout << "Waiting Authentication" << std::endl;
-		Connected.wait();
+	bMonitoring = true;
+	// Sends a ping every 12 seconds to keep alive the Heart Rate Monitoring
+	Timers->Arm(HeartRatePingTimer, 12000, 12000);
+	// The band has some time to start streaming, then every notification
+	// must arrive within the stall timeout of the previous one
+	{
+		std::lock_guard<std::mutex> Guard(MonitorLock);
+		Monitor = MonitorState::Streaming;
+		Timers->Cancel(RecoveryTimer);
+		Timers->Arm(StallTimer, StartupGrace);
 	}
-	Connected.reset();
-
-	// Sends a ping to keep alive the Heart Rate Monitoring
-	HeartRatePingCallback = new concurrency::call<int>([this](int) {
-		HeartRatePing();
-		});
-
-	// Sets a timer to send the ping every 12 seconds
-	HeartRatePingTimer = new concurrency::timer<int>(
-		12000, 0, HeartRatePingCallback, true);
 
-	// Creates a timer to delay start on the checkReset timer
-	HeartRateCounterDelayCallback = new concurrency::call<int>([this](int) {
-		HeartRateCounterDelayTimer->pause();
-		HeartRateCounterTimer->start();
-		});
-	HeartRateCounterDelayTimer = new concurrency::timer<int>(
-		20000, 0, HeartRateCounterDelayCallback, true);
-
-	// CheckReset timer, checks periodically if the band is sending HRM 
-	// notifications
-	HeartRateCounterCallback = new concurrency::call<int>([this](int) {
-		CheckReset();
-		});
-
-	HeartRateCounterTimer = new concurrency::timer<int>(
-		7000, 0, HeartRateCounterCallback, true);
-
-	// Start timers
-	HeartRatePingTimer->start();
-	HeartRateCounterDelayTimer->start();
-
-	std::cout << "Started stardard HRM behaviour" << std::endl;
-}
-
-// Gets the descriptors for the different services and characteristics of a 
-// MiBand 3 peripheral.
-concurrency::task<void> MiBand3::Initialize(BluetoothLEDevice^ InDevice)
-{
-	Device = InDevice;
-	// Authentication
-	ServiceAuthentication =
-		(co_await Device->GetGattServicesForUuidAsync(
-			UUIDServiceAuthentication))->Services->GetAt(0);
-	CharacteristicAuthentication =
-		(co_await ServiceAuthentication->
-			GetCharacteristicsForUuidAsync(GetGuidFromStringBase("0009")))
-		->Characteristics->GetAt(0);
-	DescriptorAuthentication =
-		(co_await CharacteristicAuthentication->
-			GetDescriptorsForUuidAsync(BluetoothUuidHelper::
-				FromShortId(0x2902)))->Descriptors->GetAt(0);
-	// Heart Rate Monitoring
-	ServiceHeartRate =
-		(co_await Device->GetGattServicesForUuidAsync(UUIDServiceHeartRate))
-		->Services->GetAt(0);
-	CharacteristicHeartRateControlPoint =
-		(co_await ServiceHeartRate->
-			GetCharacteristicsForUuidAsync(BluetoothUuidHelper::
-				FromShortId(0x2a39)))->Characteristics->GetAt(0);
-	CharacteristicHeartRateMeasurement =
-		(co_await ServiceHeartRate->
-			GetCharacteristicsForUuidAsync(
-				BluetoothUuidHelper::FromShortId(0x2a37)))
-		->Characteristics->GetAt(0);
-	DescriptorHeartRateMeasurement =
-		(co_await CharacteristicHeartRateMeasurement->
-			GetDescriptorsForUuidAsync(BluetoothUuidHelper::
-				FromShortId(0x2902)))->Descriptors->GetAt(0);
-	// Messages
-	ServiceInmediateAlert =
-		(co_await Device->GetGattServicesForUuidAsync(
-			UUIDServiceInmediateAlert))->Services->GetAt(0);
-	CharacteristicAlert =
-		(co_await ServiceInmediateAlert->GetCharacteristicsForUuidAsync(
-			BluetoothUuidHelper::
-			FromShortId(0x2a06)))->Characteristics->GetAt(0);
-
-	ServiceAlertNotification =
-		(co_await Device->GetGattServicesForUuidAsync(
-			UUIDServiceAlertNotification))->Services->GetAt(0);
-	CharacteristicNewAlert =
-		(co_await ServiceAlertNotification->GetCharacteristicsForUuidAsync(
-			BluetoothUuidHelper::FromShortId(0x2a46)))
-		->Characteristics->GetAt(0);
-	CharacteristicAlertNotificationControlPoint =
-		(co_await ServiceAlertNotification->GetCharacteristicsForUuidAsync(
-			BluetoothUuidHelper::FromShortId(0x2a44)))
-		->Characteristics->GetAt(0);
+	std::cout << "Started stardard HRM behaviour on band "
+		<< static_cast<int>(BandId) << std::endl;
 }
 
 // Authenticates with the MiBand 3.
-concurrency::task<void> MiBand3::Authentication()
+Async::Task<void> MiBand3::Authentication()
 {
 	// Enables the notifications about authentification and handles their
 	// responses
 	co_await EnableAuthenticationNotifications();
 
+	// A band seen before that rejected our key gets it right away, instead of
+	// after failing one more handshake
+	GattCacheEntry Entry;
+	if (RC->Manager->GetGattCache().Find(ConnectedAddress, Entry) &&
+		Entry.Pairing == PairingState::Rejected)
+	{
+		co_await SendNewKey(AuthKey);
+		co_return;
+	}
 	// Request key. If the key stored on the device is different we send our key
 	co_await RequestRandomKey();
 }
 
-// Reads the value from a given characteristic of the MiBand 3 periferal.
-concurrency::task<Platform::Array<unsigned char>^> MiBand3::
-ReadFromCharacteristic(GenericAttributeProfile::
-	GattCharacteristic^ Characteristic)
+// Opens the transport to the MiBand 3 peripheral in the given address.
+Async::Task<bool> MiBand3::OpenTransport(
+	unsigned long long BluetoothAddress)
 {
-	// Attemps a reading
-	auto Data = co_await Characteristic->ReadValueAsync();
-	// If the reading succeeds, decode the reading and returns it as a byte 
-	// array
-	if (Data->Status == GenericAttributeProfile::
-		GattCommunicationStatus::Success)
-	{
-		auto DataReader = Windows::Storage::Streams::DataReader::FromBuffer(
-			Data->Value);
-		auto Bytes = ref new Platform::Array<unsigned char>(
-			DataReader->UnconsumedBufferLength);
-		DataReader->ReadBytes(Bytes);
-		co_return Bytes;
-	}
-	// If the reading fails, return an empty array
-	else
-	{
-		co_return ref new Platform::Array<unsigned char>(0);
-	}
+	co_return co_await Async::FromCallback<bool>(*BandReactor,
+		[this, BluetoothAddress](GattTransport::Completion Done) {
+			Transport->Open(BluetoothAddress, std::move(Done));
+		});
 }
 
-// Writes to a given characteristic
-concurrency::task<void> MiBand3::WriteToCharacteristic(
-	GenericAttributeProfile::GattCharacteristic^ Characteristic,
-	std::vector<unsigned char> Data)
+// Queues a write to a given characteristic. Queued writes with the same
+// non-zero collapse key replace each other.
+Async::Task<bool> MiBand3::WriteToCharacteristic(GattChannel Channel,
+	std::vector<unsigned char> Data, GattPriority Priority, uint32 CollapseKey)
 {
-	// Create new writer and load the data
-	auto Writer = ref new DataWriter();
-	Writer->WriteBytes(ref new Platform::Array<unsigned char>(
-		Data.data(), static_cast<unsigned int>(Data.size())));
-	// Write the data asyncronously
-	co_await Characteristic->WriteValueAsync(Writer->DetachBuffer());
+	co_return co_await Async::FromCallback<bool>(*BandReactor,
+		[&](GattTransport::Completion Done) {
+			Commands->Write(Channel, std::move(Data), Priority, CollapseKey,
+				std::move(Done));
+		});
 }
 
-// Writes to a given descriptor
-concurrency::task<void> MiBand3::WriteToDescriptor(
-	GenericAttributeProfile::GattDescriptor^ Descriptor,
-	std::vector<unsigned char> Data)
+void MiBand3::QueueWrite(GattChannel Channel,
+	std::vector<unsigned char> Data, GattPriority Priority, uint32 CollapseKey)
 {
-	// Create new writer and load the data
-	auto Writer = ref new DataWriter();
-	Writer->WriteBytes(ref new Platform::Array<unsigned char>(
-		Data.data(), static_cast<unsigned int>(Data.size())));
-	// Write the data asyncronously
-	co_await DescriptorAuthentication->WriteValueAsync(Writer->DetachBuffer());
+	Commands->Write(Channel, std::move(Data), Priority, CollapseKey, nullptr);
 }
 
-// Enables the notifications from a given descriptor and characteristic, and
-// sets a task to handle them on arrival.
-concurrency::task<void> MiBand3::EnableNotifications(
-	GenericAttributeProfile::GattDescriptor^ Descriptor,
-	GenericAttributeProfile::GattCharacteristic^ Characteristic,
-	concurrency::task<void>(MiBand3::* HandleNotifications)
-	(GenericAttributeProfile::GattCharacteristic^ Sender,
-		GenericAttributeProfile::GattValueChangedEventArgs^ Args))
+// Enables the notifications of a given characteristic, the transport hands
+// them to the handlers set in the constructor.
+Async::Task<bool> MiBand3::EnableNotifications(GattChannel Channel)
 {
-	// Enable notifications
-	co_await WriteToDescriptor(Descriptor, { 0x01, 0x00 });
-
-	// Set the characteristic on Notify
-	auto Status = co_await Characteristic->
-		WriteClientCharacteristicConfigurationDescriptorAsync(
-			GenericAttributeProfile::
-			GattClientCharacteristicConfigurationDescriptorValue::Notify);
-	// Logs an error
-	if (Status != GenericAttributeProfile::GattCommunicationStatus::Success)
-	{
-		std::cout << "Enable notifications error." << std::endl;
-	}
-	// Sets the given task to handle the notifications, along with any other set 
-	// before
-	Characteristic->ValueChanged += ref new Windows::Foundation::
-		TypedEventHandler<GenericAttributeProfile::GattCharacteristic^,
-		GenericAttributeProfile::GattValueChangedEventArgs^>(
-			[this, HandleNotifications](
-				GenericAttributeProfile::GattCharacteristic^ Sender,
-				GenericAttributeProfile::GattValueChangedEventArgs^ Args) {
-					(this->*HandleNotifications)(Sender, Args);
-			});
+	co_return co_await Async::FromCallback<bool>(*BandReactor,
+		[this, Channel](GattTransport::Completion Done) {
+			Commands->EnableNotifications(Channel, GattPriority::Control,
+				std::move(Done));
+		});
 }
 
 // Enable the notification from authentications and sets their handler
-concurrency::task<void> MiBand3::EnableAuthenticationNotifications()
+Async::Task<void> MiBand3::EnableAuthenticationNotifications()
 {
-	co_await EnableNotifications(
-		DescriptorAuthentication, CharacteristicAuthentication,
-		&MiBand3::HandleAuthenticationNotifications);
+	co_await EnableNotifications(GattChannel::Authentication);
 }
 
 // Handles the arrival of the notifications for authentication and their 
 // responses, to link the device with the pc.
-concurrency::task<void> MiBand3::HandleAuthenticationNotifications(
-	GenericAttributeProfile::GattCharacteristic^ Sender,
-	GenericAttributeProfile::GattValueChangedEventArgs^ Args)
+Async::Task<void> MiBand3::HandleAuthenticationNotifications(
+	std::vector<unsigned char> Bytes)
 {
-
-	auto Lenght = Args->CharacteristicValue->Length;
-
-	if (Lenght > 2)
+	HRM_TRACE_SCOPE("Auth.Notification");
+	if (Bytes.size() > 2)
 	{
-		auto Bytes = ref new Platform::Array<unsigned char>(Lenght);
-		Windows::Storage::Streams::DataReader::FromBuffer(
-			Args->CharacteristicValue)->ReadBytes(Bytes);
 		// If the key is received
 		if (Bytes[0] == 0x10 && Bytes[1] == 0x01 && Bytes[2] == 0x01)
 		{
@@ -279,10 +296,11 @@ concurrency::task<void> MiBand3::HandleAuthenticationNotifications(
 			co_await RequestRandomKey();
 		}
 		// If the random key is received
-		else if (Bytes[0] == 0x10 && Bytes[1] == 0x02 && Bytes[2] == 0x01)
+		else if (Bytes[0] == 0x10 && Bytes[1] == 0x02 && Bytes[2] == 0x01 &&
+			Bytes.size() >= 3 + 16)
 		{
 			// Send encrypted random authentication key
-			auto Encrypted = Encrypt(Bytes->Data + 3, AuthKey.data());
+			auto Encrypted = Encrypt(Bytes.data() + 3, AuthKey.data());
 			co_await SendEncryptedKey(Encrypted);
 		}
 		// If the authentication is completed
@@ -290,7 +308,7 @@ concurrency::task<void> MiBand3::HandleAuthenticationNotifications(
 		{
 			// Set internal status as authenticated
 			std::cout << "Success - Authentication completed." << std::endl;
-			Authenticated.set();
+			Authenticated.Set();
 		}
 		// If the key isn't received
 		else if (Bytes[0] == 0x10 && Bytes[1] == 0x01 && Bytes[2] == 0x04)
@@ -308,173 +326,293 @@ concurrency::task<void> MiBand3::HandleAuthenticationNotifications(
 		else if (Bytes[0] == 0x10 && Bytes[1] == 0x03 && Bytes[2] == 0x04)
 		{
 			std::cout << "Key encryption failed, sending new one." << std::endl;
+			RC->Manager->GetGattCache().SetPairing(ConnectedAddress,
+				PairingState::Rejected);
 			co_await SendNewKey(AuthKey);
 		}
 	}
 }
 
-concurrency::task<void> MiBand3::SendNewKey(std::vector<unsigned char> Key)
+Async::Task<void> MiBand3::SendNewKey(std::vector<unsigned char> Key)
 {
+	HRM_TRACE_SCOPE("Auth.SendNewKey");
 	auto Data = Concat({ 0x01, 0x00 }, Key);
-	co_await WriteToCharacteristic(CharacteristicAuthentication, Data);
+	co_await WriteToCharacteristic(GattChannel::Authentication, Data);
 }
 
-concurrency::task<void> MiBand3::RequestRandomKey()
+Async::Task<void> MiBand3::RequestRandomKey()
 {
-	co_await WriteToCharacteristic(CharacteristicAuthentication,
+	HRM_TRACE_SCOPE("Auth.RequestRandomKey");
+	co_await WriteToCharacteristic(GattChannel::Authentication,
 		{ 0x02, 0x00, 0x02 });
 }
 
-concurrency::task<void> MiBand3::SendEncryptedKey(
+Async::Task<void> MiBand3::SendEncryptedKey(
 	std::vector<unsigned char> Encrypted)
 {
+	HRM_TRACE_SCOPE("Auth.SendEncryptedKey");
 	auto Data = Concat({ 0x03, 0x00 }, Encrypted);
-	co_await WriteToCharacteristic(CharacteristicAuthentication, Data);
+	co_await WriteToCharacteristic(GattChannel::Authentication, Data);
 }
 
 void MiBand3::EnableHeartRateNotifications()
 {
-	EnableNotifications(DescriptorHeartRateMeasurement,
-		CharacteristicHeartRateMeasurement, 
-		&MiBand3::HandleHeartRateNotifications);
+	Commands->EnableNotifications(GattChannel::HeartRateMeasurement,
+		GattPriority::Control, nullptr);
 }
 
-concurrency::task<void> MiBand3::HandleHeartRateNotifications(
-	GenericAttributeProfile::GattCharacteristic^ Sender,
-	GenericAttributeProfile::GattValueChangedEventArgs^ Args)
+// Handles the heart rate notifications. It only decodes the value and
+// publishes it for the delivery stage, which does the formatting and output.
+void MiBand3::HandleHeartRateNotifications(const uint8* Data, uint32 Size)
 {
-	auto HeartRate = ref new Platform::Array<unsigned char>(
-		Args->CharacteristicValue->Length);
-	Windows::Storage::Streams::DataReader::FromBuffer(
-		Args->CharacteristicValue)->ReadBytes(HeartRate);
-
-	auto HeartRateString = FormatHeartRate(HeartRate);
-
-	std::cout << "Heart Rate: " << HeartRateString << std::endl;
-
-	auto HeartRateWString = std::wstring(HeartRateString.begin(),
-		HeartRateString.end());
-
-	auto Message = ref new Platform::String(HeartRateWString.c_str());
-
-	InWriteToServer(Message, true);
-
-	++HeartRateCounter;
+	HRM_TRACE_SCOPE("HeartRateNotification");
+	HRM_ALLOCATION_STAGE(Notification);
+	const HeartRateSample Sample = HeartRate->Publish(Data, Size,
+		SampleFrames::MonotonicMicroseconds());
+	if (Recorder)
+	{
+		Recorder->Append(SessionLog::RecordType::HeartRate, BandId,
+			Sample.Bpm, Sample.Sequence, Data, Size);
+	}
+	Delivery->Wake();
 
-	if (!HeartRatePingTimer)
+	OnSample();
+	if (bAwaitingFirstSample.exchange(false))
 	{
-		HeartMeasureReaded.set();
+		FirstSampleMs = static_cast<uint64>(
+			std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now() - ConnectStart).count());
+		std::cout << "First heart rate sample " << FirstSampleMs.load()
+			<< " ms after connecting, band " << static_cast<int>(BandId)
+			<< std::endl;
 	}
-	co_return;
+	if (!bMonitoring)
+	{
+		HeartMeasureReaded.Set();
+	}
+}
+
+// Sends every published sample to the client. Called from the delivery stage
+// only.
+void MiBand3::DrainSamples()
+{
+	HRM_TRACE_SCOPE("DrainSamples");
+	HRM_ALLOCATION_STAGE(Delivery);
+	ClientSink Sink(RC);
+	HeartRate->Drain(Sink, RC->OutputMode, RC->bDatagramsEnabled);
+}
+
+// Sends the aggregates of every window ending now as one binary frame
+void MiBand3::SendAggregates()
+{
+	const uint64 Now = SampleFrames::MonotonicMicroseconds();
+	const AggregateSnapshot Snapshot =
+		HeartRate->GetAggregates().Snapshot(Now);
+	std::array<uint8, SampleFrames::MaxAggregatesFrameSize> Frame;
+	auto Size = SampleFrames::WriteAggregates(Frame.data(), BandId,
+		AggregatesSequence++, Now, Snapshot);
+	RC->Send(SampleFrames::FrameType::Aggregates, Frame.data(),
+		static_cast<uint32>(Size));
 }
 
-std::string MiBand3::FormatHeartRate(
-	const Platform::Array<unsigned char>^ HeartRate)
+bool MiBand3::ConfigureAggregates(const std::vector<uint32>& WindowSeconds,
+	const std::vector<uint8>& ZoneBounds)
 {
-	unsigned short HearRateValue = (
-		static_cast<unsigned short>(
-			HeartRate[0]) << 8) | (0x00ff & HeartRate[1]);
-	std::stringstream BatteryBuffer;
-	BatteryBuffer << HearRateValue;
-	return BatteryBuffer.str();
+	return HeartRate->GetAggregates().Configure(WindowSeconds, ZoneBounds);
 }
 
-concurrency::task<void> MiBand3::HeartRateDefault()
+Async::Task<void> MiBand3::HeartRateDefault()
 {
 	// Disable continuous
-	co_await WriteToCharacteristic(CharacteristicHeartRateControlPoint,
+	co_await WriteToCharacteristic(GattChannel::HeartRateControlPoint,
 		{ 0x15, 0x01, 0x00 });
 	// Disable one-shot
-	co_await WriteToCharacteristic(CharacteristicHeartRateControlPoint,
+	co_await WriteToCharacteristic(GattChannel::HeartRateControlPoint,
 		{ 0x15, 0x02, 0x00 });
 	// Enable one-shot
-	co_await WriteToCharacteristic(CharacteristicHeartRateControlPoint,
+	co_await WriteToCharacteristic(GattChannel::HeartRateControlPoint,
 		{ 0x15, 0x02, 0x01 });
 
-	HeartMeasureReaded.wait();
+	co_await HeartMeasureReaded;
 }
 
-void MiBand3::CheckReset()
+void MiBand3::ReplayNotification(const uint8* Data, uint32 Size)
 {
-	if (HeartRateCounter == HeartRateLastCounter)
+	HandleHeartRateNotifications(Data, Size);
+}
+
+// Pushes the stall deadline back, and ends a recovery on its first sample.
+void MiBand3::OnSample()
+{
+	std::lock_guard<std::mutex> Guard(MonitorLock);
+	if (Monitor == MonitorState::Restarting)
 	{
+		auto Now = std::chrono::steady_clock::now();
+		LastRecoveryMs = static_cast<uint64>(
+			std::chrono::duration_cast<std::chrono::milliseconds>(
+				Now - RecoveryStart).count());
+		MaxRecoveryMs = std::max(MaxRecoveryMs, LastRecoveryMs);
+		++RecoveryCount;
+		LastRecovery = Now;
+		Monitor = MonitorState::Streaming;
+		std::cout << "Heart rate recovered on band " << static_cast<int>(BandId)
+			<< " after " << LastRecoveryMs << " ms (" << StallCount
+			<< " stalls, " << RecoveryCount << " recoveries, max "
+			<< MaxRecoveryMs << " ms)" << std::endl;
+		if (Recorder)
+		{
+			Recorder->Append(SessionLog::RecordType::Recovery, BandId, 0, 0,
+				&LastRecoveryMs, sizeof(LastRecoveryMs));
+		}
+	}
+	if (Monitor == MonitorState::Streaming)
+	{
+		Timers->Arm(StallTimer, StallTimeout);
+	}
+}
+
+// The deadline passed without notifications, while streaming or while
+// waiting for a restart to work. Disables continuous monitoring first.
+void MiBand3::OnStall()
+{
+	{
+		std::lock_guard<std::mutex> Guard(MonitorLock);
+		auto Now = std::chrono::steady_clock::now();
+		if (Monitor == MonitorState::Streaming)
+		{
+			// A new recovery, the backoff keeps growing only if the band
+			// recovered a short while ago
+			RecoveryStart = Now;
+			if (RecoveryCount == 0 || Now - LastRecovery > FlappingWindow)
+			{
+				Backoff = BaseBackoff;
+			}
+			else
+			{
+				Backoff = std::min(Backoff * 2, MaxBackoff);
+			}
+		}
+		else if (Monitor == MonitorState::Restarting)
+		{
+			// The restart didn't bring the notifications back
+			Backoff = std::min(Backoff * 2, MaxBackoff);
+		}
+		else
+		{
+			return;
+		}
+		Monitor = MonitorState::Stopping;
+		++StallCount;
+		std::cout << "Heart rate stalled on band " << static_cast<int>(BandId)
+			<< ", restarting in " << Backoff << " ms" << std::endl;
+		if (Recorder)
+		{
+			Recorder->Append(SessionLog::RecordType::Stall, BandId,
+				static_cast<uint16>(Backoff), 0);
+		}
+	}
+	// Disable continuous
+	Commands->Write(GattChannel::HeartRateControlPoint, { 0x15, 0x01, 0x00 },
+		GattPriority::Control, 0, [this](bool) {
+			BandReactor->Post([this]() { OnStopped(); });
+		});
+}
 
-		HeartRateStop();
-		concurrency::wait(2000);
-		HeartRateStart();
+void MiBand3::OnStopped()
+{
+	std::lock_guard<std::mutex> Guard(MonitorLock);
+	if (Monitor == MonitorState::Stopping)
+	{
+		Monitor = MonitorState::CoolingDown;
+		Timers->Arm(RecoveryTimer, Backoff);
 	}
-	else
+}
+
+void MiBand3::OnCooledDown()
+{
 	{
-		HeartRateLastCounter = HeartRateCounter;
+		std::lock_guard<std::mutex> Guard(MonitorLock);
+		if (Monitor != MonitorState::CoolingDown)
+		{
+			return;
+		}
+		Monitor = MonitorState::Restarting;
+		Timers->Arm(StallTimer, StartupGrace);
 	}
+	Async::Spawn(RestartContinuous());
+}
+
+// Same sequence as HeartRateStart, without touching the timers.
+Async::Task<void> MiBand3::RestartContinuous()
+{
+	co_await EnableNotifications(GattChannel::HeartRateMeasurement);
+	// Disable one-shot
+	co_await WriteToCharacteristic(GattChannel::HeartRateControlPoint,
+		{ 0x15, 0x02, 0x00 });
+	// Disable continuous
+	co_await WriteToCharacteristic(GattChannel::HeartRateControlPoint,
+		{ 0x15, 0x01, 0x00 });
+	// Enable continuous
+	co_await WriteToCharacteristic(GattChannel::HeartRateControlPoint,
+		{ 0x15, 0x01, 0x01 });
 }
 
 void MiBand3::HeartRateStart()
 {
+	// The command queue runs these in order
 	// Enable notifications
 	EnableHeartRateNotifications();
 
 	// Disable one-shot
-	WriteToCharacteristic(
-		CharacteristicHeartRateControlPoint, { 0x15, 0x02, 0x00 });
+	QueueWrite(
+		GattChannel::HeartRateControlPoint, { 0x15, 0x02, 0x00 });
 	// Disable continuous
-	WriteToCharacteristic(
-		CharacteristicHeartRateControlPoint, { 0x15, 0x01, 0x00 });
+	QueueWrite(
+		GattChannel::HeartRateControlPoint, { 0x15, 0x01, 0x00 });
 	// Enable continuous
-	WriteToCharacteristic(
-		CharacteristicHeartRateControlPoint, { 0x15, 0x01, 0x01 });
+	QueueWrite(
+		GattChannel::HeartRateControlPoint, { 0x15, 0x01, 0x01 });
 
-	if (HeartRatePingTimer)
-	{
-		HeartRatePingTimer->start();
-	}
-	if (HeartRateCounterDelayTimer)
-	{
-		HeartRateCounterDelayTimer->start();
-	}
 	// Runs monitoring
 	RunHRM();
 }
 
 void MiBand3::HeartRatePing()
 {
-	WriteToCharacteristic(
-		CharacteristicHeartRateControlPoint, { 0x16 });
+	// A ping still queued is as good as a new one
+	QueueWrite(GattChannel::HeartRateControlPoint, { 0x16 },
+		GattPriority::Background, PingCollapseKey);
 }
 
 void MiBand3::HeartRateStop()
 {
 	// Disable continuous
-	WriteToCharacteristic(
-		CharacteristicHeartRateControlPoint, { 0x15, 0x01, 0x00 });
-
-	if (HeartRateCounterTimer)
-	{
-		HeartRateCounterTimer->pause();
-	}
-	if (HeartRateCounterDelayTimer)
-	{
-		HeartRateCounterDelayTimer->pause();
-	}
-	if (HeartRatePingTimer)
-	{
-		HeartRatePingTimer->pause();
-	}
+	QueueWrite(
+		GattChannel::HeartRateControlPoint, { 0x15, 0x01, 0x00 });
+
+	bMonitoring = false;
+	Timers->Cancel(HeartRatePingTimer);
+	std::lock_guard<std::mutex> Guard(MonitorLock);
+	Monitor = MonitorState::Idle;
+	Timers->Cancel(StallTimer);
+	Timers->Cancel(RecoveryTimer);
 }
 
 void MiBand3::Vibrate()
 {
-	WriteToCharacteristic(CharacteristicAlert, { 0x03 });
+	QueueWrite(GattChannel::Alert, { 0x03 }, GattPriority::Haptic,
+		VibrateCollapseKey);
 }
 
 void MiBand3::Vibrate(uint16 Milliseconds)
 {
-	WriteToCharacteristic(CharacteristicAlert,
+	QueueWrite(GattChannel::Alert,
 		{ 0xff, (unsigned char)(Milliseconds & 0xff),
-		(unsigned char)((Milliseconds >> 8) & 0xff), 0x00, 0x00, 0x01 });
+		(unsigned char)((Milliseconds >> 8) & 0xff), 0x00, 0x00, 0x01 },
+		GattPriority::Haptic, VibrateCollapseKey);
 }
 
-void MiBand3::WriteMessage(uint8* Message, uint32 MessageSize)
+void MiBand3::WriteMessage(const uint8* Message, uint32 MessageSize)
 {
 	std::vector<unsigned char> Data{ 0x01, 0x01 };
 	for (uint32 i = 0; i < MessageSize; ++i)
@@ -482,37 +620,106 @@ void MiBand3::WriteMessage(uint8* Message, uint32 MessageSize)
 		Data.push_back(Message[i]);
 	}
 
-	WriteToCharacteristic(CharacteristicNewAlert, Data);
+	QueueWrite(GattChannel::NewAlert, Data, GattPriority::Haptic);
 }
 
-void MiBand3::WriteToServer(Platform::String^ Message, bool pad)
+// Sends a string to the client. Strings of bands other than the first one are
+// prefixed with "<band id>:", so single band clients see the legacy output.
+void MiBand3::WriteToServer(Platform::String^ Message, bool pad,
+	SampleFrames::FrameType Stream)
 {
-	InWriteToServer(Message, pad);
+	if (BandId != 0)
+	{
+		wchar_t Prefix[Codec::MaxDecimalDigits + 1];
+		auto Size = Codec::FormatUnsigned(BandId, Prefix);
+		Prefix[Size++] = L':';
+		Message = ref new Platform::String(Prefix,
+			static_cast<unsigned int>(Size)) + Message;
+	}
+	RC->Send(Stream, Message, pad);
 }
 
-concurrency::task<void> MiBand3::InWriteToServer(
-	Platform::String^ Message, bool pad)
+// Sends a status code to the client, as a decimal string or as a status frame
+// depending on the negotiated output mode.
+void MiBand3::WriteStatus(uint16 Code)
 {
-	// Ignore if there's no client
-	if (RC->bClientConnected)
+	if (Recorder)
 	{
-		// Send a request to the HRM server.
-		auto Writer = ref new Windows::Storage::Streams::DataWriter(
-			RC->ClientSocket->OutputStream);
-
-		Writer->WriteString(Message);
-
-		if (pad) {
-			Writer->WriteByte('\0');
-		}
-
-		co_await Writer->StoreAsync();
+		Recorder->Append(SessionLog::RecordType::Status, BandId, Code, 0);
+	}
+	if (Publisher)
+	{
+		Publisher->PublishStatus(BandId, Code);
+	}
+	if (RC->OutputMode == SampleFrames::FrameMode::Binary)
+	{
+		std::array<uint8, SampleFrames::MaxFrameSize> Frame;
+		auto Size = SampleFrames::WriteStatus(Frame.data(), BandId,
+			StatusSequence++, SampleFrames::MonotonicMicroseconds(), Code);
+		RC->Send(SampleFrames::FrameType::Status, Frame.data(),
+			static_cast<uint32>(Size));
+	}
+	else
+	{
+		wchar_t Text[Codec::MaxDecimalDigits];
+		auto Size = Codec::FormatUnsigned(Code, Text);
+		WriteToServer(ref new Platform::String(Text,
+			static_cast<unsigned int>(Size)), true);
+	}
+}
 
-		co_await Writer->FlushAsync();
+// Sends the address of a device found by the scanner to a text mode client,
+// once per device. Binary clients get scan batches instead.
+void MiBand3::WriteScanResult(unsigned long long BluetoothAddress)
+{
+	if (RC->OutputMode == SampleFrames::FrameMode::Text)
+	{
+		WriteToServer(ref new Platform::String(
+			FormatBluetoothAddress(BluetoothAddress).c_str()), true,
+			SampleFrames::FrameType::ScanResult);
+	}
+}
 
-		Writer->DetachStream();
+// Sends scanner results to a binary mode client, as many scan batch frames
+// as needed.
+void MiBand3::WriteScanBatch(const std::vector<ScanEntry>& Entries,
+	bool bFinal)
+{
+	if (RC->OutputMode != SampleFrames::FrameMode::Binary)
+	{
+		return;
 	}
-	co_return;
+	std::array<uint8, SampleFrames::MaxScanBatchFrameSize> Frame;
+	size_t Next = 0;
+	do
+	{
+		const size_t Count = std::min(Entries.size() - Next,
+			SampleFrames::MaxScanEntriesPerFrame);
+		uint8 Flags = 0;
+		if (bFinal)
+		{
+			Flags |= SampleFrames::ScanBatchSummary;
+			if (Next + Count == Entries.size())
+			{
+				Flags |= SampleFrames::ScanBatchLast;
+			}
+		}
+		auto Size = SampleFrames::WriteScanBatchHeader(Frame.data(), BandId,
+			ScanResultSequence++, SampleFrames::MonotonicMicroseconds(),
+			static_cast<uint16>(Count), Flags);
+		uint8* Out = Frame.data() + SampleFrames::HeaderSize +
+			SampleFrames::ScanBatchHeaderSize;
+		for (size_t i = Next; i < Next + Count; ++i)
+		{
+			const ScanEntry& Entry = Entries[i];
+			Out += SampleFrames::WriteScanEntry(Out, Entry.Address,
+				Entry.FirstSeen, Entry.LastSeen, Entry.Advertisements,
+				Entry.RssiMin, Entry.RssiAverage(), Entry.RssiLast);
+		}
+		RC->Send(SampleFrames::FrameType::ScanBatch, Frame.data(),
+			static_cast<uint32>(Size));
+		Next += Count;
+	} while (Next < Entries.size());
 }
 
 std::vector<unsigned char> MiBand3::Concat(
@@ -529,6 +736,7 @@ std::vector<unsigned char> MiBand3::Concat(
 std::vector<unsigned char> MiBand3::Encrypt(
 	unsigned char* Data, unsigned char* Key)
 {
+	HRM_TRACE_SCOPE("Auth.Encrypt");
 	int OutLenght;
 	unsigned char Encrypted[16];
 	EVP_CIPHER_CTX* Context = EVP_CIPHER_CTX_new();
@@ -539,3 +747,47 @@ std::vector<unsigned char> MiBand3::Encrypt(
 	EVP_CIPHER_CTX_free(Context);
 	return std::vector<unsigned char>(Encrypted, Encrypted + 16);
 }
+
+uint32 MiBand3::Stalls::get()
+{
+	std::lock_guard<std::mutex> Guard(MonitorLock);
+	return StallCount;
+}
+
+uint32 MiBand3::Recoveries::get()
+{
+	std::lock_guard<std::mutex> Guard(MonitorLock);
+	return RecoveryCount;
+}
+
+uint64 MiBand3::LastRecoveryTime::get()
+{
+	std::lock_guard<std::mutex> Guard(MonitorLock);
+	return LastRecoveryMs;
+}
+
+uint64 MiBand3::MaxRecoveryTime::get()
+{
+	std::lock_guard<std::mutex> Guard(MonitorLock);
+	return MaxRecoveryMs;
+}
+
+uint64 MiBand3::ConnectTime::get()
+{
+	return ConnectMs;
+}
+
+uint64 MiBand3::TimeToFirstSample::get()
+{
+	return FirstSampleMs;
+}
+
+bool MiBand3::bWarmConnect::get()
+{
+	return Transport->OpenedFromCache();
+}
+
+GattQueueSummary MiBand3::GetCommandQueueSummary()
+{
+	return Commands->GetSummary();
+}
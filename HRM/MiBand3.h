@@ -1,16 +1,29 @@
 #pragma once
 
 #include "pch.h"
+#include "Awaitables.h"
+#include "BleScanner.h"
 #include "BlthUtil.h"
+#include "GattCommandQueue.h"
+#include "GattTransport.h"
+#include "HeartRateStream.h"
+#include "Reactor.h"
+#include "SampleFrame.h"
+#include "SampleDelivery.h"
+#include "SessionRecorder.h"
+#include "SharedHeartRatePublisher.h"
+#include "Task.h"
+#include "TimerWheel.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 #include <string>
 #include <vector>
-#include <agents.h>
-#include <ppltasks.h>
-#include <pplawait.h>
-#include <ppl.h>
+#include <array>
+#include <memory>
 #include <collection.h>
 #include <Windows.Devices.Bluetooth.h>
 #include <Windows.Devices.Enumeration.h>
@@ -26,16 +39,36 @@ using namespace Windows::Storage::Streams;
 
 ref class RemoteCommunication;
 
+// Heart rate monitoring states. A stalled band goes through every state from
+// Stopping back to Streaming without blocking any thread.
+enum class MonitorState : uint8
+{
+	// Heart rate monitoring off
+	Idle,
+	// Notifications arriving, each one pushes the stall deadline back
+	Streaming,
+	// No notification before the deadline, continuous monitoring being
+	// disabled on the band
+	Stopping,
+	// Waiting for the backoff to restart
+	CoolingDown,
+	// Continuous monitoring enabled again, waiting for the first sample
+	Restarting
+};
+
 ref class MiBand3 sealed
 {
 public:
-	MiBand3();
+	MiBand3(uint8 InBandId, RemoteCommunication^ InRC);
 
 	property RemoteCommunication^ RC;
 	void Connect(unsigned long long BluetoothAddress);
+	// Scans for bands in the background and reports them to the client, see
+	// BleScanner. 0 seconds stops a running scan.
+	void Scan(uint16 Seconds);
 
 	void Vibrate(uint16 Milliseconds);
-	void WriteMessage(uint8* Message, uint32 MessageSize);
+	void WriteMessage(const uint8* Message, uint32 MessageSize);
 
 	void HeartRateStart();
 	void HeartRatePing();
@@ -46,63 +79,99 @@ public:
 	void Vibrate();
 
 	void WriteToServer(
-		Platform::String^ Message, bool pad = false);
-
+		Platform::String^ Message, bool pad = false,
+		SampleFrames::FrameType Stream = SampleFrames::FrameType::Status);
+	void WriteStatus(uint16 Code);
+	void WriteScanResult(unsigned long long BluetoothAddress);
+	void WriteScanBatch(const std::vector<ScanEntry>& Entries, bool bFinal);
+
+	// Formats and sends the samples published by the notification handler
+	void DrainSamples();
+
+	// Sends a snapshot of the rolling heart rate aggregates to the client
+	void SendAggregates();
+	// Replaces the windows and zones of the rolling aggregates, see
+	// HeartRateAggregator::Configure
+	bool ConfigureAggregates(const std::vector<uint32>& WindowSeconds,
+		const std::vector<uint8>& ZoneBounds);
+
+	// Feeds a recorded 0x2a37 notification through the path of live ones
+	void ReplayNotification(const uint8* Data, uint32 Size);
+
+	// Service advertised by MiBand 3 peripherals, used to filter scans
 	property Platform::Guid UUIDServiceInfo;
-	property Platform::Guid UUIDServiceAuthentication;
-	property Platform::Guid UUIDServiceAlertNotification;
-	property Platform::Guid UUIDServiceInmediateAlert;
-	property Platform::Guid UUIDServiceHeartRate;
 
+	// Set and cleared on the reactor of the band, read there only
 	property bool bAuthenticated;
 
+	// Identifies this band on every command and every frame sent to the
+	// client
+	property uint8 BandId;
+
+	// Stall recovery counters, times in milliseconds
+	property uint32 Stalls { uint32 get(); }
+	property uint32 Recoveries { uint32 get(); }
+	property uint64 LastRecoveryTime { uint64 get(); }
+	property uint64 MaxRecoveryTime { uint64 get(); }
+
+	// Milliseconds from the last connect request until the transport was
+	// open and until its first heart rate sample, 0 until they happen
+	property uint64 ConnectTime { uint64 get(); }
+	property uint64 TimeToFirstSample { uint64 get(); }
+	// The last connection reused the cached GATT layout
+	property bool bWarmConnect { bool get(); }
+
+	// GATT operations queued or in flight, and the 99th percentile of their
+	// wait in the queue and of their time on the link, read together
+	GattQueueSummary GetCommandQueueSummary();
+
 private:
-	concurrency::task<void> InConnect(unsigned long long BluetoothAddress);
-	concurrency::task<void> Initialize(BluetoothLEDevice^ InDevice);
-	concurrency::task<void> Authentication();
+	// Tasks of the band run on its reactor
+	Async::Task<void> InConnect(unsigned long long BluetoothAddress);
+	Async::Task<void> Authentication();
 
 	void RunHRM();
 
-	concurrency::task<Platform::Array<unsigned char>^> ReadFromCharacteristic(
-		GenericAttributeProfile::GattCharacteristic^ Characteristic);
-	concurrency::task<void> WriteToCharacteristic(
-		GenericAttributeProfile::GattCharacteristic^ Characteristic,
-		std::vector<unsigned char> Data);
-	concurrency::task<void> WriteToDescriptor(
-		GenericAttributeProfile::GattDescriptor^ Descriptor, 
-		std::vector<unsigned char> Data);
-
-	concurrency::task<void> EnableNotifications(
-		GenericAttributeProfile::GattDescriptor^ Descriptor, 
-		GenericAttributeProfile::GattCharacteristic^ Characteristic, 
-		concurrency::task<void>(MiBand3::* HandleNotifications)(
-			GenericAttributeProfile::GattCharacteristic^ Sender,
-			GenericAttributeProfile::GattValueChangedEventArgs^ Args));
-	concurrency::task<void> EnableAuthenticationNotifications();
-	concurrency::task<void> HandleAuthenticationNotifications(
-		GenericAttributeProfile::GattCharacteristic^ Sender, 
-		GenericAttributeProfile::GattValueChangedEventArgs^ Args);
-	concurrency::task<void> SendNewKey(std::vector<unsigned char> Key);
-	concurrency::task<void> RequestRandomKey();
-	concurrency::task<void> SendEncryptedKey(
+	// Task wrappers around the transport, resuming on the reactor of the
+	// band. Writes and subscriptions go through the command queue.
+	Async::Task<bool> OpenTransport(unsigned long long BluetoothAddress);
+	Async::Task<bool> WriteToCharacteristic(GattChannel Channel,
+		std::vector<unsigned char> Data,
+		GattPriority Priority = GattPriority::Control, uint32 CollapseKey = 0);
+	Async::Task<bool> EnableNotifications(GattChannel Channel);
+	// Queues a write nobody waits for
+	void QueueWrite(GattChannel Channel, std::vector<unsigned char> Data,
+		GattPriority Priority = GattPriority::Control, uint32 CollapseKey = 0);
+
+	Async::Task<void> EnableAuthenticationNotifications();
+	Async::Task<void> HandleAuthenticationNotifications(
+		std::vector<unsigned char> Bytes);
+	Async::Task<void> SendNewKey(std::vector<unsigned char> Key);
+	Async::Task<void> RequestRandomKey();
+	Async::Task<void> SendEncryptedKey(
 		std::vector<unsigned char> Encrypted);
 
-	concurrency::task<void> HandleHeartRateNotifications(
-		GenericAttributeProfile::GattCharacteristic^ Sender, 
-		GenericAttributeProfile::GattValueChangedEventArgs^ Args);
-
-	std::string FormatHeartRate(
-		const Platform::Array<unsigned char>^ HeartRate);
+	void HandleHeartRateNotifications(const uint8* Data, uint32 Size);
 
-	concurrency::task<void> HeartRateDefault();
+	Async::Task<void> HeartRateDefault();
 
-	void CheckReset();
+	// Stall recovery transitions
+	void OnSample();
+	void OnStall();
+	void OnStopped();
+	void OnCooledDown();
+	Async::Task<void> RestartContinuous();
 
-	uint32 HeartRateCounter;
-	uint32 HeartRateLastCounter;
+	// Sequence numbers of the binary frames sent by this band, except the
+	// heart rate ones, see HeartRateStream
+	uint32 StatusSequence;
+	uint32 ScanResultSequence;
+	uint32 AggregatesSequence;
 
-	concurrency::task<void> InWriteToServer(
-		Platform::String^ Message, bool pad = false);
+	// Samples published by the notification handler (producer) and drained
+	// by the delivery stage (consumer), with their aggregates and HRV
+	std::unique_ptr<HeartRateStream> HeartRate;
+	SampleDelivery^ Delivery;
 
 	std::vector<unsigned char> Concat(
 		std::vector<unsigned char> Prefix, std::vector<unsigned char> Data);
@@ -115,41 +184,52 @@ private:
 		0x75, 0xa8, 0xd5, 0x03, 0xc8, 0x3f, 0x66, 0x44, 0x18,
 		0xe3, 0x96, 0x9d, 0x67, 0x17, 0x2e, 0xaa };
 
-	BluetoothLEDevice^ Device;
-
-	GenericAttributeProfile::GattDeviceService^ ServiceAuthentication;
-	GenericAttributeProfile::GattCharacteristic^ CharacteristicAuthentication;
-	GenericAttributeProfile::GattDescriptor^ DescriptorAuthentication;
-
-	GenericAttributeProfile::GattDeviceService^ ServiceHeartRate;
-	GenericAttributeProfile::
-		GattCharacteristic^ CharacteristicHeartRateControlPoint;
-	GenericAttributeProfile::
-		GattCharacteristic^ CharacteristicHeartRateMeasurement;
-	GenericAttributeProfile::GattDescriptor^ DescriptorHeartRateMeasurement;
-
-	GenericAttributeProfile::GattDeviceService^ ServiceInmediateAlert;
-	GenericAttributeProfile::GattCharacteristic^ CharacteristicAlert;
-
-	GenericAttributeProfile::GattDeviceService^ ServiceAlertNotification;
-	GenericAttributeProfile::GattCharacteristic^ CharacteristicNewAlert;
-	GenericAttributeProfile::
-		GattDescriptor^ DescriptorCharacteristicUserDescription;
-	GenericAttributeProfile::
-		GattCharacteristic^ CharacteristicAlertNotificationControlPoint;
-	GenericAttributeProfile::
-		GattDescriptor^ DescriptorClientCharacteristicConfiguration;
-
-	concurrency::timer<int>* HeartRatePingTimer;
-	concurrency::timer<int>* HeartRateCounterTimer;
-	concurrency::timer<int>* HeartRateCounterDelayTimer;
-	concurrency::timer<int>* VibratePingTimer;
-
-	concurrency::call<int>* HeartRatePingCallback;
-	concurrency::call<int>* HeartRateCounterDelayCallback;
-	concurrency::call<int>* HeartRateCounterCallback;
-
-	concurrency::event Authenticated;
-	concurrency::event Connected;
-	concurrency::event HeartMeasureReaded;
+	// GATT backend, a real band or a simulated one
+	std::unique_ptr<GattTransport> Transport;
+	// Orders, prioritizes and retries every operation on the transport
+	std::unique_ptr<GattCommandQueue> Commands;
+	// Session log of every sample and event, null if not recording
+	SessionRecorder* Recorder;
+	// Shared memory channel of local readers, null if not publishing
+	SharedHeartRatePublisher* Publisher;
+	// Created by the first scan
+	std::mutex ScannerLock;
+	std::unique_ptr<BleScanner> Scanner;
+
+	// Reactor owning the state of this band. GATT and timer callbacks post
+	// to it, except heart rate notifications, which go through Samples.
+	Reactor* BandReactor;
+
+	// Keepalive ping and notification watchdog, on the timer wheel shared
+	// by every band of the session
+	TimerWheel* Timers;
+	TimerEntry HeartRatePingTimer;
+	// Continuous monitoring running, one-shot readings otherwise
+	std::atomic<bool> bMonitoring;
+
+	// Stall recovery, guarded by MonitorLock
+	std::mutex MonitorLock;
+	MonitorState Monitor;
+	// Deadline for the next notification, pushed back by every sample
+	TimerEntry StallTimer;
+	// End of the cool down before restarting
+	TimerEntry RecoveryTimer;
+	// Current cool down, doubled by every failed restart
+	uint32 Backoff;
+	std::chrono::steady_clock::time_point RecoveryStart;
+	std::chrono::steady_clock::time_point LastRecovery;
+	uint32 StallCount;
+	uint32 RecoveryCount;
+	uint64 LastRecoveryMs;
+	uint64 MaxRecoveryMs;
+
+	// Last connection, for the cached auth state and the reconnect times
+	uint64 ConnectedAddress;
+	std::chrono::steady_clock::time_point ConnectStart;
+	std::atomic<uint64> ConnectMs;
+	std::atomic<uint64> FirstSampleMs;
+	std::atomic<bool> bAwaitingFirstSample;
+
+	Async::Event Authenticated;
+	Async::Event HeartMeasureReaded;
 };
\ No newline at end of file
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+
+// Link of an item of an MpscQueue, embedded in the item
+struct MpscNode
+{
+	std::atomic<MpscNode*> Next{ nullptr };
+};
+
+// Unbounded lock-free queue for any number of producer threads and exactly
+// one consumer thread (Vyukov's intrusive MPSC list). A push is one atomic
+// exchange and never waits for the consumer nor for other producers. Items
+// of one producer come out in the order it pushed them.
+//
+// The queue never allocates: items derive from MpscNode and are owned by
+// whoever pushes them, and must stay alive until popped. An item can't be
+// pushed again before it's popped.
+template <typename T>
+class MpscQueue
+{
+public:
+	MpscQueue() : Head(&Stub), Tail(&Stub)
+	{
+	}
+
+	MpscQueue(const MpscQueue&) = delete;
+	MpscQueue& operator=(const MpscQueue&) = delete;
+
+	// Producer side, from any thread
+	void Push(T& Item)
+	{
+		Item.Next.store(nullptr, std::memory_order_relaxed);
+		Link(&Item);
+	}
+
+	// Consumer side. Returns null if the queue is empty, or if the only item
+	// left is still being linked by its producer; IsEmpty tells them apart.
+	T* TryPop()
+	{
+		MpscNode* First = Tail;
+		MpscNode* Next = First->Next.load(std::memory_order_acquire);
+		// The stub only marks the end, skip it
+		if (First == &Stub)
+		{
+			if (!Next)
+			{
+				return nullptr;
+			}
+			Tail = Next;
+			First = Next;
+			Next = Next->Next.load(std::memory_order_acquire);
+		}
+		if (!Next)
+		{
+			// The last item can only be taken once the stub goes behind it
+			if (First != Head.load(std::memory_order_acquire))
+			{
+				return nullptr;
+			}
+			Stub.Next.store(nullptr, std::memory_order_relaxed);
+			Link(&Stub);
+			Next = First->Next.load(std::memory_order_acquire);
+			if (!Next)
+			{
+				return nullptr;
+			}
+		}
+		Tail = Next;
+		return static_cast<T*>(First);
+	}
+
+	// Consumer side. True once every push so far has been popped.
+	bool IsEmpty() const
+	{
+		return Tail == &Stub && Head.load() == &Stub;
+	}
+
+private:
+	void Link(MpscNode* New)
+	{
+		// Sequentially consistent, so a consumer about to sleep either sees
+		// the item or is seen sleeping by the producer
+		MpscNode* Previous = Head.exchange(New);
+		Previous->Next.store(New, std::memory_order_release);
+	}
+
+	// Last item pushed, producers only
+	std::atomic<MpscNode*> Head;
+	// Next item to pop, consumer only
+	MpscNode* Tail;
+	MpscNode Stub;
+};
@@ -0,0 +1,38 @@
+#include "pch.h"
+#include "OutputBuffer.h"
+#include <algorithm>
+#include <utility>
+
+OutputBuffer::OutputBuffer(uint32_t Capacity) :
+	Sizes(std::max<uint32_t>(1, Capacity)), First(0), Count(0)
+{
+}
+
+void OutputBuffer::Push(const uint8_t* Data, uint32_t Size)
+{
+	Bytes.insert(Bytes.end(), Data, Data + Size);
+	Sizes[(First + Count) % Sizes.size()] = Size;
+	++Count;
+}
+
+void OutputBuffer::DropOldest()
+{
+	Bytes.erase(Bytes.begin(), Bytes.begin() + Sizes[First]);
+	First = static_cast<uint32_t>((First + 1) % Sizes.size());
+	--Count;
+}
+
+void OutputBuffer::Take(std::vector<uint8_t>& Batch)
+{
+	Batch.clear();
+	std::swap(Bytes, Batch);
+	First = 0;
+	Count = 0;
+}
+
+void OutputBuffer::Clear()
+{
+	Bytes.clear();
+	First = 0;
+	Count = 0;
+}
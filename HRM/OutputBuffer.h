@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Messages waiting for the writer of an outbound stream: their bytes back to
+// back, and the size of each one in a ring of Capacity entries. Once the
+// byte buffers grew to the usual batch, neither queueing nor taking a batch
+// allocates. Not thread safe, OutputQueue guards it with its lock.
+class OutputBuffer
+{
+public:
+	explicit OutputBuffer(uint32_t Capacity);
+
+	// Appends a message. The buffer must not be full.
+	void Push(const uint8_t* Data, uint32_t Size);
+	// Drops the oldest message
+	void DropOldest();
+	// Swaps the bytes of every message into Batch, for the writer, and
+	// empties the buffer. The buffers are exchanged, not copied, so both
+	// keep their capacity.
+	void Take(std::vector<uint8_t>& Batch);
+	void Clear();
+	// Makes room for that many queued bytes up front
+	void Reserve(size_t Bytes) { this->Bytes.reserve(Bytes); }
+
+	uint32_t GetCount() const { return Count; }
+	bool IsFull() const { return Count >= Sizes.size(); }
+
+private:
+	std::vector<uint8_t> Bytes;
+	std::vector<uint32_t> Sizes;
+	// Slot of the oldest size and sizes in use
+	uint32_t First;
+	uint32_t Count;
+};
@@ -0,0 +1,241 @@
+#include "pch.h"
+#include "OutputQueue.h"
+#include "AllocationBudget.h"
+#include "Trace.h"
+#include "WinRtAwait.h"
+#include <algorithm>
+#include <iostream>
+
+// Class that owns the only DataWriter of an outbound stream. Producers never
+// touch the stream, they just queue bytes; the pump drains the queue in
+// batches so bursts of samples cost a single store and flush.
+OutputQueue::OutputQueue(IOutputStream^ Stream, TimerWheel& Timers,
+	Reactor& Loop, uint32 Capacity, uint32 CoalescingWindow,
+	OverflowPolicy Policy) : Timers(&Timers), Loop(&Loop),
+	Pending(Capacity)
+{
+	// Long-lived writer, detached by the pump once the queue is closed
+	Writer = ref new DataWriter(Stream);
+	this->CoalescingWindow = CoalescingWindow;
+	this->Policy = Policy;
+	// Initialize variables
+	bPumping = false;
+	bClosedFlag = false;
+	Peak = 0;
+	DroppedCount = 0;
+	BatchCount = 0;
+	MessageCount = 0;
+	// Sleeps until the first message
+	Async::Spawn(Pump());
+}
+
+// Copies the message into the queue and wakes the pump up if it's idle.
+bool OutputQueue::Enqueue(const uint8* Data, uint32 Size)
+{
+	HRM_ALLOCATION_STAGE(Output);
+	bool bWakePump = false;
+	bool bClosing = false;
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		if (bClosedFlag)
+		{
+			return false;
+		}
+		// The consumer fell behind, apply the overflow policy
+		if (Pending.IsFull())
+		{
+			// Log the first drop and then every hundred of them
+			if (DroppedCount++ % 100 == 0)
+			{
+				std::cout << "Output queue full (" << Pending.GetCount()
+					<< " messages), " << DroppedCount << " dropped so far"
+					<< std::endl;
+			}
+			if (Policy == OverflowPolicy::DropNewest)
+			{
+				return false;
+			}
+			if (Policy == OverflowPolicy::Disconnect)
+			{
+				bClosing = true;
+				bWakePump = CloseLocked();
+			}
+			else
+			{
+				// Drop oldest, the pump never holds queued messages so the
+				// front one can always go
+				Pending.DropOldest();
+			}
+		}
+		if (!bClosing)
+		{
+			Pending.Push(Data, Size);
+			Peak = std::max(Peak, Pending.GetCount());
+			if (!bPumping)
+			{
+				bPumping = true;
+				bWakePump = true;
+			}
+		}
+	}
+	// The pump moves over to its reactor right away
+	if (bWakePump)
+	{
+		WorkQueued.Set();
+	}
+	return !bClosing;
+}
+
+// Writes everything queued, in batches, until the queue is closed. Only one
+// pump runs per queue, so writes never interleave. Sleeps while the queue is
+// empty, on the thread that wakes it up, and moves to the reactor of the
+// queue to write.
+Async::Task<void> OutputQueue::Pump()
+{
+	// Keep the queue alive while the pump runs
+	OutputQueue^ Self = this;
+
+	while (true)
+	{
+		co_await WorkQueued;
+		co_await Async::ResumeOn(*Loop);
+
+		// Let more messages arrive before waking up the socket
+		if (CoalescingWindow > 0)
+		{
+			co_await Async::Delay(*Timers, *Loop, CoalescingWindow);
+		}
+
+		while (true)
+		{
+			{
+				HRM_ALLOCATION_STAGE(Output);
+				std::lock_guard<std::mutex> Guard(Lock);
+				Sending.clear();
+				if (bClosedFlag)
+				{
+					// Only the pump touches the writer, a write may have
+					// been in progress when the queue was closed
+					Writer->DetachStream();
+					co_return;
+				}
+				if (Pending.GetCount() == 0)
+				{
+					// Reset before going idle, so the next message sets it
+					WorkQueued.Reset();
+					bPumping = false;
+					break;
+				}
+				MessageCount += Pending.GetCount();
+				Pending.Take(Sending);
+				++BatchCount;
+			}
+
+			try
+			{
+				HRM_TRACE_SCOPE("Socket.StoreFlush");
+				// The operations are started apart from their awaits, so
+				// the socket stage doesn't span them
+				Windows::Foundation::IAsyncOperation<unsigned int>^ Store;
+				{
+					HRM_ALLOCATION_STAGE(Socket);
+					Writer->WriteBytes(Platform::ArrayReference<uint8>(
+						Sending.data(),
+						static_cast<unsigned int>(Sending.size())));
+					Store = Writer->StoreAsync();
+				}
+				co_await Async::Await<unsigned int>(*Loop, Store);
+				Windows::Foundation::IAsyncOperation<bool>^ Flush;
+				{
+					HRM_ALLOCATION_STAGE(Socket);
+					Flush = Writer->FlushAsync();
+				}
+				co_await Async::Await<bool>(*Loop, Flush);
+			}
+			catch (Platform::Exception^ Ex)
+			{
+				std::wcout << "Output stream failed with error: "
+					<< Ex->Message->Data() << std::endl;
+				Close();
+			}
+		}
+	}
+}
+
+// Closes the queue, later messages are rejected.
+void OutputQueue::Close()
+{
+	bool bWakePump;
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		bWakePump = CloseLocked();
+	}
+	if (bWakePump)
+	{
+		WorkQueued.Set();
+	}
+}
+
+// Closes the queue with the lock already held. Returns true if the pump must
+// be woken up, once the lock is released, so it detaches the stream and ends.
+bool OutputQueue::CloseLocked()
+{
+	if (!bClosedFlag)
+	{
+		bClosedFlag = true;
+		Pending.Clear();
+		// An idle pump has to wake up to end
+		if (!bPumping)
+		{
+			bPumping = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Logs the queue counters.
+void OutputQueue::ReportStats()
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	std::cout << "Output queue: depth " << Pending.GetCount()
+		<< ", peak " << Peak << ", messages " << MessageCount
+		<< ", batches " << BatchCount << ", dropped " << DroppedCount
+		<< std::endl;
+}
+
+bool OutputQueue::bClosed::get()
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	return bClosedFlag;
+}
+
+uint32 OutputQueue::Depth::get()
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	return Pending.GetCount();
+}
+
+uint32 OutputQueue::PeakDepth::get()
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	return Peak;
+}
+
+uint64 OutputQueue::Dropped::get()
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	return DroppedCount;
+}
+
+uint64 OutputQueue::Batches::get()
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	return BatchCount;
+}
+
+uint64 OutputQueue::Messages::get()
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	return MessageCount;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "pch.h"
+#include "Awaitables.h"
+#include "OutputBuffer.h"
+#include "Reactor.h"
+#include "Task.h"
+#include "TimerWheel.h"
+#include <mutex>
+#include <vector>
+#include <Windows.Networking.Sockets.h>
+
+using namespace Windows::Storage::Streams;
+
+// What a full queue does with a new message
+enum class OverflowPolicy : uint8
+{
+	// Drop the new message
+	DropNewest = 0,
+	// Drop the oldest queued message to make room for the new one
+	DropOldest = 1,
+	// Close the queue, the owner is expected to disconnect the consumer
+	Disconnect = 2
+};
+
+// Single writer for an outbound stream. Messages from any thread are copied
+// into a bounded queue and a single pump writes everything pending with one
+// store and flush per wake-up, keeping the order in which they were queued.
+// The pump lives as long as the queue is open, waits on the timer wheel and
+// resumes on the given reactor. Once the buffers grew to the usual batch,
+// queueing and pumping don't allocate; only the socket writes do.
+ref class OutputQueue sealed
+{
+public:
+	OutputQueue(IOutputStream^ Stream, TimerWheel& Timers, Reactor& Loop,
+		uint32 Capacity, uint32 CoalescingWindow,
+		OverflowPolicy Policy = OverflowPolicy::DropNewest);
+
+	// Queues a message. Returns false if the message was dropped or the
+	// queue is closed.
+	bool Enqueue(const uint8* Data, uint32 Size);
+	// Stops the pump, which releases the stream once the write in progress,
+	// if any, is over. Pending messages are discarded.
+	void Close();
+
+	void ReportStats();
+
+	// Milliseconds the pump waits after waking up to gather more messages
+	property uint32 CoalescingWindow;
+
+	property OverflowPolicy Policy;
+	// True once the queue was closed, by its owner, a write error or the
+	// disconnect policy
+	property bool bClosed { bool get(); }
+
+	property uint32 Depth { uint32 get(); }
+	property uint32 PeakDepth { uint32 get(); }
+	property uint64 Dropped { uint64 get(); }
+	property uint64 Batches { uint64 get(); }
+	property uint64 Messages { uint64 get(); }
+
+private:
+	Async::Task<void> Pump();
+	bool CloseLocked();
+
+	DataWriter^ Writer;
+	TimerWheel* Timers;
+	Reactor* Loop;
+
+	std::mutex Lock;
+	// Queued messages, up to the capacity of the queue
+	OutputBuffer Pending;
+	// Bytes being written by the pump, taken from Pending on every wake-up
+	std::vector<uint8> Sending;
+
+	// Set by whoever finds the pump idle, or closes the queue
+	Async::Event WorkQueued;
+	bool bPumping;
+	bool bClosedFlag;
+
+	uint32 Peak;
+	uint64 DroppedCount;
+	uint64 BatchCount;
+	uint64 MessageCount;
+};
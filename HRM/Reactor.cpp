@@ -0,0 +1,109 @@
+#include "pch.h"
+#include "Reactor.h"
+#include <algorithm>
+
+Reactor::Reactor(uint32_t Index) : Index(Index), bSleeping(false),
+	bRunning(true), Processed(0)
+{
+	Worker = std::thread([this] { Run(); });
+}
+
+Reactor::~Reactor()
+{
+	bRunning = false;
+	{
+		std::lock_guard<std::mutex> Guard(WakeLock);
+	}
+	WakeSignal.notify_one();
+	Worker.join();
+}
+
+void Reactor::Post(Event Callback)
+{
+	Post(*new EventItem(std::move(Callback)));
+}
+
+void Reactor::Post(Item& Work)
+{
+	Queue.Push(Work);
+	// Pairs with the sleeping flag set before the last emptiness check of
+	// the reactor, so the wake up can't be lost. The lock only orders the
+	// notification with the wait, it's never held while events run.
+	if (bSleeping)
+	{
+		std::lock_guard<std::mutex> Guard(WakeLock);
+		WakeSignal.notify_one();
+	}
+}
+
+void Reactor::Dispatch(Event Callback)
+{
+	if (IsCurrent())
+	{
+		Callback();
+	}
+	else
+	{
+		Post(std::move(Callback));
+	}
+}
+
+bool Reactor::IsCurrent() const
+{
+	return std::this_thread::get_id() == Worker.get_id();
+}
+
+uint64_t Reactor::GetProcessed() const
+{
+	return Processed.load(std::memory_order_relaxed);
+}
+
+// Runs the events as they come, and sleeps only when there's none left.
+void Reactor::Run()
+{
+	for (;;)
+	{
+		while (Item* Work = Queue.TryPop())
+		{
+			// Nothing of the item is touched after it ran
+			Work->Run(*Work);
+			Processed.fetch_add(1, std::memory_order_relaxed);
+		}
+		if (!Queue.IsEmpty())
+		{
+			// A producer is between its exchange and its link
+			std::this_thread::yield();
+			continue;
+		}
+		if (!bRunning)
+		{
+			return;
+		}
+		std::unique_lock<std::mutex> Guard(WakeLock);
+		bSleeping = true;
+		WakeSignal.wait(Guard, [this] {
+			return !Queue.IsEmpty() || !bRunning;
+			});
+		bSleeping = false;
+	}
+}
+
+Reactor::EventItem::EventItem(Event&& Callback) : Item(&RunAndDelete),
+	Callback(std::move(Callback))
+{
+}
+
+void Reactor::EventItem::RunAndDelete(Item& Work)
+{
+	EventItem* Posted = static_cast<EventItem*>(&Work);
+	Posted->Callback();
+	delete Posted;
+}
+
+ReactorPool::ReactorPool(uint32_t Count)
+{
+	for (uint32_t i = 0; i < std::max<uint32_t>(1, Count); ++i)
+	{
+		Reactors.push_back(std::make_unique<Reactor>(i));
+	}
+}
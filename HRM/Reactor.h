@@ -0,0 +1,110 @@
+#pragma once
+
+#include "MpscQueue.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Event loop on its own thread. The state it owns is only touched by the
+// events it runs, one at a time and in the order they were posted, so that
+// state needs no locks. Callbacks of other threads (GATT, sockets, timers)
+// post an event instead of touching it. Events must not throw.
+class Reactor
+{
+public:
+	using Event = std::function<void()>;
+
+	// Event embedded in its owner, posted without allocating. The owner
+	// keeps it alive until it runs and doesn't post it again before that;
+	// Run may destroy the owner.
+	class Item : public MpscNode
+	{
+	public:
+		explicit Item(void (*Run)(Item&)) : Run(Run) {}
+
+		Item(const Item&) = delete;
+		Item& operator=(const Item&) = delete;
+
+	private:
+		friend class Reactor;
+
+		void (*Run)(Item&);
+	};
+
+	explicit Reactor(uint32_t Index = 0);
+	// Runs every event already posted, then stops the thread
+	~Reactor();
+
+	Reactor(const Reactor&) = delete;
+	Reactor& operator=(const Reactor&) = delete;
+
+	// Queues the event from any thread. Never waits for the reactor; wakes
+	// it up only if it's sleeping. Allocates the node of the event.
+	void Post(Event Callback);
+	// Same for an item, without allocating
+	void Post(Item& Work);
+	// Runs the event right away when called from the reactor itself, posts
+	// it otherwise
+	void Dispatch(Event Callback);
+	// The caller is the reactor thread
+	bool IsCurrent() const;
+
+	uint32_t GetIndex() const { return Index; }
+	// Events run so far
+	uint64_t GetProcessed() const;
+
+private:
+	// Item owning a posted event, deleted once it ran
+	struct EventItem : Item
+	{
+		explicit EventItem(Event&& Callback);
+		static void RunAndDelete(Item& Work);
+
+		Event Callback;
+	};
+
+	void Run();
+
+	const uint32_t Index;
+	MpscQueue<Item> Queue;
+
+	std::mutex WakeLock;
+	std::condition_variable WakeSignal;
+	std::atomic<bool> bSleeping;
+	std::atomic<bool> bRunning;
+	std::atomic<uint64_t> Processed;
+
+	std::thread Worker;
+};
+
+// Reactors of a session. Reactor 0 is the core one, owning the control
+// connections and the client; every band belongs to one reactor, picked by
+// its id, which owns its state. A single reactor serves everything; more
+// of them shard the bands.
+class ReactorPool
+{
+public:
+	explicit ReactorPool(uint32_t Count = 1);
+
+	ReactorPool(const ReactorPool&) = delete;
+	ReactorPool& operator=(const ReactorPool&) = delete;
+
+	Reactor& Core() { return *Reactors[0]; }
+	Reactor& ForBand(uint32_t BandId)
+	{
+		return *Reactors[BandId % Reactors.size()];
+	}
+
+	uint32_t GetCount() const
+	{
+		return static_cast<uint32_t>(Reactors.size());
+	}
+
+private:
+	std::vector<std::unique_ptr<Reactor>> Reactors;
+};
@@ -1,114 +1,491 @@
 #include "pch.h"
 #include "RemoteCommunication.h"
+#include "AllocationBudget.h"
 #include "MiBand3.h"
+#include "SessionManager.h"
+#include "Trace.h"
+#include "WinRtAwait.h"
 #include "intrin.h"
 #include <algorithm>
+#include <atomic>
+#include <memory>
 #include <comdef.h>
+#include <Windows.h>
 #include "BlthUtil.h"
 #include <iostream>
+#include <robuffer.h>
+#include <wrl/client.h>
 
 
 using namespace BluetoothUtilities;
 
+namespace
+{
+	// Client reconnection delays, in milliseconds
+	constexpr uint32 BaseReconnectBackoff = 250;
+	constexpr uint32 MaxReconnectBackoff = 30000;
+
+	// Raw bytes of a WinRT buffer, written in place
+	uint8* BufferBytes(IBuffer^ Target)
+	{
+		Microsoft::WRL::ComPtr<IBufferByteAccess> Access;
+		reinterpret_cast<IInspectable*>(Target)->QueryInterface(
+			IID_PPV_ARGS(&Access));
+		byte* Bytes = nullptr;
+		Access->Buffer(&Bytes);
+		return Bytes;
+	}
+}
+
 // Class that handles the remote communication between this HRM module and
-// external servers and connectors. Requires a MiBand3 reference, but no extra
-// methods invoked after initialization. It's automtically created when creating
-// a MiBand3 object.
-RemoteCommunication::RemoteCommunication(MiBand3^ InMiBand) : MiBand(InMiBand)
+// external servers and connectors. Requires a SessionManager reference, but no
+// extra methods invoked after initialization. It's automtically created when
+// creating a SessionManager object, and shared by all of its bands.
+RemoteCommunication::RemoteCommunication(SessionManager^ InManager)
 {
+	Manager = InManager;
+	Core = &Manager->GetReactors().Core();
 	// Create a StreamSocket to establish a connection to the external HRM
 	// server.
 	ClientSocket = ref new StreamSocket();
 	// Initialize variables
-	bClientConnected = false;
+	bClientAttached = false;
 	bServerRunning = false;
-	bWaitingClientConnection = false;
+	bClientWanted = false;
+	ReconnectJitter.seed(static_cast<uint32>(
+		SampleFrames::MonotonicMicroseconds()));
+	Backlog = std::make_unique<MessageBacklog>();
+	// Existing clients expect decimal strings until they ask otherwise
+	OutputMode = SampleFrames::FrameMode::Text;
+	QueueCapacity = 256;
+	CoalescingWindow = 0;
+	bDatagrams = false;
+	DatagramGeneration = 0;
+	FreeDatagrams.reserve(DatagramPoolSize);
+	for (uint32 i = 0; i < DatagramPoolSize; ++i)
+	{
+		FreeDatagrams.push_back(
+			ref new Windows::Storage::Streams::Buffer(MaxDatagramSize));
+	}
+	DroppedDatagrams = 0;
 	// Start server to receive incoming messages
 	StartServer();
 }
 
-// Establishes a connection to the external HRM server. It NEEDS the external
-// server to be already listening on the connection port.
-void RemoteCommunication::StartClient(int tries)
+// Establishes a connection to the external HRM server, and keeps it: a
+// failed attempt or a dropped connection is retried after a backoff until
+// StopClient. The server doesn't need to be listening yet.
+void RemoteCommunication::StartClient()
+{
+	Core->Dispatch([this]() {
+		if (bClientWanted.exchange(true))
+		{
+			return;
+		}
+		ClientStop = std::stop_source();
+		Async::Spawn(SuperviseClient(ClientStop.get_token()));
+		});
+}
+
+bool RemoteCommunication::bClientConnected::get()
+{
+	return bClientAttached.load();
+}
+
+// Client supervision, on the core reactor. Connects, waits for the
+// connection to drop, and connects again after the current backoff, taken
+// at random between half and all of it so clients of a restarted server
+// don't retry in lockstep. The backoff doubles up to its cap on every
+// failure. Ends when StopClient cancels the token.
+Async::Task<void> RemoteCommunication::SuperviseClient(std::stop_token Token)
+{
+	// Hostname of the external HRM server.
+	auto InHostName = ref new Windows::Networking::HostName(RCHostName);
+	uint32 Backoff = BaseReconnectBackoff;
+	while (!Token.stop_requested())
+	{
+		// A socket whose connection failed can't be reused
+		auto Socket = ref new StreamSocket();
+		bool bConnected = false;
+		try
+		{
+			// Attempt to connect to the server through the ClientPort port.
+			co_await Async::Await(*Core, Socket->ConnectAsync(InHostName,
+				ClientPort), Token);
+			bConnected = !Token.stop_requested();
+		}
+		catch (Platform::Exception ^ Ex)
+		{
+			SocketErrorStatus WebErrorStatus =
+				SocketError::GetStatus(Ex->HResult);
+			std::cout << "The client couldn't connect with the server: "
+				<< (WebErrorStatus.ToString() != L"Unknown" ?
+					WebErrorStatus.ToString() : Ex->Message)->Data()
+				<< std::endl;
+		}
+		if (bConnected)
+		{
+			std::wcout << "Client connected" << std::endl;
+			ClientSocket = Socket;
+			ClientDropped.Reset();
+			AttachClient();
+			Backoff = BaseReconnectBackoff;
+			// Until a write fails or StopClient
+			co_await ClientDropped;
+		}
+		else
+		{
+			delete Socket;
+		}
+		if (Token.stop_requested())
+		{
+			break;
+		}
+		const uint32 Half = Backoff / 2;
+		const uint32 Delay = Half + ReconnectJitter() % (Backoff - Half + 1);
+		Backoff = std::min(Backoff * 2, MaxReconnectBackoff);
+		std::cout << "Reconnecting the client in " << Delay << " ms"
+			<< std::endl;
+		co_await Async::Delay(Manager->GetTimers(), *Core, Delay, Token);
+	}
+}
+
+// Subscribes the connected client to every stream, as it always was, after
+// queueing what it missed while disconnected. Both happen under the
+// subscribers lock, so nothing sent meanwhile can overtake the backlog.
+void RemoteCommunication::AttachClient()
+{
+	std::lock_guard<std::mutex> Guard(SubscribersLock);
+	Subscriber Sub;
+	Sub.Socket = ClientSocket;
+	Sub.Queue = ref new OutputQueue(ClientSocket->OutputStream,
+		Manager->GetTimers(), *Core,
+		QueueCapacity + static_cast<uint32>(Backlog->GetCount()),
+		CoalescingWindow, OverflowPolicy::DropNewest);
+	Sub.StreamMask = DataStreams::All;
+	Sub.bClient = true;
+	const size_t Missed = Backlog->GetCount();
+	Backlog->Drain([&Sub](const uint8_t* Data, uint32_t Size) {
+		Sub.Queue->Enqueue(Data, Size);
+		});
+	Subscribers.push_back(Sub);
+	bClientAttached = true;
+	if (Missed > 0 || Backlog->GetDropped() > 0)
+	{
+		std::cout << "Client backfilled with " << Missed << " messages, "
+			<< Backlog->GetDropped() << " lost to the backlog limit so far"
+			<< std::endl;
+	}
+}
+
+// Stops an established connection to an external HRM server, and its
+// reconnection. If there's no active connection it's just ignored.
+void RemoteCommunication::StopClient()
+{
+	Core->Dispatch([this]() {
+		bClientWanted = false;
+		ClientStop.request_stop();
+		{
+			std::lock_guard<std::mutex> Guard(SubscribersLock);
+			Backlog->Clear();
+		}
+		if (bClientAttached.exchange(false))
+		{
+			Unsubscribe(ClientSocket);
+			// Due to C++ magic, this automatically closes the socket
+			delete ClientSocket;
+			ClientSocket = nullptr;
+		}
+		// Ends the supervision if it waits for the connection to drop
+		ClientDropped.Set();
+		});
+}
+
+// Adds a subscriber with its own output queue on the given socket. If the
+// socket is already subscribed only its stream mask changes.
+void RemoteCommunication::Subscribe(StreamSocket^ Socket, uint8 StreamMask,
+	OverflowPolicy Policy)
+{
+	std::lock_guard<std::mutex> Guard(SubscribersLock);
+	for (auto& Sub : Subscribers)
+	{
+		if (Sub.Socket == Socket)
+		{
+			Sub.StreamMask = StreamMask;
+			Sub.Queue->Policy = Policy;
+			return;
+		}
+	}
+	Subscriber Sub;
+	Sub.Socket = Socket;
+	Sub.Queue = ref new OutputQueue(Socket->OutputStream,
+		Manager->GetTimers(), *Core, QueueCapacity, CoalescingWindow, Policy);
+	Sub.StreamMask = StreamMask;
+	Subscribers.push_back(Sub);
+	std::cout << "Subscriber added, " << Subscribers.size() << " in total"
+		<< std::endl;
+}
+
+// Removes the subscriber on the given socket, if any. The socket stays open.
+void RemoteCommunication::Unsubscribe(StreamSocket^ Socket)
+{
+	std::lock_guard<std::mutex> Guard(SubscribersLock);
+	for (auto It = Subscribers.begin(); It != Subscribers.end(); ++It)
+	{
+		if (It->Socket == Socket)
+		{
+			It->Queue->ReportStats();
+			It->Queue->Close();
+			Subscribers.erase(It);
+			return;
+		}
+	}
+}
+
+// Drops the subscribers whose queue was closed by a write error or by the
+// disconnect policy. Their sockets are closed on the core reactor, which
+// also tells the client supervision if the client was one of them.
+void RemoteCommunication::RemoveClosedSubscribers()
 {
-	// When there's no external connection
-	if (!bClientConnected && !bWaitingClientConnection)
+	std::vector<StreamSocket^> Closed;
+	bool bClientClosed = false;
 	{
-		if (!ClientSocket)
+		std::lock_guard<std::mutex> Guard(SubscribersLock);
+		for (auto It = Subscribers.begin(); It != Subscribers.end();)
+		{
+			if (It->Queue->bClosed)
+			{
+				It->Queue->ReportStats();
+				Closed.push_back(It->Socket);
+				// The backlog takes over from the next message on
+				if (It->bClient)
+				{
+					bClientAttached = false;
+					bClientClosed = true;
+				}
+				It = Subscribers.erase(It);
+			}
+			else
+			{
+				++It;
+			}
+		}
+	}
+	if (Closed.empty())
+	{
+		return;
+	}
+	Core->Post([this, Closed, bClientClosed]() {
+		for (auto Socket : Closed)
+		{
+			std::cout << "Slow or broken subscriber disconnected" << std::endl;
+			if (Socket == ClientSocket)
+			{
+				ClientSocket = nullptr;
+			}
+			// Explicitly close the socket.
+			delete Socket;
+		}
+		if (bClientClosed)
 		{
-			ClientSocket = ref new StreamSocket();
+			ClientDropped.Set();
 		}
-		bWaitingClientConnection = true;
+		});
+}
 
-		// Hostname of the external HRM server.
-		auto InHostName = ref new Windows::Networking::HostName(RCHostName);
-		// Attempt to connect to the server through the ClientPort port.
-		concurrency::create_task(ClientSocket->ConnectAsync(InHostName,
-			ClientPort))
-			.then([this, tries](concurrency::task<void> PreviousTask) {
-			try
+// Queues raw bytes for the subscribers of the given stream. Never waits for
+// a subscriber, slow ones drop data or get disconnected as they asked.
+void RemoteCommunication::Send(SampleFrames::FrameType Stream,
+	const uint8* Data, uint32 Size)
+{
+	uint8 Bit = DataStreams::FromFrameType(Stream);
+	bool bAnyClosed = false;
+	{
+		std::lock_guard<std::mutex> Guard(SubscribersLock);
+		// Kept for the client until it's back
+		if (bClientWanted && !bClientAttached)
+		{
+			Backlog->Push(Data, Size);
+		}
+		for (auto& Sub : Subscribers)
+		{
+			if ((Sub.StreamMask & Bit) && !Sub.Queue->Enqueue(Data, Size))
 			{
-				PreviousTask.get();
-				std::wcout << "Client connected" << std::endl;
-				bWaitingClientConnection = false;
-				bClientConnected = true;
+				bAnyClosed = bAnyClosed || Sub.Queue->bClosed;
 			}
-			catch (Platform::Exception ^ Ex)
+		}
+	}
+	if (bAnyClosed)
+	{
+		RemoveClosedSubscribers();
+	}
+}
+
+// Queues a string for the subscribers of the given stream, encoded as UTF-8
+// and optionally followed by a '\0'.
+void RemoteCommunication::Send(SampleFrames::FrameType Stream,
+	Platform::String^ Message, bool pad)
+{
+	std::string Utf8;
+	int Length = WideCharToMultiByte(CP_UTF8, 0, Message->Data(),
+		static_cast<int>(Message->Length()), nullptr, 0, nullptr, nullptr);
+	Utf8.resize(Length);
+	WideCharToMultiByte(CP_UTF8, 0, Message->Data(),
+		static_cast<int>(Message->Length()), &Utf8[0], Length, nullptr,
+		nullptr);
+	if (pad)
+	{
+		Utf8.push_back('\0');
+	}
+	Send(Stream, reinterpret_cast<const uint8*>(Utf8.data()),
+		static_cast<uint32>(Utf8.size()));
+}
+
+void RemoteCommunication::SendDatagram(const uint8* Data, uint32 Size)
+{
+	IOutputStream^ Stream;
+	Windows::Storage::Streams::Buffer^ Datagram;
+	{
+		std::lock_guard<std::mutex> Guard(DatagramLock);
+		if (!DatagramStream || Size > MaxDatagramSize)
+		{
+			return;
+		}
+		if (FreeDatagrams.empty())
+		{
+			// Log the first drop and then every hundred of them
+			if (DroppedDatagrams++ % 100 == 0)
 			{
-				bClientConnected = false;
-				std::cout << "The client couldn't connect with the server"
+				std::cout << "Every datagram buffer in flight, "
+					<< DroppedDatagrams << " datagrams dropped so far"
 					<< std::endl;
-				std::wcout << Ex->ToString()->Begin() << std::endl;
-
-				SocketErrorStatus WebErrorStatus =
-					SocketError::GetStatus(Ex->HResult);
-				std::cout << (WebErrorStatus.ToString()
-					!= L"Unknown" ? WebErrorStatus.ToString() :
-					Ex->Message)->Data() << std::endl;
-
-				// Retry connection, if so indicated
-				if (tries > 0) {
-					std::cout << "Retrying connection" << std::endl;
-					StartClient(tries - 1);
-				}
 			}
+			return;
+		}
+		Stream = DatagramStream;
+		Datagram = FreeDatagrams.back();
+		FreeDatagrams.pop_back();
+	}
+	std::copy_n(Data, Size, BufferBytes(Datagram));
+	Datagram->Length = Size;
+
+	// Every write is one datagram. Nobody awaits its completion, errors
+	// such as an unreachable port only lose that datagram. The operation and
+	// its completion handler are all that allocates.
+	RemoteCommunication^ Self = this;
+	try
+	{
+		HRM_ALLOCATION_STAGE(Socket);
+		auto Write = Stream->WriteAsync(Datagram);
+		Write->Completed = ref new Windows::Foundation::
+			AsyncOperationWithProgressCompletedHandler<unsigned int,
+				unsigned int>([Self, Datagram](
+				Windows::Foundation::IAsyncOperationWithProgress<
+					unsigned int, unsigned int>^,
+				Windows::Foundation::AsyncStatus) {
+					Self->RecycleDatagram(Datagram);
 				});
 	}
+	catch (Platform::Exception^)
+	{
+		RecycleDatagram(Datagram);
+	}
 }
 
-// Stops an established connection to an external HRM server. If there's no
-// active connection it's just ignored.
-void RemoteCommunication::StopClient()
+// Gives the buffer of a finished datagram write back to the pool.
+void RemoteCommunication::RecycleDatagram(
+	Windows::Storage::Streams::Buffer^ Datagram)
+{
+	std::lock_guard<std::mutex> Guard(DatagramLock);
+	FreeDatagrams.push_back(Datagram);
+}
+
+bool RemoteCommunication::bDatagramsEnabled::get()
 {
-	if (bClientConnected)
+	return bDatagrams.load(std::memory_order_relaxed);
+}
+
+// Points the heart rate datagrams at the given host and port, 0 disables
+// them. The previous socket is closed, and a connect still in progress is
+// superseded.
+void RemoteCommunication::SetDatagramTarget(
+	Windows::Networking::HostName^ Host, uint16 Port)
+{
+	uint64 Generation;
 	{
-		bClientConnected = false;
-		// Due to C++ magic, this automatically closes the socket
-		delete ClientSocket;
-		ClientSocket = nullptr;
+		std::lock_guard<std::mutex> Guard(DatagramLock);
+		Generation = ++DatagramGeneration;
+		bDatagrams = false;
+		DatagramStream = nullptr;
+		if (DatagramTarget)
+		{
+			delete DatagramTarget;
+			DatagramTarget = nullptr;
+		}
+	}
+	if (Port == 0)
+	{
+		std::cout << "Datagrams disabled" << std::endl;
+		return;
 	}
+
+	Async::Spawn(ConnectDatagramTarget(ref new DatagramSocket(), Host, Port,
+		Generation));
 }
 
+// Connects the datagram socket and makes it the target once connected,
+// unless the target changed meanwhile.
+Async::Task<void> RemoteCommunication::ConnectDatagramTarget(
+	DatagramSocket^ Socket, Windows::Networking::HostName^ Host, uint16 Port,
+	uint64 Generation)
+{
+	try
+	{
+		co_await Async::Await(*Core,
+			Socket->ConnectAsync(Host, Port.ToString()));
+		std::lock_guard<std::mutex> Guard(DatagramLock);
+		if (Generation == DatagramGeneration)
+		{
+			DatagramTarget = Socket;
+			DatagramStream = Socket->OutputStream;
+			bDatagrams = true;
+			std::cout << "Sending datagrams to port " << Port << std::endl;
+			co_return;
+		}
+	}
+	catch (Platform::Exception^ Ex)
+	{
+		std::cout << "Datagram target failed: " << Ex->Message->Data()
+			<< std::endl;
+	}
+	delete Socket;
+}
 
 // Starts a server to receive connections from an external connector. It's
 // called automatically on this object's creation.
 void RemoteCommunication::StartServer(int tries)
 {
-	// Create new listener for a socket
-	ServerSocket = ref new StreamSocketListener();
-	// Bind the receiving of a message to the OnConnection function
-	ServerSocket->ConnectionReceived += ref new Windows::Foundation::
-		TypedEventHandler<StreamSocketListener^,
-		StreamSocketListenerConnectionReceivedEventArgs^>
-		(this, &RemoteCommunication::OnConnection);
-	// Create asyncronous task to establish the server on the given port
-	concurrency::create_task(ServerSocket->BindServiceNameAsync(ServerPort))
-		.then([this, tries](concurrency::task<void> PreviousTask) {
+	Async::Spawn(RunServer(tries));
+}
+
+// Binds the server port, retrying up to the given number of times.
+Async::Task<void> RemoteCommunication::RunServer(int Tries)
+{
+	while (true)
+	{
+		// Create new listener for a socket
+		ServerSocket = ref new StreamSocketListener();
+		// Bind the receiving of a message to the OnConnection function
+		ServerSocket->ConnectionReceived += ref new Windows::Foundation::
+			TypedEventHandler<StreamSocketListener^,
+			StreamSocketListenerConnectionReceivedEventArgs^>
+			(this, &RemoteCommunication::OnConnection);
 		try
 		{
-			// Try getting an exception.
-			PreviousTask.get();
+			co_await Async::Await(*Core,
+				ServerSocket->BindServiceNameAsync(ServerPort));
 			std::cout << "Server started" << std::endl;
+			co_return;
 		}
 		catch (Platform::Exception ^ Ex)
 		{
@@ -118,264 +495,319 @@ void RemoteCommunication::StartServer(int tries)
 				SocketError::GetStatus(Ex->HResult);
 			std::cout << (WebErrorStatus.ToString() != L"Unknown" ?
 				WebErrorStatus.ToString() : Ex->Message)->Data() << std::endl;
-
-			// Retry server startup, if so indicated
-			if (tries > 0) {
-				std::cout << "Retrying server startup" << std::endl;
-				StartServer(tries - 1);
-			}
 		}
-			});
+		// Retry server startup, if so indicated
+		if (Tries-- <= 0)
+		{
+			co_return;
+		}
+		std::cout << "Retrying server startup" << std::endl;
+	}
 }
 
 // Handles a new connection to the mounted server.
 void RemoteCommunication::OnConnection(StreamSocketListener^ Listener,
 	StreamSocketListenerConnectionReceivedEventArgs^ Args)
 {
-	// Create and initialize a DataReader
-	auto Reader = ref new DataReader(Args->Socket->InputStream);
-	Reader->UnicodeEncoding = UnicodeEncoding::Utf8;
-	Reader->ByteOrder = ByteOrder::LittleEndian;
+	// Create and initialize the state of the connection
+	auto Connection = std::make_shared<ControlConnection>();
+	Connection->Socket = Args->Socket;
+	Connection->Reader = ref new DataReader(Args->Socket->InputStream);
+	// Return as soon as any data arrives instead of waiting for a full chunk
+	Connection->Reader->InputStreamOptions = InputStreamOptions::Partial;
+	Connection->Buffer.resize(ControlChunkSize);
+	Connection->NextBand = -1;
 
 	// Start a receive loop, reading all messages arriving to the DataReader.
-	ReceiveStringLoop(Reader, Args->Socket);
+	Async::Spawn(ReceiveLoop(Connection));
 }
 
-// Server message handling loop. A properly formatted message indicates its ID
-// on the first byte and on the remaining ones gives the payload in accordance
-// to its ID.
-void RemoteCommunication::ReceiveStringLoop(DataReader^ Reader,
-	StreamSocket^ Socket)
+// Server message handling loop, on the core reactor. Reads whatever arrived,
+// up to a chunk, into the reusable buffer of the connection and lets the
+// parser run every instruction completed by it. Partial instructions are
+// kept by the parser until the next chunk. The connection is closed when
+// the stream ends, fails or breaks the protocol.
+Async::Task<void> RemoteCommunication::ReceiveLoop(
+	std::shared_ptr<ControlConnection> Connection)
 {
-	// Read the first byte to retrieve the instruction ID
-	concurrency::create_task(Reader->LoadAsync(sizeof(byte))).then(
-		[this, Reader, Socket](unsigned int Size) {
-			// If the size loaded was smaller than the size of a byte the socket
-			// was closed before reading the whole data.
-			if (Size < sizeof(byte))
+	co_await Async::ResumeOn(*Core);
+	try
+	{
+		while (true)
+		{
+			const unsigned int Size = co_await Async::Await<unsigned int>(
+				*Core, Connection->Reader->LoadAsync(ControlChunkSize));
+			// Nothing loaded means the socket was closed
+			if (Size == 0)
 			{
-				concurrency::cancel_current_task();
+				break;
 			}
 
-			// Save the instruction ID
-			byte Id = Reader->ReadByte();
-
-			std::wcout << "Received instruction, ID = " << Id << std::endl;
+			Connection->Reader->ReadBytes(Platform::ArrayReference<uint8>(
+				Connection->Buffer.data(), Size));
 
-			// ID = 0 is an instruction to start (true) or stop (false) the
-			// client. 
-			if (Id == 0)
-			{
-				return concurrency::create_task(Reader->LoadAsync(sizeof(bool)))
-					.then([this, Reader](unsigned int Size) {
-					// If the size loaded was smaller than the size of a bool
-					// the socket was closed before reading the whole data.
-					if (Size < sizeof(bool))
-					{
-						concurrency::cancel_current_task();
-					}
-					// Read the instruction
-					bool bStart = Reader->ReadBoolean();
-					// Start or stop the client
-					if (bStart)
-					{
-						StartClient();
-					}
-					else
-					{
-						StopClient();
-					}
-						});
-			}
-			// ID = 1 is an instruction to scan for peripherals for the given
-			// amount of seconds and send the addresses of the ones found.
-			if (Id == 1)
-			{
-				// Start the scanner with the current MiBand3 for the seconds 
-				// given
-				return concurrency::create_task(Reader->
-					LoadAsync(sizeof(uint16)))
-					.then([this, Reader](unsigned int Size) {
-					// If the size loaded was smaller than the size of a
-					// uint16 the socket was closed before reading the whole
-					// data.
-					if (Size < sizeof(uint16))
-					{
-						concurrency::cancel_current_task();
-					}
-
-					// Read the messsage
-					uint16 seconds = Reader->ReadUInt16();
-					// Scan the given seconds
-					scan(MiBand, seconds);
-						});
-			}
-			// ID = 2 is an instruction to connect to a MiBand3 in the given
-			// address.
-			else if (Id == 2)
+			bool bValid = Connection->Parser.Feed(Connection->Buffer.data(),
+				Size, [this, &Connection](
+					const ControlInstruction& Instruction) {
+					HandleInstruction(*Connection, Instruction);
+				});
+			// The stream can't be resynchronized after a protocol error
+			if (!bValid)
 			{
-				return concurrency::create_task(
-					Reader->LoadAsync(sizeof(uint32)))
-					.then([this, Reader](unsigned int Size) {
-					// If the size loaded was smaller than the size of a uint32
-					// the socket was closed before reading the whole size data.
-					if (Size < sizeof(uint32))
-					{
-						concurrency::cancel_current_task();
-					}
-
-					// Read the size (in bytes) of the address
-					uint32 MessageSize = Reader->ReadUInt32();
-
-					return concurrency::create_task(
-						Reader->LoadAsync(MessageSize))
-						.then([this, Reader, MessageSize](unsigned int Size) {
-						// If the size loaded was smaller than the size
-						// indicated the socket was closed before reading the
-						// whole message data.
-						if (Size < MessageSize)
-						{
-							concurrency::cancel_current_task();
-						}
-
-						// Allocate space, read the address and format it
-						Platform::Array<uint8>^ Message =
-							ref new Platform::Array<uint8>(Size);
-						Reader->ReadBytes(Message);
-						auto Address = FormatBluetoothAddressInverse(Message);
-
-						// Connect to the given address
-						MiBand->Connect(Address);
-							});
-						});
+				std::cout << "Malformed instruction, closing connection"
+					<< std::endl;
+				break;
 			}
-			// All the following IDs require a MiBand3 connected and
-			// authenticated.
-			else if (MiBand->bAuthenticated)
-			{
-				// ID = 3 is an instruction to write a message to the connected
-				// MiBand3.
-				if (Id == 3)
-				{
-					return concurrency::create_task(
-						Reader->LoadAsync(sizeof(uint32)))
-						.then([this, Reader](unsigned int Size) {
-						// If the size loaded was smaller than the size of a
-						// uint32 the socket was closed before reading the whole
-						// size data.
-						if (Size < sizeof(uint32))
-						{
-							concurrency::cancel_current_task();
-						}
-
-						uint32 MessageSize = Reader->ReadUInt32();
-
-						return concurrency::create_task(
-							Reader->LoadAsync(MessageSize))
-							.then([this, Reader, MessageSize](unsigned int Size)
-								{
-									// If the size loaded was smaller than the
-									// size indicated the socket was closed
-									// before reading the whole message data.
-									if (Size < MessageSize)
-									{
-										concurrency::cancel_current_task();
-									}
-
-									// Allocate space and read the message
-									Platform::Array<uint8>^ Message =
-										ref new Platform::Array<uint8>(Size);
-									Reader->ReadBytes(Message);
-
-									// Write message to the MiBand3
-									MiBand->WriteMessage(Message->Data, Size);
-								});
-							});
-				}
-				// ID = 4 is an instruction to start (true) or stop (false) the
-				// Heart Rate Monitoring.
-				else if (Id == 4)
-				{
-					return concurrency::create_task(
-						Reader->LoadAsync(sizeof(bool)))
-						.then([this, Reader](unsigned int Size) {
-						// If the size loaded was smaller than the size of a
-						// bool the socket was closed before reading the whole
-						// data.
-						if (Size < sizeof(bool))
-						{
-							concurrency::cancel_current_task();
-						}
-
-						// Read the instruction
-						bool bStart = Reader->ReadBoolean();
-						// Start or stop the HRM service
-						if (bStart)
-						{
-							MiBand->HeartRateStart();
-						}
-						else
-						{
-							MiBand->HeartRateStop();
-						}
-							});
-				}
-				// ID = 5 is an instruction to vibrate the MiBand3 for the given
-				// amoumt of milliseconds.
-				else if (Id == 5)
-				{
-					return concurrency::create_task(Reader->
-						LoadAsync(sizeof(uint16)))
-						.then([this, Reader](unsigned int Size) {
-						// If the size loaded was smaller than the size of a
-						// uint16 the socket was closed before reading the whole
-						// data.
-						if (Size < sizeof(uint16))
-						{
-							concurrency::cancel_current_task();
-						}
-
-						// Read the messsage
-						uint16 milliseconds = Reader->ReadUInt16();
-						// Vibrate the MiBand3
-						MiBand->Vibrate(milliseconds);
-							});
-				}
+		}
+	}
+	catch (Platform::Exception ^ Ex)
+	{
+		std::cout << "Read stream failed with error: "
+			<< Ex->Message->Data() << std::endl;
+	}
+	Unsubscribe(Connection->Socket);
+	// Explicitly close the socket.
+	delete Connection->Socket;
+}
 
-				// ID = 6 is an instruction to vibrate the MiBand3 for the
-				// standard amoumt of milliseconds. It isn't followed by any
-				// payload.
-				else if (Id == 6)
-				{
-					// Vibrate the MiBand3
-					MiBand->Vibrate();
-				}
-			}
-			return concurrency::create_task([] {});
-		})
-		// Restart the loop to receive messages.
-			.then([this, Reader, Socket](concurrency::task<void> PreviousTask) {
-			try
-			{
-				PreviousTask.get();
+// Executes a complete instruction received on the given connection. The
+// parser already checked that its arguments have the right size.
+void RemoteCommunication::HandleInstruction(ControlConnection& Connection,
+	const ControlInstruction& Instruction)
+{
+	HRM_TRACE_SCOPE("ControlInstruction");
+	const uint8* Args = Instruction.Args;
+	const byte Id = Instruction.Id;
 
-				// Recursive invocation
-				ReceiveStringLoop(Reader, Socket);
-			}
-			catch (Platform::Exception ^ Ex)
-			{
-				std::cout << "Read stream failed with error: "
-					<< Ex->Message->Data() << std::endl;
-				// Explicitly close the socket.
-				delete Socket;
-			}
-			catch (concurrency::task_canceled&)
-			{
-				// Do not print anything here - this will usually happen because
-				// user closed the client socket.
+	std::wcout << "Received instruction, ID = " << Id << std::endl;
 
-				// Explicitly close the socket.
-				delete Socket;
-			}
-				});
+	// Band the instruction applies to, the one addressed by the previous
+	// instruction or band 0. An id out of range is ignored on the band
+	// reactor, where the band is looked up.
+	uint8 BandId = Connection.NextBand >= 0 ?
+		static_cast<uint8>(Connection.NextBand) : 0;
+	Connection.NextBand = -1;
+
+	if (auto Recorder = Manager->GetRecorder())
+	{
+		Recorder->Append(SessionLog::RecordType::Command, BandId, Id, 0,
+			Args, Instruction.ArgsSize);
+	}
+
+	switch (Id)
+	{
+	// ID = 0 is an instruction to start (true) or stop (false) the client.
+	case 0:
+		if (Args[0])
+		{
+			StartClient();
+		}
+		else
+		{
+			StopClient();
+		}
+		return;
+	// ID = 7 is an instruction to select the framing of the data sent to the
+	// client. Unknown modes fall back to the legacy text framing.
+	case 7:
+		OutputMode = Args[0] == static_cast<uint8>(
+			SampleFrames::FrameMode::Binary) ?
+			SampleFrames::FrameMode::Binary :
+			SampleFrames::FrameMode::Text;
+		return;
+	// ID = 8 is an instruction to set the coalescing window of the output
+	// queues, in milliseconds.
+	case 8:
+	{
+		CoalescingWindow = ControlParser::ReadLE16(Args);
+		std::lock_guard<std::mutex> Guard(SubscribersLock);
+		for (auto& Sub : Subscribers)
+		{
+			Sub.Queue->CoalescingWindow = CoalescingWindow;
+		}
+		return;
+	}
+	// ID = 9 addresses the next instruction to the band with the given id.
+	case 9:
+		Connection.NextBand = Args[0];
+		return;
+	// ID = 10 is an instruction to subscribe this connection to the given
+	// data streams.
+	case 10:
+		if (Args[0] == 0)
+		{
+			Unsubscribe(Connection.Socket);
+		}
+		else
+		{
+			Subscribe(Connection.Socket, Args[0], Args[1] == static_cast<
+				uint8>(OverflowPolicy::Disconnect) ?
+				OverflowPolicy::Disconnect : OverflowPolicy::DropOldest);
+		}
+		return;
+	// ID = 11 is an instruction to write the trace spans recorded so far to
+	// a new file in the working directory.
+	case 11:
+	{
+		static std::atomic<uint32> TraceDumps(0);
+		std::string Path = "hrm-trace-" + std::to_string(TraceDumps++) +
+			".json";
+		if (Tracing::WriteChromeTrace(Path))
+		{
+			std::cout << "Trace written to " << Path << std::endl;
+		}
+		else
+		{
+			std::cout << "Tracing not built in (HRM_ENABLE_TRACING)"
+				<< std::endl;
+		}
+		return;
+	}
+	// ID = 14 is an instruction to send heart rate datagrams to the given
+	// port of the host of this connection, or to stop them with port 0.
+	case 14:
+		SetDatagramTarget(Connection.Socket->Information->RemoteAddress,
+			ControlParser::ReadLE16(Args));
+		return;
+	}
+
+	// Everything else applies to a band, and runs on the reactor owning it.
+	// Arguments only outlive this call as a copy.
+	Reactor& BandReactor = Manager->GetReactors().ForBand(BandId);
+	if (BandReactor.IsCurrent())
+	{
+		// A failed instruction mustn't close the connection it came on
+		try
+		{
+			HandleBandInstruction(BandId, Id, Args, Instruction.ArgsSize);
+		}
+		catch (Platform::Exception^ Ex)
+		{
+			std::cout << "Instruction " << static_cast<int>(Id)
+				<< " failed: " << Ex->Message->Data() << std::endl;
+		}
+		return;
+	}
+	std::vector<uint8> Arguments(Args, Args + Instruction.ArgsSize);
+	BandReactor.Post([this, BandId, Id, Arguments]() {
+		try
+		{
+			HandleBandInstruction(BandId, Id, Arguments.data(),
+				static_cast<uint32>(Arguments.size()));
+		}
+		catch (Platform::Exception^ Ex)
+		{
+			std::cout << "Instruction " << static_cast<int>(Id)
+				<< " failed: " << Ex->Message->Data() << std::endl;
+		}
+		});
+}
+
+// Executes an instruction addressed to a band, on the reactor of that band.
+void RemoteCommunication::HandleBandInstruction(uint8 BandId, uint8 Id,
+	const uint8* Args, uint32 ArgsSize)
+{
+	switch (Id)
+	{
+	// ID = 1 is an instruction to scan for peripherals for the given amount
+	// of seconds and send the addresses of the ones found. The scan runs in
+	// the background.
+	case 1:
+	{
+		auto Band = Manager->GetBand(BandId);
+		if (Band)
+		{
+			Band->Scan(ControlParser::ReadLE16(Args));
+		}
+		return;
+	}
+	// ID = 2 is an instruction to connect to a MiBand3 in the given address.
+	case 2:
+	{
+		auto Band = Manager->GetBand(BandId);
+		if (Band)
+		{
+			// Copy and format the address
+			auto Message = ref new Platform::Array<uint8>(
+				const_cast<uint8*>(Args), ArgsSize);
+			Band->Connect(FormatBluetoothAddressInverse(Message));
+		}
+		return;
+	}
+	// ID = 12 is an instruction to send the rolling aggregates of the band.
+	// They are kept whether the band is authenticated or replayed.
+	case 12:
+	{
+		auto Band = Manager->FindBand(BandId);
+		if (Band)
+		{
+			Band->SendAggregates();
+		}
+		return;
+	}
+	// ID = 13 is an instruction to set the window lengths and heart rate
+	// zones of the rolling aggregates of the band.
+	case 13:
+	{
+		auto Band = Manager->FindBand(BandId);
+		if (!Band || ArgsSize < 1)
+		{
+			return;
+		}
+		const uint32 Windows = Args[0];
+		if (ArgsSize < 1 + Windows * sizeof(uint16))
+		{
+			return;
+		}
+		std::vector<uint32> WindowSeconds;
+		for (uint32 i = 0; i < Windows; ++i)
+		{
+			WindowSeconds.push_back(ControlParser::ReadLE16(Args + 1 + i * 2));
+		}
+		std::vector<uint8> ZoneBounds(Args + 1 + Windows * 2,
+			Args + ArgsSize);
+		if (!Band->ConfigureAggregates(WindowSeconds, ZoneBounds))
+		{
+			std::cout << "Invalid aggregates configuration" << std::endl;
+		}
+		return;
+	}
+	}
+
+	// All the following IDs require a MiBand3 connected and authenticated.
+	auto Band = Manager->FindBand(BandId);
+	if (!Band || !Band->bAuthenticated)
+	{
+		return;
+	}
+
+	switch (Id)
+	{
+	// ID = 3 is an instruction to write a message to the connected MiBand3.
+	case 3:
+		Band->WriteMessage(Args, ArgsSize);
+		return;
+	// ID = 4 is an instruction to start (true) or stop (false) the Heart Rate
+	// Monitoring.
+	case 4:
+		if (Args[0])
+		{
+			Band->HeartRateStart();
+		}
+		else
+		{
+			Band->HeartRateStop();
+		}
+		return;
+	// ID = 5 is an instruction to vibrate the MiBand3 for the given amount of
+	// milliseconds.
+	case 5:
+		Band->Vibrate(ControlParser::ReadLE16(Args));
+		return;
+	// ID = 6 is an instruction to vibrate the MiBand3 for the standard amount
+	// of milliseconds. It isn't followed by any payload.
+	case 6:
+		Band->Vibrate();
+		return;
+	}
 }
@@ -5,14 +5,24 @@
 #include <iomanip>
 #include <sstream>
 #include <string>
-#include <agents.h>
-#include <ppltasks.h>
-#include <pplawait.h>
-#include <ppl.h>
 #include <collection.h>
 #include <Windows.Devices.Bluetooth.h>
 #include <Windows.Devices.Enumeration.h>
 #include <Windows.Networking.Sockets.h>
+#include "SampleFrame.h"
+#include "OutputQueue.h"
+#include "ControlParser.h"
+#include "HeartRateStream.h"
+#include "MessageBacklog.h"
+#include "Awaitables.h"
+#include "Reactor.h"
+#include "Task.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stop_token>
+#include <vector>
 
 using namespace Windows::Devices::Bluetooth;
 using namespace Windows::Devices::Enumeration;
@@ -20,31 +30,165 @@ using namespace Windows::Networking::Sockets;
 using namespace Windows::Storage::Streams;
 
 ref class MiBand3;
+ref class SessionManager;
 
+// Data streams a connection can subscribe to, as bits of a mask
+namespace DataStreams
+{
+	constexpr uint8 HeartRate = 1 << 0;
+	constexpr uint8 Status = 1 << 1;
+	constexpr uint8 ScanResult = 1 << 2;
+	constexpr uint8 Aggregates = 1 << 3;
+	constexpr uint8 All = 0xff;
+
+	// Bit of the stream a frame type belongs to
+	inline uint8 FromFrameType(SampleFrames::FrameType Type)
+	{
+		if (Type == SampleFrames::FrameType::ScanBatch)
+		{
+			return ScanResult;
+		}
+		if (Type == SampleFrames::FrameType::Aggregates)
+		{
+			return Aggregates;
+		}
+		if (Type == SampleFrames::FrameType::Hrv)
+		{
+			return HeartRate;
+		}
+		return static_cast<uint8>(1 << (static_cast<uint8>(Type) - 1));
+	}
+}
+
+// Heart rate datagrams being written at most, each in a buffer allocated
+// once
+constexpr uint32 DatagramPoolSize = 8;
+
+// Bytes requested from a control connection on every read
+constexpr uint32 ControlChunkSize = 4096;
+
+// State of a control connection, kept between reads
+struct ControlConnection
+{
+	StreamSocket^ Socket;
+	DataReader^ Reader;
+	// Reusable receive buffer of ControlChunkSize bytes
+	std::vector<uint8> Buffer;
+	ControlParser Parser;
+	// Band addressed by a band instruction (ID 9) for the next instruction,
+	// -1 if none
+	int NextBand;
+};
+
+// Connection receiving data streams, with its own bounded output queue so a
+// stalled subscriber never delays the others
+struct Subscriber
+{
+	StreamSocket^ Socket;
+	OutputQueue^ Queue;
+	uint8 StreamMask;
+	// The external HRM server connected by StartClient
+	bool bClient = false;
+};
+
+// Control connections and client supervision run on the core reactor of the
+// session, which owns their state; socket completions and timers only post
+// events to it. Instructions addressed to a band are handed to the reactor
+// of that band. Send and SendDatagram may be called from any thread.
 ref class RemoteCommunication sealed
 {
 public:
-	RemoteCommunication(MiBand3^ InMiBand);
+	RemoteCommunication(SessionManager^ InManager);
 
-	void StartClient(int tries = 5);
+	// Connects to the external server and keeps reconnecting, with capped
+	// and jittered exponential backoff, until StopClient
+	void StartClient();
 	void StopClient();
 	void StartServer(int tries = 5);
 
+	// Queues data of the given stream for every subscriber of that stream,
+	// the client included
+	void Send(SampleFrames::FrameType Stream, const uint8* Data, uint32 Size);
+	void Send(SampleFrames::FrameType Stream, Platform::String^ Message,
+		bool pad = false);
+	// Sends one datagram of up to MaxDatagramSize bytes to the UDP target, if
+	// any. Never waits: a datagram that can't go out right away, because
+	// every buffer of the pool is still being written, is lost, as late ones
+	// would be stale.
+	void SendDatagram(const uint8* Data, uint32 Size);
+
 	property Windows::Networking::Sockets::StreamSocket^ ClientSocket;
 	property Windows::Networking::Sockets::StreamSocketListener^ ServerSocket;
 
-	property bool bClientConnected;
+	// The client is subscribed, read from any thread
+	property bool bClientConnected { bool get(); }
 	property bool bServerRunning;
+	// A UDP target was set with the datagram instruction (ID 14)
+	property bool bDatagramsEnabled { bool get(); }
 
-private:
-	MiBand3^ MiBand;
+	property SessionManager^ Manager;
+
+	// Framing used for everything written to the subscribers
+	property SampleFrames::FrameMode OutputMode;
 
+	// Settings of the subscriber output queues, applied on the next
+	// subscription except for the window, which applies right away
+	property uint32 QueueCapacity;
+	property uint32 CoalescingWindow;
+
+private:
 	Platform::String^ RCHostName = L"localhost";
 	Platform::String^ ClientPort = L"1242";
 	Platform::String^ ServerPort = L"1243";
 
-	bool bWaitingClientConnection;
+	// Reactor owning the connections, the client and the state below
+	Reactor* Core;
+
+	// Client supervision: wanted between StartClient and StopClient, and
+	// reconnected whenever it drops in between. What the client would have
+	// been sent meanwhile is kept in the backlog (guarded by
+	// SubscribersLock) and delivered first on reconnect.
+	std::atomic<bool> bClientWanted;
+	std::stop_source ClientStop;
+	// Set when the client connection drops or is stopped
+	Async::Event ClientDropped;
+	std::minstd_rand ReconnectJitter;
+	std::unique_ptr<MessageBacklog> Backlog;
+	// Set with the client subscriber, under SubscribersLock
+	std::atomic<bool> bClientAttached;
+
+	Async::Task<void> SuperviseClient(std::stop_token Token);
+	void AttachClient();
+
+	// Every connection receiving data, the client included while connected
+	std::mutex SubscribersLock;
+	std::vector<Subscriber> Subscribers;
+
+	// Target of the heart rate datagrams, null if disabled. Replaced by the
+	// control connections, read by the delivery stage.
+	std::mutex DatagramLock;
+	DatagramSocket^ DatagramTarget;
+	IOutputStream^ DatagramStream;
+	std::atomic<bool> bDatagrams;
+	// Bumped by every change of target, a connect finishing after a newer
+	// change is dropped
+	uint64 DatagramGeneration;
+	// Buffers of the pool not being written, each write gives its own back
+	// once complete
+	std::vector<Windows::Storage::Streams::Buffer^> FreeDatagrams;
+	uint64 DroppedDatagrams;
+
+	void SetDatagramTarget(Windows::Networking::HostName^ Host, uint16 Port);
+	Async::Task<void> ConnectDatagramTarget(DatagramSocket^ Socket,
+		Windows::Networking::HostName^ Host, uint16 Port, uint64 Generation);
+	void RecycleDatagram(Windows::Storage::Streams::Buffer^ Datagram);
+
+	void Subscribe(StreamSocket^ Socket, uint8 StreamMask,
+		OverflowPolicy Policy);
+	void Unsubscribe(StreamSocket^ Socket);
+	void RemoveClosedSubscribers();
 
+	Async::Task<void> RunServer(int Tries);
 	void OnConnection(StreamSocketListener^ Listener, 
 		StreamSocketListenerConnectionReceivedEventArgs^ Args);
 
@@ -53,21 +197,88 @@ private:
 	 * byte Id: instruction to execute
 	 * T Args: instruction dependant arguments
 	 ***
-	 * Vibrate x seconds
+	 * Start / stop client. A started client is reconnected until stopped,
+	 * and gets what it missed while disconnected, in order, from a bounded
+	 * backlog (oldest dropped first; binary frames show the gap in their
+	 * sequence)
 	 * 0
+	 * bool 1 start / 0 stop
+	 ***
+	 * Scan x seconds, without blocking. Scanning again restarts the
+	 * countdown, 0 stops the scan
+	 * 1
 	 * uint16 x
 	 ***
+	 * Connect to MiBand3
+	 * 2
+	 * uint32 address size
+	 * address
+	 ***
 	 * Custom message
-	 * 1
+	 * 3
 	 * uint32 message size
 	 * message
 	 ***
 	 * Heart Rate
-	 * 2
-	 * 0 off / 1 on
+	 * 4
+	 * bool 1 on / 0 off
+	 ***
+	 * Vibrate x milliseconds
+	 * 5
+	 * uint16 x
 	 ***
 	 * Default vibration
-	 * 3
+	 * 6
+	 ***
+	 * Output mode
+	 * 7
+	 * uint8 0 text (default) / 1 binary frames, see SampleFrame.h
+	 ***
+	 * Output coalescing window x milliseconds
+	 * 8
+	 * uint16 x
+	 ***
+	 * Band addressed instruction
+	 * 9
+	 * uint8 band id, the following instruction applies to this band
+	 * instruction
+	 ***
+	 * Subscribe this connection to data streams
+	 * 10
+	 * uint8 stream mask, see DataStreams, 0 unsubscribes
+	 * uint8 slow consumer policy, 1 drop oldest / 2 disconnect
+	 ***
+	 * Write the trace spans to hrm-trace-<n>.json, see Trace.h
+	 * 11
+	 ***
+	 * Send a snapshot of the rolling heart rate aggregates of the band, as
+	 * one binary aggregates frame whatever the output mode, see
+	 * SampleFrame.h
+	 * 12
+	 ***
+	 * Configure the rolling aggregates of the band, clearing them
+	 * 13
+	 * uint32 size
+	 * uint8 window count n, 1 to 8
+	 * uint16 window length in seconds, n times
+	 * uint8 lowest heart rate of zones 1 and up, ascending, up to 7
+	 ***
+	 * Send heart rate datagrams to port x of the address of this
+	 * connection, 0 stops them. Every datagram holds the binary heart rate
+	 * frames of up to MaxDatagramFrames samples of one band, whatever the
+	 * output mode, with their band, sequence and timestamp so gaps show.
+	 * 14
+	 * uint16 x
+	 ***
+	 * Instructions 1 to 6 not preceded by 9 apply to band 0, so single band
+	 * clients keep working unchanged. Integers are little-endian.
 	 */
-	void ReceiveStringLoop(DataReader^ Reader, StreamSocket^ Socket);
+	Async::Task<void> ReceiveLoop(
+		std::shared_ptr<ControlConnection> Connection);
+	// Runs on the core reactor
+	void HandleInstruction(ControlConnection& Connection,
+		const ControlInstruction& Instruction);
+	// Instructions 1 to 6, 12 and 13, on the reactor of the band
+	void HandleBandInstruction(uint8 BandId, uint8 Id, const uint8* Args,
+		uint32 ArgsSize);
 };
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Double-ended FIFO on a circular buffer, for the sliding windows of the
+// sample path. It doubles its capacity when full and never shrinks, so once
+// a window reached its usual size pushing and popping never allocate, unlike
+// a std::deque, which allocates and frees a block every few elements. Not
+// thread safe.
+template <typename T>
+class RingQueue
+{
+public:
+	explicit RingQueue(size_t InitialCapacity = 16) : Head(0), Count(0)
+	{
+		Items.resize(1);
+		Reserve(InitialCapacity);
+	}
+
+	bool IsEmpty() const { return Count == 0; }
+	size_t Size() const { return Count; }
+
+	// Index 0 is the front
+	T& operator[](size_t Index)
+	{
+		return Items[(Head + Index) & (Items.size() - 1)];
+	}
+	const T& operator[](size_t Index) const
+	{
+		return Items[(Head + Index) & (Items.size() - 1)];
+	}
+
+	T& Front() { return (*this)[0]; }
+	const T& Front() const { return (*this)[0]; }
+	T& Back() { return (*this)[Count - 1]; }
+	const T& Back() const { return (*this)[Count - 1]; }
+
+	void PushBack(const T& Item)
+	{
+		if (Count == Items.size())
+		{
+			Grow();
+		}
+		(*this)[Count++] = Item;
+	}
+
+	void PopFront()
+	{
+		Head = (Head + 1) & (Items.size() - 1);
+		--Count;
+	}
+
+	void PopBack()
+	{
+		--Count;
+	}
+
+	void Clear()
+	{
+		Head = 0;
+		Count = 0;
+	}
+
+	// Makes room for the given number of items up front
+	void Reserve(size_t Capacity)
+	{
+		size_t Size = Items.size();
+		while (Size < Capacity)
+		{
+			Size *= 2;
+		}
+		if (Size != Items.size())
+		{
+			Resize(Size);
+		}
+	}
+
+private:
+	void Grow()
+	{
+		Resize(Items.size() * 2);
+	}
+
+	void Resize(size_t Size)
+	{
+		std::vector<T> Larger(Size);
+		for (size_t i = 0; i < Count; ++i)
+		{
+			Larger[i] = std::move((*this)[i]);
+		}
+		Items.swap(Larger);
+		Head = 0;
+	}
+
+	// Power of two sized
+	std::vector<T> Items;
+	size_t Head;
+	size_t Count;
+};
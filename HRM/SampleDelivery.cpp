@@ -0,0 +1,49 @@
+#include "pch.h"
+#include "SampleDelivery.h"
+#include "MiBand3.h"
+#include "Trace.h"
+
+// Starts the consumer thread. It lives as long as the process.
+SampleDelivery::SampleDelivery()
+{
+	bWakePending = false;
+	SampleDelivery^ Self = this;
+	std::thread([Self] { Self->Run(); }).detach();
+}
+
+void SampleDelivery::Register(MiBand3^ Band)
+{
+	std::lock_guard<std::mutex> Guard(SourcesLock);
+	Sources.push_back(Band);
+}
+
+void SampleDelivery::Wake()
+{
+	// Only the first wake-up since the last drain needs to signal
+	if (!bWakePending.exchange(true, std::memory_order_acq_rel))
+	{
+		std::lock_guard<std::mutex> Guard(WakeLock);
+		WakeSignal.notify_one();
+	}
+}
+
+// Consumer loop, drains every registered band each time it's woken up.
+void SampleDelivery::Run()
+{
+	HRM_TRACE_THREAD_NAME("SampleDelivery");
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> Guard(WakeLock);
+			WakeSignal.wait_for(Guard, std::chrono::milliseconds(100),
+				[this] { return bWakePending.load(); });
+		}
+		bWakePending.store(false, std::memory_order_release);
+
+		std::lock_guard<std::mutex> Guard(SourcesLock);
+		for (auto Band : Sources)
+		{
+			Band->DrainSamples();
+		}
+	}
+}
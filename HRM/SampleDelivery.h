@@ -0,0 +1,37 @@
+#pragma once
+
+#include "pch.h"
+#include "HeartRateStream.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+ref class MiBand3;
+
+// Consumer stage of the heart rate pipeline. The GATT callbacks only publish
+// samples into the ring of their band and wake this stage up; formatting and
+// socket output happen on its own thread, so a slow client never delays the
+// BLE notifications.
+ref class SampleDelivery sealed
+{
+public:
+	SampleDelivery();
+
+	// Adds a band whose samples are drained by this stage
+	void Register(MiBand3^ Band);
+	// Wakes the consumer up. Doesn't allocate and never waits for the
+	// consumer to run.
+	void Wake();
+
+private:
+	void Run();
+
+	std::mutex WakeLock;
+	std::condition_variable WakeSignal;
+	std::atomic<bool> bWakePending;
+
+	std::mutex SourcesLock;
+	std::vector<MiBand3^> Sources;
+};
@@ -0,0 +1,292 @@
+#pragma once
+
+#include "pch.h"
+#include "HeartRateAggregator.h"
+#include "HeartRateMeasurement.h"
+#include "HrvTracker.h"
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+// Binary framing used on the data socket once a client negotiates it with the
+// output mode instruction. Every frame is a fixed 16 byte little-endian header
+// followed by the raw decoded fields of its type, so a consumer can decode it
+// with a single fixed-size read and no parsing.
+//
+// Header layout (little-endian)
+// uint8  Type: one of FrameType
+// uint8  BandId: band that produced the frame
+// uint16 PayloadSize: bytes following the header
+// uint32 Sequence: per band, per type increasing counter
+// uint64 Timestamp: monotonic microseconds when the frame was produced
+namespace SampleFrames
+{
+	// Output modes of the data socket. Text is the legacy, default mode
+	// (decimal strings terminated by '\0').
+	enum class FrameMode : uint8_t
+	{
+		Text = 0,
+		Binary = 1
+	};
+
+	enum class FrameType : uint8_t
+	{
+		// uint16 beats per minute
+		HeartRate = 1,
+		// uint16 status code (200 = band connected and authenticated)
+		Status = 2,
+		// uint64 bluetooth address of a device found by the scanner. No
+		// longer sent, scans report ScanBatch frames.
+		ScanResult = 3,
+		// Devices found by the scanner, see WriteScanBatchHeader
+		ScanBatch = 4,
+		// Rolling heart rate aggregates of a band, see WriteAggregates
+		Aggregates = 5,
+		// RR intervals of a heart rate sample and the HRV they update, see
+		// WriteHrv. Belongs to the heart rate stream.
+		Hrv = 6
+	};
+
+	constexpr size_t HeaderSize = 16;
+	// Big enough for the header plus the largest fixed payload
+	constexpr size_t MaxFrameSize = 32;
+
+	// Monotonic clock used for every frame timestamp
+	inline uint64_t MonotonicMicroseconds()
+	{
+		return static_cast<uint64_t>(
+			std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	inline void WriteLE16(uint8_t* Out, uint16_t Value)
+	{
+		Out[0] = static_cast<uint8_t>(Value);
+		Out[1] = static_cast<uint8_t>(Value >> 8);
+	}
+
+	inline void WriteLE32(uint8_t* Out, uint32_t Value)
+	{
+		WriteLE16(Out, static_cast<uint16_t>(Value));
+		WriteLE16(Out + 2, static_cast<uint16_t>(Value >> 16));
+	}
+
+	inline void WriteLE64(uint8_t* Out, uint64_t Value)
+	{
+		WriteLE32(Out, static_cast<uint32_t>(Value));
+		WriteLE32(Out + 4, static_cast<uint32_t>(Value >> 32));
+	}
+
+	// Writes a frame header into Out, which must hold at least HeaderSize
+	// bytes. Returns the number of bytes written.
+	inline size_t WriteHeader(uint8_t* Out, FrameType Type, uint8_t BandId,
+		uint16_t PayloadSize, uint32_t Sequence, uint64_t Timestamp)
+	{
+		Out[0] = static_cast<uint8_t>(Type);
+		Out[1] = BandId;
+		WriteLE16(Out + 2, PayloadSize);
+		WriteLE32(Out + 4, Sequence);
+		WriteLE64(Out + 8, Timestamp);
+		return HeaderSize;
+	}
+
+	// Writes a complete heart rate frame. Returns the frame size.
+	inline size_t WriteHeartRate(uint8_t* Out, uint8_t BandId,
+		uint32_t Sequence, uint64_t Timestamp, uint16_t Bpm)
+	{
+		WriteHeader(Out, FrameType::HeartRate, BandId, sizeof(uint16_t),
+			Sequence, Timestamp);
+		WriteLE16(Out + HeaderSize, Bpm);
+		return HeaderSize + sizeof(uint16_t);
+	}
+
+	// Writes a complete status frame. Returns the frame size.
+	inline size_t WriteStatus(uint8_t* Out, uint8_t BandId,
+		uint32_t Sequence, uint64_t Timestamp, uint16_t Code)
+	{
+		WriteHeader(Out, FrameType::Status, BandId, sizeof(uint16_t),
+			Sequence, Timestamp);
+		WriteLE16(Out + HeaderSize, Code);
+		return HeaderSize + sizeof(uint16_t);
+	}
+
+	// Scan batch payload
+	// uint16 Count: entries following
+	// uint8  Flags: ScanBatchSummary, ScanBatchLast
+	// uint8  reserved
+	// Count entries of
+	//   uint64 Address
+	//   uint64 FirstSeen, LastSeen: monotonic microseconds
+	//   uint32 Advertisements received
+	//   int8   RssiMin, RssiAverage, RssiLast: dBm
+	//   uint8  reserved
+	// While scanning, batches carry the devices updated since the previous
+	// one. When the scan ends a summary of every device follows, in as many
+	// frames as needed, the last one flagged ScanBatchLast.
+	constexpr uint8_t ScanBatchSummary = 1 << 0;
+	constexpr uint8_t ScanBatchLast = 1 << 1;
+	constexpr size_t ScanBatchHeaderSize = 4;
+	constexpr size_t ScanEntrySize = 32;
+	constexpr size_t MaxScanEntriesPerFrame = 64;
+	constexpr size_t MaxScanBatchFrameSize = HeaderSize +
+		ScanBatchHeaderSize + MaxScanEntriesPerFrame * ScanEntrySize;
+
+	inline int8_t ClampRssi(int16_t Rssi)
+	{
+		return static_cast<int8_t>(Rssi < -128 ? -128 : Rssi > 127 ? 127 :
+			Rssi);
+	}
+
+	// Writes one scan batch entry at Out. Returns ScanEntrySize.
+	inline size_t WriteScanEntry(uint8_t* Out, uint64_t Address,
+		uint64_t FirstSeen, uint64_t LastSeen, uint32_t Advertisements,
+		int16_t RssiMin, int16_t RssiAverage, int16_t RssiLast)
+	{
+		WriteLE64(Out, Address);
+		WriteLE64(Out + 8, FirstSeen);
+		WriteLE64(Out + 16, LastSeen);
+		WriteLE32(Out + 24, Advertisements);
+		Out[28] = static_cast<uint8_t>(ClampRssi(RssiMin));
+		Out[29] = static_cast<uint8_t>(ClampRssi(RssiAverage));
+		Out[30] = static_cast<uint8_t>(ClampRssi(RssiLast));
+		Out[31] = 0;
+		return ScanEntrySize;
+	}
+
+	// Writes the header of a scan batch frame of Count entries, which the
+	// caller writes right after it with WriteScanEntry. Returns the frame
+	// size.
+	inline size_t WriteScanBatchHeader(uint8_t* Out, uint8_t BandId,
+		uint32_t Sequence, uint64_t Timestamp, uint16_t Count, uint8_t Flags)
+	{
+		const size_t PayloadSize = ScanBatchHeaderSize + Count * ScanEntrySize;
+		WriteHeader(Out, FrameType::ScanBatch, BandId,
+			static_cast<uint16_t>(PayloadSize), Sequence, Timestamp);
+		WriteLE16(Out + HeaderSize, Count);
+		Out[HeaderSize + 2] = Flags;
+		Out[HeaderSize + 3] = 0;
+		return HeaderSize + PayloadSize;
+	}
+
+	// Aggregates payload
+	// uint8  WindowCount, ZoneCount
+	// uint16 reserved
+	// uint8  ZoneBounds[7]: lowest heart rate of zones 1 to ZoneCount - 1
+	// uint8  reserved
+	// WindowCount entries of
+	//   uint32 Seconds: window length
+	//   uint32 Samples in the window
+	//   uint16 Min, Max: bpm
+	//   uint32 MeanCenti: mean in hundredths of a bpm
+	//   uint32 ZoneMs[ZoneCount]: milliseconds spent in every zone
+	constexpr size_t AggregatesHeaderSize = 12;
+	constexpr size_t AggregateWindowSize = 16;
+	constexpr size_t MaxAggregatesFrameSize = HeaderSize +
+		AggregatesHeaderSize + HeartRateAggregator::MaxWindows *
+		(AggregateWindowSize + HeartRateAggregator::MaxZones *
+			sizeof(uint32_t));
+
+	// Writes a complete aggregates frame into Out, which must hold
+	// MaxAggregatesFrameSize bytes. Returns the frame size.
+	inline size_t WriteAggregates(uint8_t* Out, uint8_t BandId,
+		uint32_t Sequence, uint64_t Timestamp,
+		const AggregateSnapshot& Snapshot)
+	{
+		uint8_t* Payload = Out + HeaderSize;
+		Payload[0] = Snapshot.WindowCount;
+		Payload[1] = Snapshot.ZoneCount;
+		WriteLE16(Payload + 2, 0);
+		for (size_t i = 0; i < Snapshot.ZoneBounds.size(); ++i)
+		{
+			Payload[4 + i] = Snapshot.ZoneBounds[i];
+		}
+		Payload[11] = 0;
+		uint8_t* Entry = Payload + AggregatesHeaderSize;
+		for (size_t i = 0; i < Snapshot.WindowCount; ++i)
+		{
+			const AggregateWindow& Window = Snapshot.Windows[i];
+			WriteLE32(Entry, Window.Seconds);
+			WriteLE32(Entry + 4, Window.Samples);
+			WriteLE16(Entry + 8, Window.Min);
+			WriteLE16(Entry + 10, Window.Max);
+			WriteLE32(Entry + 12, Window.MeanCenti);
+			Entry += AggregateWindowSize;
+			for (size_t Zone = 0; Zone < Snapshot.ZoneCount; ++Zone)
+			{
+				WriteLE32(Entry, Window.ZoneMs[Zone]);
+				Entry += sizeof(uint32_t);
+			}
+		}
+		const size_t PayloadSize = static_cast<size_t>(Entry - Payload);
+		WriteHeader(Out, FrameType::Aggregates, BandId,
+			static_cast<uint16_t>(PayloadSize), Sequence, Timestamp);
+		return HeaderSize + PayloadSize;
+	}
+
+	// HRV payload, sent right after the heart rate frame of the sample that
+	// carried RR intervals, with the same sequence
+	// uint8  RrCount, WindowCount
+	// uint16 reserved
+	// uint16 RrIntervals[RrCount]: 1/1024 s
+	// WindowCount entries of
+	//   uint16 Seconds: window length
+	//   uint16 Beats in the window
+	//   uint16 Rmssd, Sdnn: tenths of a millisecond
+	//   uint16 Pnn50: tenths of a percent
+	//   uint16 reserved
+	constexpr size_t HrvHeaderSize = 4;
+	constexpr size_t HrvWindowSize = 12;
+	constexpr size_t MaxHrvFrameSize = HeaderSize + HrvHeaderSize +
+		HeartRateMeasurement::MaxRrIntervals * sizeof(uint16_t) +
+		HrvTracker::MaxWindows * HrvWindowSize;
+
+	inline uint16_t ToTenths(double Value)
+	{
+		const double Tenths = Value * 10.0 + 0.5;
+		return static_cast<uint16_t>(Tenths > 65535.0 ? 65535.0 : Tenths);
+	}
+
+	// Writes a complete HRV frame into Out, which must hold MaxHrvFrameSize
+	// bytes. Returns the frame size.
+	inline size_t WriteHrv(uint8_t* Out, uint8_t BandId, uint32_t Sequence,
+		uint64_t Timestamp, const uint16_t* RrIntervals, uint8_t RrCount,
+		const HrvSnapshot& Snapshot)
+	{
+		uint8_t* Payload = Out + HeaderSize;
+		Payload[0] = RrCount;
+		Payload[1] = Snapshot.WindowCount;
+		WriteLE16(Payload + 2, 0);
+		uint8_t* Entry = Payload + HrvHeaderSize;
+		for (size_t i = 0; i < RrCount; ++i)
+		{
+			WriteLE16(Entry, RrIntervals[i]);
+			Entry += sizeof(uint16_t);
+		}
+		for (size_t i = 0; i < Snapshot.WindowCount; ++i)
+		{
+			const HrvWindow& Window = Snapshot.Windows[i];
+			WriteLE16(Entry, static_cast<uint16_t>(Window.Seconds));
+			WriteLE16(Entry + 2, static_cast<uint16_t>(
+				Window.Beats > 65535 ? 65535 : Window.Beats));
+			WriteLE16(Entry + 4, ToTenths(Window.Rmssd));
+			WriteLE16(Entry + 6, ToTenths(Window.Sdnn));
+			WriteLE16(Entry + 8, ToTenths(Window.Pnn50));
+			WriteLE16(Entry + 10, 0);
+			Entry += HrvWindowSize;
+		}
+		const size_t PayloadSize = static_cast<size_t>(Entry - Payload);
+		WriteHeader(Out, FrameType::Hrv, BandId,
+			static_cast<uint16_t>(PayloadSize), Sequence, Timestamp);
+		return HeaderSize + PayloadSize;
+	}
+
+	// Writes a complete scan result frame. Returns the frame size.
+	inline size_t WriteScanResult(uint8_t* Out, uint8_t BandId,
+		uint32_t Sequence, uint64_t Timestamp, uint64_t Address)
+	{
+		WriteHeader(Out, FrameType::ScanResult, BandId, sizeof(uint64_t),
+			Sequence, Timestamp);
+		WriteLE64(Out + HeaderSize, Address);
+		return HeaderSize + sizeof(uint64_t);
+	}
+}
@@ -0,0 +1,55 @@
+#include "pch.h"
+#include "ScanTable.h"
+#include <algorithm>
+
+int16_t ScanEntry::RssiAverage() const
+{
+	if (Advertisements == 0)
+	{
+		return 0;
+	}
+	// Rounded to the nearest, RSSI is negative
+	const int64_t Count = Advertisements;
+	return static_cast<int16_t>(RssiSum >= 0 ?
+		(RssiSum + Count / 2) / Count : (RssiSum - Count / 2) / Count);
+}
+
+bool ScanTable::Record(uint64_t Address, int16_t Rssi, uint64_t Timestamp)
+{
+	auto It = std::lower_bound(Entries.begin(), Entries.end(), Address,
+		[](const ScanEntry& Entry, uint64_t Key) {
+			return Entry.Address < Key;
+		});
+	bool bNew = It == Entries.end() || It->Address != Address;
+	if (bNew)
+	{
+		if (Entries.size() >= MaxEntries)
+		{
+			return false;
+		}
+		ScanEntry Entry;
+		Entry.Address = Address;
+		Entry.FirstSeen = Timestamp;
+		Entry.RssiMin = Rssi;
+		It = Entries.insert(It, Entry);
+	}
+	It->LastSeen = Timestamp;
+	++It->Advertisements;
+	It->RssiMin = std::min(It->RssiMin, Rssi);
+	It->RssiLast = Rssi;
+	It->RssiSum += Rssi;
+	It->bUpdated = true;
+	return bNew;
+}
+
+void ScanTable::TakeUpdates(std::vector<ScanEntry>& Out)
+{
+	for (ScanEntry& Entry : Entries)
+	{
+		if (Entry.bUpdated)
+		{
+			Out.push_back(Entry);
+			Entry.bUpdated = false;
+		}
+	}
+}
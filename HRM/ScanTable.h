@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// What the scanner knows about one advertising device. Times are monotonic
+// microseconds, signal strengths dBm.
+struct ScanEntry
+{
+	uint64_t Address = 0;
+	uint64_t FirstSeen = 0;
+	uint64_t LastSeen = 0;
+	uint32_t Advertisements = 0;
+	int16_t RssiMin = 0;
+	int16_t RssiLast = 0;
+	int64_t RssiSum = 0;
+	// Changed since the last batch of updates was taken
+	bool bUpdated = false;
+
+	int16_t RssiAverage() const;
+};
+
+// Devices found by a scan, one entry per address however many times it
+// advertises. Kept sorted by address in a flat vector. Not thread safe.
+class ScanTable
+{
+public:
+	// Devices beyond this are ignored, a noisy room can't grow it unbounded
+	static constexpr size_t MaxEntries = 256;
+
+	// Returns true the first time the address is seen
+	bool Record(uint64_t Address, int16_t Rssi, uint64_t Timestamp);
+	// Appends the entries updated since the last call and clears their flag
+	void TakeUpdates(std::vector<ScanEntry>& Out);
+	const std::vector<ScanEntry>& GetEntries() const { return Entries; }
+	void Clear() { Entries.clear(); }
+
+private:
+	std::vector<ScanEntry> Entries;
+};
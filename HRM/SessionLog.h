@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// On-disk format of the session logs written by SessionRecorder and played
+// by SessionReplay. A 64 byte header followed by fixed 64 byte records, in
+// the order they were appended, all little-endian as laid out below.
+namespace SessionLog
+{
+	// "HRMSLOG1"
+	constexpr uint8_t Magic[8] = { 'H', 'R', 'M', 'S', 'L', 'O', 'G', '1' };
+	constexpr uint32_t Version = 1;
+
+	enum class RecordType : uint8_t
+	{
+		// Payload: the raw 0x2a37 notification, Value: decoded bpm
+		HeartRate = 1,
+		// Value: status code sent to the client
+		Status = 2,
+		// Payload: uint64 address, Value: 1 if the GATT cache was used
+		Connect = 3,
+		Disconnect = 4,
+		// Value: cool down before the restart, in milliseconds
+		Stall = 5,
+		// Payload: uint64 milliseconds from the stall to the first sample
+		Recovery = 6,
+		// Value: instruction id, Payload: its first argument bytes
+		Command = 7
+	};
+
+	struct Header
+	{
+		uint8_t Magic[8];
+		uint32_t Version;
+		uint32_t RecordSize;
+		// Records appended so far, updated after every append
+		uint64_t Count;
+		// Monotonic microseconds when recording started
+		uint64_t Start;
+		uint8_t Reserved[32];
+	};
+
+	constexpr size_t MaxPayload = 40;
+
+	struct Record
+	{
+		// Monotonic microseconds, the clock of the frame timestamps
+		uint64_t Timestamp;
+		// Sequence of the heart rate sample, 0 for other records
+		uint32_t Sequence;
+		RecordType Type;
+		uint8_t BandId;
+		uint16_t Value;
+		// Payload bytes in use
+		uint8_t Size;
+		uint8_t Reserved[7];
+		uint8_t Payload[MaxPayload];
+	};
+
+	static_assert(sizeof(Header) == 64, "Header must be 64 bytes");
+	static_assert(sizeof(Record) == 64, "Records must be 64 bytes");
+}
@@ -0,0 +1,120 @@
+#include "pch.h"
+#include "SessionManager.h"
+#include "MiBand3.h"
+#include "RemoteCommunication.h"
+#include "SampleDelivery.h"
+#include "WinRtGattTransport.h"
+
+// Class that owns the bands of a session. Bands are created lazily the first
+// time a command addresses them, so a single band session costs the same as
+// before.
+SessionManager::SessionManager()
+{
+	Bands.resize(MaxBands);
+	// A single reactor owns every band and connection for now
+	Reactors = std::make_unique<ReactorPool>(1);
+	// One wheel thread drives the timers of every band
+	Timers = std::make_unique<TimerWheel>();
+	// Bands seen in earlier runs reconnect without a full discovery
+	Cache = std::make_unique<GattCache>("gatt-cache.txt");
+	// Shared consumer stage for the samples of every band
+	Delivery = ref new SampleDelivery();
+	// Create a new RemoteCommunicaton object
+	RC = ref new RemoteCommunication(this);
+}
+
+MiBand3^ SessionManager::GetBand(uint8 BandId)
+{
+	if (BandId >= MaxBands)
+	{
+		return nullptr;
+	}
+	std::lock_guard<std::mutex> Guard(BandsLock);
+	if (!Bands[BandId])
+	{
+		Bands[BandId] = ref new MiBand3(BandId, RC);
+		Delivery->Register(Bands[BandId]);
+	}
+	return Bands[BandId];
+}
+
+MiBand3^ SessionManager::FindBand(uint8 BandId)
+{
+	if (BandId >= MaxBands)
+	{
+		return nullptr;
+	}
+	std::lock_guard<std::mutex> Guard(BandsLock);
+	return Bands[BandId];
+}
+
+void SessionManager::UseSimulatedBands(const SimulatedBandSettings& Settings,
+	SimulatedMiBand3::WriteObserver Observer)
+{
+	Simulation = std::make_unique<SimulatedBandSettings>(Settings);
+	SimulationObserver = Observer;
+}
+
+std::unique_ptr<GattTransport> SessionManager::CreateTransport(uint8 BandId)
+{
+	if (Simulation)
+	{
+		// Every simulated band gets its own readings
+		SimulatedBandSettings Settings = *Simulation;
+		Settings.Seed += BandId;
+		auto Band = std::make_unique<SimulatedMiBand3>(Settings);
+		if (SimulationObserver)
+		{
+			Band->SetWriteObserver(SimulationObserver);
+		}
+		return Band;
+	}
+	return std::make_unique<WinRtGattTransport>(Cache.get());
+}
+
+ReactorPool& SessionManager::GetReactors()
+{
+	return *Reactors;
+}
+
+TimerWheel& SessionManager::GetTimers()
+{
+	return *Timers;
+}
+
+GattCache& SessionManager::GetGattCache()
+{
+	return *Cache;
+}
+
+bool SessionManager::RecordTo(const std::wstring& Path)
+{
+	auto NewRecorder = std::make_unique<SessionRecorder>();
+	if (!NewRecorder->Open(Path))
+	{
+		return false;
+	}
+	Recorder = std::move(NewRecorder);
+	return true;
+}
+
+SessionRecorder* SessionManager::GetRecorder()
+{
+	return Recorder.get();
+}
+
+bool SessionManager::PublishTo(const std::string& Name)
+{
+	auto NewPublisher = std::make_unique<SharedHeartRatePublisher>();
+	if (!NewPublisher->Open(Name))
+	{
+		return false;
+	}
+	Publisher = std::move(NewPublisher);
+	return true;
+}
+
+SharedHeartRatePublisher* SessionManager::GetPublisher()
+{
+	return Publisher.get();
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "pch.h"
+#include "GattCache.h"
+#include "GattTransport.h"
+#include "Reactor.h"
+#include "SessionRecorder.h"
+#include "SharedHeartRatePublisher.h"
+#include "SimulatedMiBand3.h"
+#include "TimerWheel.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+
+ref class MiBand3;
+ref class RemoteCommunication;
+ref class SampleDelivery;
+
+// Holds every MiBand3 served by this process. All bands share one
+// RemoteCommunication (one control port and one client socket) and one
+// delivery stage, and are addressed by their band id.
+ref class SessionManager sealed
+{
+public:
+	SessionManager();
+
+	// Returns the band with the given id, creating it on first use. Returns
+	// nullptr if the id is out of range.
+	MiBand3^ GetBand(uint8 BandId);
+	// Returns the band with the given id only if it already exists.
+	MiBand3^ FindBand(uint8 BandId);
+
+	// Serves simulated bands instead of real ones, optionally observing every
+	// write they receive. Must be called before any band is created.
+	void UseSimulatedBands(const SimulatedBandSettings& Settings,
+		SimulatedMiBand3::WriteObserver Observer = nullptr);
+	// GATT backend of a new band, a simulated one if UseSimulatedBands was
+	// called
+	std::unique_ptr<GattTransport> CreateTransport(uint8 BandId);
+
+	// Event loops owning the state of the bands and connections, see
+	// Reactor.h
+	ReactorPool& GetReactors();
+	// Timers of every band, keepalive pings and watchdogs
+	TimerWheel& GetTimers();
+	// Layout and auth state of the real bands seen so far
+	GattCache& GetGattCache();
+
+	// Records every sample and event of the session into a log at the
+	// given path. Must be called before any band is created.
+	bool RecordTo(const std::wstring& Path);
+	// The session log, null if not recording
+	SessionRecorder* GetRecorder();
+
+	// Also publishes every sample and status code into the shared memory
+	// channel with the given name, see SharedHeartRate.h. Must be called
+	// before any band is created.
+	bool PublishTo(const std::string& Name);
+	// The shared memory channel, null if not publishing
+	SharedHeartRatePublisher* GetPublisher();
+
+	property RemoteCommunication^ RC;
+	property SampleDelivery^ Delivery;
+
+	// Highest number of bands served at the same time
+	static property uint32 MaxBands { uint32 get() { return 64; } }
+
+private:
+	std::mutex BandsLock;
+	// Indexed by band id, empty slots for ids not in use
+	std::vector<MiBand3^> Bands;
+	// Settings of the simulated bands, null for real bands
+	std::unique_ptr<SimulatedBandSettings> Simulation;
+	SimulatedMiBand3::WriteObserver SimulationObserver;
+	std::unique_ptr<ReactorPool> Reactors;
+	std::unique_ptr<TimerWheel> Timers;
+	std::unique_ptr<GattCache> Cache;
+	std::unique_ptr<SessionRecorder> Recorder;
+	std::unique_ptr<SharedHeartRatePublisher> Publisher;
+};
@@ -0,0 +1,159 @@
+#include "pch.h"
+#include "SessionRecorder.h"
+#include "SampleFrame.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <Windows.h>
+
+namespace
+{
+	// Records mapped at first, about 4 MB
+	constexpr uint64_t InitialCapacity = 65536;
+}
+
+SessionRecorder::SessionRecorder() : File(INVALID_HANDLE_VALUE),
+	Mapping(nullptr), View(nullptr), Capacity(0), Count(0), Dropped(0)
+{
+}
+
+SessionRecorder::~SessionRecorder()
+{
+	Close();
+}
+
+bool SessionRecorder::Open(const std::wstring& Path)
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	if (File != INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	File = CreateFileW(Path.c_str(), GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+		nullptr);
+	if (File == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	Count = 0;
+	Dropped = 0;
+	if (!MapLocked(InitialCapacity))
+	{
+		CloseHandle(File);
+		File = INVALID_HANDLE_VALUE;
+		return false;
+	}
+
+	SessionLog::Header Header = {};
+	std::memcpy(Header.Magic, SessionLog::Magic, sizeof(Header.Magic));
+	Header.Version = SessionLog::Version;
+	Header.RecordSize = sizeof(SessionLog::Record);
+	Header.Start = SampleFrames::MonotonicMicroseconds();
+	std::memcpy(View, &Header, sizeof(Header));
+	return true;
+}
+
+void SessionRecorder::Close()
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	if (File == INVALID_HANDLE_VALUE)
+	{
+		return;
+	}
+	UnmapLocked();
+	// Drop the unused tail of the last mapping
+	LARGE_INTEGER Size;
+	Size.QuadPart = static_cast<LONGLONG>(sizeof(SessionLog::Header) +
+		Count * sizeof(SessionLog::Record));
+	SetFilePointerEx(File, Size, nullptr, FILE_BEGIN);
+	SetEndOfFile(File);
+	CloseHandle(File);
+	File = INVALID_HANDLE_VALUE;
+	if (Dropped > 0)
+	{
+		std::cout << "Session log couldn't grow, " << Dropped
+			<< " records lost" << std::endl;
+	}
+}
+
+void SessionRecorder::Append(SessionLog::RecordType Type, uint8_t BandId,
+	uint16_t Value, uint32_t Sequence, const void* Payload,
+	size_t PayloadSize)
+{
+	SessionLog::Record Record = {};
+	Record.Timestamp = SampleFrames::MonotonicMicroseconds();
+	Record.Sequence = Sequence;
+	Record.Type = Type;
+	Record.BandId = BandId;
+	Record.Value = Value;
+	Record.Size = static_cast<uint8_t>(
+		std::min(PayloadSize, SessionLog::MaxPayload));
+	if (Payload)
+	{
+		std::memcpy(Record.Payload, Payload, Record.Size);
+	}
+
+	std::lock_guard<std::mutex> Guard(Lock);
+	if (!View)
+	{
+		return;
+	}
+	if (Count == Capacity && !MapLocked(Capacity * 2))
+	{
+		++Dropped;
+		return;
+	}
+	std::memcpy(View + sizeof(SessionLog::Header) +
+		Count * sizeof(SessionLog::Record), &Record, sizeof(Record));
+	++Count;
+	// The header always tells how much of the file is valid
+	auto Header = reinterpret_cast<SessionLog::Header*>(View);
+	Header->Count = Count;
+}
+
+uint64_t SessionRecorder::GetCount()
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	return Count;
+}
+
+// Maps the header and the given number of records, growing the file to fit.
+// The previous mapping, if any, is kept when the new one can't be created.
+bool SessionRecorder::MapLocked(uint64_t NewCapacity)
+{
+	const uint64_t Size = sizeof(SessionLog::Header) +
+		NewCapacity * sizeof(SessionLog::Record);
+	HANDLE NewMapping = CreateFileMappingW(File, nullptr, PAGE_READWRITE,
+		static_cast<DWORD>(Size >> 32), static_cast<DWORD>(Size), nullptr);
+	if (!NewMapping)
+	{
+		return false;
+	}
+	auto NewView = static_cast<uint8_t*>(MapViewOfFile(NewMapping,
+		FILE_MAP_WRITE, 0, 0, static_cast<SIZE_T>(Size)));
+	if (!NewView)
+	{
+		CloseHandle(NewMapping);
+		return false;
+	}
+	UnmapLocked();
+	Mapping = NewMapping;
+	View = NewView;
+	Capacity = NewCapacity;
+	return true;
+}
+
+void SessionRecorder::UnmapLocked()
+{
+	if (View)
+	{
+		UnmapViewOfFile(View);
+		View = nullptr;
+	}
+	if (Mapping)
+	{
+		CloseHandle(Mapping);
+		Mapping = nullptr;
+	}
+}
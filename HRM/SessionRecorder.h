@@ -0,0 +1,46 @@
+#pragma once
+
+#include "SessionLog.h"
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Append-only log of a session, every sample and event in a memory mapped
+// file of fixed size records (see SessionLog.h). Appending is a copy into the
+// mapping under a lock; the file grows by doubling its mapping, and is trimmed
+// to the records written when the recorder closes. Thread safe.
+class SessionRecorder
+{
+public:
+	SessionRecorder();
+	~SessionRecorder();
+
+	SessionRecorder(const SessionRecorder&) = delete;
+	SessionRecorder& operator=(const SessionRecorder&) = delete;
+
+	// Creates the log, replacing any file at the path. False if it can't be
+	// created or mapped.
+	bool Open(const std::wstring& Path);
+	void Close();
+
+	// Payload bytes beyond SessionLog::MaxPayload are left out
+	void Append(SessionLog::RecordType Type, uint8_t BandId, uint16_t Value,
+		uint32_t Sequence, const void* Payload = nullptr,
+		size_t PayloadSize = 0);
+	uint64_t GetCount();
+
+private:
+	// Lock must be held
+	bool MapLocked(uint64_t Capacity);
+	void UnmapLocked();
+
+	std::mutex Lock;
+	void* File;
+	void* Mapping;
+	uint8_t* View;
+	// Records the current mapping holds
+	uint64_t Capacity;
+	uint64_t Count;
+	// Lost because the mapping couldn't grow
+	uint64_t Dropped;
+};
@@ -0,0 +1,158 @@
+#include "pch.h"
+#include "SessionReplay.h"
+#include "MiBand3.h"
+#include "RemoteCommunication.h"
+#include "SessionManager.h"
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <Windows.h>
+
+SessionReplay::SessionReplay(SessionManager^ Manager) : Manager(Manager),
+	File(INVALID_HANDLE_VALUE), Mapping(nullptr), View(nullptr), Count(0),
+	bStopping(false)
+{
+}
+
+SessionReplay::~SessionReplay()
+{
+	bStopping = true;
+	if (Worker.joinable())
+	{
+		Worker.join();
+	}
+	Unmap();
+}
+
+bool SessionReplay::Open(const std::wstring& Path)
+{
+	File = CreateFileW(Path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	LARGE_INTEGER Size;
+	if (File == INVALID_HANDLE_VALUE || !GetFileSizeEx(File, &Size) ||
+		Size.QuadPart < static_cast<LONGLONG>(sizeof(SessionLog::Header)))
+	{
+		Unmap();
+		return false;
+	}
+	Mapping = CreateFileMappingW(File, nullptr, PAGE_READONLY, 0, 0,
+		nullptr);
+	View = Mapping ? static_cast<const uint8_t*>(
+		MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+	if (!View)
+	{
+		Unmap();
+		return false;
+	}
+
+	SessionLog::Header Header;
+	std::memcpy(&Header, View, sizeof(Header));
+	if (std::memcmp(Header.Magic, SessionLog::Magic, sizeof(Header.Magic)) ||
+		Header.Version != SessionLog::Version ||
+		Header.RecordSize != sizeof(SessionLog::Record))
+	{
+		Unmap();
+		return false;
+	}
+	// A recorder that didn't close leaves a longer file, the header knows
+	// what was written
+	const uint64_t Fits = (static_cast<uint64_t>(Size.QuadPart) -
+		sizeof(SessionLog::Header)) / sizeof(SessionLog::Record);
+	Count = Header.Count < Fits ? Header.Count : Fits;
+	return true;
+}
+
+void SessionReplay::Start(double Speed)
+{
+	if (View && !Worker.joinable())
+	{
+		Worker = std::thread([this, Speed] { Run(Speed); });
+	}
+}
+
+void SessionReplay::Run(double Speed)
+{
+	using Clock = std::chrono::steady_clock;
+
+	std::wcout << "Replaying " << Count << " records once the client is "
+		"connected" << std::endl;
+	while (!bStopping && !Manager->RC->bClientConnected)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+
+	auto Records = reinterpret_cast<const SessionLog::Record*>(
+		View + sizeof(SessionLog::Header));
+	const uint64_t First = Count > 0 ? Records[0].Timestamp : 0;
+	uint64_t Samples = 0;
+	uint64_t Events = 0;
+	uint64_t Skipped = 0;
+	const auto Start = Clock::now();
+	for (uint64_t i = 0; i < Count && !bStopping; ++i)
+	{
+		SessionLog::Record Record;
+		std::memcpy(&Record, &Records[i], sizeof(Record));
+		// Only the header is checked on open, a corrupt record is dropped
+		// here rather than read past its payload
+		if (Record.Size > SessionLog::MaxPayload)
+		{
+			++Skipped;
+			continue;
+		}
+		if (Speed > 0)
+		{
+			// Recorded offset from the first record, scaled, and none for a
+			// record stamped before it
+			const double Offset = Record.Timestamp > First ?
+				static_cast<double>(Record.Timestamp - First) / Speed : 0.0;
+			std::this_thread::sleep_until(Start +
+				std::chrono::duration_cast<Clock::duration>(
+					std::chrono::duration<double, std::micro>(Offset)));
+		}
+
+		MiBand3^ Band = Manager->GetBand(Record.BandId);
+		if (!Band)
+		{
+			continue;
+		}
+		switch (Record.Type)
+		{
+		case SessionLog::RecordType::HeartRate:
+			Band->ReplayNotification(Record.Payload, Record.Size);
+			++Samples;
+			break;
+		case SessionLog::RecordType::Status:
+			Band->WriteStatus(Record.Value);
+			break;
+		default:
+			++Events;
+			break;
+		}
+	}
+
+	const double Seconds = std::chrono::duration<double>(
+		Clock::now() - Start).count();
+	std::wcout << "Replay done, " << Samples << " samples and " << Events
+		<< " other events in " << Seconds << " s ("
+		<< (Seconds > 0 ? Samples / Seconds : 0) << " samples/s), "
+		<< Skipped << " corrupt records skipped" << std::endl;
+}
+
+void SessionReplay::Unmap()
+{
+	if (View)
+	{
+		UnmapViewOfFile(View);
+		View = nullptr;
+	}
+	if (Mapping)
+	{
+		CloseHandle(Mapping);
+		Mapping = nullptr;
+	}
+	if (File != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(File);
+		File = INVALID_HANDLE_VALUE;
+	}
+}
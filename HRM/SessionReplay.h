@@ -0,0 +1,44 @@
+#pragma once
+
+#include "pch.h"
+#include "SessionLog.h"
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+ref class SessionManager;
+
+// Plays a session log back through the bands of a session, without any band
+// attached. Heart rate records go through the same path as live 0x2a37
+// notifications, status records to the client as they were sent; the other
+// events are only counted. Starts once the client is connected, at the
+// recorded pace times a speed factor, or as fast as possible.
+class SessionReplay
+{
+public:
+	explicit SessionReplay(SessionManager^ Manager);
+	~SessionReplay();
+
+	SessionReplay(const SessionReplay&) = delete;
+	SessionReplay& operator=(const SessionReplay&) = delete;
+
+	// Maps the log read-only. False if it can't be opened or isn't a log.
+	bool Open(const std::wstring& Path);
+	// Plays the log on its own thread, Speed times faster than recorded, or
+	// without waiting between records if Speed is 0.
+	void Start(double Speed);
+
+private:
+	void Run(double Speed);
+	void Unmap();
+
+	SessionManager^ Manager;
+	void* File;
+	void* Mapping;
+	const uint8_t* View;
+	uint64_t Count;
+
+	std::thread Worker;
+	std::atomic<bool> bStopping;
+};
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Layout of the shared memory channel, shared by the service (the only
+// writer) and any number of readers in other processes. Standard C++ and the
+// OS mapping calls only, so readers can copy this header and
+// SharedHeartRateReader.h into their own build.
+//
+// Every band gets a latest value slot and a ring of its recent samples. Both
+// are seqlocks: the writer makes the version odd, stores the fields and makes
+// it even again, and a reader keeps a copy only if it saw the same even
+// version before and after reading. Reads never block the writer and never
+// enter the kernel.
+namespace SharedHeartRate
+{
+	// Name of the mapping, "Local\<name>" on Windows and "/<name>" as a POSIX
+	// shared memory object elsewhere
+	constexpr char DefaultName[] = "hrm-heart-rate";
+	constexpr char Magic[8] = { 'H', 'R', 'M', 'S', 'H', 'M', '0', '1' };
+	constexpr uint32_t Version = 1;
+	constexpr uint32_t MaxBands = 64;
+	// Samples kept per band, a power of two
+	constexpr uint32_t RingCapacity = 256;
+
+	static_assert(std::atomic<uint64_t>::is_always_lock_free,
+		"Seqlocks across processes need lock free 64 bit atomics");
+
+	// Heart rate sample as readers get it. Timestamp is in monotonic
+	// microseconds (std::chrono::steady_clock), Sequence the per band
+	// counter of the heart rate frames.
+	struct Sample
+	{
+		uint64_t Timestamp = 0;
+		uint32_t Sequence = 0;
+		uint16_t Bpm = 0;
+	};
+
+	// Seqlock protected sample. Index is the ring position it was written
+	// for, so a reader can tell a slot that was overwritten by a newer lap.
+	struct Slot
+	{
+		std::atomic<uint32_t> Version;
+		std::atomic<uint64_t> Index;
+		std::atomic<uint64_t> Timestamp;
+		// Sequence in the low 32 bits, Bpm above
+		std::atomic<uint64_t> Packed;
+	};
+
+	struct alignas(64) BandRegion
+	{
+		Slot Latest;
+		// Last status code sent for the band, 0 if none. Written on its own
+		// from any thread, outside the seqlocks.
+		alignas(64) std::atomic<uint32_t> Status;
+		// Samples ever written to the ring
+		alignas(64) std::atomic<uint64_t> Written;
+		Slot Ring[RingCapacity];
+	};
+
+	struct alignas(64) Header
+	{
+		// Set by the writer once the rest of the header is written
+		std::atomic<uint32_t> bReady;
+		char Magic[8];
+		uint32_t Version;
+		uint32_t Bands;
+		uint32_t RingCapacity;
+		uint32_t BandSize;
+	};
+
+	struct Region
+	{
+		Header Info;
+		BandRegion Bands[MaxBands];
+	};
+
+	// Single writer per slot
+	inline void WriteSlot(Slot& Target, uint64_t Index, const Sample& Value)
+	{
+		const uint32_t Start = Target.Version.load(std::memory_order_relaxed);
+		Target.Version.store(Start + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		Target.Index.store(Index, std::memory_order_relaxed);
+		Target.Timestamp.store(Value.Timestamp, std::memory_order_relaxed);
+		Target.Packed.store(Value.Sequence |
+			(static_cast<uint64_t>(Value.Bpm) << 32),
+			std::memory_order_relaxed);
+		Target.Version.store(Start + 2, std::memory_order_release);
+	}
+
+	// False if the slot was never written or is being written
+	inline bool ReadSlot(const Slot& Source, uint64_t& Index, Sample& Value)
+	{
+		const uint32_t Before = Source.Version.load(std::memory_order_acquire);
+		if (Before == 0 || (Before & 1) != 0)
+		{
+			return false;
+		}
+		Index = Source.Index.load(std::memory_order_relaxed);
+		const uint64_t Timestamp =
+			Source.Timestamp.load(std::memory_order_relaxed);
+		const uint64_t Packed = Source.Packed.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (Source.Version.load(std::memory_order_relaxed) != Before)
+		{
+			return false;
+		}
+		Value.Timestamp = Timestamp;
+		Value.Sequence = static_cast<uint32_t>(Packed);
+		Value.Bpm = static_cast<uint16_t>(Packed >> 32);
+		return true;
+	}
+
+	// OS mapping of the region
+	struct Mapping
+	{
+		Region* View = nullptr;
+#ifdef _WIN32
+		HANDLE Handle = nullptr;
+#else
+		char Name[64] = {};
+		bool bOwner = false;
+#endif
+	};
+
+	// Creates the mapping, zeroed. Fails if it already exists on Windows;
+	// elsewhere a stale object left by a crashed writer is replaced.
+	inline bool CreateMapping(const char* Name, Mapping& Out)
+	{
+#ifdef _WIN32
+		char FullName[128] = "Local\\";
+		strncat_s(FullName, Name, _TRUNCATE);
+		Out.Handle = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr,
+			PAGE_READWRITE, 0, static_cast<DWORD>(sizeof(Region)), FullName);
+		if (!Out.Handle || GetLastError() == ERROR_ALREADY_EXISTS)
+		{
+			if (Out.Handle)
+			{
+				CloseHandle(Out.Handle);
+				Out.Handle = nullptr;
+			}
+			return false;
+		}
+		Out.View = static_cast<Region*>(MapViewOfFile(Out.Handle,
+			FILE_MAP_ALL_ACCESS, 0, 0, sizeof(Region)));
+		if (!Out.View)
+		{
+			CloseHandle(Out.Handle);
+			Out.Handle = nullptr;
+			return false;
+		}
+		return true;
+#else
+		std::snprintf(Out.Name, sizeof(Out.Name), "/%s", Name);
+		shm_unlink(Out.Name);
+		const int File = shm_open(Out.Name, O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (File < 0)
+		{
+			return false;
+		}
+		void* View = ftruncate(File, sizeof(Region)) == 0 ?
+			mmap(nullptr, sizeof(Region), PROT_READ | PROT_WRITE, MAP_SHARED,
+				File, 0) : MAP_FAILED;
+		close(File);
+		if (View == MAP_FAILED)
+		{
+			shm_unlink(Out.Name);
+			return false;
+		}
+		Out.View = static_cast<Region*>(View);
+		Out.bOwner = true;
+		return true;
+#endif
+	}
+
+	inline void CloseMapping(Mapping& Target)
+	{
+#ifdef _WIN32
+		if (Target.View)
+		{
+			UnmapViewOfFile(Target.View);
+		}
+		if (Target.Handle)
+		{
+			CloseHandle(Target.Handle);
+		}
+		Target.Handle = nullptr;
+#else
+		if (Target.View)
+		{
+			munmap(Target.View, sizeof(Region));
+		}
+		if (Target.bOwner)
+		{
+			shm_unlink(Target.Name);
+		}
+		Target.bOwner = false;
+#endif
+		Target.View = nullptr;
+	}
+
+	// Maps an existing region read-only. False if there is none or it isn't
+	// initialized yet.
+	inline bool OpenMapping(const char* Name, Mapping& Out)
+	{
+#ifdef _WIN32
+		char FullName[128] = "Local\\";
+		strncat_s(FullName, Name, _TRUNCATE);
+		Out.Handle = OpenFileMappingA(FILE_MAP_READ, FALSE, FullName);
+		if (!Out.Handle)
+		{
+			return false;
+		}
+		Out.View = static_cast<Region*>(MapViewOfFile(Out.Handle,
+			FILE_MAP_READ, 0, 0, sizeof(Region)));
+#else
+		std::snprintf(Out.Name, sizeof(Out.Name), "/%s", Name);
+		const int File = shm_open(Out.Name, O_RDONLY, 0);
+		if (File < 0)
+		{
+			return false;
+		}
+		void* View = mmap(nullptr, sizeof(Region), PROT_READ, MAP_SHARED,
+			File, 0);
+		close(File);
+		Out.View = View == MAP_FAILED ? nullptr : static_cast<Region*>(View);
+#endif
+		if (!Out.View)
+		{
+			CloseMapping(Out);
+			return false;
+		}
+		const Header& Info = Out.View->Info;
+		if (Info.bReady.load(std::memory_order_acquire) == 0 ||
+			std::memcmp(Info.Magic, Magic, sizeof(Magic)) != 0 ||
+			Info.Version != Version || Info.BandSize != sizeof(BandRegion))
+		{
+			CloseMapping(Out);
+			return false;
+		}
+		return true;
+	}
+}
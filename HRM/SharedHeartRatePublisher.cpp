@@ -0,0 +1,53 @@
+#include "pch.h"
+#include "SharedHeartRatePublisher.h"
+
+SharedHeartRatePublisher::~SharedHeartRatePublisher()
+{
+	Close();
+}
+
+bool SharedHeartRatePublisher::Open(const std::string& Name)
+{
+	if (Region.View || !SharedHeartRate::CreateMapping(Name.c_str(), Region))
+	{
+		return false;
+	}
+	// The mapping starts zeroed, only the header needs writing
+	auto& Info = Region.View->Info;
+	std::memcpy(Info.Magic, SharedHeartRate::Magic, sizeof(Info.Magic));
+	Info.Version = SharedHeartRate::Version;
+	Info.Bands = SharedHeartRate::MaxBands;
+	Info.RingCapacity = SharedHeartRate::RingCapacity;
+	Info.BandSize = sizeof(SharedHeartRate::BandRegion);
+	Info.bReady.store(1, std::memory_order_release);
+	return true;
+}
+
+void SharedHeartRatePublisher::Close()
+{
+	SharedHeartRate::CloseMapping(Region);
+}
+
+void SharedHeartRatePublisher::Publish(uint8_t BandId,
+	const SharedHeartRate::Sample& Value)
+{
+	if (!Region.View || BandId >= SharedHeartRate::MaxBands)
+	{
+		return;
+	}
+	auto& Band = Region.View->Bands[BandId];
+	const uint64_t Index = Band.Written.load(std::memory_order_relaxed);
+	SharedHeartRate::WriteSlot(
+		Band.Ring[Index % SharedHeartRate::RingCapacity], Index, Value);
+	Band.Written.store(Index + 1, std::memory_order_release);
+	SharedHeartRate::WriteSlot(Band.Latest, Index, Value);
+}
+
+void SharedHeartRatePublisher::PublishStatus(uint8_t BandId, uint16_t Code)
+{
+	if (!Region.View || BandId >= SharedHeartRate::MaxBands)
+	{
+		return;
+	}
+	Region.View->Bands[BandId].Status.store(Code, std::memory_order_relaxed);
+}
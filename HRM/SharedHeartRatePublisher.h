@@ -0,0 +1,30 @@
+#pragma once
+
+#include "SharedHeartRate.h"
+#include <cstdint>
+#include <string>
+
+// Writer side of the shared memory channel (see SharedHeartRate.h). Samples
+// of a band must be published from a single thread, the delivery stage;
+// status codes may come from any thread.
+class SharedHeartRatePublisher
+{
+public:
+	SharedHeartRatePublisher() = default;
+	~SharedHeartRatePublisher();
+
+	SharedHeartRatePublisher(const SharedHeartRatePublisher&) = delete;
+	SharedHeartRatePublisher& operator=(const SharedHeartRatePublisher&) =
+		delete;
+
+	// Creates the mapping. False if it can't, or another writer has it.
+	bool Open(const std::string& Name);
+	void Close();
+
+	// Stores the sample as the latest of the band and appends it to its ring
+	void Publish(uint8_t BandId, const SharedHeartRate::Sample& Value);
+	void PublishStatus(uint8_t BandId, uint16_t Code);
+
+private:
+	SharedHeartRate::Mapping Region;
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "SharedHeartRate.h"
+
+// Reader of the shared memory channel for consumers in other processes, such
+// as a game polling the heart rate every frame. Header only, it needs just
+// this file and SharedHeartRate.h. Every read is a few loads from the mapping,
+// without syscalls, locks or parsing.
+//
+//     SharedHeartRateReader Reader;
+//     SharedHeartRate::Sample Latest;
+//     if (Reader.Open() && Reader.ReadLatest(0, Latest)) { ... Latest.Bpm }
+class SharedHeartRateReader
+{
+public:
+	SharedHeartRateReader() = default;
+	~SharedHeartRateReader() { Close(); }
+
+	SharedHeartRateReader(const SharedHeartRateReader&) = delete;
+	SharedHeartRateReader& operator=(const SharedHeartRateReader&) = delete;
+
+	// False if the service isn't publishing under that name (yet)
+	bool Open(const char* Name = SharedHeartRate::DefaultName)
+	{
+		Close();
+		return SharedHeartRate::OpenMapping(Name, Region);
+	}
+
+	void Close() { SharedHeartRate::CloseMapping(Region); }
+
+	bool IsOpen() const { return Region.View != nullptr; }
+
+	// Latest sample of the band. False if it has none yet, the band id is
+	// out of range or the writer kept it busy for every retry.
+	bool ReadLatest(uint8_t BandId, SharedHeartRate::Sample& Out) const
+	{
+		if (!Region.View || BandId >= SharedHeartRate::MaxBands)
+		{
+			return false;
+		}
+		const auto& Band = Region.View->Bands[BandId];
+		uint64_t Index = 0;
+		for (int Attempt = 0; Attempt < MaxAttempts; ++Attempt)
+		{
+			if (SharedHeartRate::ReadSlot(Band.Latest, Index, Out))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Last status code sent for the band (200 = connected and
+	// authenticated), 0 if none
+	uint32_t ReadStatus(uint8_t BandId) const
+	{
+		if (!Region.View || BandId >= SharedHeartRate::MaxBands)
+		{
+			return 0;
+		}
+		return Region.View->Bands[BandId].Status.load(
+			std::memory_order_relaxed);
+	}
+
+	// Copies up to Max samples of the band written since Cursor, oldest
+	// first, and moves Cursor past them. Start with a Cursor of 0. Samples
+	// the ring overwrote before they were read are skipped and added to
+	// Lost. Returns the samples copied.
+	size_t ReadSamples(uint8_t BandId, uint64_t& Cursor,
+		SharedHeartRate::Sample* Out, size_t Max, uint64_t* Lost = nullptr)
+		const
+	{
+		if (!Region.View || BandId >= SharedHeartRate::MaxBands)
+		{
+			return 0;
+		}
+		const auto& Band = Region.View->Bands[BandId];
+		const uint64_t Written = Band.Written.load(std::memory_order_acquire);
+		size_t Count = 0;
+		while (Cursor < Written && Count < Max)
+		{
+			if (Written - Cursor > SharedHeartRate::RingCapacity)
+			{
+				Skip(Cursor, Written - SharedHeartRate::RingCapacity, Lost);
+			}
+			const auto& Source =
+				Band.Ring[Cursor % SharedHeartRate::RingCapacity];
+			uint64_t Index = 0;
+			bool bRead = false;
+			for (int Attempt = 0; Attempt < MaxAttempts && !bRead; ++Attempt)
+			{
+				bRead = SharedHeartRate::ReadSlot(Source, Index, Out[Count]);
+			}
+			if (!bRead || Index != Cursor)
+			{
+				// Overwritten by a later lap while reading
+				Skip(Cursor, Cursor + 1, Lost);
+				continue;
+			}
+			++Count;
+			++Cursor;
+		}
+		return Count;
+	}
+
+private:
+	static constexpr int MaxAttempts = 16;
+
+	static void Skip(uint64_t& Cursor, uint64_t To, uint64_t* Lost)
+	{
+		if (Lost)
+		{
+			*Lost += To - Cursor;
+		}
+		Cursor = To;
+	}
+
+	SharedHeartRate::Mapping Region;
+};
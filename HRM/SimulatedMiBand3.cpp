@@ -0,0 +1,451 @@
+#include "pch.h"
+#include "SimulatedMiBand3.h"
+#include <algorithm>
+#include <limits>
+#include <openssl/evp.h>
+
+namespace
+{
+	constexpr uint64_t Never = std::numeric_limits<uint64_t>::max();
+
+	// Encrypt using aes ecb 128 no padding, as the band checks the challenge
+	std::array<uint8_t, 16> Encrypt(const uint8_t* Data, const uint8_t* Key)
+	{
+		std::array<uint8_t, 16> Encrypted{};
+		int OutLength = 0;
+		EVP_CIPHER_CTX* Context = EVP_CIPHER_CTX_new();
+		EVP_EncryptInit_ex(Context, EVP_aes_128_ecb(), nullptr, Key, nullptr);
+		EVP_CIPHER_CTX_set_padding(Context, 0);
+		EVP_EncryptUpdate(Context, Encrypted.data(), &OutLength, Data, 16);
+		EVP_EncryptFinal_ex(Context, Encrypted.data() + OutLength,
+			&OutLength);
+		EVP_CIPHER_CTX_free(Context);
+		return Encrypted;
+	}
+}
+
+SimulatedMiBand3::SimulatedMiBand3(const SimulatedBandSettings& Settings) :
+	Settings(Settings), bRunning(false), bConnected(false),
+	Epoch(std::chrono::steady_clock::now()), ManualNow(0),
+	bPaired(Settings.bPaired), Key(Settings.PairedKey), Challenge{},
+	bChallengeSent(false), bContinuous(false), NextMeasurement(Never),
+	LastPing(0), StallUntil(0), Measurements(0), Random(Settings.Seed)
+{
+	bNotifying.fill(false);
+}
+
+SimulatedMiBand3::~SimulatedMiBand3()
+{
+	Close();
+}
+
+void SimulatedMiBand3::SetNotificationHandler(NotificationHandler Handler)
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	OnNotification = Handler;
+}
+
+void SimulatedMiBand3::SetDisconnectionHandler(DisconnectionHandler Handler)
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	OnDisconnection = Handler;
+}
+
+void SimulatedMiBand3::SetWriteObserver(WriteObserver Observer)
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	OnWrite = Observer;
+}
+
+SimulatedMiBand3::Counters SimulatedMiBand3::GetCounters()
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	return Stats;
+}
+
+uint64_t SimulatedMiBand3::Now()
+{
+	if (Settings.bManualClock)
+	{
+		return ManualNow;
+	}
+	return static_cast<uint64_t>(
+		std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - Epoch).count());
+}
+
+// Any address connects, the simulated band is always in range.
+void SimulatedMiBand3::Open(uint64_t, Completion Done)
+{
+	{
+		std::unique_lock<std::mutex> Guard(Lock);
+		bConnected = true;
+		if (!Settings.bManualClock && !bRunning)
+		{
+			if (Worker.joinable() &&
+				Worker.get_id() == std::this_thread::get_id())
+			{
+				// Closed and reopened from its own callbacks, the loop is
+				// still running and carries on
+				bRunning = true;
+			}
+			else
+			{
+				// A worker closed from its own thread wasn't joined, it is
+				// leaving its loop now
+				if (Worker.joinable())
+				{
+					Guard.unlock();
+					Worker.join();
+					Guard.lock();
+				}
+				bRunning = true;
+				Worker = std::thread([this] { Run(); });
+			}
+		}
+	}
+	Done(true);
+}
+
+void SimulatedMiBand3::Close()
+{
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		bConnected = false;
+		bContinuous = false;
+		bRunning = false;
+		Pending.clear();
+	}
+	Wakeup.notify_all();
+	if (Worker.joinable() && Worker.get_id() != std::this_thread::get_id())
+	{
+		Worker.join();
+	}
+}
+
+void SimulatedMiBand3::Write(GattChannel Channel, const uint8_t* Data,
+	uint32_t Size, Completion Done)
+{
+	WriteObserver Observer;
+	bool bAccepted = false;
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		if (bConnected)
+		{
+			bAccepted = true;
+			Observer = OnWrite;
+			switch (Channel)
+			{
+			case GattChannel::Authentication:
+				HandleAuthentication(Data, Size);
+				break;
+			case GattChannel::HeartRateControlPoint:
+				HandleHeartRateControl(Data, Size);
+				break;
+			case GattChannel::Alert:
+				++Stats.Vibrations;
+				break;
+			case GattChannel::NewAlert:
+				++Stats.Messages;
+				break;
+			default:
+				break;
+			}
+		}
+	}
+	if (bAccepted)
+	{
+		Wakeup.notify_all();
+		if (Observer)
+		{
+			Observer(Channel, Data, Size);
+		}
+	}
+	Done(bAccepted);
+}
+
+// Only the auth and heart rate measurement characteristics notify.
+void SimulatedMiBand3::EnableNotifications(GattChannel Channel,
+	Completion Done)
+{
+	bool bEnabled = false;
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		if (bConnected && (Channel == GattChannel::Authentication ||
+			Channel == GattChannel::HeartRateMeasurement))
+		{
+			bNotifying[static_cast<size_t>(Channel)] = true;
+			bEnabled = true;
+		}
+	}
+	Done(bEnabled);
+}
+
+// fee1 handshake: 0x01 stores a new key, 0x02 asks for a random challenge and
+// 0x03 answers it encrypted with the key. Every step is answered with
+// 0x10, step, 0x01 on success or 0x04 on failure.
+void SimulatedMiBand3::HandleAuthentication(const uint8_t* Data,
+	uint32_t Size)
+{
+	if (Size < 2)
+	{
+		return;
+	}
+	if (Data[0] == 0x01)
+	{
+		if (Size == 2 + Key.size())
+		{
+			std::copy(Data + 2, Data + Size, Key.begin());
+			bPaired = true;
+			Respond(GattChannel::Authentication, { 0x10, 0x01, 0x01 });
+		}
+		else
+		{
+			Respond(GattChannel::Authentication, { 0x10, 0x01, 0x04 });
+		}
+	}
+	else if (Data[0] == 0x02)
+	{
+		for (auto& Byte : Challenge)
+		{
+			Byte = static_cast<uint8_t>(Random());
+		}
+		bChallengeSent = true;
+		std::vector<uint8_t> Answer{ 0x10, 0x02, 0x01 };
+		Answer.insert(Answer.end(), Challenge.begin(), Challenge.end());
+		Respond(GattChannel::Authentication, Answer);
+	}
+	else if (Data[0] == 0x03)
+	{
+		bool bValid = bChallengeSent && bPaired && Size == 2 + Key.size() &&
+			Encrypt(Challenge.data(), Key.data()) ==
+			*reinterpret_cast<const std::array<uint8_t, 16>*>(Data + 2);
+		bChallengeSent = false;
+		if (bValid)
+		{
+			++Stats.AuthSuccesses;
+			Respond(GattChannel::Authentication, { 0x10, 0x03, 0x01 });
+		}
+		else
+		{
+			++Stats.AuthFailures;
+			Respond(GattChannel::Authentication, { 0x10, 0x03, 0x04 });
+		}
+	}
+}
+
+// 0x15 0x01 x turns continuous monitoring on or off, 0x15 0x02 0x01 asks for
+// a single measurement and 0x16 keeps continuous monitoring alive.
+void SimulatedMiBand3::HandleHeartRateControl(const uint8_t* Data,
+	uint32_t Size)
+{
+	const uint64_t Time = Now();
+	if (Size == 1 && Data[0] == 0x16)
+	{
+		++Stats.Pings;
+		LastPing = Time;
+	}
+	else if (Size == 3 && Data[0] == 0x15 && Data[1] == 0x01)
+	{
+		bContinuous = Data[2] == 0x01;
+		NextMeasurement = bContinuous ?
+			Time + Settings.NotificationInterval : Never;
+		LastPing = Time;
+	}
+	else if (Size == 3 && Data[0] == 0x15 && Data[1] == 0x02 &&
+		Data[2] == 0x01)
+	{
+		uint8_t Bpm = static_cast<uint8_t>(Settings.Bpm);
+		Notification OneShot{ Time + Settings.NotificationInterval,
+			GattChannel::HeartRateMeasurement, Measurement(Bpm) };
+		auto Position = std::upper_bound(Pending.begin(), Pending.end(),
+			OneShot.Due, [](uint64_t Due, const Notification& Other) {
+				return Due < Other.Due;
+			});
+		Pending.insert(Position, OneShot);
+	}
+}
+
+// Queues a notification answering a write, if the host enabled them.
+void SimulatedMiBand3::Respond(GattChannel Channel, std::vector<uint8_t> Data)
+{
+	if (!bNotifying[static_cast<size_t>(Channel)])
+	{
+		return;
+	}
+	Notification Answer{ Now() + Settings.ResponseLatency, Channel,
+		std::move(Data) };
+	auto Position = std::upper_bound(Pending.begin(), Pending.end(),
+		Answer.Due, [](uint64_t Due, const Notification& Other) {
+			return Due < Other.Due;
+		});
+	Pending.insert(Position, std::move(Answer));
+}
+
+std::vector<uint8_t> SimulatedMiBand3::Measurement(uint8_t Bpm)
+{
+	if (!Settings.bRrIntervals)
+	{
+		return { 0x00, Bpm };
+	}
+	// The beats of one notification interval, each within 3% of the mean
+	std::vector<uint8_t> Data{ 0x10, Bpm };
+	const uint32_t Beats = std::max(1u, std::min(8u,
+		(Settings.NotificationInterval * Bpm + 30000) / 60000));
+	const int Mean = 60 * 1024 / std::max<int>(Bpm, 1);
+	for (uint32_t i = 0; i < Beats; ++i)
+	{
+		const int Spread = Mean * 3 / 100;
+		const int Rr = Mean + (Spread > 0 ? static_cast<int>(
+			Random() % (2 * Spread + 1)) - Spread : 0);
+		Data.push_back(static_cast<uint8_t>(Rr));
+		Data.push_back(static_cast<uint8_t>(Rr >> 8));
+	}
+	return Data;
+}
+
+uint64_t SimulatedMiBand3::NextEvent()
+{
+	uint64_t Next = bContinuous ? NextMeasurement : Never;
+	if (!Pending.empty())
+	{
+		Next = std::min(Next, Pending.front().Due);
+	}
+	return Next;
+}
+
+void SimulatedMiBand3::Collect(uint64_t Time, std::vector<Notification>& Out,
+	bool& bDisconnected)
+{
+	while (!Pending.empty() && Pending.front().Due <= Time)
+	{
+		Out.push_back(std::move(Pending.front()));
+		Pending.pop_front();
+	}
+
+	while (bContinuous && NextMeasurement <= Time)
+	{
+		const uint64_t Due = NextMeasurement;
+		NextMeasurement += Settings.NotificationInterval;
+		// The band gives up on continuous monitoring without pings
+		if (Settings.PingTimeout > 0 && Due - LastPing > Settings.PingTimeout)
+		{
+			bContinuous = false;
+			NextMeasurement = Never;
+			break;
+		}
+		if (Due < StallUntil)
+		{
+			continue;
+		}
+
+		int Jitter = Settings.BpmJitter > 0 ? static_cast<int>(
+			Random() % (2 * Settings.BpmJitter + 1)) - Settings.BpmJitter : 0;
+		uint8_t Bpm = static_cast<uint8_t>(std::max(30, std::min(220,
+			Settings.Bpm + Jitter)));
+		if (bNotifying[static_cast<size_t>(GattChannel::HeartRateMeasurement)])
+		{
+			Out.push_back(Notification{ Due,
+				GattChannel::HeartRateMeasurement, Measurement(Bpm) });
+		}
+		++Measurements;
+		++Stats.Notifications;
+
+		if (Settings.StallEvery > 0 &&
+			Measurements % Settings.StallEvery == 0)
+		{
+			StallUntil = Due + Settings.StallDuration;
+			++Stats.Stalls;
+		}
+		if (Settings.DisconnectAfter > 0 &&
+			Measurements >= Settings.DisconnectAfter)
+		{
+			bConnected = false;
+			bContinuous = false;
+			NextMeasurement = Never;
+			Pending.clear();
+			bDisconnected = true;
+			break;
+		}
+	}
+}
+
+// Runs the handlers, without the lock so they can write back.
+void SimulatedMiBand3::Deliver(std::vector<Notification>& Ready,
+	bool bDisconnected)
+{
+	NotificationHandler Handler;
+	DisconnectionHandler Disconnection;
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		Handler = OnNotification;
+		Disconnection = OnDisconnection;
+	}
+	for (auto& Item : Ready)
+	{
+		if (Handler)
+		{
+			Handler(Item.Channel, Item.Data.data(),
+				static_cast<uint32_t>(Item.Data.size()));
+		}
+	}
+	Ready.clear();
+	if (bDisconnected && Disconnection)
+	{
+		Disconnection();
+	}
+}
+
+// Simulation thread, sleeps until the next event is due.
+void SimulatedMiBand3::Run()
+{
+	std::vector<Notification> Ready;
+	std::unique_lock<std::mutex> Guard(Lock);
+	while (bRunning)
+	{
+		const uint64_t Next = NextEvent();
+		if (Next == Never)
+		{
+			Wakeup.wait(Guard);
+		}
+		else if (Next > Now())
+		{
+			Wakeup.wait_until(Guard, Epoch + std::chrono::milliseconds(Next));
+		}
+		if (!bRunning)
+		{
+			break;
+		}
+		bool bDisconnected = false;
+		Collect(Now(), Ready, bDisconnected);
+		if (Ready.empty() && !bDisconnected)
+		{
+			continue;
+		}
+		Guard.unlock();
+		Deliver(Ready, bDisconnected);
+		Guard.lock();
+	}
+}
+
+void SimulatedMiBand3::Advance(uint32_t Milliseconds)
+{
+	std::vector<Notification> Ready;
+	std::unique_lock<std::mutex> Guard(Lock);
+	const uint64_t Target = ManualNow + Milliseconds;
+	while (true)
+	{
+		const uint64_t Next = NextEvent();
+		if (Next > Target)
+		{
+			break;
+		}
+		ManualNow = std::max(ManualNow, Next);
+		bool bDisconnected = false;
+		Collect(ManualNow, Ready, bDisconnected);
+		Guard.unlock();
+		Deliver(Ready, bDisconnected);
+		Guard.lock();
+	}
+	ManualNow = Target;
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "GattTransport.h"
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+// Behaviour of a simulated MiBand 3
+struct SimulatedBandSettings
+{
+	// Milliseconds between heart rate notifications while streaming
+	uint32_t NotificationInterval = 1000;
+	// Heart rate reported, varied randomly by up to +-BpmJitter
+	uint16_t Bpm = 70;
+	uint16_t BpmJitter = 5;
+	// Notifications also carry the RR intervals of the beats since the
+	// previous one, as chest straps send them. The MiBand 3 never does.
+	bool bRrIntervals = false;
+	// Milliseconds between a write and the notification answering it
+	uint32_t ResponseLatency = 0;
+	// Continuous monitoring stops if no ping arrives for this many
+	// milliseconds, as the real band does. 0 never stops.
+	uint32_t PingTimeout = 15000;
+	// After every StallEvery notifications the band stops notifying for
+	// StallDuration milliseconds. 0 never stalls.
+	uint32_t StallEvery = 0;
+	uint32_t StallDuration = 0;
+	// The band disconnects after this many notifications. 0 never does.
+	uint32_t DisconnectAfter = 0;
+	// Key already paired with the band. If unpaired, or the host uses another
+	// key, the first handshake fails and the host has to send its key.
+	bool bPaired = false;
+	std::array<uint8_t, 16> PairedKey{};
+	// Seed of the random keys and heart rate variation
+	uint32_t Seed = 1;
+	// Without a clock thread, time only moves through Advance(), which makes
+	// runs fully deterministic
+	bool bManualClock = false;
+};
+
+// In-process MiBand 3 peripheral. Implements the fee1 auth handshake, the
+// heart rate control point and notifications, and records the alerts, so the
+// whole pipeline runs without Bluetooth hardware. Notifications are delivered
+// from the simulation thread, like the WinRT callbacks, or from Advance() on a
+// manual clock. Only standard C++ and OpenSSL, it builds on any platform.
+class SimulatedMiBand3 : public GattTransport
+{
+public:
+	explicit SimulatedMiBand3(const SimulatedBandSettings& Settings);
+	~SimulatedMiBand3() override;
+
+	void Open(uint64_t Address, Completion Done) override;
+	void Close() override;
+
+	void Write(GattChannel Channel, const uint8_t* Data, uint32_t Size,
+		Completion Done) override;
+	void EnableNotifications(GattChannel Channel, Completion Done) override;
+
+	void SetNotificationHandler(NotificationHandler Handler) override;
+	void SetDisconnectionHandler(DisconnectionHandler Handler) override;
+
+	// Moves the manual clock forward, delivering everything due meanwhile
+	void Advance(uint32_t Milliseconds);
+
+	// Called with every write the band receives, on the writer's thread
+	using WriteObserver = std::function<void(GattChannel Channel,
+		const uint8_t* Data, uint32_t Size)>;
+	void SetWriteObserver(WriteObserver Observer);
+
+	struct Counters
+	{
+		uint64_t Notifications = 0;
+		uint64_t Stalls = 0;
+		uint64_t Pings = 0;
+		uint64_t Vibrations = 0;
+		uint64_t Messages = 0;
+		uint64_t AuthSuccesses = 0;
+		uint64_t AuthFailures = 0;
+	};
+	Counters GetCounters();
+
+private:
+	struct Notification
+	{
+		uint64_t Due;
+		GattChannel Channel;
+		std::vector<uint8_t> Data;
+	};
+
+	uint64_t Now();
+	void Run();
+	// Collects everything due at the given time. Lock must be held.
+	void Collect(uint64_t Time, std::vector<Notification>& Out,
+		bool& bDisconnected);
+	void Deliver(std::vector<Notification>& Ready, bool bDisconnected);
+	// Earliest time something happens. Lock must be held.
+	uint64_t NextEvent();
+
+	// Handle writes, lock must be held
+	void HandleAuthentication(const uint8_t* Data, uint32_t Size);
+	void HandleHeartRateControl(const uint8_t* Data, uint32_t Size);
+	void Respond(GattChannel Channel, std::vector<uint8_t> Data);
+	// 0x2a37 notification of the given heart rate. Lock must be held.
+	std::vector<uint8_t> Measurement(uint8_t Bpm);
+
+	SimulatedBandSettings Settings;
+
+	std::mutex Lock;
+	std::condition_variable Wakeup;
+	std::thread Worker;
+	bool bRunning;
+	bool bConnected;
+
+	std::chrono::steady_clock::time_point Epoch;
+	uint64_t ManualNow;
+
+	std::array<bool, static_cast<size_t>(GattChannel::Count)> bNotifying;
+	// Answers to writes waiting for their due time, in order
+	std::deque<Notification> Pending;
+
+	// Auth state
+	bool bPaired;
+	std::array<uint8_t, 16> Key;
+	std::array<uint8_t, 16> Challenge;
+	bool bChallengeSent;
+
+	// Heart rate state
+	bool bContinuous;
+	uint64_t NextMeasurement;
+	uint64_t LastPing;
+	uint64_t StallUntil;
+	uint64_t Measurements;
+
+	std::mt19937 Random;
+	Counters Stats;
+
+	NotificationHandler OnNotification;
+	DisconnectionHandler OnDisconnection;
+	WriteObserver OnWrite;
+};
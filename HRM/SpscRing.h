@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Preallocated lock-free ring for exactly one producer thread and one consumer
+// thread. Pushing and popping never allocate nor block; when the ring is full
+// the push fails and is counted as an overflow.
+template <typename T, size_t Capacity>
+class SpscRing
+{
+	static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+		"SpscRing capacity must be a power of two");
+
+public:
+	SpscRing() : Head(0), CachedTail(0), Tail(0), CachedHead(0),
+		OverflowCount(0)
+	{
+	}
+
+	SpscRing(const SpscRing&) = delete;
+	SpscRing& operator=(const SpscRing&) = delete;
+
+	// Producer side. Returns false, and counts an overflow, if the ring is
+	// full.
+	bool TryPush(const T& Item)
+	{
+		const size_t CurrentHead = Head.load(std::memory_order_relaxed);
+		if (CurrentHead - CachedTail == Capacity)
+		{
+			// Refresh the consumer position only when the ring looks full
+			CachedTail = Tail.load(std::memory_order_acquire);
+			if (CurrentHead - CachedTail == Capacity)
+			{
+				OverflowCount.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+		}
+		Slots[CurrentHead & (Capacity - 1)] = Item;
+		Head.store(CurrentHead + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer side. Returns false if the ring is empty.
+	bool TryPop(T& Item)
+	{
+		const size_t CurrentTail = Tail.load(std::memory_order_relaxed);
+		if (CurrentTail == CachedHead)
+		{
+			// Refresh the producer position only when the ring looks empty
+			CachedHead = Head.load(std::memory_order_acquire);
+			if (CurrentTail == CachedHead)
+			{
+				return false;
+			}
+		}
+		Item = Slots[CurrentTail & (Capacity - 1)];
+		Tail.store(CurrentTail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Approximate number of queued items, exact when called from either side
+	// while the other one is idle.
+	size_t Size() const
+	{
+		return Head.load(std::memory_order_acquire) -
+			Tail.load(std::memory_order_acquire);
+	}
+
+	uint64_t Overflows() const
+	{
+		return OverflowCount.load(std::memory_order_relaxed);
+	}
+
+	static constexpr size_t GetCapacity()
+	{
+		return Capacity;
+	}
+
+private:
+	// Producer and consumer positions live on separate cache lines, each one
+	// next to the cached copy of the other side's position.
+	alignas(64) std::atomic<size_t> Head;
+	size_t CachedTail;
+	alignas(64) std::atomic<size_t> Tail;
+	size_t CachedHead;
+	alignas(64) std::atomic<uint64_t> OverflowCount;
+	alignas(64) T Slots[Capacity];
+};
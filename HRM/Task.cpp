@@ -0,0 +1,90 @@
+#include "pch.h"
+#include "Task.h"
+#include <array>
+#include <atomic>
+#include <new>
+
+namespace
+{
+	constexpr size_t Granularity = 64;
+	constexpr size_t SizeClasses = 32;
+	// Frames kept per size class and thread, the rest go back to the heap
+	constexpr uint32_t MaxFreeFrames = 64;
+
+	struct FreeFrame
+	{
+		FreeFrame* Next;
+	};
+
+	// Free lists of the calling thread, emptied when it exits
+	struct FrameCache
+	{
+		std::array<FreeFrame*, SizeClasses> First{};
+		std::array<uint32_t, SizeClasses> Count{};
+
+		~FrameCache()
+		{
+			for (FreeFrame* Frame : First)
+			{
+				while (Frame)
+				{
+					FreeFrame* Next = Frame->Next;
+					::operator delete(Frame);
+					Frame = Next;
+				}
+			}
+		}
+	};
+
+	thread_local FrameCache Cache;
+
+	std::atomic<uint64_t> AllocatedFrames(0);
+	std::atomic<uint64_t> ReusedFrames(0);
+
+	// Size class of a frame, SizeClasses if too big to pool
+	size_t ClassOf(size_t Size)
+	{
+		return Size == 0 ? 0 : (Size - 1) / Granularity;
+	}
+}
+
+void* Async::FramePool::Allocate(size_t Size)
+{
+	const size_t Class = ClassOf(Size);
+	if (Class >= SizeClasses)
+	{
+		AllocatedFrames.fetch_add(1, std::memory_order_relaxed);
+		return ::operator new(Size);
+	}
+	if (FreeFrame* Frame = Cache.First[Class])
+	{
+		Cache.First[Class] = Frame->Next;
+		--Cache.Count[Class];
+		ReusedFrames.fetch_add(1, std::memory_order_relaxed);
+		return Frame;
+	}
+	AllocatedFrames.fetch_add(1, std::memory_order_relaxed);
+	return ::operator new((Class + 1) * Granularity);
+}
+
+void Async::FramePool::Free(void* Frame, size_t Size)
+{
+	const size_t Class = ClassOf(Size);
+	if (Class >= SizeClasses || Cache.Count[Class] >= MaxFreeFrames)
+	{
+		::operator delete(Frame);
+		return;
+	}
+	FreeFrame* Free = static_cast<FreeFrame*>(Frame);
+	Free->Next = Cache.First[Class];
+	Cache.First[Class] = Free;
+	++Cache.Count[Class];
+}
+
+Async::FramePool::Stats Async::FramePool::GetStats()
+{
+	Stats Result;
+	Result.Allocated = AllocatedFrames.load(std::memory_order_relaxed);
+	Result.Reused = ReusedFrames.load(std::memory_order_relaxed);
+	return Result;
+}
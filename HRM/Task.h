@@ -0,0 +1,236 @@
+#pragma once
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <utility>
+
+// Coroutine layer of the project, standard C++20 only. A Task is lazy: it
+// starts when awaited, and resumes its awaiter by symmetric transfer when it
+// finishes, so chains of tasks completing synchronously never grow the
+// stack. Frames come from a pool, so a steady stream of tasks doesn't touch
+// the heap. Where a task resumes is up to what it awaits, see Awaitables.h.
+namespace Async
+{
+	// Recycles coroutine frames by size, in blocks of 64 bytes up to 2 KB.
+	// Every thread keeps its own free lists, a frame freed on another thread
+	// than the one that allocated it just moves to that thread's lists.
+	namespace FramePool
+	{
+		void* Allocate(size_t Size);
+		void Free(void* Frame, size_t Size);
+
+		struct Stats
+		{
+			// Frames taken from the heap, and reused from a free list
+			uint64_t Allocated = 0;
+			uint64_t Reused = 0;
+		};
+		Stats GetStats();
+	}
+
+	template <typename T = void>
+	class Task;
+
+	namespace Detail
+	{
+		// Resumes whoever awaits the finished coroutine
+		struct FinalAwaiter
+		{
+			bool await_ready() const noexcept { return false; }
+
+			template <typename Promise>
+			std::coroutine_handle<> await_suspend(
+				std::coroutine_handle<Promise> Finished) const noexcept
+			{
+				std::coroutine_handle<> Continuation =
+					Finished.promise().Continuation;
+				return Continuation ? Continuation : std::noop_coroutine();
+			}
+
+			void await_resume() const noexcept {}
+		};
+
+		struct PromiseBase
+		{
+			std::coroutine_handle<> Continuation;
+			std::exception_ptr Error;
+
+			static void* operator new(size_t Size)
+			{
+				return FramePool::Allocate(Size);
+			}
+			static void operator delete(void* Frame, size_t Size)
+			{
+				FramePool::Free(Frame, Size);
+			}
+
+			std::suspend_always initial_suspend() const noexcept { return {}; }
+			FinalAwaiter final_suspend() const noexcept { return {}; }
+			// Rethrown to the awaiter
+			void unhandled_exception() noexcept
+			{
+				Error = std::current_exception();
+			}
+		};
+
+		template <typename T>
+		struct Promise : PromiseBase
+		{
+			std::optional<T> Value;
+
+			Task<T> get_return_object() noexcept;
+
+			template <typename U>
+			void return_value(U&& Result)
+			{
+				Value.emplace(std::forward<U>(Result));
+			}
+
+			T TakeResult()
+			{
+				if (Error)
+				{
+					std::rethrow_exception(Error);
+				}
+				return std::move(*Value);
+			}
+		};
+
+		template <>
+		struct Promise<void> : PromiseBase
+		{
+			Task<void> get_return_object() noexcept;
+
+			void return_void() const noexcept {}
+
+			void TakeResult()
+			{
+				if (Error)
+				{
+					std::rethrow_exception(Error);
+				}
+			}
+		};
+	}
+
+	// Coroutine returning a T to the coroutine awaiting it. Owns its frame,
+	// which goes away with the task.
+	template <typename T>
+	class [[nodiscard]] Task
+	{
+	public:
+		using promise_type = Detail::Promise<T>;
+
+		explicit Task(std::coroutine_handle<promise_type> Handle) noexcept :
+			Handle(Handle)
+		{
+		}
+
+		Task(Task&& Other) noexcept : Handle(std::exchange(Other.Handle,
+			nullptr))
+		{
+		}
+
+		Task& operator=(Task&& Other) noexcept
+		{
+			if (this != &Other)
+			{
+				if (Handle)
+				{
+					Handle.destroy();
+				}
+				Handle = std::exchange(Other.Handle, nullptr);
+			}
+			return *this;
+		}
+
+		Task(const Task&) = delete;
+		Task& operator=(const Task&) = delete;
+
+		~Task()
+		{
+			if (Handle)
+			{
+				Handle.destroy();
+			}
+		}
+
+		bool await_ready() const noexcept { return false; }
+
+		// Starts the task in place of the awaiting coroutine
+		std::coroutine_handle<> await_suspend(
+			std::coroutine_handle<> Awaiting) noexcept
+		{
+			Handle.promise().Continuation = Awaiting;
+			return Handle;
+		}
+
+		T await_resume()
+		{
+			return Handle.promise().TakeResult();
+		}
+
+	private:
+		std::coroutine_handle<promise_type> Handle;
+	};
+
+	namespace Detail
+	{
+		template <typename T>
+		Task<T> Promise<T>::get_return_object() noexcept
+		{
+			return Task<T>(
+				std::coroutine_handle<Promise<T>>::from_promise(*this));
+		}
+
+		inline Task<void> Promise<void>::get_return_object() noexcept
+		{
+			return Task<void>(
+				std::coroutine_handle<Promise<void>>::from_promise(*this));
+		}
+
+		// Coroutine nobody awaits, its frame goes away when it finishes
+		struct Detached
+		{
+			struct promise_type
+			{
+				static void* operator new(size_t Size)
+				{
+					return FramePool::Allocate(Size);
+				}
+				static void operator delete(void* Frame, size_t Size)
+				{
+					FramePool::Free(Frame, Size);
+				}
+
+				Detached get_return_object() const noexcept { return {}; }
+				std::suspend_never initial_suspend() const noexcept
+				{
+					return {};
+				}
+				std::suspend_never final_suspend() const noexcept
+				{
+					return {};
+				}
+				void return_void() const noexcept {}
+				void unhandled_exception() const noexcept { std::terminate(); }
+			};
+		};
+
+		inline Detached RunDetached(Task<void> Work)
+		{
+			co_await Work;
+		}
+	}
+
+	// Starts the task on the calling thread and lets it run to completion on
+	// its own. An exception escaping it ends the process, as an unobserved
+	// exception of a PPL task did.
+	inline void Spawn(Task<void> Work)
+	{
+		Detail::RunDetached(std::move(Work));
+	}
+}
@@ -0,0 +1,306 @@
+// Runs the coroutine layer of Task.h and Awaitables.h and the portable part of
+// the heart rate path against the simulated band. GATT commands are awaited
+// through GattCommandQueue on a reactor. Heart rate notifications go through
+// HeartRateStream, from the bytes to the frames, and the frames into an
+// OutputBuffer emptied by a pump, as OutputQueue does; MiBand3, SampleDelivery
+// and OutputQueue add the WinRT sockets and their threads around that same
+// code. Delivery runs as a coroutine on the reactor. Prints the coroutine
+// frames taken from the heap or reused from the pool and the heap
+// allocations, per command and per sample, and fails if the notification,
+// delivery or output stage allocates once warmed up, in binary and in text
+// mode. Built with HRM_COUNT_ALLOCATIONS by the portable CMake target, run by
+// ctest. The WinRT socket writes are only measured by "--bench alloc" on
+// Windows.
+
+#include "AllocationBudget.h"
+#include "Awaitables.h"
+#include "GattCommandQueue.h"
+#include "HeartRateStream.h"
+#include "OutputBuffer.h"
+#include "SimulatedMiBand3.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+	constexpr uint32_t WarmUpCommands = 100;
+	constexpr uint32_t Commands = 1000;
+
+	// Messages the client queue holds, as the subscriber queues of the
+	// service
+	constexpr uint32_t QueueCapacity = 256;
+
+	// Subscriber queue of the client, filled as OutputQueue::Enqueue does and
+	// emptied as its pump does, up to the socket write. Datagrams are only
+	// counted, their socket writes allocate on Windows anyway.
+	class ClientOutput : public HeartRateSink
+	{
+	public:
+		ClientOutput() : Pending(QueueCapacity), Messages(0), Datagrams(0)
+		{
+			// Every queued message may be as big as an HRV frame, so no
+			// batch grows either buffer
+			Pending.Reserve(QueueCapacity * SampleFrames::MaxHrvFrameSize);
+			Sending.reserve(QueueCapacity * SampleFrames::MaxHrvFrameSize);
+		}
+
+		void Send(SampleFrames::FrameType, const uint8_t* Data,
+			uint32_t Size) override
+		{
+			HRM_ALLOCATION_STAGE(Output);
+			std::lock_guard<std::mutex> Guard(Lock);
+			if (!Pending.IsFull())
+			{
+				Pending.Push(Data, Size);
+			}
+		}
+
+		void SendDatagram(const uint8_t*, uint32_t) override
+		{
+			++Datagrams;
+		}
+
+		void Pump()
+		{
+			HRM_ALLOCATION_STAGE(Output);
+			std::lock_guard<std::mutex> Guard(Lock);
+			Messages += Pending.GetCount();
+			Pending.Take(Sending);
+		}
+
+		uint64_t GetMessages() const { return Messages; }
+		uint64_t GetDatagrams() const { return Datagrams; }
+
+	private:
+		std::mutex Lock;
+		OutputBuffer Pending;
+		std::vector<uint8_t> Sending;
+		uint64_t Messages;
+		uint64_t Datagrams;
+	};
+
+	// Frames and heap allocations since a starting point
+	struct Usage
+	{
+		Async::FramePool::Stats Frames;
+		AllocationBudget::Snapshot Allocations;
+
+		static Usage Take()
+		{
+			return { Async::FramePool::GetStats(), AllocationBudget::Take() };
+		}
+	};
+
+	struct Pipeline
+	{
+		explicit Pipeline(const SimulatedBandSettings& Settings) :
+			Band(Settings), Queue(Band), Stream(1, nullptr), Timestamp(0),
+			Mode(SampleFrames::FrameMode::Binary), Delivered(0),
+			bStopping(false), bWithinBudget(false), bWritesFailed(false)
+		{
+		}
+
+		ReactorPool Pool;
+		TimerWheel Timers;
+		SimulatedMiBand3 Band;
+		GattCommandQueue Queue;
+
+		// Notification thread to reactor
+		HeartRateStream Stream;
+		Async::Event SampleQueued;
+		// Microseconds of the notifications, one a second as a real band
+		// sends them. The simulated band notifies far more often, which
+		// would overflow the windows reserved for real rates.
+		uint64_t Timestamp;
+
+		// Owned by the reactor
+		SampleFrames::FrameMode Mode;
+		ClientOutput Output;
+		uint64_t Delivered;
+
+		std::atomic<bool> bStopping;
+		Async::Event Finished;
+		Async::Event Stopped;
+		bool bWithinBudget;
+		bool bWritesFailed;
+	};
+
+	void PrintFrames(const char* Path, const Usage& Before,
+		const Usage& After, uint64_t Count)
+	{
+		const uint64_t Allocated = After.Frames.Allocated -
+			Before.Frames.Allocated;
+		const uint64_t Reused = After.Frames.Reused - Before.Frames.Reused;
+		std::cout << Path << ": " << Count << ", frames per " << Path
+			<< " " << static_cast<double>(Allocated) / Count
+			<< " from the heap, " << static_cast<double>(Reused) / Count
+			<< " reused" << std::endl;
+	}
+
+	// Notification thread, as MiBand3::HandleHeartRateNotifications
+	void OnNotification(Pipeline& Target, GattChannel Channel,
+		const uint8_t* Data, uint32_t Size)
+	{
+		HRM_ALLOCATION_STAGE(Notification);
+		if (Channel != GattChannel::HeartRateMeasurement)
+		{
+			return;
+		}
+		Target.Timestamp += 1000000;
+		Target.Stream.Publish(Data, Size, Target.Timestamp);
+		Target.SampleQueued.Set();
+	}
+
+	// One drain, as MiBand3::DrainSamples, in a short lived task as the
+	// delivery stage runs them
+	Async::Task<uint32_t> DeliverBatch(Pipeline& Target)
+	{
+		HRM_ALLOCATION_STAGE(Delivery);
+		co_return Target.Stream.Drain(Target.Output, Target.Mode, true);
+	}
+
+	Async::Task<void> Deliver(Pipeline& Target)
+	{
+		while (true)
+		{
+			co_await Target.SampleQueued;
+			co_await Async::ResumeOn(Target.Pool.Core());
+			// Reset before draining, a sample queued meanwhile sets it again
+			Target.SampleQueued.Reset();
+			if (Target.bStopping)
+			{
+				Target.Stopped.Set();
+				co_return;
+			}
+			Target.Delivered += co_await DeliverBatch(Target);
+			Target.Output.Pump();
+		}
+	}
+
+	Async::Task<bool> Vibrate(Pipeline& Target)
+	{
+		co_return co_await Async::FromCallback<bool>(Target.Pool.Core(),
+			[&Target](GattTransport::Completion Done) {
+				Target.Queue.Write(GattChannel::Alert, { 0x03 },
+					GattPriority::Haptic, 0, std::move(Done));
+			});
+	}
+
+	Async::Task<bool> Write(Pipeline& Target, GattChannel Channel,
+		std::vector<uint8_t> Data)
+	{
+		co_return co_await Async::FromCallback<bool>(Target.Pool.Core(),
+			[&Target, Channel, &Data](GattTransport::Completion Done) {
+				Target.Queue.Write(Channel, std::move(Data),
+					GattPriority::Control, 0, std::move(Done));
+			});
+	}
+
+	// Samples delivered for that long, false if none or if a steady state
+	// stage allocated
+	Async::Task<bool> Measure(Pipeline& Target, uint32_t Milliseconds,
+		const char* Unit)
+	{
+		const Usage Before = Usage::Take();
+		const uint64_t DeliveredBefore = Target.Delivered;
+		co_await Async::Delay(Target.Timers, Target.Pool.Core(), Milliseconds);
+		const Usage After = Usage::Take();
+		const uint64_t Delivered = Target.Delivered - DeliveredBefore;
+		PrintFrames(Unit, Before, After, std::max<uint64_t>(1, Delivered));
+		co_return Delivered > 0 &&
+			AllocationBudget::Report(Before.Allocations, Delivered, Unit);
+	}
+
+	Async::Task<void> Run(Pipeline& Target)
+	{
+		co_await Async::ResumeOn(Target.Pool.Core());
+		Reactor& Core = Target.Pool.Core();
+		const bool bOpened = co_await Async::FromCallback<bool>(Core,
+			[&Target](GattTransport::Completion Done) {
+				Target.Band.Open(1, std::move(Done));
+			});
+		const bool bEnabled = co_await Async::FromCallback<bool>(Core,
+			[&Target](GattTransport::Completion Done) {
+				Target.Queue.EnableNotifications(
+					GattChannel::HeartRateMeasurement, GattPriority::Control,
+					std::move(Done));
+			});
+		bool bWritten = bOpened && bEnabled;
+
+		// Commands, once the pool and the queue are warmed up
+		for (uint32_t i = 0; i < WarmUpCommands; ++i)
+		{
+			bWritten = co_await Vibrate(Target) && bWritten;
+		}
+		const Usage BeforeCommands = Usage::Take();
+		for (uint32_t i = 0; i < Commands; ++i)
+		{
+			bWritten = co_await Vibrate(Target) && bWritten;
+		}
+		const Usage AfterCommands = Usage::Take();
+		PrintFrames("command", BeforeCommands, AfterCommands, Commands);
+		AllocationBudget::Report(BeforeCommands.Allocations, Commands,
+			"command");
+
+		// Samples, measured for a second in binary mode after a warm up,
+		// then for a tenth of a second in text mode, which prints them
+		Async::Spawn(Deliver(Target));
+		std::vector<uint8_t> Continuous{ 0x15, 0x01, 0x01 };
+		bWritten = co_await Write(Target, GattChannel::HeartRateControlPoint,
+			std::move(Continuous)) && bWritten;
+		co_await Async::Delay(Target.Timers, Core, 300);
+		const bool bBinary = co_await Measure(Target, 1000, "binary sample");
+		Target.Mode = SampleFrames::FrameMode::Text;
+		const bool bText = co_await Measure(Target, 100, "text sample");
+		std::cout << "client: " << Target.Output.GetMessages()
+			<< " messages, " << Target.Output.GetDatagrams() << " datagrams"
+			<< std::endl;
+		Target.bWithinBudget = bBinary && bText;
+		Target.bWritesFailed = !bWritten;
+		Target.Finished.Set();
+	}
+}
+
+int main()
+{
+	SimulatedBandSettings Settings;
+	Settings.NotificationInterval = 2;
+	Settings.bRrIntervals = true;
+	Settings.PingTimeout = 0;
+	Pipeline Target(Settings);
+	Target.Band.SetNotificationHandler([&Target](GattChannel Channel,
+		const uint8_t* Data, uint32_t Size) {
+			OnNotification(Target, Channel, Data, Size);
+		});
+
+	Async::Spawn(Run(Target));
+	while (!Target.Finished.IsSet())
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	// No more notifications, then the delivery task ends on the reactor
+	Target.Band.Close();
+	Target.bStopping = true;
+	Target.SampleQueued.Set();
+	while (!Target.Stopped.IsSet())
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	if (Target.bWritesFailed)
+	{
+		std::cout << "FAILED: GATT writes" << std::endl;
+	}
+	if (!Target.bWithinBudget)
+	{
+		std::cout << "FAILED: the heart rate path allocated" << std::endl;
+	}
+	return !Target.bWritesFailed && Target.bWithinBudget ? 0 : 1;
+}
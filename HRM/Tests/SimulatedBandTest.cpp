@@ -0,0 +1,244 @@
+// Drives the simulated MiBand 3 through GattCommandQueue the way MiBand3 does:
+// the fee1 handshake, continuous heart rate with pings, stalls, the ping
+// timeout and disconnections. The streaming part runs on the manual clock, so
+// every count is exact and two runs with the same seed match byte for byte.
+// Built by the portable CMake target, run by ctest.
+
+#include "GattCommandQueue.h"
+#include "HeartRateMeasurement.h"
+#include "SimulatedMiBand3.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <openssl/evp.h>
+#include <thread>
+#include <vector>
+
+namespace
+{
+	int Failures = 0;
+
+	void Check(bool bCondition, const char* What)
+	{
+		if (!bCondition)
+		{
+			std::cout << "FAILED: " << What << std::endl;
+			++Failures;
+		}
+	}
+
+	std::array<uint8_t, 16> Encrypt(const uint8_t* Data, const uint8_t* Key)
+	{
+		std::array<uint8_t, 16> Encrypted{};
+		int OutLength = 0;
+		EVP_CIPHER_CTX* Context = EVP_CIPHER_CTX_new();
+		EVP_EncryptInit_ex(Context, EVP_aes_128_ecb(), nullptr, Key, nullptr);
+		EVP_CIPHER_CTX_set_padding(Context, 0);
+		EVP_EncryptUpdate(Context, Encrypted.data(), &OutLength, Data, 16);
+		EVP_EncryptFinal_ex(Context, Encrypted.data() + OutLength,
+			&OutLength);
+		EVP_CIPHER_CTX_free(Context);
+		return Encrypted;
+	}
+
+	// Everything the host saw of one session
+	struct SessionLog
+	{
+		std::vector<std::vector<uint8_t>> AuthReplies;
+		std::vector<uint16_t> Bpm;
+		std::vector<uint16_t> RrIntervals;
+		uint32_t Malformed = 0;
+		SimulatedMiBand3::Counters Counters;
+	};
+
+	void Write(GattCommandQueue& Queue, GattChannel Channel,
+		std::vector<uint8_t> Data)
+	{
+		bool bWritten = false;
+		Queue.Write(Channel, std::move(Data), GattPriority::Control, 0,
+			[&bWritten](bool bSuccess) { bWritten = bSuccess; });
+		Check(bWritten, "write accepted");
+	}
+
+	// One minute of streaming on the manual clock: a notification per
+	// second, a 3 s stall after every 10th one and a ping every 10 s, then
+	// 30 s without pings
+	SessionLog RunManualSession(uint32_t Seed)
+	{
+		SimulatedBandSettings Settings;
+		Settings.bManualClock = true;
+		Settings.NotificationInterval = 1000;
+		Settings.bRrIntervals = true;
+		Settings.StallEvery = 10;
+		Settings.StallDuration = 3000;
+		Settings.PingTimeout = 15000;
+		Settings.Seed = Seed;
+		SimulatedMiBand3 Band(Settings);
+		GattCommandQueue Queue(Band);
+
+		SessionLog Log;
+		Band.SetNotificationHandler([&Log](GattChannel Channel,
+			const uint8_t* Data, uint32_t Size) {
+				if (Channel == GattChannel::Authentication)
+				{
+					Log.AuthReplies.emplace_back(Data, Data + Size);
+					return;
+				}
+				HeartRateMeasurement Measurement;
+				if (!DecodeHeartRateMeasurement(Data, Size, Measurement))
+				{
+					++Log.Malformed;
+					return;
+				}
+				Log.Bpm.push_back(Measurement.Bpm);
+				Log.RrIntervals.insert(Log.RrIntervals.end(),
+					Measurement.RrIntervals.begin(),
+					Measurement.RrIntervals.begin() + Measurement.RrCount);
+			});
+
+		bool bOpened = false;
+		Band.Open(1, [&bOpened](bool bSuccess) { bOpened = bSuccess; });
+		Check(bOpened, "open");
+
+		// Unpaired band: store the key, then answer the challenge with it
+		const std::array<uint8_t, 16> Key{ 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+			12, 13, 14, 15, 16 };
+		Queue.EnableNotifications(GattChannel::Authentication,
+			GattPriority::Control, [](bool bSuccess) {
+				Check(bSuccess, "auth notifications");
+			});
+		std::vector<uint8_t> SendKey{ 0x01, 0x00 };
+		SendKey.insert(SendKey.end(), Key.begin(), Key.end());
+		Write(Queue, GattChannel::Authentication, SendKey);
+		Band.Advance(0);
+		Write(Queue, GattChannel::Authentication, { 0x02, 0x00 });
+		Band.Advance(0);
+		Check(Log.AuthReplies.size() == 2 &&
+			Log.AuthReplies[0] == std::vector<uint8_t>{ 0x10, 0x01, 0x01 } &&
+			Log.AuthReplies[1].size() == 19, "key stored, challenge sent");
+		if (Log.AuthReplies.size() == 2 && Log.AuthReplies[1].size() == 19)
+		{
+			const auto Answer = Encrypt(Log.AuthReplies[1].data() + 3,
+				Key.data());
+			std::vector<uint8_t> Reply{ 0x03, 0x00 };
+			Reply.insert(Reply.end(), Answer.begin(), Answer.end());
+			Write(Queue, GattChannel::Authentication, Reply);
+			Band.Advance(0);
+		}
+		Check(Log.AuthReplies.size() == 3 &&
+			Log.AuthReplies[2] == std::vector<uint8_t>{ 0x10, 0x03, 0x01 },
+			"challenge answered");
+
+		Queue.EnableNotifications(GattChannel::HeartRateMeasurement,
+			GattPriority::Control, [](bool bSuccess) {
+				Check(bSuccess, "heart rate notifications");
+			});
+		Write(Queue, GattChannel::HeartRateControlPoint, { 0x15, 0x01, 0x01 });
+		for (uint32_t Second = 1; Second <= 60; ++Second)
+		{
+			Band.Advance(1000);
+			if (Second % 10 == 0)
+			{
+				Write(Queue, GattChannel::HeartRateControlPoint, { 0x16 });
+			}
+		}
+		// Due at 1 s to 60 s, but the 2 after every 10th fall into a stall
+		Check(Log.Bpm.size() == 50, "50 notifications in a minute");
+
+		// The band gives up 15 s after the last ping, 13 notifications and
+		// one more stall later
+		Band.Advance(30000);
+		Check(Log.Bpm.size() == 63, "no notifications without pings");
+
+		Log.Counters = Band.GetCounters();
+		Band.Close();
+		return Log;
+	}
+
+	// Disconnections on the clock thread: once closed from there and
+	// reopened from another thread, once closed and reopened from there
+	void RunReconnections()
+	{
+		SimulatedBandSettings Settings;
+		Settings.NotificationInterval = 5;
+		Settings.DisconnectAfter = 3;
+		Settings.PingTimeout = 0;
+		SimulatedMiBand3 Band(Settings);
+		GattCommandQueue Queue(Band);
+
+		std::atomic<uint32_t> Disconnections(0);
+		Band.SetNotificationHandler([](GattChannel, const uint8_t*,
+			uint32_t) {});
+		Band.SetDisconnectionHandler([&Band, &Disconnections] {
+			Band.Close();
+			if (Disconnections.fetch_add(1) == 1)
+			{
+				Band.Open(1, [](bool bSuccess) {
+					Check(bSuccess, "reopen on the clock thread");
+				});
+			}
+		});
+
+		auto Stream = [&Band, &Queue] {
+			bool bOpened = false;
+			Band.Open(1, [&bOpened](bool bSuccess) { bOpened = bSuccess; });
+			Check(bOpened, "open");
+			Queue.EnableNotifications(GattChannel::HeartRateMeasurement,
+				GattPriority::Control, [](bool) {});
+			Write(Queue, GattChannel::HeartRateControlPoint,
+				{ 0x15, 0x01, 0x01 });
+		};
+		auto WaitFor = [&Disconnections](uint32_t Count) {
+			const auto Deadline = std::chrono::steady_clock::now() +
+				std::chrono::seconds(5);
+			while (Disconnections.load() < Count &&
+				std::chrono::steady_clock::now() < Deadline)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			return Disconnections.load() >= Count;
+		};
+
+		Stream();
+		Check(WaitFor(1), "first disconnection");
+		// The worker that closed the band from its own thread is still
+		// around, opening again must replace it
+		Stream();
+		Check(WaitFor(2), "second disconnection");
+		Band.Close();
+	}
+}
+
+int main()
+{
+	const SessionLog First = RunManualSession(7);
+	Check(First.Malformed == 0, "every notification decodes");
+	Check(First.Counters.AuthSuccesses == 1 &&
+		First.Counters.AuthFailures == 0, "one successful handshake");
+	Check(First.Counters.Notifications == First.Bpm.size(),
+		"every notification delivered");
+	Check(First.Counters.Stalls == 6, "a stall every 10 notifications");
+	Check(First.Counters.Pings == 6, "pings counted");
+	Check(!First.RrIntervals.empty(), "RR intervals decoded");
+	for (uint16_t Bpm : First.Bpm)
+	{
+		if (Bpm < 65 || Bpm > 75)
+		{
+			Check(false, "heart rate within the jitter");
+			break;
+		}
+	}
+
+	const SessionLog Second = RunManualSession(7);
+	Check(First.Bpm == Second.Bpm && First.RrIntervals == Second.RrIntervals,
+		"same seed, same session");
+
+	RunReconnections();
+
+	std::cout << "simulated band: " << First.Bpm.size() << " notifications, "
+		<< First.RrIntervals.size() << " RR intervals, " << Failures
+		<< " failures" << std::endl;
+	return Failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,229 @@
+#include "pch.h"
+#include "TimerWheel.h"
+#include <algorithm>
+
+TimerWheel::TimerWheel(uint32_t TickMilliseconds) :
+	TickMilliseconds(std::max<uint32_t>(1, TickMilliseconds)),
+	bRunning(true), bFiring(false), Start(std::chrono::steady_clock::now()),
+	CurrentTick(0), ArmedCount(0)
+{
+	Due.reserve(Slots);
+	Worker = std::thread([this] { Run(); });
+}
+
+TimerWheel::~TimerWheel()
+{
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		bRunning = false;
+	}
+	Wakeup.notify_all();
+	Worker.join();
+}
+
+uint64_t TimerWheel::ToTicks(uint32_t Milliseconds) const
+{
+	return std::max<uint64_t>(1,
+		(Milliseconds + TickMilliseconds - 1) / TickMilliseconds);
+}
+
+void TimerWheel::Arm(TimerEntry& Timer, uint32_t Delay, uint32_t Interval)
+{
+	bool bWake = false;
+	{
+		std::lock_guard<std::mutex> Guard(Lock);
+		if (Timer.bArmed)
+		{
+			RemoveLocked(Timer);
+		}
+		// One more tick for the part of the current one already elapsed, so
+		// timers never fire early
+		Timer.Deadline = CurrentTick + ToTicks(Delay) + 1;
+		Timer.Interval = Interval > 0 ? ToTicks(Interval) : 0;
+		AddLocked(Timer);
+		bWake = ArmedCount == 1;
+	}
+	// The wheel thread sleeps while nothing is armed
+	if (bWake)
+	{
+		Wakeup.notify_one();
+	}
+}
+
+void TimerWheel::Cancel(TimerEntry& Timer)
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	if (Timer.bArmed)
+	{
+		RemoveLocked(Timer);
+	}
+}
+
+void TimerWheel::CancelAndWait(TimerEntry& Timer)
+{
+	std::unique_lock<std::mutex> Guard(Lock);
+	if (Timer.bArmed)
+	{
+		RemoveLocked(Timer);
+	}
+	if (std::this_thread::get_id() == Worker.get_id())
+	{
+		return;
+	}
+	Fired.wait(Guard, [this, &Timer] {
+		return !bFiring || std::find(Due.begin(), Due.end(), &Timer) ==
+			Due.end();
+		});
+}
+
+bool TimerWheel::IsArmed(const TimerEntry& Timer)
+{
+	std::lock_guard<std::mutex> Guard(Lock);
+	return Timer.bArmed;
+}
+
+// Puts the timer in the slot of the lowest level that covers its deadline.
+void TimerWheel::AddLocked(TimerEntry& Timer)
+{
+	Timer.Deadline = std::max(Timer.Deadline, CurrentTick + 1);
+	// Farther deadlines wait in the last level and are put back in place
+	// when they come down to level 0
+	const uint64_t Delta = std::min(Timer.Deadline - CurrentTick, MaxDelta);
+	const uint64_t Target = CurrentTick + Delta;
+	uint32_t Level = 0;
+	while (Level + 1 < Levels && Delta >= (1ull << (SlotBits * (Level + 1))))
+	{
+		++Level;
+	}
+	TimerSlot& Head =
+		Wheel[Level][(Target >> (SlotBits * Level)) & (Slots - 1)];
+	Timer.Owner = &Head;
+	Timer.Prev = nullptr;
+	Timer.Next = Head.First;
+	if (Head.First)
+	{
+		Head.First->Prev = &Timer;
+	}
+	Head.First = &Timer;
+	Timer.bArmed = true;
+	++ArmedCount;
+}
+
+void TimerWheel::RemoveLocked(TimerEntry& Timer)
+{
+	if (Timer.Prev)
+	{
+		Timer.Prev->Next = Timer.Next;
+	}
+	else
+	{
+		Timer.Owner->First = Timer.Next;
+	}
+	if (Timer.Next)
+	{
+		Timer.Next->Prev = Timer.Prev;
+	}
+	Timer.Owner = nullptr;
+	Timer.Next = nullptr;
+	Timer.Prev = nullptr;
+	Timer.bArmed = false;
+	--ArmedCount;
+}
+
+// Moves the timers of the current slot of a level down to the lower levels.
+void TimerWheel::CascadeLocked(uint32_t Level)
+{
+	TimerSlot& Head = Wheel[Level][(CurrentTick >> (SlotBits * Level)) &
+		(Slots - 1)];
+	TimerEntry* Timer = Head.First;
+	Head.First = nullptr;
+	while (Timer)
+	{
+		TimerEntry* Next = Timer->Next;
+		--ArmedCount;
+		AddLocked(*Timer);
+		Timer = Next;
+	}
+}
+
+// Advances one tick and collects the timers due on it.
+void TimerWheel::TickLocked()
+{
+	++CurrentTick;
+	for (uint32_t Level = 1; Level < Levels; ++Level)
+	{
+		if ((CurrentTick & ((1ull << (SlotBits * Level)) - 1)) != 0)
+		{
+			break;
+		}
+		CascadeLocked(Level);
+	}
+
+	TimerSlot& Head = Wheel[0][CurrentTick & (Slots - 1)];
+	TimerEntry* Timer = Head.First;
+	Head.First = nullptr;
+	while (Timer)
+	{
+		TimerEntry* Next = Timer->Next;
+		--ArmedCount;
+		Timer->bArmed = false;
+		if (Timer->Deadline > CurrentTick)
+		{
+			// Deadline beyond the wheel range, not due yet
+			AddLocked(*Timer);
+		}
+		else
+		{
+			if (Timer->Interval > 0)
+			{
+				Timer->Deadline = CurrentTick + Timer->Interval;
+				AddLocked(*Timer);
+			}
+			Due.push_back(Timer);
+		}
+		Timer = Next;
+	}
+}
+
+// Wheel thread. Catches up on every tick elapsed since it last ran, then
+// sleeps until the next one, or until a timer is armed if none is.
+void TimerWheel::Run()
+{
+	const auto Tick = std::chrono::milliseconds(TickMilliseconds);
+	std::unique_lock<std::mutex> Guard(Lock);
+	while (bRunning)
+	{
+		if (ArmedCount == 0)
+		{
+			Wakeup.wait(Guard, [this] { return !bRunning || ArmedCount > 0; });
+			// Idle time doesn't count, deadlines are relative to arming
+			Start = std::chrono::steady_clock::now() - CurrentTick * Tick;
+			continue;
+		}
+		Wakeup.wait_until(Guard, Start + (CurrentTick + 1) * Tick);
+
+		const uint64_t Elapsed = static_cast<uint64_t>(
+			(std::chrono::steady_clock::now() - Start) / Tick);
+		while (bRunning && CurrentTick < Elapsed)
+		{
+			TickLocked();
+			if (Due.empty())
+			{
+				continue;
+			}
+			bFiring = true;
+			Guard.unlock();
+			for (TimerEntry* Timer : Due)
+			{
+				if (Timer->Callback)
+				{
+					Timer->Callback();
+				}
+			}
+			Guard.lock();
+			Due.clear();
+			bFiring = false;
+			Fired.notify_all();
+		}
+	}
+}
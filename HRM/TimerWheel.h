@@ -0,0 +1,106 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TimerWheel;
+struct TimerSlot;
+
+// Timer embedded in its owner. The callback is set once, arming and
+// cancelling never allocate. The owner must outlive its arming.
+struct TimerEntry
+{
+	explicit TimerEntry(std::function<void()> Callback = nullptr) :
+		Callback(std::move(Callback)) {}
+
+	TimerEntry(const TimerEntry&) = delete;
+	TimerEntry& operator=(const TimerEntry&) = delete;
+
+	std::function<void()> Callback;
+
+private:
+	friend class TimerWheel;
+
+	// Links of the slot list, owned by the wheel
+	TimerSlot* Owner = nullptr;
+	TimerEntry* Next = nullptr;
+	TimerEntry* Prev = nullptr;
+	// Absolute tick it fires on, and ticks between firings of periodic ones
+	uint64_t Deadline = 0;
+	uint64_t Interval = 0;
+	bool bArmed = false;
+};
+
+// List of the timers of a wheel slot
+struct TimerSlot
+{
+	TimerEntry* First = nullptr;
+};
+
+// Hierarchical timing wheel (four levels of 64 slots) shared by every band.
+// Arm, re-arm and cancel are O(1) under a single lock; a single thread
+// advances the wheel every tick and runs the callbacks due, outside the lock,
+// so they may arm or cancel timers themselves. It only wakes up while timers
+// are armed.
+class TimerWheel
+{
+public:
+	explicit TimerWheel(uint32_t TickMilliseconds = 10);
+	~TimerWheel();
+
+	TimerWheel(const TimerWheel&) = delete;
+	TimerWheel& operator=(const TimerWheel&) = delete;
+
+	// Fires the timer after Delay milliseconds, and every Interval
+	// milliseconds after that if Interval isn't 0. Re-arming a timer moves
+	// it. Timers fire up to one tick late, never early.
+	void Arm(TimerEntry& Timer, uint32_t Delay, uint32_t Interval = 0);
+	// Disarms the timer. A callback already picked up by the wheel thread
+	// may still run once.
+	void Cancel(TimerEntry& Timer);
+	// Disarms the timer and waits until the wheel thread is done with it, so
+	// its owner can go away. From a timer callback it doesn't wait.
+	void CancelAndWait(TimerEntry& Timer);
+	bool IsArmed(const TimerEntry& Timer);
+
+	uint32_t GetTickMilliseconds() const { return TickMilliseconds; }
+
+private:
+	static constexpr uint32_t SlotBits = 6;
+	static constexpr uint32_t Slots = 1 << SlotBits;
+	static constexpr uint32_t Levels = 4;
+	static constexpr uint64_t MaxDelta = (1ull << (SlotBits * Levels)) - 1;
+
+	uint64_t ToTicks(uint32_t Milliseconds) const;
+	// Lock must be held by all of these
+	void AddLocked(TimerEntry& Timer);
+	void RemoveLocked(TimerEntry& Timer);
+	void CascadeLocked(uint32_t Level);
+	void TickLocked();
+
+	void Run();
+
+	const uint32_t TickMilliseconds;
+
+	std::mutex Lock;
+	std::condition_variable Wakeup;
+	std::thread Worker;
+	bool bRunning;
+	// Callbacks of Due running outside the lock, signalled when they're done
+	bool bFiring;
+	std::condition_variable Fired;
+
+	std::chrono::steady_clock::time_point Start;
+	// Ticks processed so far
+	uint64_t CurrentTick;
+	uint32_t ArmedCount;
+	std::array<std::array<TimerSlot, Slots>, Levels> Wheel;
+	// Timers due on the current tick, reused so firing doesn't allocate
+	std::vector<TimerEntry*> Due;
+};
@@ -0,0 +1,179 @@
+#include "pch.h"
+#include "Trace.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#if HRM_ENABLE_TRACING
+
+namespace
+{
+	struct Event
+	{
+		const char* Name;
+		uint64_t Begin;
+		uint64_t Duration;
+		// 'X' complete span, 'i' instant
+		char Phase;
+	};
+
+	// Ring of the events of one thread. Only its thread writes; the exporter
+	// reads behind it and discards whatever was overwritten meanwhile.
+	struct ThreadBuffer
+	{
+		uint32_t ThreadId = 0;
+		std::atomic<const char*> ThreadName{ nullptr };
+		std::atomic<uint64_t> Head{ 0 };
+		std::unique_ptr<Event[]> Events{
+			new Event[Tracing::EventsPerThread] };
+	};
+
+	// Buffers outlive their threads so late exports still see them
+	std::mutex RegistryLock;
+	std::vector<std::shared_ptr<ThreadBuffer>> Buffers;
+
+	ThreadBuffer& CurrentBuffer()
+	{
+		thread_local ThreadBuffer* Buffer = nullptr;
+		if (!Buffer)
+		{
+			auto NewBuffer = std::make_shared<ThreadBuffer>();
+			std::lock_guard<std::mutex> Guard(RegistryLock);
+			NewBuffer->ThreadId = static_cast<uint32_t>(Buffers.size()) + 1;
+			Buffers.push_back(NewBuffer);
+			Buffer = NewBuffer.get();
+		}
+		return *Buffer;
+	}
+
+	void Record(const Event& NewEvent)
+	{
+		ThreadBuffer& Buffer = CurrentBuffer();
+		const uint64_t Index = Buffer.Head.load(std::memory_order_relaxed);
+		Buffer.Events[Index % Tracing::EventsPerThread] = NewEvent;
+		Buffer.Head.store(Index + 1, std::memory_order_release);
+	}
+
+	// Copies the events still in the buffer, oldest first
+	std::vector<Event> Snapshot(const ThreadBuffer& Buffer)
+	{
+		const uint64_t Capacity = Tracing::EventsPerThread;
+		const uint64_t Head = Buffer.Head.load(std::memory_order_acquire);
+		const uint64_t First = Head > Capacity ? Head - Capacity : 0;
+		std::vector<Event> Events;
+		Events.reserve(static_cast<size_t>(Head - First));
+		for (uint64_t i = First; i < Head; ++i)
+		{
+			Events.push_back(Buffer.Events[i % Capacity]);
+		}
+		// Slots reused while copying may be torn, drop them
+		const uint64_t After = Buffer.Head.load(std::memory_order_acquire);
+		if (After >= Capacity && After - Capacity + 1 > First)
+		{
+			const uint64_t Stale = std::min(After - Capacity + 1, Head) -
+				First;
+			Events.erase(Events.begin(), Events.begin() + Stale);
+		}
+		return Events;
+	}
+}
+
+uint64_t Tracing::Now()
+{
+	return static_cast<uint64_t>(
+		std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+void Tracing::RecordSpan(const char* Name, uint64_t Begin, uint64_t End)
+{
+	Record(Event{ Name, Begin, End - Begin, 'X' });
+}
+
+void Tracing::RecordInstant(const char* Name)
+{
+	Record(Event{ Name, Now(), 0, 'i' });
+}
+
+void Tracing::SetThreadName(const char* Name)
+{
+	CurrentBuffer().ThreadName.store(Name, std::memory_order_release);
+}
+
+bool Tracing::WriteChromeTrace(const std::string& Path)
+{
+	std::ofstream Out(Path);
+	if (!Out)
+	{
+		return false;
+	}
+	std::vector<std::shared_ptr<ThreadBuffer>> Threads;
+	{
+		std::lock_guard<std::mutex> Guard(RegistryLock);
+		Threads = Buffers;
+	}
+
+	// Timestamps in microseconds, with nanosecond decimals
+	Out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+	bool bFirst = true;
+	for (auto& Thread : Threads)
+	{
+		if (const char* Name = Thread->ThreadName.load())
+		{
+			Out << (bFirst ? "" : ",")
+				<< "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+				<< "\"tid\":" << Thread->ThreadId
+				<< ",\"args\":{\"name\":\"" << Name << "\"}}";
+			bFirst = false;
+		}
+		for (const Event& Item : Snapshot(*Thread))
+		{
+			Out << (bFirst ? "" : ",") << "\n{\"name\":\"" << Item.Name
+				<< "\",\"ph\":\"" << Item.Phase << "\",\"pid\":1,\"tid\":"
+				<< Thread->ThreadId << ",\"ts\":" << Item.Begin / 1000.0;
+			if (Item.Phase == 'X')
+			{
+				Out << ",\"dur\":" << Item.Duration / 1000.0;
+			}
+			else
+			{
+				Out << ",\"s\":\"t\"";
+			}
+			Out << "}";
+			bFirst = false;
+		}
+	}
+	Out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+	return static_cast<bool>(Out);
+}
+
+#else
+
+uint64_t Tracing::Now()
+{
+	return 0;
+}
+
+void Tracing::RecordSpan(const char*, uint64_t, uint64_t)
+{
+}
+
+void Tracing::RecordInstant(const char*)
+{
+}
+
+void Tracing::SetThreadName(const char*)
+{
+}
+
+bool Tracing::WriteChromeTrace(const std::string&)
+{
+	return false;
+}
+
+#endif
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Scoped trace spans of the pipeline stages, exported as Chrome trace-event
+// JSON (chrome://tracing, Perfetto). Built only with HRM_ENABLE_TRACING
+// defined to 1, otherwise the macros compile to nothing.
+//
+// HRM_TRACE_SCOPE("Stage") records a span from that line to the end of the
+// scope, into a buffer of the current thread, so recording never takes a
+// lock. The name must be a string literal. A span that crosses a co_await is
+// recorded by the thread that ends it.
+#ifndef HRM_ENABLE_TRACING
+#define HRM_ENABLE_TRACING 0
+#endif
+
+#if HRM_ENABLE_TRACING
+#define HRM_TRACE_CONCAT_INNER(A, B) A##B
+#define HRM_TRACE_CONCAT(A, B) HRM_TRACE_CONCAT_INNER(A, B)
+#define HRM_TRACE_SCOPE(Name) \
+	Tracing::ScopedSpan HRM_TRACE_CONCAT(TraceSpan, __LINE__)(Name)
+#define HRM_TRACE_INSTANT(Name) Tracing::RecordInstant(Name)
+#define HRM_TRACE_THREAD_NAME(Name) Tracing::SetThreadName(Name)
+#else
+#define HRM_TRACE_SCOPE(Name) ((void)0)
+#define HRM_TRACE_INSTANT(Name) ((void)0)
+#define HRM_TRACE_THREAD_NAME(Name) ((void)0)
+#endif
+
+namespace Tracing
+{
+	// Events kept per thread, older ones are overwritten
+	constexpr uint32_t EventsPerThread = 16384;
+
+	// Nanoseconds on the monotonic clock
+	uint64_t Now();
+
+	void RecordSpan(const char* Name, uint64_t Begin, uint64_t End);
+	void RecordInstant(const char* Name);
+	// Names the current thread in the trace
+	void SetThreadName(const char* Name);
+
+	// Writes every buffered event as Chrome trace-event JSON. Can be called
+	// while other threads keep recording. Returns false if tracing isn't
+	// built in or the file can't be written.
+	bool WriteChromeTrace(const std::string& Path);
+
+	class ScopedSpan
+	{
+	public:
+		explicit ScopedSpan(const char* Name) : Name(Name), Begin(Now()) {}
+		~ScopedSpan() { RecordSpan(Name, Begin, Now()); }
+
+		ScopedSpan(const ScopedSpan&) = delete;
+		ScopedSpan& operator=(const ScopedSpan&) = delete;
+
+	private:
+		const char* Name;
+		uint64_t Begin;
+	};
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "pch.h"
+#include "AllocationBudget.h"
+#include "Awaitables.h"
+#include "Reactor.h"
+#include <coroutine>
+#include <optional>
+#include <stop_token>
+
+// Lets the tasks of Task.h await WinRT asynchronous actions and operations,
+// resuming on the given reactor instead of a thread pool thread. A failed or
+// cancelled operation throws its Platform::Exception from co_await.
+// Cancelling the token cancels the operation.
+namespace Async
+{
+	class ActionAwaiter
+	{
+	public:
+		ActionAwaiter(Reactor& Loop,
+			Windows::Foundation::IAsyncAction^ Action, std::stop_token Token) :
+			Loop(Loop), Action(Action), Token(std::move(Token))
+		{
+		}
+
+		ActionAwaiter(const ActionAwaiter&) = delete;
+		ActionAwaiter& operator=(const ActionAwaiter&) = delete;
+
+		bool await_ready() const
+		{
+			return Action->Status !=
+				Windows::Foundation::AsyncStatus::Started;
+		}
+		void await_suspend(std::coroutine_handle<> Awaiting)
+		{
+			if (Token.stop_possible())
+			{
+				OnCancel.emplace(Token, Cancel{ Action });
+			}
+			HRM_ALLOCATION_STAGE(Socket);
+			Handle = Awaiting;
+			// Runs right away if the action already finished
+			Action->Completed = ref new Windows::Foundation::
+				AsyncActionCompletedHandler([this](
+					Windows::Foundation::IAsyncAction^,
+					Windows::Foundation::AsyncStatus) {
+					Resumed.Post(Loop, Handle);
+				});
+		}
+		void await_resume()
+		{
+			OnCancel.reset();
+			Action->GetResults();
+		}
+
+	private:
+		struct Cancel
+		{
+			Windows::Foundation::IAsyncAction^ Action;
+			void operator()() const noexcept { Action->Cancel(); }
+		};
+
+		Reactor& Loop;
+		Windows::Foundation::IAsyncAction^ Action;
+		std::coroutine_handle<> Handle;
+		Resumption Resumed;
+		std::stop_token Token;
+		std::optional<std::stop_callback<Cancel>> OnCancel;
+	};
+
+	template <typename T>
+	class OperationAwaiter
+	{
+	public:
+		OperationAwaiter(Reactor& Loop,
+			Windows::Foundation::IAsyncOperation<T>^ Operation,
+			std::stop_token Token) : Loop(Loop), Operation(Operation),
+			Token(std::move(Token))
+		{
+		}
+
+		OperationAwaiter(const OperationAwaiter&) = delete;
+		OperationAwaiter& operator=(const OperationAwaiter&) = delete;
+
+		bool await_ready() const
+		{
+			return Operation->Status !=
+				Windows::Foundation::AsyncStatus::Started;
+		}
+		void await_suspend(std::coroutine_handle<> Awaiting)
+		{
+			if (Token.stop_possible())
+			{
+				OnCancel.emplace(Token, Cancel{ Operation });
+			}
+			HRM_ALLOCATION_STAGE(Socket);
+			Handle = Awaiting;
+			// Runs right away if the operation already finished
+			Operation->Completed = ref new Windows::Foundation::
+				AsyncOperationCompletedHandler<T>([this](
+					Windows::Foundation::IAsyncOperation<T>^,
+					Windows::Foundation::AsyncStatus) {
+					Resumed.Post(Loop, Handle);
+				});
+		}
+		T await_resume()
+		{
+			OnCancel.reset();
+			return Operation->GetResults();
+		}
+
+	private:
+		struct Cancel
+		{
+			Windows::Foundation::IAsyncOperation<T>^ Operation;
+			void operator()() const noexcept { Operation->Cancel(); }
+		};
+
+		Reactor& Loop;
+		Windows::Foundation::IAsyncOperation<T>^ Operation;
+		std::coroutine_handle<> Handle;
+		Resumption Resumed;
+		std::stop_token Token;
+		std::optional<std::stop_callback<Cancel>> OnCancel;
+	};
+
+	inline ActionAwaiter Await(Reactor& Loop,
+		Windows::Foundation::IAsyncAction^ Action, std::stop_token Token = {})
+	{
+		return ActionAwaiter(Loop, Action, std::move(Token));
+	}
+
+	// T is given explicitly for the runtime classes implementing the
+	// operation, such as the DataReader and DataWriter operations
+	template <typename T>
+	OperationAwaiter<T> Await(Reactor& Loop,
+		Windows::Foundation::IAsyncOperation<T>^ Operation,
+		std::stop_token Token = {})
+	{
+		return OperationAwaiter<T>(Loop, Operation, std::move(Token));
+	}
+}
@@ -0,0 +1,480 @@
+#include "pch.h"
+#include "WinRtGattTransport.h"
+#include "BlthUtil.h"
+#include "Trace.h"
+#include <algorithm>
+#include <iostream>
+#include <robuffer.h>
+#include <wrl/client.h>
+
+using namespace BluetoothUtilities;
+using namespace Windows::Security::Cryptography;
+
+namespace
+{
+	// Raw bytes of a WinRT buffer, read in place without copies
+	const uint8_t* BufferBytes(Windows::Storage::Streams::IBuffer^ Buffer)
+	{
+		Microsoft::WRL::ComPtr<Windows::Storage::Streams::IBufferByteAccess>
+			Access;
+		reinterpret_cast<IInspectable*>(Buffer)->QueryInterface(
+			IID_PPV_ARGS(&Access));
+		byte* Bytes = nullptr;
+		Access->Buffer(&Bytes);
+		return Bytes;
+	}
+
+	// Where every channel lives
+	struct ChannelLayout
+	{
+		Platform::Guid Service;
+		Platform::Guid Characteristic;
+		// Has a client configuration descriptor, for notifications
+		bool bNotifies;
+		// Not needed to connect, resolved on its first write
+		bool bOnDemand;
+	};
+
+	using ChannelLayouts = std::array<ChannelLayout,
+		static_cast<size_t>(GattChannel::Count)>;
+
+	const ChannelLayouts& MiBand3Layout()
+	{
+		static const ChannelLayouts Channels = [] {
+			auto Short = [](unsigned int Id) {
+				return BluetoothUuidHelper::FromShortId(Id);
+			};
+			return ChannelLayouts{ {
+				// Authentication
+				{ Short(0xfee1), ToGuid(Codec::MiBandGuid(0x0009)), true,
+					false },
+				// Heart rate control point and measurement
+				{ Short(0x180d), Short(0x2a39), false, false },
+				{ Short(0x180d), Short(0x2a37), true, false },
+				// Alert, only for vibrate commands
+				{ Short(0x1802), Short(0x2a06), false, true },
+				// New alert and alert notification control point, only for
+				// messages
+				{ Short(0x1811), Short(0x2a46), false, true },
+				{ Short(0x1811), Short(0x2a44), false, true }
+			} };
+		}();
+		return Channels;
+	}
+}
+
+WinRtGattTransport::WinRtGattTransport(GattCache* Cache) : Cache(Cache)
+{
+	bNotifying.fill(false);
+	bOpenedFromCache = false;
+	Address = 0;
+	bOnDemandStarted = false;
+}
+
+WinRtGattTransport::~WinRtGattTransport()
+{
+	Close();
+}
+
+void WinRtGattTransport::SetNotificationHandler(NotificationHandler Handler)
+{
+	OnNotification = Handler;
+}
+
+void WinRtGattTransport::SetDisconnectionHandler(
+	DisconnectionHandler Handler)
+{
+	OnDisconnection = Handler;
+}
+
+// Connects to the MiBand 3 and resolves every channel. Completes with false if
+// the device or any characteristic can't be found.
+void WinRtGattTransport::Open(uint64_t Address, Completion Done)
+{
+	Initialize(Address).then([Done](concurrency::task<void> PreviousTask) {
+		try
+		{
+			PreviousTask.get();
+			Done(true);
+		}
+		catch (Platform::Exception^ Ex)
+		{
+			std::wcout << "GATT discovery failed: " << Ex->Message->Data()
+				<< std::endl;
+			Done(false);
+		}
+		});
+}
+
+void WinRtGattTransport::Close()
+{
+	for (size_t i = 0; i < ChannelCount; ++i)
+	{
+		if (bNotifying[i])
+		{
+			Characteristics[i]->ValueChanged -= NotificationTokens[i];
+			bNotifying[i] = false;
+		}
+		Characteristics[i] = nullptr;
+		Descriptors[i] = nullptr;
+	}
+	{
+		std::lock_guard<std::mutex> Guard(OnDemandLock);
+		bOnDemandStarted = false;
+	}
+	if (Device)
+	{
+		Device->ConnectionStatusChanged -= ConnectionToken;
+		// Due to C++ magic, this releases the connection
+		delete Device;
+		Device = nullptr;
+	}
+}
+
+// Connects to the device and resolves its channels, from the cache if they
+// still match, with a full discovery otherwise.
+concurrency::task<void> WinRtGattTransport::Initialize(uint64_t Address)
+{
+	HRM_TRACE_SCOPE("GattDiscovery");
+
+	this->Address = Address;
+	Device = co_await BluetoothLEDevice::FromBluetoothAddressAsync(Address);
+	if (!Device)
+	{
+		throw ref new Platform::FailureException(L"Device not found");
+	}
+	ConnectionToken = Device->ConnectionStatusChanged += ref new
+		Windows::Foundation::TypedEventHandler<BluetoothLEDevice^,
+		Platform::Object^>([this](BluetoothLEDevice^ Sender,
+			Platform::Object^) {
+			if (Sender->ConnectionStatus ==
+				BluetoothConnectionStatus::Disconnected && OnDisconnection)
+			{
+				OnDisconnection();
+			}
+			});
+
+	GattCacheEntry Entry;
+	bOpenedFromCache = Cache && Cache->Find(Address, Entry) &&
+		Entry.HasLayout() && co_await CachedDiscovery(Entry);
+	if (!bOpenedFromCache)
+	{
+		if (Cache)
+		{
+			Cache->Forget(Address);
+		}
+		Characteristics.fill(nullptr);
+		Descriptors.fill(nullptr);
+		co_await DiscoverChannels(false);
+		StoreLayout(Address);
+	}
+
+	// Channels the cache didn't have are resolved on their first write
+	bool bAllResolved = true;
+	for (size_t i = 0; i < ChannelCount; ++i)
+	{
+		bAllResolved = bAllResolved && Characteristics[i] != nullptr;
+	}
+	std::lock_guard<std::mutex> Guard(OnDemandLock);
+	bOnDemandStarted = bAllResolved;
+	if (bAllResolved)
+	{
+		OnDemand = concurrency::task_from_result(true);
+	}
+}
+
+// Looks every channel up in the system cache, and checks its attribute
+// handles against the ones stored the last time.
+concurrency::task<bool> WinRtGattTransport::CachedDiscovery(
+	const GattCacheEntry& Entry)
+{
+	using namespace GenericAttributeProfile;
+	HRM_TRACE_SCOPE("GattDiscovery.Cached");
+
+	auto Cccd = BluetoothUuidHelper::FromShortId(0x2902);
+	auto Services = co_await Device->GetGattServicesAsync(
+		BluetoothCacheMode::Cached);
+	if (Services->Status != GattCommunicationStatus::Success)
+	{
+		co_return false;
+	}
+	const auto& Layout = MiBand3Layout();
+	for (size_t i = 0; i < ChannelCount; ++i)
+	{
+		// Never resolved on the last connection, left for their first write
+		if (Layout[i].bOnDemand && Entry.Characteristics[i] == 0)
+		{
+			continue;
+		}
+		GattDeviceService^ Service = nullptr;
+		for (auto Candidate : Services->Services)
+		{
+			if (Candidate->Uuid == Layout[i].Service)
+			{
+				Service = Candidate;
+				break;
+			}
+		}
+		if (!Service)
+		{
+			co_return false;
+		}
+		auto Found = co_await Service->GetCharacteristicsForUuidAsync(
+			Layout[i].Characteristic, BluetoothCacheMode::Cached);
+		if (Found->Status != GattCommunicationStatus::Success ||
+			Found->Characteristics->Size == 0 ||
+			Found->Characteristics->GetAt(0)->AttributeHandle !=
+			Entry.Characteristics[i])
+		{
+			co_return false;
+		}
+		Characteristics[i] = Found->Characteristics->GetAt(0);
+		if (!Layout[i].bNotifies)
+		{
+			continue;
+		}
+		auto Descriptor = co_await Characteristics[i]->
+			GetDescriptorsForUuidAsync(Cccd, BluetoothCacheMode::Cached);
+		if (Descriptor->Status != GattCommunicationStatus::Success ||
+			Descriptor->Descriptors->Size == 0 ||
+			Descriptor->Descriptors->GetAt(0)->AttributeHandle !=
+			Entry.Descriptors[i])
+		{
+			co_return false;
+		}
+		Descriptors[i] = Descriptor->Descriptors->GetAt(0);
+	}
+	co_return true;
+}
+
+// Stores the attribute handles just discovered.
+void WinRtGattTransport::StoreLayout(uint64_t Address)
+{
+	if (!Cache)
+	{
+		return;
+	}
+	GattCacheEntry Entry;
+	Entry.Address = Address;
+	for (size_t i = 0; i < ChannelCount; ++i)
+	{
+		Entry.Characteristics[i] = Characteristics[i] ?
+			Characteristics[i]->AttributeHandle : 0;
+		Entry.Descriptors[i] = Descriptors[i] ?
+			Descriptors[i]->AttributeHandle : 0;
+	}
+	Cache->StoreLayout(Entry);
+}
+
+// Resolves the channels on or off the connect path, without the cache. The
+// services don't depend on each other, so they are looked up concurrently
+// and this takes about as long as the slowest of them.
+concurrency::task<void> WinRtGattTransport::DiscoverChannels(bool bOnDemand)
+{
+	HRM_TRACE_SCOPE("GattDiscovery.Full");
+
+	// Channels of every service, in layout order
+	const auto& Layout = MiBand3Layout();
+	std::vector<std::pair<Platform::Guid, std::vector<size_t>>> Services;
+	for (size_t i = 0; i < ChannelCount; ++i)
+	{
+		if (Layout[i].bOnDemand != bOnDemand)
+		{
+			continue;
+		}
+		auto Service = std::find_if(Services.begin(), Services.end(),
+			[&](const auto& Item) {
+				return Item.first == Layout[i].Service;
+			});
+		if (Service == Services.end())
+		{
+			Services.push_back({ Layout[i].Service, {} });
+			Service = Services.end() - 1;
+		}
+		Service->second.push_back(i);
+	}
+
+	std::vector<concurrency::task<void>> Lookups;
+	for (const auto& Service : Services)
+	{
+		Lookups.push_back(DiscoverService(Service.first, Service.second));
+	}
+	co_await concurrency::when_all(Lookups.begin(), Lookups.end());
+}
+
+// Gets the characteristics, and the descriptors of those that notify, of the
+// given channels of a service.
+concurrency::task<void> WinRtGattTransport::DiscoverService(
+	Platform::Guid Uuid, std::vector<size_t> Channels)
+{
+	HRM_TRACE_SCOPE("GattDiscovery.Service");
+
+	const auto& Layout = MiBand3Layout();
+	auto Cccd = BluetoothUuidHelper::FromShortId(0x2902);
+	auto Service = (co_await Device->GetGattServicesForUuidAsync(Uuid))
+		->Services->GetAt(0);
+	for (size_t i : Channels)
+	{
+		Characteristics[i] =
+			(co_await Service->GetCharacteristicsForUuidAsync(
+				Layout[i].Characteristic))->Characteristics->GetAt(0);
+		if (Layout[i].bNotifies)
+		{
+			Descriptors[i] =
+				(co_await Characteristics[i]->GetDescriptorsForUuidAsync(
+					Cccd))->Descriptors->GetAt(0);
+		}
+	}
+}
+
+// Starts resolving the on demand channels, once per connection, or retries
+// after a failure. The task is true once they can be written.
+concurrency::task<bool> WinRtGattTransport::ResolveOnDemand()
+{
+	std::lock_guard<std::mutex> Guard(OnDemandLock);
+	if (!bOnDemandStarted)
+	{
+		bOnDemandStarted = true;
+		OnDemand = DiscoverChannels(true).then(
+			[this](concurrency::task<void> PreviousTask) {
+			try
+			{
+				PreviousTask.get();
+				StoreLayout(Address);
+				return true;
+			}
+			catch (Platform::Exception^ Ex)
+			{
+				std::wcout << "GATT discovery failed: " << Ex->Message->Data()
+					<< std::endl;
+				std::lock_guard<std::mutex> Guard(OnDemandLock);
+				bOnDemandStarted = false;
+				return false;
+			}
+			});
+	}
+	return OnDemand;
+}
+
+// Writes to a given characteristic
+void WinRtGattTransport::Write(GattChannel Channel, const uint8_t* Data,
+	uint32_t Size, Completion Done)
+{
+	// Copy the data into a buffer, the caller's may not outlive this call
+	auto Buffer = CryptographicBuffer::CreateFromByteArray(
+		Platform::ArrayReference<uint8>(const_cast<uint8*>(Data), Size));
+	auto Index = static_cast<size_t>(Channel);
+	if (!MiBand3Layout()[Index].bOnDemand)
+	{
+		WriteResolved(Index, Buffer, Done);
+		return;
+	}
+	ResolveOnDemand().then([this, Index, Buffer, Done](bool bResolved) {
+		if (!bResolved)
+		{
+			Done(false);
+			return;
+		}
+		WriteResolved(Index, Buffer, Done);
+		});
+}
+
+// Writes the buffer asyncronously to a channel already resolved.
+void WinRtGattTransport::WriteResolved(size_t Index,
+	Windows::Storage::Streams::IBuffer^ Buffer, Completion Done)
+{
+	auto Characteristic = Characteristics[Index];
+	if (!Characteristic)
+	{
+		Done(false);
+		return;
+	}
+	concurrency::create_task(Characteristic->WriteValueAsync(Buffer))
+		.then([Done](concurrency::task<GenericAttributeProfile::
+			GattCommunicationStatus> PreviousTask) {
+		try
+		{
+			Done(PreviousTask.get() == GenericAttributeProfile::
+				GattCommunicationStatus::Success);
+		}
+		catch (Platform::Exception^)
+		{
+			Done(false);
+		}
+			});
+}
+
+void WinRtGattTransport::EnableNotifications(GattChannel Channel,
+	Completion Done)
+{
+	InEnableNotifications(Channel).then(
+		[Done](concurrency::task<bool> PreviousTask) {
+		try
+		{
+			Done(PreviousTask.get());
+		}
+		catch (Platform::Exception^)
+		{
+			Done(false);
+		}
+		});
+}
+
+// Enables the notifications from a given descriptor and characteristic, and
+// forwards them to the notification handler on arrival.
+concurrency::task<bool> WinRtGattTransport::InEnableNotifications(
+	GattChannel Channel)
+{
+	auto Index = static_cast<size_t>(Channel);
+	auto Characteristic = Characteristics[Index];
+	auto Descriptor = Descriptors[Index];
+	if (!Characteristic || !Descriptor)
+	{
+		co_return false;
+	}
+
+	// Enable notifications
+	uint8 Enable[] = { 0x01, 0x00 };
+	co_await Descriptor->WriteValueAsync(
+		CryptographicBuffer::CreateFromByteArray(
+			Platform::ArrayReference<uint8>(Enable, sizeof(Enable))));
+
+	// Set the characteristic on Notify
+	auto Status = co_await Characteristic->
+		WriteClientCharacteristicConfigurationDescriptorAsync(
+			GenericAttributeProfile::
+			GattClientCharacteristicConfigurationDescriptorValue::Notify);
+	// Logs an error
+	if (Status != GenericAttributeProfile::GattCommunicationStatus::Success)
+	{
+		std::cout << "Enable notifications error." << std::endl;
+	}
+	// Registers the handler only once, enabling the channel again just
+	// rewrites the descriptors
+	if (!bNotifying[Index])
+	{
+		NotificationTokens[Index] = Characteristic->ValueChanged +=
+			ref new Windows::Foundation::TypedEventHandler<
+			GenericAttributeProfile::GattCharacteristic^,
+			GenericAttributeProfile::GattValueChangedEventArgs^>(
+				[this, Channel](
+					GenericAttributeProfile::GattCharacteristic^ Sender,
+					GenericAttributeProfile::GattValueChangedEventArgs^ Args) {
+						OnValueChanged(Channel, Args->CharacteristicValue);
+				});
+		bNotifying[Index] = true;
+	}
+	co_return Status ==
+		GenericAttributeProfile::GattCommunicationStatus::Success;
+}
+
+// Hands the notification bytes to the handler straight from the WinRT buffer.
+void WinRtGattTransport::OnValueChanged(GattChannel Channel,
+	Windows::Storage::Streams::IBuffer^ Value)
+{
+	HRM_TRACE_SCOPE("GattNotification");
+	if (OnNotification)
+	{
+		OnNotification(Channel, BufferBytes(Value), Value->Length);
+	}
+}
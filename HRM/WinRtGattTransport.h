@@ -0,0 +1,86 @@
+#pragma once
+
+#include "pch.h"
+#include "GattCache.h"
+#include "GattTransport.h"
+#include <array>
+#include <mutex>
+#include <ppltasks.h>
+#include <pplawait.h>
+#include <vector>
+#include <Windows.Devices.Bluetooth.h>
+
+using namespace Windows::Devices::Bluetooth;
+
+// GattTransport backend on top of the WinRT Bluetooth LE APIs, talking to a
+// real MiBand 3. With a cache, reconnects resolve the channels from the
+// system's GATT cache and check them against the cached attribute handles,
+// without any radio round trip; full discovery runs only on a miss.
+//
+// Discovery looks the services up concurrently. Only authentication and
+// heart rate are needed to connect; the alert channels are resolved on the
+// first write to one of them.
+class WinRtGattTransport : public GattTransport
+{
+public:
+	explicit WinRtGattTransport(GattCache* Cache = nullptr);
+	~WinRtGattTransport() override;
+
+	void Open(uint64_t Address, Completion Done) override;
+	void Close() override;
+
+	void Write(GattChannel Channel, const uint8_t* Data, uint32_t Size,
+		Completion Done) override;
+	void EnableNotifications(GattChannel Channel, Completion Done) override;
+
+	bool OpenedFromCache() const override { return bOpenedFromCache; }
+
+	void SetNotificationHandler(NotificationHandler Handler) override;
+	void SetDisconnectionHandler(DisconnectionHandler Handler) override;
+
+private:
+	static constexpr size_t ChannelCount =
+		static_cast<size_t>(GattChannel::Count);
+
+	concurrency::task<void> Initialize(uint64_t Address);
+	// Resolves every channel from the system cache, true only if all of them
+	// match the cached handles
+	concurrency::task<bool> CachedDiscovery(const GattCacheEntry& Entry);
+	concurrency::task<void> DiscoverChannels(bool bOnDemand);
+	concurrency::task<void> DiscoverService(Platform::Guid Uuid,
+		std::vector<size_t> Channels);
+	concurrency::task<bool> ResolveOnDemand();
+	void StoreLayout(uint64_t Address);
+	void WriteResolved(size_t Index, Windows::Storage::Streams::IBuffer^ Buffer,
+		Completion Done);
+	concurrency::task<bool> InEnableNotifications(GattChannel Channel);
+
+	void OnValueChanged(GattChannel Channel,
+		Windows::Storage::Streams::IBuffer^ Value);
+
+	BluetoothLEDevice^ Device;
+	Windows::Foundation::EventRegistrationToken ConnectionToken;
+
+	// Characteristic of every channel
+	std::array<GenericAttributeProfile::GattCharacteristic^, ChannelCount>
+		Characteristics;
+	// Client characteristic configuration descriptor (0x2902) of the
+	// channels that notify
+	std::array<GenericAttributeProfile::GattDescriptor^, ChannelCount>
+		Descriptors;
+	std::array<Windows::Foundation::EventRegistrationToken, ChannelCount>
+		NotificationTokens;
+	std::array<bool, ChannelCount> bNotifying;
+
+	GattCache* Cache;
+	bool bOpenedFromCache;
+	uint64_t Address;
+
+	// Resolution of the on demand channels, started by their first write
+	std::mutex OnDemandLock;
+	bool bOnDemandStarted;
+	concurrency::task<bool> OnDemand;
+
+	NotificationHandler OnNotification;
+	DisconnectionHandler OnDisconnection;
+};